@@ -6,6 +6,7 @@
 // algorithms are optimized for their respective platforms. You can still
 // compile and run any of them on any platform, but your performance with the
 // non-native version will be less than optimal.
+#include <string.h>
 #include "MurmurHash3.h"
 
 //-----------------------------------------------------------------------------
@@ -15,7 +16,7 @@
 
 #if defined(_MSC_VER)
 
-#define FORCE_INLINE	__forceinline
+#define FORCE_INLINE	static __forceinline
 
 //#include <stdlib.h>
 
@@ -28,14 +29,15 @@
 
 #else	// defined(_MSC_VER)
 
-#define	FORCE_INLINE inline __attribute__((always_inline))
+// static, so that unoptimized builds, which do not inline, still have a definition to call
+#define	FORCE_INLINE static inline __attribute__((always_inline))
 
-inline uint32_t rotl32 ( uint32_t x, int8_t r )
+static inline uint32_t rotl32 ( uint32_t x, int8_t r )
 {
   return (x << r) | (x >> (32 - r));
 }
 
-inline uint64_t rotl64 ( uint64_t x, int8_t r )
+static inline uint64_t rotl64 ( uint64_t x, int8_t r )
 {
   return (x << r) | (x >> (64 - r));
 }
@@ -332,3 +334,152 @@ void MurmurHash3_x64_128 ( const void * key, const uint32_t len,
 
 //-----------------------------------------------------------------------------
 
+//-----------------------------------------------------------------------------
+// FastHash64 - not part of MurmurHash3. A wyhash style hash: every 16 bytes
+// of input take one 64x64->128 bit multiply, and keys of up to 16 bytes are
+// read with at most four overlapping loads, no byte loop.
+
+#define FAST_SECRET0 BIG_CONSTANT(0xa0761d6478bd642f)
+#define FAST_SECRET1 BIG_CONSTANT(0xe7037ed1a0b428db)
+#define FAST_SECRET2 BIG_CONSTANT(0x8ebc6af09c88c6e3)
+#define FAST_SECRET3 BIG_CONSTANT(0x589965cc75374cc3)
+
+// low and high halves of the full product, in place
+FORCE_INLINE void fastMultiply ( uint64_t * a, uint64_t * b )
+{
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64u);
+#else
+  uint64_t ha = *a >> 32u, hb = *b >> 32u, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32u), c = t < rl;
+  uint64_t lo = t + (rm1 << 32u);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32u) + (rm1 >> 32u) + c;
+#endif
+}
+
+FORCE_INLINE uint64_t fastMix ( uint64_t a, uint64_t b )
+{
+  fastMultiply(&a, &b);
+  return a ^ b;
+}
+
+FORCE_INLINE uint64_t fastRead64 ( const uint8_t * p )
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+FORCE_INLINE uint64_t fastRead32 ( const uint8_t * p )
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// first, middle and last byte, enough to tell apart all keys of 1 to 3 bytes
+FORCE_INLINE uint64_t fastRead3 ( const uint8_t * p, uint32_t len )
+{
+  return ((uint64_t)p[0] << 16u) | ((uint64_t)p[len >> 1u] << 8u) | p[len - 1];
+}
+
+// a and b of a key up to 16 bytes long
+FORCE_INLINE void fastShortWords ( const uint8_t * p, uint32_t len,
+                                   uint64_t * a, uint64_t * b )
+{
+  if(len >= 4)
+  {
+    uint32_t middle = (len >> 3u) << 2u;
+    *a = (fastRead32(p) << 32u) | fastRead32(p + middle);
+    *b = (fastRead32(p + len - 4) << 32u) | fastRead32(p + len - 4 - middle);
+  }
+  else if(len > 0)
+  {
+    *a = fastRead3(p, len);
+    *b = 0;
+  }
+  else
+  {
+    *a = *b = 0;
+  }
+}
+
+FORCE_INLINE uint64_t fastFinish ( uint64_t a, uint64_t b, uint64_t seed,
+                                   uint32_t len )
+{
+  a ^= FAST_SECRET1;
+  b ^= seed;
+  fastMultiply(&a, &b);
+  return fastMix(a ^ FAST_SECRET0 ^ len, b ^ FAST_SECRET1);
+}
+
+FORCE_INLINE uint64_t fastSeed ( uint64_t seed )
+{
+  return seed ^ fastMix(seed ^ FAST_SECRET0, FAST_SECRET1);
+}
+
+// state is the seed already mixed by fastSeed
+FORCE_INLINE uint64_t fastHash ( const void * key, const uint32_t len, uint64_t state )
+{
+  const uint8_t * p = (const uint8_t*)key;
+  uint64_t a, b;
+
+  if(len <= 16)
+  {
+    fastShortWords(p, len, &a, &b);
+    return fastFinish(a, b, state, len);
+  }
+
+  uint32_t i = len;
+  if(i > 48)
+  {
+    uint64_t state1 = state, state2 = state;
+    do
+    {
+      state = fastMix(fastRead64(p) ^ FAST_SECRET1, fastRead64(p + 8) ^ state);
+      state1 = fastMix(fastRead64(p + 16) ^ FAST_SECRET2, fastRead64(p + 24) ^ state1);
+      state2 = fastMix(fastRead64(p + 32) ^ FAST_SECRET3, fastRead64(p + 40) ^ state2);
+      p += 48;
+      i -= 48;
+    } while(i > 48);
+    state ^= state1 ^ state2;
+  }
+  while(i > 16)
+  {
+    state = fastMix(fastRead64(p) ^ FAST_SECRET1, fastRead64(p + 8) ^ state);
+    p += 16;
+    i -= 16;
+  }
+  a = fastRead64(p + i - 16);
+  b = fastRead64(p + i - 8);
+  return fastFinish(a, b, state, len);
+}
+
+uint64_t FastHash64 ( const void * key, const uint32_t len, const uint64_t seed )
+{
+  return fastHash(key, len, fastSeed(seed));
+}
+
+//-----------------------------------------------------------------------------
+// The seed is mixed once per batch and the keys are hashed in a loop that
+// carries nothing from one key to the next, so the 64x64->128 bit multiplies
+// of consecutive keys overlap in the pipeline. Spelling the lanes out by hand
+// measured no faster than that. There is no vector form of the multiply below
+// AVX-512, which is why this is not done with SIMD registers.
+
+void FastHash64_batch ( const uint32_t count, const void * const * keys,
+                        const uint32_t * lens, const uint64_t seed,
+                        uint64_t * out )
+{
+  const uint64_t state = fastSeed(seed);
+
+  for(uint32_t i = 0; i < count; i++)
+    out[i] = fastHash(keys[i], lens[i], state);
+}
+
+//-----------------------------------------------------------------------------
@@ -32,6 +32,15 @@ void MurmurHash3_x86_128 ( const void * key, uint32_t len, uint32_t seed, void *
 
 void MurmurHash3_x64_128 ( const void * key, uint32_t len, uint32_t seed, void * out );
 
+//-----------------------------------------------------------------------------
+// Faster 64-bit hash for the short keys maps are looked up by. Results differ
+// from all of the above. The batch gives out[i] = FastHash64(keys[i], lens[i], seed).
+
+uint64_t FastHash64 ( const void * key, uint32_t len, uint64_t seed );
+
+void FastHash64_batch ( uint32_t count, const void * const * keys,
+                        const uint32_t * lens, uint64_t seed, uint64_t * out );
+
 //-----------------------------------------------------------------------------
 
 #endif // _MURMURHASH3_H_
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "hash_map.h"
+#include "MurmurHash3.h"
+
+/*
+ * Micro-benchmark of hash_map with the key shapes library.c uses: attribute and sorting index names looked up
+ * by every query, and result cache keys put, looked up and evicted in turn. Also compares the hash functions
+ * hash_map can use by key length.
+ */
+
+#define NAME_COUNT 64
+#define NAME_LOOKUPS 20000000
+#define CACHE_KEY_COUNT 200000
+#define CACHE_KEY_LENGTH 48
+#define CACHE_LIVE_KEYS 4096
+#define CACHE_OPERATIONS 5000000
+#define HASH_KEY_COUNT 1024
+#define HASH_BYTES 400000000
+
+static uint64_t randomState = 88172645463325252ULL;
+
+static uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return (uint32_t) randomState;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void benchNames(hash_map_hash_t hash, const char *hashName) {
+    char names[NAME_COUNT][24];
+    uint32_t lengths[NAME_COUNT];
+    hash_map_t *hashMap = hash_map_create_with_hash(0, hash);
+    for (uint32_t i = 0; i < NAME_COUNT; i++) {
+        lengths[i] = snprintf(names[i], sizeof(names[i]), "attribute_%u", i * 7919);
+        hash_map_put(hashMap, lengths[i], names[i], names[i]);
+    }
+    uint32_t *order = malloc(sizeof(uint32_t) * NAME_LOOKUPS);
+    for (uint32_t i = 0; i < NAME_LOOKUPS; i++) {
+        order[i] = nextRandom() % NAME_COUNT;
+    }
+    uint64_t found = 0;
+    double start = now();
+    for (uint32_t i = 0; i < NAME_LOOKUPS; i++) {
+        found += hash_map_get(hashMap, lengths[order[i]], names[order[i]]) == names[order[i]];
+    }
+    double elapsed = now() - start;
+    printf("%s name get: %.1f ns/op, %llu of %u found\n", hashName, elapsed * 1e9 / NAME_LOOKUPS,
+           (unsigned long long) found, NAME_LOOKUPS);
+
+    // the same lookups NAME_COUNT at a time, the way a query resolves its filter names
+    const void *keys[NAME_COUNT];
+    uint32_t keyLengths[NAME_COUNT];
+    void *values[NAME_COUNT];
+    found = 0;
+    start = now();
+    for (uint32_t i = 0; i + NAME_COUNT <= NAME_LOOKUPS; i += NAME_COUNT) {
+        for (uint32_t j = 0; j < NAME_COUNT; j++) {
+            keys[j] = names[order[i + j]];
+            keyLengths[j] = lengths[order[i + j]];
+        }
+        hash_map_get_many(hashMap, NAME_COUNT, keyLengths, keys, values);
+        for (uint32_t j = 0; j < NAME_COUNT; j++) {
+            found += values[j] == keys[j];
+        }
+    }
+    elapsed = now() - start;
+    printf("%s name get_many: %.1f ns/op, %llu found\n", hashName, elapsed * 1e9 / NAME_LOOKUPS,
+           (unsigned long long) found);
+    free(order);
+    hash_map_free(hashMap);
+}
+
+/*
+ * Keeps CACHE_LIVE_KEYS keys in the map: every step looks one key up and, on a miss, puts it and removes the
+ * oldest one, the way result cache evicts.
+ */
+static void benchCache(hash_map_hash_t hash, const char *hashName) {
+    char (*keys)[CACHE_KEY_LENGTH] = calloc(CACHE_KEY_COUNT, CACHE_KEY_LENGTH);
+    for (uint32_t i = 0; i < CACHE_KEY_COUNT; i++) {
+        snprintf(keys[i], CACHE_KEY_LENGTH, "(%u|%u)&%u&!%u price:%u", nextRandom() % 5000,
+                 nextRandom() % 5000, nextRandom() % 5000, i, nextRandom() % 1000);
+    }
+    uint32_t *live = malloc(sizeof(uint32_t) * CACHE_LIVE_KEYS);
+    uint32_t liveCount = 0;
+    uint32_t oldest = 0;
+    hash_map_t *hashMap = hash_map_create_with_hash(0, hash);
+    uint64_t hits = 0;
+    double start = now();
+    for (uint32_t i = 0; i < CACHE_OPERATIONS; i++) {
+        // a small hot set of keys repeats, the rest are mostly misses
+        uint32_t key = nextRandom() % 4 == 0 ? nextRandom() % CACHE_KEY_COUNT : nextRandom() % (CACHE_LIVE_KEYS / 2);
+        if (hash_map_get(hashMap, CACHE_KEY_LENGTH, keys[key])) {
+            hits++;
+            continue;
+        }
+        if (liveCount == CACHE_LIVE_KEYS) {
+            hash_map_remove(hashMap, CACHE_KEY_LENGTH, keys[live[oldest]]);
+        } else {
+            liveCount++;
+        }
+        hash_map_put(hashMap, CACHE_KEY_LENGTH, keys[key], keys[key]);
+        live[oldest] = key;
+        oldest = (oldest + 1) % CACHE_LIVE_KEYS;
+    }
+    double elapsed = now() - start;
+    printf("%s cache get/put/remove: %.1f ns/op, %llu hits\n", hashName, elapsed * 1e9 / CACHE_OPERATIONS,
+           (unsigned long long) hits);
+    hash_map_free(hashMap);
+    free(live);
+    free(keys);
+}
+
+/*
+ * Hashes HASH_KEY_COUNT keys of keyLength bytes over and over until HASH_BYTES are hashed and prints
+ * ns per key and GB/s for each hash.
+ */
+static void benchHashes(uint32_t keyLength) {
+    char *data = malloc((size_t) HASH_KEY_COUNT * keyLength);
+    const void **keys = malloc(sizeof(void *) * HASH_KEY_COUNT);
+    uint32_t *lengths = malloc(sizeof(uint32_t) * HASH_KEY_COUNT);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * HASH_KEY_COUNT);
+    for (uint32_t i = 0; i < HASH_KEY_COUNT * keyLength; i++) {
+        data[i] = (char) nextRandom();
+    }
+    for (uint32_t i = 0; i < HASH_KEY_COUNT; i++) {
+        keys[i] = data + (size_t) i * keyLength;
+        lengths[i] = keyLength;
+    }
+    uint32_t rounds = HASH_BYTES / (HASH_KEY_COUNT * keyLength) + 1;
+    double keyCount = (double) rounds * HASH_KEY_COUNT;
+    uint64_t sink = 0;
+    double elapsed[4];
+
+    double start = now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < HASH_KEY_COUNT; i++) {
+            uint32_t hash;
+            MurmurHash3_x86_32(keys[i], keyLength, round, &hash);
+            sink += hash;
+        }
+    }
+    elapsed[0] = now() - start;
+
+    start = now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < HASH_KEY_COUNT; i++) {
+            uint64_t hash[2];
+            MurmurHash3_x64_128(keys[i], keyLength, round, hash);
+            sink += hash[0];
+        }
+    }
+    elapsed[1] = now() - start;
+
+    start = now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < HASH_KEY_COUNT; i++) {
+            sink += FastHash64(keys[i], keyLength, round);
+        }
+    }
+    elapsed[2] = now() - start;
+
+    start = now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        FastHash64_batch(HASH_KEY_COUNT, keys, lengths, round, hashes);
+        sink += hashes[round % HASH_KEY_COUNT];
+    }
+    elapsed[3] = now() - start;
+
+    static const char *names[] = {"murmur3_x86_32", "murmur3_x64_128", "fast64", "fast64_batch"};
+    printf("%4u byte keys:", keyLength);
+    for (uint32_t i = 0; i < 4; i++) {
+        printf("  %s %.2f ns %.2f GB/s", names[i], elapsed[i] * 1e9 / keyCount, keyCount * keyLength / elapsed[i] / 1e9);
+    }
+    printf("  (%llu)\n", (unsigned long long) (sink & 1));
+    free(hashes);
+    free(lengths);
+    free(keys);
+    free(data);
+}
+
+int main() {
+    static const uint32_t keyLengths[] = {4, 8, 16, 32, 64, 256};
+    for (uint32_t i = 0; i < sizeof(keyLengths) / sizeof(keyLengths[0]); i++) {
+        benchHashes(keyLengths[i]);
+    }
+    benchNames(HASH_MAP_HASH_MURMUR3_32, "murmur3");
+    benchNames(HASH_MAP_HASH_FAST64, "fast64");
+    benchCache(HASH_MAP_HASH_MURMUR3_32, "murmur3");
+    benchCache(HASH_MAP_HASH_FAST64, "fast64");
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bit_sliced_index.h"
+
+// encoded values are 32-bit, so are the slices; all of them are there from the start so setting a key never allocates
+#define BIT_SLICED_INDEX_SLICES 32
+
+typedef struct bit_sliced_index_s {
+    roaring_bitmap_t *keys;
+    roaring_bitmap_t *slices[BIT_SLICED_INDEX_SLICES];
+} bit_sliced_index_t;
+
+static void freeBitmaps(roaring_bitmap_t *keys, roaring_bitmap_t **slices) {
+    if (keys)
+        roaring_bitmap_free(keys);
+    for (uint32_t slice = 0; slice < BIT_SLICED_INDEX_SLICES; slice++) {
+        if (slices[slice])
+            roaring_bitmap_free(slices[slice]);
+    }
+}
+
+bit_sliced_index_t* bit_sliced_index_create(uint32_t count, const uint32_t *keys, const float *values,
+                                            uint32_t stride) {
+    bit_sliced_index_t *index = calloc(1, sizeof(bit_sliced_index_t));
+    uint32_t *buffer = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t *encoded = malloc(sizeof(uint32_t) * (count + 1));
+    bool built = index && buffer && encoded;
+
+    uint32_t keyCount = 0;
+    for (uint32_t i = 0; i < count && built; i++) {
+        uint32_t key = *(const uint32_t *) ((const char *) keys + (size_t) i * stride);
+        if (key == BIT_SLICED_INDEX_NO_KEY)
+            continue;
+        encoded[keyCount] = bit_sliced_index_encode(*(const float *) ((const char *) values + (size_t) i * stride));
+        buffer[keyCount++] = key;
+    }
+    built = built && (index->keys = roaring_bitmap_of_ptr(keyCount, buffer)) != 0;
+    for (uint32_t slice = 0; slice < BIT_SLICED_INDEX_SLICES && built; slice++) {
+        uint32_t sliceKeyCount = 0;
+        for (uint32_t i = 0, j = 0; i < count; i++) {
+            uint32_t key = *(const uint32_t *) ((const char *) keys + (size_t) i * stride);
+            if (key == BIT_SLICED_INDEX_NO_KEY)
+                continue;
+            if ((encoded[j++] >> slice) & 1)
+                buffer[sliceKeyCount++] = key;
+        }
+        built = (index->slices[slice] = roaring_bitmap_of_ptr(sliceKeyCount, buffer)) != 0;
+        if (built)
+            roaring_bitmap_run_optimize(index->slices[slice]);
+    }
+    free(encoded);
+    free(buffer);
+    if (!built && index) {
+        freeBitmaps(index->keys, index->slices);
+        free(index);
+        return 0;
+    }
+    return index;
+}
+
+void bit_sliced_index_set(bit_sliced_index_t *index, uint32_t key, uint32_t value) {
+    roaring_bitmap_add(index->keys, key);
+    for (uint32_t slice = 0; slice < BIT_SLICED_INDEX_SLICES; slice++) {
+        if ((value >> slice) & 1) {
+            roaring_bitmap_add(index->slices[slice], key);
+        } else {
+            roaring_bitmap_remove(index->slices[slice], key);
+        }
+    }
+}
+
+void bit_sliced_index_remove(bit_sliced_index_t *index, uint32_t key) {
+    if (!roaring_bitmap_remove_checked(index->keys, key))
+        return;
+    for (uint32_t slice = 0; slice < BIT_SLICED_INDEX_SLICES; slice++) {
+        roaring_bitmap_remove(index->slices[slice], key);
+    }
+}
+
+/*
+ * Keys with encoded values <= value, walking the slices from the highest bit: keys equal to value in the bits seen
+ * so far stay in equal, the ones that already compare lower move to lower.
+ */
+static roaring_bitmap_t *lessOrEqual(const bit_sliced_index_t *index, uint32_t value) {
+    roaring_bitmap_t *lower = roaring_bitmap_create();
+    roaring_bitmap_t *equal = roaring_bitmap_copy(index->keys);
+    for (uint32_t slice = BIT_SLICED_INDEX_SLICES; slice-- > 0 && !roaring_bitmap_is_empty(equal);) {
+        if ((value >> slice) & 1) {
+            roaring_bitmap_t *cleared = roaring_bitmap_andnot(equal, index->slices[slice]);
+            roaring_bitmap_or_inplace(lower, cleared);
+            roaring_bitmap_free(cleared);
+            roaring_bitmap_and_inplace(equal, index->slices[slice]);
+        } else {
+            roaring_bitmap_andnot_inplace(equal, index->slices[slice]);
+        }
+    }
+    roaring_bitmap_or_inplace(lower, equal);
+    roaring_bitmap_free(equal);
+    return lower;
+}
+
+roaring_bitmap_t* bit_sliced_index_range(const bit_sliced_index_t* index, uint32_t from, uint32_t to) {
+    if (from > to)
+        return roaring_bitmap_create();
+    roaring_bitmap_t *result = to == UINT32_MAX ? roaring_bitmap_copy(index->keys) : lessOrEqual(index, to);
+    if (from > 0) {
+        roaring_bitmap_t *below = lessOrEqual(index, from - 1);
+        roaring_bitmap_andnot_inplace(result, below);
+        roaring_bitmap_free(below);
+    }
+    return result;
+}
+
+uint64_t bit_sliced_index_size_in_bytes(const bit_sliced_index_t* index) {
+    uint64_t size = sizeof(bit_sliced_index_t) + roaring_bitmap_size_in_bytes(index->keys);
+    for (uint32_t slice = 0; slice < BIT_SLICED_INDEX_SLICES; slice++) {
+        size += roaring_bitmap_size_in_bytes(index->slices[slice]);
+    }
+    return size;
+}
+
+void bit_sliced_index_free(bit_sliced_index_t* index) {
+    if (!index)
+        return;
+    freeBitmaps(index->keys, index->slices);
+    free(index);
+}
@@ -0,0 +1,49 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <roaring/roaring.h>
+
+#ifndef JROARING_BIT_SLICED_INDEX_H
+#define JROARING_BIT_SLICED_INDEX_H
+
+typedef struct bit_sliced_index_s bit_sliced_index_t;
+
+// key of entries holding nothing, left out of the index
+#define BIT_SLICED_INDEX_NO_KEY UINT32_MAX
+
+/*
+ * Maps a float to an unsigned integer of the same order: the sign bit is flipped for positive values, all bits
+ * for negative ones. Both zeros map to the same value.
+ */
+static inline uint32_t bit_sliced_index_encode(float value) {
+    uint32_t bits;
+    value += 0.0f;
+    memcpy(&bits, &value, sizeof(uint32_t));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+/*
+ * Indexes keys[i] -> values[i] for every i in [0, count), both read with the given stride, one bitmap per bit of
+ * the encoded value. Keys are expected to be unique.
+ */
+bit_sliced_index_t* bit_sliced_index_create(uint32_t count, const uint32_t *keys, const float *values,
+                                            uint32_t stride);
+
+/*
+ * Indexes key with the encoded value, whatever it had before. Takes one bitmap operation per slice.
+ */
+void bit_sliced_index_set(bit_sliced_index_t *index, uint32_t key, uint32_t value);
+
+void bit_sliced_index_remove(bit_sliced_index_t *index, uint32_t key);
+
+/*
+ * Returns new bitmap of the keys with encoded values in [from, to]. Takes two bitmap operations per slice no
+ * matter how many keys are in the range.
+ */
+roaring_bitmap_t* bit_sliced_index_range(const bit_sliced_index_t* index, uint32_t from, uint32_t to);
+
+uint64_t bit_sliced_index_size_in_bytes(const bit_sliced_index_t* index);
+
+void bit_sliced_index_free(bit_sliced_index_t* index);
+
+#endif //JROARING_BIT_SLICED_INDEX_H
@@ -0,0 +1,489 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "expression.h"
+
+#define EXPRESSION_MAX_DEPTH 256
+
+typedef enum expression_type_e {
+    EXPRESSION_EMPTY,
+    EXPRESSION_FEATURE,
+    EXPRESSION_EXT_FEATURE,
+    EXPRESSION_NOT,
+    EXPRESSION_AND,
+    EXPRESSION_OR
+} expression_type_t;
+
+/*
+ * Chains of the same operator are kept as one node with many children, so the evaluator sees every operand
+ * of "1&2&3&4" at once and is free to pick the order.
+ */
+struct expression_s {
+    expression_type_t type;
+    uint32_t feature;
+    uint32_t childCount;
+    uint32_t childCapacity;
+    struct expression_s **children;
+};
+
+typedef struct expression_parser_s {
+    const char *text;
+    uint32_t length;
+    uint32_t position;
+    uint32_t featureCount;
+    bool failed;
+} expression_parser_t;
+
+typedef struct expression_operand_s {
+    roaring_bitmap_t *bitmap;
+    uint64_t cardinality;
+    bool owned;
+} expression_operand_t;
+
+typedef struct expression_evaluation_s {
+    const expression_source_t *source;
+    roaring_bitmap_t *universe;
+} expression_evaluation_t;
+
+static expression_t *createNode(expression_type_t type, uint32_t feature) {
+    expression_t *node = malloc(sizeof(expression_t));
+    node->type = type;
+    node->feature = feature;
+    node->childCount = 0;
+    node->childCapacity = 0;
+    node->children = 0;
+    return node;
+}
+
+static void appendChild(expression_t *node, expression_t *child) {
+    if (node->childCount == node->childCapacity) {
+        node->childCapacity = node->childCapacity ? node->childCapacity * 2 : 4;
+        node->children = realloc(node->children, sizeof(expression_t *) * node->childCapacity);
+    }
+    node->children[node->childCount++] = child;
+}
+
+void expression_free(expression_t *expression) {
+    if (!expression)
+        return;
+    for (uint32_t i = 0; i < expression->childCount; i++) {
+        expression_free(expression->children[i]);
+    }
+    free(expression->children);
+    free(expression);
+}
+
+/*
+ * Applies operator to what is accumulated so far, NULL standing for the empty set. Like the original
+ * interpreter, a sequence starts from the empty set, so a leading "&" keeps it empty.
+ */
+static expression_t *combine(char operator, expression_t *accumulator, expression_t *operand) {
+    expression_type_t type = operator == '&' ? EXPRESSION_AND : EXPRESSION_OR;
+    if (operand->type == EXPRESSION_EMPTY) {
+        expression_free(operand);
+        if (type == EXPRESSION_AND) {
+            expression_free(accumulator);
+            return 0;
+        }
+        return accumulator;
+    }
+    if (!accumulator) {
+        if (type == EXPRESSION_AND) {
+            expression_free(operand);
+            return 0;
+        }
+        return operand;
+    }
+    if (accumulator->type != type) {
+        expression_t *node = createNode(type, 0);
+        appendChild(node, accumulator);
+        accumulator = node;
+    }
+    if (operand->type == type) {
+        for (uint32_t i = 0; i < operand->childCount; i++) {
+            appendChild(accumulator, operand->children[i]);
+        }
+        operand->childCount = 0;
+        expression_free(operand);
+    } else {
+        appendChild(accumulator, operand);
+    }
+    return accumulator;
+}
+
+static bool parseNumber(expression_parser_t *parser, uint32_t *number) {
+    uint64_t value = 0;
+    uint32_t start = parser->position;
+    while (parser->position < parser->length && parser->text[parser->position] >= '0' &&
+           parser->text[parser->position] <= '9') {
+        if (value <= UINT32_MAX)
+            value = value * 10 + (parser->text[parser->position] - '0');
+        parser->position++;
+    }
+    *number = value > UINT32_MAX ? UINT32_MAX : value;
+    return parser->position > start;
+}
+
+static expression_t *parseSequence(expression_parser_t *parser, uint32_t depth);
+
+// returns NULL when operand is dropped or parser failed
+static expression_t *parseOperand(expression_parser_t *parser, uint32_t depth) {
+    if (depth > EXPRESSION_MAX_DEPTH || parser->position >= parser->length) {
+        parser->failed = true;
+        return 0;
+    }
+    char current = parser->text[parser->position];
+    if (current == '!') {
+        parser->position++;
+        expression_t *operand = parseOperand(parser, depth + 1);
+        if (!operand)
+            return 0;
+        if (operand->type == EXPRESSION_NOT) {
+            expression_t *negated = operand->children[0];
+            operand->childCount = 0;
+            expression_free(operand);
+            return negated;
+        }
+        expression_t *node = createNode(EXPRESSION_NOT, 0);
+        appendChild(node, operand);
+        return node;
+    }
+    if (current == '(') {
+        parser->position++;
+        expression_t *node = parseSequence(parser, depth + 1);
+        if (parser->failed) {
+            expression_free(node);
+            return 0;
+        }
+        return node ? node : createNode(EXPRESSION_EMPTY, 0);
+    }
+    expression_type_t type = EXPRESSION_FEATURE;
+    if (current == 'e') {
+        type = EXPRESSION_EXT_FEATURE;
+        parser->position++;
+    }
+    uint32_t feature;
+    if (!parseNumber(parser, &feature)) {
+        parser->failed = true;
+        return 0;
+    }
+    if (feature >= parser->featureCount)
+        return 0;
+    return createNode(type, feature);
+}
+
+static expression_t *parseSequence(expression_parser_t *parser, uint32_t depth) {
+    expression_t *accumulator = 0;
+    char operator = '|';
+    while (parser->position < parser->length) {
+        char current = parser->text[parser->position];
+        if (current == ' ' || current == '\t') {
+            parser->position++;
+        } else if (current == ')') {
+            parser->position++;
+            // stray closing parenthesis at the top level is ignored
+            if (depth > 0)
+                break;
+        } else if (current == '&' || current == '|') {
+            operator = current;
+            parser->position++;
+        } else {
+            expression_t *operand = parseOperand(parser, depth);
+            if (parser->failed)
+                break;
+            if (operand)
+                accumulator = combine(operator, accumulator, operand);
+        }
+    }
+    return accumulator;
+}
+
+expression_t* expression_compile(const char *text, uint32_t length, uint32_t featureCount) {
+    expression_parser_t parser = {text, length, 0, featureCount, false};
+    expression_t *root = parseSequence(&parser, 0);
+    if (parser.failed) {
+        expression_free(root);
+        return 0;
+    }
+    return root ? root : createNode(EXPRESSION_EMPTY, 0);
+}
+
+typedef struct expression_text_s {
+    char *chars;
+    uint32_t length;
+} expression_text_t;
+
+static int compareTexts(const void *text1, const void *text2) {
+    return strcmp(((expression_text_t *) text1)->chars, ((expression_text_t *) text2)->chars);
+}
+
+static expression_text_t writeCanonical(const expression_t *node) {
+    expression_text_t text;
+    switch (node->type) {
+        case EXPRESSION_FEATURE:
+        case EXPRESSION_EXT_FEATURE:
+            text.chars = malloc(16);
+            text.length = sprintf(text.chars, node->type == EXPRESSION_FEATURE ? "%u" : "e%u", node->feature);
+            return text;
+        case EXPRESSION_NOT: {
+            expression_text_t negated = writeCanonical(node->children[0]);
+            text.chars = malloc(negated.length + 2);
+            text.chars[0] = '!';
+            memcpy(text.chars + 1, negated.chars, negated.length + 1);
+            text.length = negated.length + 1;
+            free(negated.chars);
+            return text;
+        }
+        case EXPRESSION_AND:
+        case EXPRESSION_OR: {
+            // operands are sorted and deduplicated, so "2&1&2" and "1&2" read the same
+            expression_text_t *children = malloc(sizeof(expression_text_t) * node->childCount);
+            uint32_t length = 2;
+            for (uint32_t i = 0; i < node->childCount; i++) {
+                children[i] = writeCanonical(node->children[i]);
+                length += children[i].length + 1;
+            }
+            qsort(children, node->childCount, sizeof(expression_text_t), compareTexts);
+            text.chars = malloc(length);
+            text.chars[0] = '(';
+            text.length = 1;
+            for (uint32_t i = 0; i < node->childCount; i++) {
+                if (i == 0 || strcmp(children[i - 1].chars, children[i].chars) != 0) {
+                    if (text.length > 1)
+                        text.chars[text.length++] = node->type == EXPRESSION_AND ? '&' : '|';
+                    memcpy(text.chars + text.length, children[i].chars, children[i].length);
+                    text.length += children[i].length;
+                }
+            }
+            for (uint32_t i = 0; i < node->childCount; i++) {
+                free(children[i].chars);
+            }
+            free(children);
+            text.chars[text.length++] = ')';
+            text.chars[text.length] = 0;
+            return text;
+        }
+        default:
+            text.chars = malloc(3);
+            text.length = sprintf(text.chars, "()");
+            return text;
+    }
+}
+
+char* expression_canonical(const expression_t *expression, uint32_t *length) {
+    expression_text_t text = writeCanonical(expression);
+    *length = text.length;
+    return text.chars;
+}
+
+static inline bool isEmpty(const roaring_bitmap_t *bitmap) {
+    return !bitmap || roaring_bitmap_is_empty(bitmap);
+}
+
+static inline bool isLeaf(const expression_t *node) {
+    return node->type == EXPRESSION_FEATURE || node->type == EXPRESSION_EXT_FEATURE;
+}
+
+static inline void releaseOperand(roaring_bitmap_t *bitmap, bool owned) {
+    if (owned)
+        roaring_bitmap_free(bitmap);
+}
+
+static const roaring_bitmap_t *getUniverse(expression_evaluation_t *evaluation) {
+    if (!evaluation->universe)
+        evaluation->universe = roaring_bitmap_of_ptr(evaluation->source->productCount,
+                                                     evaluation->source->products);
+    return evaluation->universe;
+}
+
+static int compareOperands(const void *operand1, const void *operand2) {
+    uint64_t cardinality1 = ((expression_operand_t *) operand1)->cardinality;
+    uint64_t cardinality2 = ((expression_operand_t *) operand2)->cardinality;
+    return cardinality1 < cardinality2 ? -1 : cardinality1 > cardinality2 ? 1 : 0;
+}
+
+static roaring_bitmap_t *evaluateNode(expression_evaluation_t *evaluation, const expression_t *node, bool *owned);
+
+static roaring_bitmap_t *evaluateNegation(expression_evaluation_t *evaluation, const expression_t *node) {
+    bool owned;
+    roaring_bitmap_t *negated = evaluateNode(evaluation, node->children[0], &owned);
+    roaring_bitmap_t *result = isEmpty(negated) ? roaring_bitmap_copy(getUniverse(evaluation)) :
+                               roaring_bitmap_andnot(getUniverse(evaluation), negated);
+    releaseOperand(negated, owned);
+    return result;
+}
+
+static roaring_bitmap_t *evaluateAnd(expression_evaluation_t *evaluation, const expression_t *node, bool *owned) {
+    expression_operand_t *operands = malloc(sizeof(expression_operand_t) * node->childCount);
+    uint32_t operandCount = 0;
+    roaring_bitmap_t *result = 0;
+    *owned = false;
+
+    // leaf cardinalities are known up front, so an empty one ends evaluation before anything is computed
+    for (uint32_t i = 0; i < node->childCount; i++) {
+        const expression_t *child = node->children[i];
+        if (!isLeaf(child))
+            continue;
+        bool childOwned;
+        roaring_bitmap_t *bitmap = evaluateNode(evaluation, child, &childOwned);
+        if (isEmpty(bitmap))
+            goto empty;
+        operands[operandCount].bitmap = bitmap;
+        operands[operandCount].cardinality = roaring_bitmap_get_cardinality(bitmap);
+        operands[operandCount].owned = childOwned;
+        operandCount++;
+    }
+    qsort(operands, operandCount, sizeof(expression_operand_t), compareOperands);
+
+    if (operandCount == 1) {
+        result = operands[0].bitmap;
+        *owned = operands[0].owned;
+        operandCount = 0;
+    } else if (operandCount > 1) {
+        result = roaring_bitmap_and(operands[0].bitmap, operands[1].bitmap);
+        *owned = true;
+        for (uint32_t i = 2; i < operandCount && !roaring_bitmap_is_empty(result); i++) {
+            roaring_bitmap_and_inplace(result, operands[i].bitmap);
+        }
+        if (roaring_bitmap_is_empty(result))
+            goto empty;
+    }
+
+    for (uint32_t i = 0; i < node->childCount; i++) {
+        const expression_t *child = node->children[i];
+        if (isLeaf(child) || child->type == EXPRESSION_NOT)
+            continue;
+        bool childOwned;
+        roaring_bitmap_t *bitmap = evaluateNode(evaluation, child, &childOwned);
+        if (isEmpty(bitmap)) {
+            releaseOperand(bitmap, childOwned);
+            goto empty;
+        }
+        if (!result) {
+            result = bitmap;
+            *owned = childOwned;
+            continue;
+        }
+        if (!*owned) {
+            roaring_bitmap_t *intersection = roaring_bitmap_and(result, bitmap);
+            result = intersection;
+            *owned = true;
+        } else {
+            roaring_bitmap_and_inplace(result, bitmap);
+        }
+        releaseOperand(bitmap, childOwned);
+        if (roaring_bitmap_is_empty(result))
+            goto empty;
+    }
+
+    for (uint32_t i = 0; i < node->childCount; i++) {
+        const expression_t *child = node->children[i];
+        if (child->type != EXPRESSION_NOT)
+            continue;
+        bool childOwned;
+        roaring_bitmap_t *bitmap = evaluateNode(evaluation, child->children[0], &childOwned);
+        if (isEmpty(bitmap)) {
+            releaseOperand(bitmap, childOwned);
+            continue;
+        }
+        if (!result) {
+            result = roaring_bitmap_andnot(getUniverse(evaluation), bitmap);
+            *owned = true;
+        } else if (!*owned) {
+            result = roaring_bitmap_andnot(result, bitmap);
+            *owned = true;
+        } else {
+            roaring_bitmap_andnot_inplace(result, bitmap);
+        }
+        releaseOperand(bitmap, childOwned);
+        if (roaring_bitmap_is_empty(result))
+            goto empty;
+    }
+    // only negations of empty sets were there
+    if (!result) {
+        result = roaring_bitmap_copy(getUniverse(evaluation));
+        *owned = true;
+    }
+
+    for (uint32_t i = 0; i < operandCount; i++) {
+        releaseOperand(operands[i].bitmap, operands[i].owned);
+    }
+    free(operands);
+    return result;
+
+    empty:
+    for (uint32_t i = 0; i < operandCount; i++) {
+        releaseOperand(operands[i].bitmap, operands[i].owned);
+    }
+    free(operands);
+    releaseOperand(result, *owned);
+    *owned = false;
+    return 0;
+}
+
+static roaring_bitmap_t *evaluateOr(expression_evaluation_t *evaluation, const expression_t *node, bool *owned) {
+    roaring_bitmap_t **bitmaps = malloc(sizeof(roaring_bitmap_t *) * node->childCount);
+    bool *bitmapsOwned = malloc(sizeof(bool) * node->childCount);
+    uint32_t bitmapCount = 0;
+    for (uint32_t i = 0; i < node->childCount; i++) {
+        bool childOwned;
+        roaring_bitmap_t *bitmap = evaluateNode(evaluation, node->children[i], &childOwned);
+        if (isEmpty(bitmap)) {
+            releaseOperand(bitmap, childOwned);
+            continue;
+        }
+        bitmaps[bitmapCount] = bitmap;
+        bitmapsOwned[bitmapCount] = childOwned;
+        bitmapCount++;
+    }
+
+    roaring_bitmap_t *result = 0;
+    *owned = false;
+    if (bitmapCount == 1) {
+        result = bitmaps[0];
+        *owned = bitmapsOwned[0];
+    } else if (bitmapCount > 1) {
+        result = roaring_bitmap_or_many(bitmapCount, (const roaring_bitmap_t **) bitmaps);
+        *owned = true;
+        for (uint32_t i = 0; i < bitmapCount; i++) {
+            releaseOperand(bitmaps[i], bitmapsOwned[i]);
+        }
+    }
+    free(bitmapsOwned);
+    free(bitmaps);
+    return result;
+}
+
+// NULL result is the empty set, owned tells whether the caller has to free the result
+static roaring_bitmap_t *evaluateNode(expression_evaluation_t *evaluation, const expression_t *node, bool *owned) {
+    *owned = false;
+    switch (node->type) {
+        case EXPRESSION_FEATURE:
+            return evaluation->source->features[node->feature];
+        case EXPRESSION_EXT_FEATURE:
+            return evaluation->source->extFeatures[node->feature];
+        case EXPRESSION_NOT:
+            *owned = true;
+            return evaluateNegation(evaluation, node);
+        case EXPRESSION_AND:
+            return evaluateAnd(evaluation, node, owned);
+        case EXPRESSION_OR:
+            return evaluateOr(evaluation, node, owned);
+        default:
+            return 0;
+    }
+}
+
+roaring_bitmap_t* expression_evaluate(const expression_t *expression, const expression_source_t *source) {
+    expression_evaluation_t evaluation = {source, 0};
+    bool owned;
+    roaring_bitmap_t *result = evaluateNode(&evaluation, expression, &owned);
+    if (!result) {
+        result = roaring_bitmap_create();
+    } else if (!owned) {
+        result = roaring_bitmap_copy(result);
+    }
+    if (evaluation.universe)
+        roaring_bitmap_free(evaluation.universe);
+    return result;
+}
@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <roaring/roaring.h>
+
+#ifndef JROARING_EXPRESSION_H
+#define JROARING_EXPRESSION_H
+
+typedef struct expression_s expression_t;
+
+/*
+ * Bitmaps the operands of an expression refer to. A missing bitmap is an empty set. The product list is the
+ * universe negations are taken against, it is only touched when a negation has nothing to subtract from.
+ */
+typedef struct expression_source_s {
+    roaring_bitmap_t **features;
+    roaring_bitmap_t **extFeatures;
+    uint32_t featureCount;
+    const uint32_t *products;
+    uint32_t productCount;
+} expression_source_t;
+
+/*
+ * Parses expression such as "(1|2)&e5&!(7|8)". Operands are feature numbers, "e" prefixed numbers are ext
+ * features. "&", "|" have equal precedence and are applied left to right, "!" negates the next operand and
+ * parentheses nest to any depth. Operands not below featureCount are dropped as if they were not written.
+ * Returns NULL if the text contains anything else.
+ */
+expression_t* expression_compile(const char *text, uint32_t length, uint32_t featureCount);
+
+/*
+ * Returns new bitmap owned by the caller. AND operands are intersected from the smallest one and the
+ * evaluation stops at the first empty intermediate result, ORs are merged with a single or_many.
+ */
+roaring_bitmap_t* expression_evaluate(const expression_t *expression, const expression_source_t *source);
+
+/*
+ * Returns NUL terminated text equal for expressions that always match the same products, as long as they differ
+ * only in the order or repetition of AND/OR operands, redundant parentheses or double negations. The caller frees it.
+ */
+char* expression_canonical(const expression_t *expression, uint32_t *length);
+
+void expression_free(expression_t *expression);
+
+#endif //JROARING_EXPRESSION_H
@@ -3,192 +3,407 @@
 //
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include "MurmurHash3.h"
 #include "hash_map.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Open addressing in the Swiss table layout. Every slot has a control byte: empty, deleted, or the low 7 bits
+ * of the hash of the key in it. A lookup matches a whole group of control bytes against those 7 bits at once
+ * and compares keys only on hits, until the first group with an empty slot. Keys up to INLINE_KEY_LENGTH bytes
+ * are kept in the slot, longer ones in a key buffer of the map, so a put or remove allocates only when the
+ * slot array or the key buffer has to grow.
+ */
 
-#define DEFAULT_BINS_COUNT 20
 #define DEFAULT_HASH_SEED 0x5EC327D1
-#define LOAD_FACTOR 0.8F
+#define MIN_CAPACITY 16
+#define MIN_KEYS_CAPACITY 256
+#define INLINE_KEY_LENGTH 16
+// keys hashed per batch call in hash_map_get_many
+#define HASH_BATCH_KEYS 64
+#define CONTROL_EMPTY ((int8_t) -128)
+#define CONTROL_DELETED ((int8_t) -2)
 
-typedef struct hash_map_bin_entry_s {
+typedef struct hash_map_slot_s {
     uint32_t hash;
+    uint32_t keyLength;
+    union {
+        uint8_t bytes[INLINE_KEY_LENGTH];
+        size_t offset;
+    } key;
     void* value;
-} hash_map_bin_entry_t;
-
-typedef struct hash_map_bin_s {
-    uint16_t size;
-    hash_map_bin_entry_t elements[];
-} hash_map_bin_t;
+} hash_map_slot_t;
 
 typedef struct hash_map_s {
     uint32_t hashSeed;
-    uint32_t binCount;
+    hash_map_hash_t hashKind;
+    // power of two, never below a group
+    uint32_t capacity;
     uint32_t valueCount;
-    hash_map_bin_t* bins[];
+    // empty slots left to fill before the load factor of 7/8 is reached, deleted slots do not count
+    uint32_t growthLeft;
+    // capacity + GROUP_WIDTH bytes, the tail repeats the first group so that any slot can start a group
+    int8_t* controls;
+    hash_map_slot_t* slots;
+    uint8_t* keys;
+    size_t keysLength;
+    size_t keysCapacity;
+    // bytes of removed keys still in the key buffer
+    size_t keysGarbage;
 } hash_map_t;
 
-static hash_map_t* createMap(uint32_t hashSeed, uint32_t binsCount) {
-    uint32_t lengthInBytes = sizeof(hash_map_t) + sizeof(hash_map_bin_t*) * binsCount;
-    hash_map_t* hashMap = malloc(lengthInBytes);
-    if(!hashMap)
-        return 0;
-    memset(hashMap, 0, lengthInBytes);
-    hashMap->hashSeed = hashSeed;
-    hashMap->binCount = binsCount;
-    return hashMap;
+#if defined(__SSE2__)
+
+#define GROUP_WIDTH 16
+
+typedef uint32_t group_mask_t;
+
+static inline group_mask_t matchByte(const int8_t* group, int8_t byte) {
+    __m128i controls = _mm_loadu_si128((const __m128i*) group);
+    return (group_mask_t) _mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8(byte)));
 }
 
-static hash_map_t* reallocMap(hash_map_t* hashMap, uint32_t newBinCount) {
-    if(!hashMap || newBinCount <= 0)
-        return 0;
-    hash_map_t* newPointerToMap = realloc(hashMap, sizeof(hash_map_t) + sizeof(hash_map_bin_t*) * newBinCount);
-    if(!newPointerToMap)
-        return 0;
-    return newPointerToMap;
+static inline group_mask_t matchEmpty(const int8_t* group) {
+    return matchByte(group, CONTROL_EMPTY);
 }
 
-static void* putValue(hash_map_t* hashMap, uint32_t hash, void* value) {
-    if(!hashMap)
-        return 0;
-    uint32_t index = hash % hashMap->binCount;
-    hash_map_bin_t* bin = hashMap->bins[index];
-    if(!bin) {
-        bin = malloc(sizeof(hash_map_bin_t) + sizeof(hash_map_bin_entry_t));
-        hashMap->bins[index] = bin;
-        if(bin) {
-            bin->size = 1;
-            bin->elements[0].hash = hash;
-            bin->elements[0].value = value;
-            hashMap->valueCount++;
-            return value;
+// empty and deleted are the only control bytes with the sign bit set
+static inline group_mask_t matchEmptyOrDeleted(const int8_t* group) {
+    return (group_mask_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+
+static inline uint32_t firstSlot(group_mask_t mask) {
+    return __builtin_ctz(mask);
+}
+
+static inline uint32_t slotsAfterLast(group_mask_t mask) {
+    return __builtin_clz(mask) - (32 - GROUP_WIDTH);
+}
+
+#else
+
+// eight control bytes in a word, a match sets the high bit of the byte
+#define GROUP_WIDTH 8
+#define LOW_BITS 0x0101010101010101ULL
+#define HIGH_BITS 0x8080808080808080ULL
+
+typedef uint64_t group_mask_t;
+
+static inline uint64_t loadGroup(const int8_t* group) {
+    uint64_t controls;
+    memcpy(&controls, group, sizeof(controls));
+    return controls;
+}
+
+// may report a byte next to a real match, which only costs a key comparison
+static inline group_mask_t matchByte(const int8_t* group, int8_t byte) {
+    uint64_t controls = loadGroup(group) ^ (LOW_BITS * (uint8_t) byte);
+    return (controls - LOW_BITS) & ~controls & HIGH_BITS;
+}
+
+static inline group_mask_t matchEmpty(const int8_t* group) {
+    uint64_t controls = loadGroup(group);
+    return controls & ~(controls << 6) & HIGH_BITS;
+}
+
+static inline group_mask_t matchEmptyOrDeleted(const int8_t* group) {
+    return loadGroup(group) & HIGH_BITS;
+}
+
+static inline uint32_t firstSlot(group_mask_t mask) {
+    return __builtin_ctzll(mask) >> 3;
+}
+
+static inline uint32_t slotsAfterLast(group_mask_t mask) {
+    return __builtin_clzll(mask) >> 3;
+}
+
+#endif
+
+static inline group_mask_t nextMatch(group_mask_t mask) {
+    return mask & (mask - 1);
+}
+
+// slots keep 32 bits of a 64-bit hash, the control byte and the probe start come from different ones
+static inline uint32_t foldHash(uint64_t hash) {
+    return (uint32_t) hash ^ (uint32_t) (hash >> 32);
+}
+
+static inline uint32_t hashKey(const hash_map_t* hashMap, uint32_t keyLength, const void* key) {
+    if(hashMap->hashKind == HASH_MAP_HASH_FAST64)
+        return foldHash(FastHash64(key, keyLength, hashMap->hashSeed));
+    uint32_t hash;
+    MurmurHash3_x86_32(key, keyLength, hashMap->hashSeed, &hash);
+    return hash;
+}
+
+static inline int8_t hashControl(uint32_t hash) {
+    return hash & 0x7F;
+}
+
+static inline void setControl(hash_map_t* hashMap, uint32_t index, int8_t control) {
+    hashMap->controls[index] = control;
+    if(index < GROUP_WIDTH)
+        hashMap->controls[hashMap->capacity + index] = control;
+}
+
+static inline const uint8_t* slotKey(const hash_map_t* hashMap, const hash_map_slot_t* slot) {
+    return slot->keyLength > INLINE_KEY_LENGTH ? hashMap->keys + slot->key.offset : slot->key.bytes;
+}
+
+// smallest capacity holding count keys within the load factor
+static uint32_t capacityFor(uint32_t count) {
+    uint32_t capacity = MIN_CAPACITY;
+    while(capacity - capacity / 8 < count && capacity < (1u << 31))
+        capacity *= 2;
+    return capacity;
+}
+
+/*
+ * Groups are probed at growing distances from the position the hash picks, which with a power of two capacity
+ * visits every group once before repeating.
+ */
+static hash_map_slot_t* findSlot(const hash_map_t* hashMap, uint32_t hash, uint32_t keyLength, const void* key) {
+    uint32_t mask = hashMap->capacity - 1;
+    uint32_t position = (hash >> 7) & mask;
+    int8_t control = hashControl(hash);
+    for(uint32_t distance = GROUP_WIDTH;; distance += GROUP_WIDTH) {
+        const int8_t* group = hashMap->controls + position;
+        for(group_mask_t match = matchByte(group, control); match; match = nextMatch(match)) {
+            hash_map_slot_t* slot = &hashMap->slots[(position + firstSlot(match)) & mask];
+            if(slot->hash == hash && slot->keyLength == keyLength &&
+               memcmp(slotKey(hashMap, slot), key, keyLength) == 0)
+                return slot;
         }
-        return 0;
+        if(matchEmpty(group))
+            return 0;
+        position = (position + distance) & mask;
+    }
+}
+
+static uint32_t findFreeIndex(const hash_map_t* hashMap, uint32_t hash) {
+    uint32_t mask = hashMap->capacity - 1;
+    uint32_t position = (hash >> 7) & mask;
+    for(uint32_t distance = GROUP_WIDTH;; distance += GROUP_WIDTH) {
+        group_mask_t match = matchEmptyOrDeleted(hashMap->controls + position);
+        if(match)
+            return (position + firstSlot(match)) & mask;
+        position = (position + distance) & mask;
     }
-    for(uint32_t i = 0; i < bin->size; i++) {
-        if(bin->elements[i].hash == hash) {
-            void* oldValue = bin->elements[i].value;
-            bin->elements[i].hash = hash;
-            bin->elements[i].value =value;
-            return oldValue;
+}
+
+// moves every entry into arrays of the given capacity, dropping deleted slots
+static bool resize(hash_map_t* hashMap, uint32_t capacity) {
+    int8_t* controls = malloc(capacity + GROUP_WIDTH);
+    hash_map_slot_t* slots = malloc(sizeof(hash_map_slot_t) * capacity);
+    if(!controls || !slots) {
+        free(controls);
+        free(slots);
+        return false;
+    }
+    int8_t* oldControls = hashMap->controls;
+    hash_map_slot_t* oldSlots = hashMap->slots;
+    uint32_t oldCapacity = hashMap->capacity;
+    memset(controls, CONTROL_EMPTY, capacity + GROUP_WIDTH);
+    hashMap->controls = controls;
+    hashMap->slots = slots;
+    hashMap->capacity = capacity;
+    for(uint32_t i = 0; i < oldCapacity; i++) {
+        if(oldControls[i] >= 0) {
+            uint32_t index = findFreeIndex(hashMap, oldSlots[i].hash);
+            slots[index] = oldSlots[i];
+            setControl(hashMap, index, oldControls[i]);
+        }
+    }
+    hashMap->growthLeft = capacity - capacity / 8 - hashMap->valueCount;
+    free(oldControls);
+    free(oldSlots);
+    return true;
+}
+
+// copies the long keys still in use into a new buffer with room for extra bytes more
+static bool compactKeys(hash_map_t* hashMap, size_t extra) {
+    size_t capacity = 2 * (hashMap->keysLength - hashMap->keysGarbage + extra);
+    if(capacity < MIN_KEYS_CAPACITY)
+        capacity = MIN_KEYS_CAPACITY;
+    uint8_t* keys = malloc(capacity);
+    if(!keys)
+        return false;
+    size_t length = 0;
+    for(uint32_t i = 0; i < hashMap->capacity; i++) {
+        hash_map_slot_t* slot = &hashMap->slots[i];
+        if(hashMap->controls[i] >= 0 && slot->keyLength > INLINE_KEY_LENGTH) {
+            memcpy(keys + length, hashMap->keys + slot->key.offset, slot->keyLength);
+            slot->key.offset = length;
+            length += slot->keyLength;
         }
     }
-    bin = realloc(bin, sizeof(hash_map_bin_t) + sizeof(hash_map_bin_entry_t) * (bin->size + 1));
-    if(!bin)
+    free(hashMap->keys);
+    hashMap->keys = keys;
+    hashMap->keysLength = length;
+    hashMap->keysCapacity = capacity;
+    hashMap->keysGarbage = 0;
+    return true;
+}
+
+static bool storeKey(hash_map_t* hashMap, hash_map_slot_t* slot, uint32_t keyLength, const void* key) {
+    if(keyLength <= INLINE_KEY_LENGTH) {
+        memcpy(slot->key.bytes, key, keyLength);
+    } else {
+        if(hashMap->keysLength + keyLength > hashMap->keysCapacity && !compactKeys(hashMap, keyLength))
+            return false;
+        memcpy(hashMap->keys + hashMap->keysLength, key, keyLength);
+        slot->key.offset = hashMap->keysLength;
+        hashMap->keysLength += keyLength;
+    }
+    slot->keyLength = keyLength;
+    return true;
+}
+
+static hash_map_t* createMap(uint32_t hashSeed, hash_map_hash_t hashKind, uint32_t capacity) {
+    hash_map_t* hashMap = malloc(sizeof(hash_map_t));
+    if(!hashMap)
         return 0;
-    bin->elements[bin->size].hash = hash;
-    bin->elements[bin->size].value = value;
-    bin->size++;
-    hashMap->bins[index] = bin;
-    hashMap->valueCount++;
-    return value;
+    memset(hashMap, 0, sizeof(hash_map_t));
+    hashMap->hashSeed = hashSeed;
+    hashMap->hashKind = hashKind;
+    if(!resize(hashMap, capacity)) {
+        free(hashMap);
+        return 0;
+    }
+    return hashMap;
 }
 
 hash_map_t* hash_map_create() {
-    return createMap(DEFAULT_HASH_SEED, DEFAULT_BINS_COUNT);
+    return createMap(DEFAULT_HASH_SEED, HASH_MAP_DEFAULT_HASH, MIN_CAPACITY);
+}
+
+hash_map_t* hash_map_create_with_hash(uint32_t binsCount, hash_map_hash_t hash) {
+    return createMap(DEFAULT_HASH_SEED, hash, capacityFor(binsCount));
 }
 
 hash_map_t* hash_map_create_pre_sized(uint32_t binsCount) {
-    return createMap(DEFAULT_HASH_SEED, binsCount);
+    return createMap(DEFAULT_HASH_SEED, HASH_MAP_DEFAULT_HASH, capacityFor(binsCount));
 }
 
 hash_map_t* hash_map_reload(hash_map_t* hashMap) {
     if(!hashMap)
         return 0;
-    return hash_map_reload_with_count(hashMap, ceilf(hashMap->valueCount / LOAD_FACTOR));
+    return hash_map_reload_with_count(hashMap, hashMap->valueCount);
 }
 
+// sized for newBinCount keys but never below the keys present, the map stays the same one
 hash_map_t* hash_map_reload_with_count(hash_map_t* hashMap, uint32_t newBinCount) {
     if(!hashMap || newBinCount <= 0)
         return 0;
-    hash_map_t* newMap = createMap(hashMap->hashSeed, newBinCount);
-    if(!newMap)
-        return 0;
-    for(uint32_t i = 0; i < hashMap->binCount; i++) {
-        if(hashMap->bins[i] != 0) {
-            for (uint16_t j = 0; j < hashMap->bins[i]->size; j++) {
-                hash_map_bin_entry_t entry = hashMap->bins[i]->elements[j];
-                putValue(newMap, entry.hash, entry.value);
-            }
-        }
-    }
-    hash_map_free(hashMap);
-    return newMap;
+    uint32_t capacity = capacityFor(newBinCount > hashMap->valueCount ? newBinCount : hashMap->valueCount);
+    if(capacity != hashMap->capacity || hashMap->growthLeft + hashMap->valueCount < capacity - capacity / 8)
+        resize(hashMap, capacity);
+    return hashMap;
 }
 
 void hash_map_free(hash_map_t* hashMap) {
     if(!hashMap)
         return;
-    for(uint32_t i = 0; i < hashMap->binCount; i++) {
-        free(hashMap->bins[i]);
-    }
+    free(hashMap->controls);
+    free(hashMap->slots);
+    free(hashMap->keys);
     free(hashMap);
 }
 
 bool hash_map_contains(hash_map_t* hashMap, uint32_t keyLength, const void *key) {
     if(!hashMap || !key || keyLength <= 0)
         return false;
-    uint32_t hash;
-    MurmurHash3_x86_32(key, keyLength, hashMap->hashSeed, &hash);
-    uint32_t index = hash % hashMap->binCount;
-    return hashMap->bins[index] != 0;
+    return findSlot(hashMap, hashKey(hashMap, keyLength, key), keyLength, key) != 0;
 }
 
 void* hash_map_get(hash_map_t* hashMap, uint32_t keyLength, const void *key) {
     if(!hashMap || !key || keyLength <= 0)
         return 0;
-    uint32_t hash;
-    MurmurHash3_x86_32(key, keyLength, hashMap->hashSeed, &hash);
-    uint32_t index = hash % hashMap->binCount;
-    hash_map_bin_t* bin = hashMap->bins[index];
-    if(!bin)
-        return 0;
-    for(uint16_t i = 0; i < bin->size; i++) {
-        if(bin->elements[i].hash == hash)
-            return bin->elements[i].value;
+    hash_map_slot_t* slot = findSlot(hashMap, hashKey(hashMap, keyLength, key), keyLength, key);
+    return slot ? slot->value : 0;
+}
+
+void hash_map_get_many(hash_map_t* hashMap, uint32_t count, const uint32_t *keyLengths, const void *const *keys,
+                       void **values) {
+    if(!hashMap || hashMap->hashKind != HASH_MAP_HASH_FAST64) {
+        for(uint32_t i = 0; i < count; i++) {
+            values[i] = hash_map_get(hashMap, keyLengths[i], keys[i]);
+        }
+        return;
+    }
+    // NULL and empty keys find nothing and are left out of the batch, the hash would read through them
+    const void* batchKeys[HASH_BATCH_KEYS];
+    uint32_t batchLengths[HASH_BATCH_KEYS];
+    uint32_t batchIndexes[HASH_BATCH_KEYS];
+    uint64_t hashes[HASH_BATCH_KEYS];
+    uint32_t next = 0;
+    while(next < count) {
+        uint32_t batchCount = 0;
+        for(; next < count && batchCount < HASH_BATCH_KEYS; next++) {
+            values[next] = 0;
+            if(!keys[next] || keyLengths[next] == 0)
+                continue;
+            batchKeys[batchCount] = keys[next];
+            batchLengths[batchCount] = keyLengths[next];
+            batchIndexes[batchCount] = next;
+            batchCount++;
+        }
+        FastHash64_batch(batchCount, batchKeys, batchLengths, hashMap->hashSeed, hashes);
+        for(uint32_t i = 0; i < batchCount; i++) {
+            hash_map_slot_t* slot = findSlot(hashMap, foldHash(hashes[i]), batchLengths[i], batchKeys[i]);
+            values[batchIndexes[i]] = slot ? slot->value : 0;
+        }
     }
-    return 0;
 }
 
+// returns the replaced value, or the new one when the key was not there
 void* hash_map_put(hash_map_t* hashMap, uint32_t keyLength, const void *key, void *value) {
     if(!hashMap || !key || keyLength <= 0)
         return 0;
-    uint32_t hash;
-    MurmurHash3_x86_32(key, keyLength, hashMap->hashSeed, &hash);
-    return putValue(hashMap, hash, value);
+    uint32_t hash = hashKey(hashMap, keyLength, key);
+    hash_map_slot_t* slot = findSlot(hashMap, hash, keyLength, key);
+    if(slot) {
+        void* oldValue = slot->value;
+        slot->value = value;
+        return oldValue;
+    }
+    // mostly deleted slots are cleared at the same capacity, a map full of keys doubles
+    if(hashMap->growthLeft == 0 && !resize(hashMap, capacityFor(hashMap->valueCount + hashMap->valueCount / 2 + 1)))
+        return 0;
+    uint32_t index = findFreeIndex(hashMap, hash);
+    slot = &hashMap->slots[index];
+    if(!storeKey(hashMap, slot, keyLength, key))
+        return 0;
+    slot->hash = hash;
+    slot->value = value;
+    if(hashMap->controls[index] == CONTROL_EMPTY)
+        hashMap->growthLeft--;
+    setControl(hashMap, index, hashControl(hash));
+    hashMap->valueCount++;
+    return value;
 }
 
 void* hash_map_remove(hash_map_t* hashMap, uint32_t keyLength, const void *key) {
     if(!hashMap || !key || keyLength <= 0)
         return 0;
-    uint32_t hash;
-    MurmurHash3_x86_32(key, keyLength, hashMap->hashSeed, &hash);
-    uint32_t index = hash % hashMap->binCount;
-    hash_map_bin_t* bin = hashMap->bins[index];
-    if(!bin)
+    hash_map_slot_t* slot = findSlot(hashMap, hashKey(hashMap, keyLength, key), keyLength, key);
+    if(!slot)
         return 0;
-    void* value = 0;
-    if(bin->size == 1) {
-        value = bin->elements[0].value;
-        hashMap->bins[index] = 0;
-        hashMap->valueCount--;
-    } else {
-        hash_map_bin_t* newBin = malloc(sizeof(hash_map_bin_t) + sizeof(hash_map_bin_entry_t) * (bin->size - 1));
-        if(!newBin)
-            return 0;
-        newBin->size = bin->size - 1;
-        uint16_t j = 0;
-        for(uint16_t i = 0; i < bin->size; i++) {
-            if(bin->elements[i].hash == hash) {
-                value = bin->elements[i].value;
-            } else {
-                newBin->elements[j] = bin->elements[i];
-                j++;
-            }
-        }
-        hashMap->bins[index] = newBin;
-        hashMap->valueCount--;
-    }
-    free(bin);
-    return value;
-}
\ No newline at end of file
+    uint32_t mask = hashMap->capacity - 1;
+    uint32_t index = slot - hashMap->slots;
+    if(slot->keyLength > INLINE_KEY_LENGTH)
+        hashMap->keysGarbage += slot->keyLength;
+    // the slot can become empty again only if no probe ever saw a whole group around it full
+    group_mask_t emptyBefore = matchEmpty(hashMap->controls + ((index - GROUP_WIDTH) & mask));
+    group_mask_t emptyAfter = matchEmpty(hashMap->controls + index);
+    bool wasNeverFull = emptyBefore && emptyAfter &&
+                        firstSlot(emptyAfter) + slotsAfterLast(emptyBefore) < GROUP_WIDTH;
+    setControl(hashMap, index, wasNeverFull ? CONTROL_EMPTY : CONTROL_DELETED);
+    if(wasNeverFull)
+        hashMap->growthLeft++;
+    hashMap->valueCount--;
+    return slot->value;
+}
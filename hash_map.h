@@ -9,8 +9,18 @@
 
 typedef struct hash_map_s hash_map_t;
 
+// function keys are hashed with, fixed for the life of a map
+typedef enum hash_map_hash_e {
+    HASH_MAP_HASH_FAST64,
+    HASH_MAP_HASH_MURMUR3_32
+} hash_map_hash_t;
+
+#define HASH_MAP_DEFAULT_HASH HASH_MAP_HASH_FAST64
+
 hash_map_t* hash_map_create();
 
+hash_map_t* hash_map_create_with_hash(uint32_t binsCount, hash_map_hash_t hash);
+
 hash_map_t* hash_map_create_pre_sized(uint32_t binsCount);
 
 hash_map_t* hash_map_reload(hash_map_t* hashMap);
@@ -23,6 +33,10 @@ bool hash_map_contains(hash_map_t* hashMap, uint32_t keyLength, const void *key)
 
 void* hash_map_get(hash_map_t* hashMap, uint32_t keyLength, const void *key);
 
+// values[i] = hash_map_get(hashMap, keyLengths[i], keys[i]), with the keys hashed in batches
+void hash_map_get_many(hash_map_t* hashMap, uint32_t count, const uint32_t *keyLengths, const void *const *keys,
+                       void **values);
+
 void* hash_map_put(hash_map_t* hashMap, uint32_t keyLength, const void *key, void *value);
 
 void* hash_map_remove(hash_map_t* hashMap, uint32_t keyLength, const void *key);
@@ -1,14 +1,45 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
 #include <roaring/roaring.h>
 #include "hash_map.h"
+#include "MurmurHash3.h"
+#include "expression.h"
+#include "result_cache.h"
+#include "bit_sliced_index.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "min_hash_index.h"
+#include "result_pool.h"
+#include "query_stats.h"
+#include "query_log.h"
 #include "ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring.h"
 
+// product id of the entries removed products leave in attribute and sorting arrays, no product has it
+#define PRODUCT_TOMBSTONE UINT32_MAX
+
 typedef struct sorting_index_s {
+    // removed products leave tombstones, the array is compacted once they are more than half of it
     uint32_t *products;
+    // position of every product id in [minProduct, minProduct + indexCount), -1 for ids not in products
     uint32_t *indices;
+    uint32_t productCount;
+    uint32_t productCapacity;
+    uint32_t tombstoneCount;
+    uint32_t minProduct;
+    uint32_t indexCount;
+    bool isMapped;
+    // built from the attribute of the same name in completeLoadData and moved along with it on every update
+    bool isAttributeMirror;
+    // set through a sharded handle with the whole order, never compacted so that positions match in every shard
+    bool isShared;
 } sorting_index_t;
 
 typedef struct product_attribute_s {
@@ -16,11 +47,104 @@ typedef struct product_attribute_s {
     uint32_t productId;
 } product_attribute_t;
 
+/*
+ * Values of one attribute sorted by value. A removed product leaves a tombstone holding its last value, so the
+ * order still holds, and an entry put in later shifts the others only up to the nearest tombstone. Entries are
+ * compacted once tombstones are more than half of them.
+ */
+typedef struct attribute_s {
+    product_attribute_t *entries;
+    uint32_t entryCount;
+    uint32_t entryCapacity;
+    uint32_t tombstoneCount;
+    // entry of every product id in [minProduct, maxProduct] of the storage, -1 for ids without one
+    uint32_t *positions;
+} attribute_t;
+
 typedef struct similar_product_s {
     uint32_t productId;
     uint8_t hitPercent;
 } similar_product_t;
 
+#define OPTION(name) ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_##name
+#define STAT(name) ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_##name
+
+#define RESULT_CACHE_DEFAULT_MEGABYTES 64
+#define QUERY_PARALLEL_DEFAULT_MIN_FEATURES 2048
+#define SIMILAR_LSH_DEFAULT_ROWS 4
+// products upserted since the similarity index was built, re-ranked by every query until the next load
+#define SIMILAR_LSH_MAX_PENDING 4096
+#define SIMILAR_ROW_DIRTY UINT32_MAX
+#define SIMILAR_TABLE_CHUNK_ROWS 1024
+#define SIMILAR_TABLE_TASK_ROWS 16
+// products changed since the rows were computed are scored by every query, past this many all rows are rebuilt
+#define SIMILAR_TABLE_MAX_CHANGED 4096
+#define SLOW_QUERY_LOG_CAPACITY 256
+// stage metrics follow each other from STAGE_MATCH to the last one, slow query records keep them in that order
+#define SLOW_QUERY_STAGE_COUNT (STAT(COUNT) - STAT(STAGE_MATCH))
+// bitmap families updates change in place, whose frozen views of a snapshot are copied out one by one
+#define MAPPED_FEATURE_PRODUCTS 0
+#define MAPPED_FEATURE_PRODUCTS_EXT 1
+#define MAPPED_FEATURE_GROUPS 2
+#define MAPPED_GROUP_PRODUCTS 3
+#define MAPPED_GROUP_FEATURES 4
+#define MAPPED_FAMILY_COUNT 5
+
+typedef struct jroaring_options_s {
+    uint32_t buildThreadCount;
+    uint64_t resultCacheBytes;
+    bool attributeBitSlices;
+    uint32_t queryParallelMinFeatures;
+    uint32_t similarBands;
+    uint32_t similarRows;
+    uint32_t similarTableSize;
+    bool compactAfterLoad;
+    uint64_t slowQueryNanos;
+} jroaring_options_t;
+
+/*
+ * Top similar products of every product index, computed by a background thread under the storage read lock.
+ * The builder writes only rows marked dirty and publishes a row by storing its count, queries read only rows
+ * with a published count, so the two never touch the same row. Updates mark rows dirty under the write lock.
+ */
+typedef struct similar_table_s {
+    uint32_t size;
+    uint32_t capacity;
+    similar_product_t *rows;
+    atomic_uint *rowCounts;
+    roaring_bitmap_t *dirtyRows;
+    roaring_bitmap_t *changed;
+    thread_pool_t *pool;
+    pthread_t builder;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    bool hasWork;
+    atomic_bool stopping;
+} similar_table_t;
+
+/*
+ * Attribute and sorting index names resolved once to small integer handles, so queries index an array instead
+ * of hashing strings. A name keeps its handle for the life of the jroaring handle, across all generations.
+ */
+typedef struct name_registry_s {
+    pthread_mutex_t mutex;
+    char **names;
+    uint32_t count;
+} name_registry_t;
+
+// what a registered name refers to in one generation
+typedef struct name_slot_s {
+    const char *name;
+    uint32_t nameLength;
+    attribute_t *attribute;
+    bit_sliced_index_t *valueIndex;
+    sorting_index_t *sortingIndex;
+} name_slot_t;
+
+// registered by every handle first, lookups report the price range from this attribute
+#define PRICE_NAME_HANDLE 0
+#define PRICE_NAME "price"
+
 typedef struct jroaring_s {
 
     roaring_bitmap_t **productFeatures;
@@ -32,6 +156,7 @@ typedef struct jroaring_s {
     roaring_bitmap_t **groupFeatures;
 
     uint32_t productCount;
+    uint32_t productCapacity;
     uint32_t featureCount;
     uint32_t minProduct;
     uint32_t maxProduct;
@@ -44,28 +169,144 @@ typedef struct jroaring_s {
     uint32_t similarHit;
 
     uint32_t *indexToProduct;
+    // id-indexed arrays cover [minProduct, maxProduct] only, a shard holding high ids does not pay for the low ones
     uint32_t *productToIndex;
+    // group of every product id in one lookup, kept in memory even for snapshots
+    uint32_t *productToGroup;
 
     uint32_t *indexToGroup;
 
     uint32_t *indexToGroupOrder;
+    // cardinality of productFeatures, so that similarity needs only the intersection
+    uint32_t *indexToFeatureCount;
 
     hash_map_t *productAttributes;
     uint32_t attributeNameCount;
     char **attributeNames;
+    // bit-sliced values of products in each attribute, kept in step with every update
+    hash_map_t *attributeIndexes;
+    // candidates for getSimilarProducts, the ids upserted after the build are always candidates on top of them
+    min_hash_index_t *similarIndex;
+    roaring_bitmap_t *similarPending;
+    similar_table_t *similarTable;
 
     hash_map_t *sortingIndexes;
     uint32_t sortingIndexNameCount;
     char **sortingIndexNames;
+    // attributes and sorting indexes by registered name handle, refreshed whenever either of them changes
+    name_slot_t *nameSlots;
+    uint32_t nameSlotCount;
+
+    mapped_file_t *snapshot;
+    // product arrays and attributes still live in the snapshot, the first update copies them out
+    bool isMapped;
+    /*
+     * Indexes of the featureProducts, featureProductsExt, featureGroups, groupProducts and groupFeatures bitmaps
+     * still being frozen views of the snapshot, each is copied out the first time an update changes it. Product
+     * bitmaps are never changed in place, so they stay views until they are replaced.
+     */
+    roaring_bitmap_t *mappedBitmaps[MAPPED_FAMILY_COUNT];
+
+    /*
+     * Product bitmaps compaction found identical to others, by address, with the number of products holding
+     * each. A shared bitmap is never changed in place: upserts give the product a new bitmap of its own and
+     * removals only drop a reference.
+     */
+    hash_map_t *sharedBitmaps;
+
+    // fields below survive clearStorage
+    jroaring_options_t *options;
+    name_registry_t *registry;
+    // taken shared by queries and exclusively by in place updates
+    pthread_rwlock_t lock;
+    // filtered matches of recent queries, emptied whenever the storage changes
+    result_cache_t *resultCache;
 
 } jroaring_t;
 
-static jroaring_t *createStorage() {
+/*
+ * What Java holds a pointer to. Queries always run against the published generation, while the next one
+ * is being loaded into staging. A retired generation is freed only after every query that could have
+ * picked it up is finished: readers register in one of two counters selected by the epoch parity, and
+ * publisher flips the epoch twice, draining each counter in turn.
+ *
+ * A sharded handle has no storage of its own. Its products are split between shard handles, which are loaded,
+ * updated and published one by one like any other handle, and its lookups and counts run on every shard at
+ * once over the query pool and merge the results. Group counts and representatives are per shard, so products
+ * of one group must go to the same shard.
+ */
+typedef struct jroaring_handle_s {
+    _Atomic(jroaring_t *) current;
+    jroaring_t *staging;
+    atomic_uint epoch;
+    atomic_uint readers[2];
+    pthread_mutex_t publishMutex;
+    jroaring_options_t options;
+    name_registry_t registry;
+    // workers queries split their per-feature loops across, replaced under the same reader protocol
+    _Atomic(thread_pool_t *) queryPool;
+    struct jroaring_handle_s **shards;
+    uint32_t shardCount;
+    // queries slower than options.slowQueryNanos, created with the first threshold and kept for the handle life
+    _Atomic(query_log_t *) slowQueries;
+} jroaring_handle_t;
+
+static jroaring_t *createStorage(jroaring_options_t *options, name_registry_t *registry) {
     jroaring_t *storage = malloc(sizeof(jroaring_t));
     memset(storage, 0, sizeof(jroaring_t));
+    storage->options = options;
+    storage->registry = registry;
+    pthread_rwlock_init(&storage->lock, NULL);
+    storage->resultCache = result_cache_create(options->resultCacheBytes);
     return storage;
 }
 
+static inline uint32_t productIdRange(const jroaring_t *storage) {
+    return storage->maxProduct - storage->minProduct + 1;
+}
+
+static inline uint32_t *productIndexOf(const jroaring_t *storage, uint32_t productId) {
+    return &storage->productToIndex[productId - storage->minProduct];
+}
+
+static inline uint32_t *productGroupOf(const jroaring_t *storage, uint32_t productId) {
+    return &storage->productToGroup[productId - storage->minProduct];
+}
+
+static inline uint32_t getSortedPosition(const sorting_index_t *sortingIndex, uint32_t productId) {
+    return productId >= sortingIndex->minProduct && productId - sortingIndex->minProduct < sortingIndex->indexCount ?
+           sortingIndex->indices[productId - sortingIndex->minProduct] : -1;
+}
+
+/*
+ * Range an id-indexed array covering [from, from + count) grows to so that it covers productId too. It grows by at
+ * least half of what it covers, so that ids arriving one by one in either direction do not copy it every time.
+ */
+static void widenProductIdRange(uint32_t from, uint32_t count, uint32_t productId, uint32_t *newFrom,
+                                uint32_t *newCount) {
+    uint64_t end = (uint64_t) from + count;
+    uint64_t newEnd = end;
+    *newFrom = from;
+    if (productId < from) {
+        *newFrom = from - max(from - productId, min(from, count / 2));
+    } else if (productId >= end) {
+        newEnd = min(max((uint64_t) productId + 1, end + count / 2), (uint64_t) UINT32_MAX);
+    }
+    *newCount = newEnd - *newFrom;
+}
+
+// copy of an id-indexed array moved to a wider range, ids new to it are filled with fillByte
+static uint32_t *widenProductIdArray(const uint32_t *array, uint32_t from, uint32_t count, uint32_t newFrom,
+                                     uint32_t newCount, int fillByte) {
+    uint32_t *widened = malloc(sizeof(uint32_t) * ((size_t) newCount + 1));
+    if (!widened)
+        return 0;
+    memset(widened, fillByte, sizeof(uint32_t) * newCount);
+    if (count > 0)
+        memcpy(widened + (from - newFrom), array, sizeof(uint32_t) * count);
+    return widened;
+}
+
 static void clearBitmaps(uint32_t length, roaring_bitmap_t **bitmaps) {
     if (bitmaps) {
         for (uint32_t i = 0; i < length; i++) {
@@ -77,21 +318,149 @@ static void clearBitmaps(uint32_t length, roaring_bitmap_t **bitmaps) {
     }
 }
 
+// the last product holding a shared bitmap owns it and frees it as usual
+static void releaseProductBitmap(jroaring_t *storage, roaring_bitmap_t *bitmap) {
+    uintptr_t referenceCount = storage->sharedBitmaps ?
+                               (uintptr_t) hash_map_get(storage->sharedBitmaps, sizeof(bitmap), &bitmap) : 0;
+    if (referenceCount > 2) {
+        hash_map_put(storage->sharedBitmaps, sizeof(bitmap), &bitmap, (void *) (referenceCount - 1));
+    } else if (referenceCount == 2) {
+        hash_map_remove(storage->sharedBitmaps, sizeof(bitmap), &bitmap);
+    } else if (bitmap) {
+        roaring_bitmap_free(bitmap);
+    }
+}
+
+static void clearProductBitmaps(jroaring_t *storage, roaring_bitmap_t **bitmaps) {
+    for (uint32_t i = 0; i < storage->productCount; i++) {
+        releaseProductBitmap(storage, bitmaps[i]);
+        bitmaps[i] = 0;
+    }
+}
+
 static inline void freeProductAttributes(jroaring_t *storage) {
+    // attributes of a storage loaded from snapshot live in the mapped file until the first update
     for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
         char *attributeName = storage->attributeNames[i];
-        product_attribute_t *attributes = hash_map_get(storage->productAttributes, strlen(attributeName),
-                                                       attributeName);
-        if (attributes) {
-            free(attributes);
+        attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(attributeName), attributeName);
+        if (!attribute)
+            continue;
+        if (!storage->isMapped) {
+            free(attribute->entries);
+            free(attribute->positions);
         }
+        free(attribute);
     }
     hash_map_free(storage->productAttributes);
 }
 
+static void freeAttributeIndexes(jroaring_t *storage) {
+    if (!storage->attributeIndexes)
+        return;
+    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+        char *attributeName = storage->attributeNames[i];
+        bit_sliced_index_free(hash_map_get(storage->attributeIndexes, strlen(attributeName), attributeName));
+    }
+    hash_map_free(storage->attributeIndexes);
+    storage->attributeIndexes = 0;
+}
+
+static void freeSimilarIndex(jroaring_t *storage) {
+    min_hash_index_free(storage->similarIndex);
+    storage->similarIndex = 0;
+    if (storage->similarPending)
+        roaring_bitmap_free(storage->similarPending);
+    storage->similarPending = 0;
+}
+
+static void freeSimilarTable(jroaring_t *storage) {
+    similar_table_t *table = storage->similarTable;
+    if (!table)
+        return;
+    pthread_mutex_lock(&table->mutex);
+    atomic_store(&table->stopping, true);
+    pthread_cond_signal(&table->wakeup);
+    pthread_mutex_unlock(&table->mutex);
+    pthread_join(table->builder, NULL);
+    thread_pool_free(table->pool);
+    pthread_cond_destroy(&table->wakeup);
+    pthread_mutex_destroy(&table->mutex);
+    roaring_bitmap_free(table->dirtyRows);
+    roaring_bitmap_free(table->changed);
+    free(table->rows);
+    free(table->rowCounts);
+    free(table);
+    storage->similarTable = 0;
+}
+
+static bool ensureSimilarTableCapacity(similar_table_t *table, uint32_t capacity) {
+    if (!table || capacity <= table->capacity)
+        return true;
+    capacity = max(capacity, table->capacity * 2);
+    similar_product_t *rows = realloc(table->rows, sizeof(similar_product_t) * table->size * capacity);
+    if (!rows)
+        return false;
+    table->rows = rows;
+    atomic_uint *rowCounts = realloc(table->rowCounts, sizeof(atomic_uint) * capacity);
+    if (!rowCounts)
+        return false;
+    table->rowCounts = rowCounts;
+    for (uint32_t i = table->capacity; i < capacity; i++) {
+        atomic_init(&table->rowCounts[i], SIMILAR_ROW_DIRTY);
+    }
+    table->capacity = capacity;
+    return true;
+}
+
+static void markSimilarRowsDirty(similar_table_t *table, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        atomic_store_explicit(&table->rowCounts[i], SIMILAR_ROW_DIRTY, memory_order_relaxed);
+    }
+    roaring_bitmap_add_range(table->dirtyRows, from, to);
+    pthread_mutex_lock(&table->mutex);
+    table->hasWork = true;
+    pthread_cond_signal(&table->wakeup);
+    pthread_mutex_unlock(&table->mutex);
+}
+
+// features of the product at index changed, the write lock is held
+static void similarProductChanged(jroaring_t *storage, uint32_t index, uint32_t productId) {
+    similar_table_t *table = storage->similarTable;
+    if (!table)
+        return;
+    roaring_bitmap_add(table->changed, productId);
+    if (roaring_bitmap_get_cardinality(table->changed) > SIMILAR_TABLE_MAX_CHANGED) {
+        roaring_bitmap_clear(table->changed);
+        markSimilarRowsDirty(table, 0, storage->productCount);
+    } else {
+        markSimilarRowsDirty(table, index, index + 1);
+    }
+}
+
+// the product at index is removed and the last one moves into its place, the write lock is held
+static void similarProductRemoved(jroaring_t *storage, uint32_t productId, uint32_t index, uint32_t lastIndex) {
+    similar_table_t *table = storage->similarTable;
+    if (!table)
+        return;
+    roaring_bitmap_remove(table->changed, productId);
+    if (index != lastIndex) {
+        memcpy(table->rows + (size_t) index * table->size, table->rows + (size_t) lastIndex * table->size,
+               sizeof(similar_product_t) * table->size);
+        atomic_store(&table->rowCounts[index], atomic_load(&table->rowCounts[lastIndex]));
+        if (roaring_bitmap_contains(table->dirtyRows, lastIndex))
+            roaring_bitmap_add(table->dirtyRows, index);
+        else
+            roaring_bitmap_remove(table->dirtyRows, index);
+    }
+    roaring_bitmap_remove(table->dirtyRows, lastIndex);
+    atomic_store(&table->rowCounts[lastIndex], SIMILAR_ROW_DIRTY);
+}
+
 static inline void freeSortingIndex(sorting_index_t *sortingIndex) {
-    free(sortingIndex->indices);
-    free(sortingIndex->products);
+    if (!sortingIndex->isMapped) {
+        free(sortingIndex->indices);
+        free(sortingIndex->products);
+    }
     free(sortingIndex);
 }
 
@@ -107,15 +476,22 @@ static inline void freeSortingIndexes(jroaring_t *storage) {
 }
 
 static void clearStorage(jroaring_t *storage) {
-    if (storage && storage->productCount > 0 && storage->featureCount > 0) {
+    if (storage) {
+        freeSimilarTable(storage);
+        free(storage->nameSlots);
+        storage->nameSlots = 0;
+        storage->nameSlotCount = 0;
+
+        // every free checks the allocation, counts may be 0 while arrays are still allocated
         if (storage->productFeatures) {
-            clearBitmaps(storage->productCount, storage->productFeatures);
+            clearProductBitmaps(storage, storage->productFeatures);
             free(storage->productFeatures);
         }
         if (storage->productFeaturesExt) {
-            clearBitmaps(storage->productCount, storage->productFeaturesExt);
+            clearProductBitmaps(storage, storage->productFeaturesExt);
             free(storage->productFeaturesExt);
         }
+        hash_map_free(storage->sharedBitmaps);
         if (storage->featureProducts) {
             clearBitmaps(storage->featureCount, storage->featureProducts);
             free(storage->featureProducts);
@@ -136,14 +512,20 @@ static void clearStorage(jroaring_t *storage) {
             clearBitmaps(storage->maxGroup + 1, storage->groupFeatures);
             free(storage->groupFeatures);
         }
-        if (storage->indexToProduct)
-            free(storage->indexToProduct);
-        if (storage->productToIndex)
-            free(storage->productToIndex);
-        if (storage->indexToGroup)
-            free(storage->indexToGroup);
-        if (storage->indexToGroupOrder)
-            free(storage->indexToGroupOrder);
+        if (!storage->isMapped) {
+            if (storage->indexToProduct)
+                free(storage->indexToProduct);
+            if (storage->productToIndex)
+                free(storage->productToIndex);
+            if (storage->indexToGroup)
+                free(storage->indexToGroup);
+            if (storage->indexToGroupOrder)
+                free(storage->indexToGroupOrder);
+        }
+        free(storage->productToGroup);
+        free(storage->indexToFeatureCount);
+        freeAttributeIndexes(storage);
+        freeSimilarIndex(storage);
         if (storage->productAttributes)
             freeProductAttributes(storage);
         if (storage->attributeNames) {
@@ -160,9 +542,58 @@ static void clearStorage(jroaring_t *storage) {
             }
             free(storage->sortingIndexNames);
         }
+        for (uint32_t i = 0; i < MAPPED_FAMILY_COUNT; i++) {
+            if (storage->mappedBitmaps[i])
+                roaring_bitmap_free(storage->mappedBitmaps[i]);
+        }
+        if (storage->snapshot)
+            mapped_file_close(storage->snapshot);
+
+        memset(storage, 0, offsetof(jroaring_t, options));
+        result_cache_reset(storage->resultCache, storage->options->resultCacheBytes);
+    }
+}
+
+/*
+ * Points the slots of every registered name at what the storage has under that name. Called under the write lock
+ * after attributes or sorting indexes are replaced, and before the storage is published.
+ */
+static void refreshNameSlots(jroaring_t *storage) {
+    name_registry_t *registry = storage->registry;
+    pthread_mutex_lock(&registry->mutex);
+    if (registry->count > storage->nameSlotCount) {
+        name_slot_t *slots = realloc(storage->nameSlots, sizeof(name_slot_t) * registry->count);
+        if (slots) {
+            storage->nameSlots = slots;
+            storage->nameSlotCount = registry->count;
+        }
+    }
+    for (uint32_t i = 0; i < storage->nameSlotCount; i++) {
+        name_slot_t *slot = &storage->nameSlots[i];
+        slot->name = registry->names[i];
+        slot->nameLength = strlen(slot->name);
+        slot->attribute = hash_map_get(storage->productAttributes, slot->nameLength, slot->name);
+        slot->valueIndex = hash_map_get(storage->attributeIndexes, slot->nameLength, slot->name);
+        slot->sortingIndex = hash_map_get(storage->sortingIndexes, slot->nameLength, slot->name);
+    }
+    pthread_mutex_unlock(&registry->mutex);
+}
 
-        memset(storage, 0, sizeof(jroaring_t));
+// registry mutex is held, returns -1 if out of memory
+static jint registerName(name_registry_t *registry, uint32_t nameLength, const char *name) {
+    for (uint32_t i = 0; i < registry->count; i++) {
+        if (strlen(registry->names[i]) == nameLength && memcmp(registry->names[i], name, nameLength) == 0)
+            return i;
     }
+    char **names = realloc(registry->names, sizeof(char *) * (registry->count + 1));
+    if (!names)
+        return -1;
+    registry->names = names;
+    if (!(names[registry->count] = malloc(nameLength + 1)))
+        return -1;
+    memcpy(names[registry->count], name, nameLength);
+    names[registry->count][nameLength] = 0;
+    return registry->count++;
 }
 
 static roaring_bitmap_t *roaring_bitmap_from_jint_array(JNIEnv *env, jintArray array) {
@@ -174,16 +605,26 @@ static roaring_bitmap_t *roaring_bitmap_from_jint_array(JNIEnv *env, jintArray a
     return bitmap;
 }
 
-static void addAttribute(JNIEnv *env, jroaring_t *storage, jint index, jint productId, jstring name, jfloat value) {
-    jint nameLength = (*env)->GetStringUTFLength(env, name);
-    jboolean isCopy;
-    const char *nameChars = (*env)->GetStringUTFChars(env, name, &isCopy);
-    product_attribute_t *attributes = hash_map_get(storage->productAttributes, nameLength, nameChars);
-    if (!attributes) {
-        attributes = malloc(sizeof(product_attribute_t *) * storage->productCount);
-        if (!attributes)
-            return;
-        hash_map_put(storage->productAttributes, nameLength, nameChars, attributes);
+static attribute_t *getOrCreateAttribute(jroaring_t *storage, uint32_t nameLength, const char *nameChars) {
+    attribute_t *attribute = hash_map_get(storage->productAttributes, nameLength, nameChars);
+    if (!attribute) {
+        attribute = calloc(1, sizeof(attribute_t));
+        if (!attribute)
+            return 0;
+        attribute->entries = malloc(sizeof(product_attribute_t) * (storage->productCount + 1));
+        if (!attribute->entries) {
+            free(attribute);
+            return 0;
+        }
+        // rows the loader never sets stay tombstones, completeLoadData drops them after sorting
+        for (uint32_t i = 0; i < storage->productCount; i++) {
+            attribute->entries[i].value = INFINITY;
+            attribute->entries[i].productId = PRODUCT_TOMBSTONE;
+        }
+        attribute->entryCount = storage->productCount;
+        attribute->entryCapacity = storage->productCount;
+        attribute->tombstoneCount = storage->productCount;
+        hash_map_put(storage->productAttributes, nameLength, nameChars, attribute);
 
         storage->attributeNameCount++;
         if (!storage->attributeNames) {
@@ -192,243 +633,444 @@ static void addAttribute(JNIEnv *env, jroaring_t *storage, jint index, jint prod
             storage->attributeNames = realloc(storage->attributeNames, sizeof(char *) * storage->attributeNameCount);
         }
         storage->attributeNames[storage->attributeNameCount - 1] = malloc(nameLength + 1);
-        memcpy(storage->attributeNames[storage->attributeNameCount - 1], nameChars, nameLength + 1);
+        memcpy(storage->attributeNames[storage->attributeNameCount - 1], nameChars, nameLength);
+        storage->attributeNames[storage->attributeNameCount - 1][nameLength] = 0;
     }
-    attributes[index].value = value;
-    attributes[index].productId = productId;
+    return attribute;
+}
+
+static inline void setLoadedAttributeEntry(attribute_t *attribute, uint32_t index, uint32_t productId, float value) {
+    if (attribute->entries[index].productId == PRODUCT_TOMBSTONE)
+        attribute->tombstoneCount--;
+    attribute->entries[index].value = value;
+    attribute->entries[index].productId = productId;
+}
+
+static void addAttribute(JNIEnv *env, jroaring_t *storage, jint index, jint productId, jstring name, jfloat value) {
+    jint nameLength = (*env)->GetStringUTFLength(env, name);
+    jboolean isCopy;
+    const char *nameChars = (*env)->GetStringUTFChars(env, name, &isCopy);
+    attribute_t *attribute = getOrCreateAttribute(storage, nameLength, nameChars);
+    if (attribute)
+        setLoadedAttributeEntry(attribute, index, productId, value);
     (*env)->ReleaseStringUTFChars(env, name, nameChars);
 }
 
+// by value, equal values by product id so that every shard orders ties the same way
 static int compareAttributes(const void *attribute1, const void *attribute2) {
     if (((product_attribute_t *) attribute1)->value < ((product_attribute_t *) attribute2)->value)
         return -1;
     if (((product_attribute_t *) attribute1)->value > ((product_attribute_t *) attribute2)->value)
         return 1;
+    if (((product_attribute_t *) attribute1)->productId < ((product_attribute_t *) attribute2)->productId)
+        return -1;
+    if (((product_attribute_t *) attribute1)->productId > ((product_attribute_t *) attribute2)->productId)
+        return 1;
     return 0;
 }
 
+// more similar first, equally similar products by id so that repeated calls cut ties at the same place
 static int compareSimilar(const void *similar1, const void *similar2) {
     if (((similar_product_t *) similar1)->hitPercent < ((similar_product_t *) similar2)->hitPercent)
         return 1;
     if (((similar_product_t *) similar1)->hitPercent > ((similar_product_t *) similar2)->hitPercent)
         return -1;
+    if (((similar_product_t *) similar1)->productId > ((similar_product_t *) similar2)->productId)
+        return 1;
+    if (((similar_product_t *) similar1)->productId < ((similar_product_t *) similar2)->productId)
+        return -1;
     return 0;
 }
 
-static void getMatches(JNIEnv *env, jroaring_t *storage, jstring expressionString, roaring_bitmap_t *matches) {
-    roaring_bitmap_t *subMatches = roaring_bitmap_create();
-    jint expressionLength = (*env)->GetStringUTFLength(env, expressionString);
-    jboolean isCopy;
-    const char *expression = (*env)->GetStringUTFChars(env, expressionString, &isCopy);
-    char groupOperator = '|';
-    char subOperator = '|';
-    char *currentOperatorPtr = &groupOperator;
-    //      (0&1)|(0&2)
-    for (jint i = 0; i < expressionLength; i++) {
-        switch (expression[i]) {
-            case '(':
-                currentOperatorPtr = &subOperator;
-                break;
-            case ')':
-                currentOperatorPtr = &groupOperator;
-                if (groupOperator == '&') {
-                    roaring_bitmap_and_inplace(matches, subMatches);
-                } else if (groupOperator == '|') {
-                    roaring_bitmap_or_inplace(matches, subMatches);
-                }
-                roaring_bitmap_clear(subMatches);
-                subOperator = '|';
-                break;
-            case '&':
-            case '|':
-                currentOperatorPtr[0] = expression[i];
-                break;
-            default:
-                roaring_bitmap_t *bitmap = currentOperatorPtr == &groupOperator ? matches : subMatches;
-                char *lastChar;
-                uint32_t index = strtol(expression + i, &lastChar, 10);
-                i = lastChar - expression - 1;
-                if (index >= storage->featureCount)
-                    continue;
-                if (currentOperatorPtr[0] == '&') {
-                    if (storage->featureProducts[index])
-                        roaring_bitmap_and_inplace(bitmap, storage->featureProducts[index]);
-                    else
-                        roaring_bitmap_clear(bitmap);
-                } else if (currentOperatorPtr[0] == '|') {
-                    if (storage->featureProducts[index])
-                        roaring_bitmap_or_inplace(bitmap, storage->featureProducts[index]);
-                }
-                break;
+/*
+ * First entry whose value is above the given one, or not below it unless isAbove. Tombstones keep their values,
+ * so the search holds over them.
+ */
+static uint32_t findAttributeBound(const attribute_t *attribute, float value, bool isAbove) {
+    uint32_t from = 0;
+    uint32_t to = attribute->entryCount;
+    while (from < to) {
+        uint32_t middle = from + (to - from) / 2;
+        float middleValue = attribute->entries[middle].value;
+        if (middleValue < value || (isAbove && middleValue == value)) {
+            from = middle + 1;
+        } else {
+            to = middle;
         }
     }
-    roaring_bitmap_free(subMatches);
-    (*env)->ReleaseStringUTFChars(env, expressionString, expression);
+    return from;
 }
 
-static inline void applyFilter(roaring_bitmap_t *bitmap, uint32_t attributeCount, product_attribute_t *attributes,
-                               float fromValue, float toValue) {
+static inline void applyFilter(roaring_bitmap_t *bitmap, uint32_t productCount, const attribute_t *attribute,
+                               const bit_sliced_index_t *valueIndex, float fromValue, float toValue) {
     if (toValue < fromValue && toValue != -1)
         return;
-    uint32_t fromIndex;
-    uint32_t toIndex;
-    if (fromValue < 0) {
-        fromIndex = 0;
-    } else {
-        fromIndex = attributeCount / 2;
-        uint32_t distance = attributeCount / 2 / 2 + 1;
-        while (true) {
-            if (attributes[fromIndex].value >= fromValue) {
-                if (fromIndex <= 0 || attributes[fromIndex - 1].value < fromValue) {
-                    break;
-                }
-                fromIndex -= distance;
-            } else {
-                if (fromIndex >= attributeCount - 1) {
-                    fromIndex = -1;
-                    break;
-                }
-                fromIndex += distance;
-            }
-            distance = (distance / 2) + (distance % 2);
-        }
-    }
-    if (fromIndex == -1) {
-        roaring_bitmap_clear(bitmap);
+    uint32_t attributeCount = attribute->entryCount;
+    // a range over every entry filters out only the products without one
+    bool hasEveryProduct = attributeCount - attribute->tombstoneCount == productCount;
+    if (fromValue < 0 && toValue < 0 && hasEveryProduct)
+        return;
+    roaring_bitmap_t *filterBitmap;
+    if (valueIndex) {
+        // the index is keyed by the values themselves, so the bounds go to it as they are
+        filterBitmap = bit_sliced_index_range(valueIndex, fromValue < 0 ? 0 : bit_sliced_index_encode(fromValue),
+                                              toValue < 0 ? UINT32_MAX : bit_sliced_index_encode(toValue));
+        roaring_bitmap_and_inplace(bitmap, filterBitmap);
+        roaring_bitmap_free(filterBitmap);
         return;
     }
-    if (toValue < 0) {
-        toIndex = attributeCount - 1;
-    } else {
-        toIndex = attributeCount / 2;
-        uint32_t distance = attributeCount / 2 / 2 + 1;
-        while (true) {
-            if (attributes[toIndex].value <= toValue) {
-                if (toIndex >= attributeCount - 1 || attributes[toIndex + 1].value > toValue) {
-                    break;
-                }
-                toIndex += distance;
-            } else {
-                if (toIndex <= 0) {
-                    toIndex = -1;
-                    break;
-                }
-                toIndex -= distance;
-            }
-            distance = (distance / 2) + (distance % 2);
-        }
-    }
-    if (toIndex == -1) {
+    const product_attribute_t *attributes = attribute->entries;
+    uint32_t fromIndex = fromValue < 0 ? 0 : findAttributeBound(attribute, fromValue, false);
+    uint32_t toEnd = toValue < 0 ? attributeCount : findAttributeBound(attribute, toValue, true);
+    if (fromIndex >= toEnd) {
         roaring_bitmap_clear(bitmap);
         return;
     }
-    if (fromIndex == 0 && toIndex == attributeCount - 1)
+    uint32_t toIndex = toEnd - 1;
+    if (fromIndex == 0 && toIndex == attributeCount - 1 && hasEveryProduct)
         return;
-    roaring_bitmap_t *filterBitmap = roaring_bitmap_create();
+    filterBitmap = roaring_bitmap_create();
     for (uint32_t i = fromIndex; i <= toIndex; i++) {
-        roaring_bitmap_add(filterBitmap, attributes[i].productId);
+        if (attributes[i].productId != PRODUCT_TOMBSTONE)
+            roaring_bitmap_add(filterBitmap, attributes[i].productId);
     }
     roaring_bitmap_and_inplace(bitmap, filterBitmap);
     roaring_bitmap_free(filterBitmap);
 }
 
-static inline void
-applyFilters(JNIEnv *env, jroaring_t *storage, roaring_bitmap_t *bitmap, jobjectArray filterNamesArray,
-             jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray) {
-    jsize filterCount = (*env)->GetArrayLength(env, filterNamesArray);
-    jboolean isCopy;
-    jfloat *fromValues = (*env)->GetFloatArrayElements(env, filterFromValuesArray, &isCopy);
-    jfloat *toValues = (*env)->GetFloatArrayElements(env, filterToValuesArray, &isCopy);
-    for (jsize i = 0; i < filterCount; i++) {
-        jstring filterNameString = (*env)->GetObjectArrayElement(env, filterNamesArray, i);
-        jsize filterNameLength = (*env)->GetStringUTFLength(env, filterNameString);
-        const char *filterName = (*env)->GetStringUTFChars(env, filterNameString, &isCopy);
-        product_attribute_t *attributes = hash_map_get(storage->productAttributes, filterNameLength, filterName);
-        (*env)->ReleaseStringUTFChars(env, filterNameString, filterName);
-        if (attributes) {
-            applyFilter(bitmap, storage->productCount, attributes, fromValues[i], toValues[i]);
-        }
+/*
+ * Attribute range a query is filtered by. Filters given by name are resolved by hashing when they are applied,
+ * the ones given by handle come resolved from the name slots.
+ */
+typedef struct query_filter_s {
+    jstring nameString;
+    const char *name;
+    uint32_t nameLength;
+    jfloat fromValue;
+    jfloat toValue;
+    const attribute_t *attribute;
+    const bit_sliced_index_t *valueIndex;
+} query_filter_t;
+
+static query_filter_t *readNamedFilters(JNIEnv *env, jobjectArray filterNamesArray, jfloatArray filterFromValuesArray,
+                                        jfloatArray filterToValuesArray, uint32_t *filterCount) {
+    jsize count = (*env)->GetArrayLength(env, filterNamesArray);
+    query_filter_t *filters = malloc(sizeof(query_filter_t) * (count + 1));
+    jfloat *fromValues = (*env)->GetFloatArrayElements(env, filterFromValuesArray, NULL);
+    jfloat *toValues = (*env)->GetFloatArrayElements(env, filterToValuesArray, NULL);
+    for (jsize i = 0; i < count; i++) {
+        filters[i].nameString = (*env)->GetObjectArrayElement(env, filterNamesArray, i);
+        filters[i].name = (*env)->GetStringUTFChars(env, filters[i].nameString, NULL);
+        filters[i].nameLength = (*env)->GetStringUTFLength(env, filters[i].nameString);
+        filters[i].fromValue = fromValues[i];
+        filters[i].toValue = toValues[i];
+        filters[i].attribute = 0;
+        filters[i].valueIndex = 0;
     }
     (*env)->ReleaseFloatArrayElements(env, filterFromValuesArray, fromValues, JNI_ABORT);
     (*env)->ReleaseFloatArrayElements(env, filterToValuesArray, toValues, JNI_ABORT);
+    *filterCount = count;
+    return filters;
 }
 
-static inline uint32_t getGroupSize(jroaring_t *storage, roaring_bitmap_t *products, roaring_bitmap_t *groups) {
-    roaring_bitmap_clear(groups);
-    roaring_uint32_iterator_t *iterator = roaring_create_iterator(products);
-    while (iterator->has_value) {
-        roaring_bitmap_add(groups, storage->indexToGroup[storage->productToIndex[iterator->current_value]]);
-        roaring_advance_uint32_iterator(iterator);
+// handles not registered when the storage was last refreshed are ignored, same as unknown names
+static uint32_t resolveHandleFilters(jroaring_t *storage, uint32_t handleCount, const jint *handles,
+                                     const jfloat *fromValues, const jfloat *toValues, query_filter_t *filters) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < handleCount; i++) {
+        if (handles[i] < 0 || handles[i] >= storage->nameSlotCount)
+            continue;
+        const name_slot_t *slot = &storage->nameSlots[handles[i]];
+        filters[count].nameString = 0;
+        filters[count].name = slot->name;
+        filters[count].nameLength = slot->nameLength;
+        filters[count].fromValue = fromValues[i];
+        filters[count].toValue = toValues[i];
+        filters[count].attribute = slot->attribute;
+        filters[count].valueIndex = slot->valueIndex;
+        count++;
     }
-    roaring_free_uint32_iterator(iterator);
-    return roaring_bitmap_get_cardinality(groups);
+    return count;
 }
 
-static void setSortingIndex(jroaring_t *storage, uint32_t sortingIdLength, const char *sortingId,
-                            uint32_t sortedProductCount, const uint32_t *sortedProducts) {
-    sorting_index_t *sortingIndex = malloc(sizeof(sorting_index_t));
-    sortingIndex->products = malloc(sizeof(uint32_t) * sortedProductCount);
-    memcpy(sortingIndex->products, sortedProducts, sortedProductCount);
-    uint32_t maxProductId = sortedProducts[0];
-    for (uint32_t i = 1; i < sortedProductCount; i++) {
-        if (sortedProducts[i] > maxProductId)
-            maxProductId = sortedProducts[i];
+static query_filter_t *readHandleFilters(JNIEnv *env, jroaring_t *storage, jintArray filterHandlesArray,
+                                         jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray,
+                                         uint32_t *filterCount) {
+    jsize handleCount = filterHandlesArray ? (*env)->GetArrayLength(env, filterHandlesArray) : 0;
+    query_filter_t *filters = malloc(sizeof(query_filter_t) * (handleCount + 1));
+    uint32_t count = 0;
+    if (handleCount > 0) {
+        jint *handles = (*env)->GetIntArrayElements(env, filterHandlesArray, NULL);
+        jfloat *fromValues = (*env)->GetFloatArrayElements(env, filterFromValuesArray, NULL);
+        jfloat *toValues = (*env)->GetFloatArrayElements(env, filterToValuesArray, NULL);
+        count = resolveHandleFilters(storage, handleCount, handles, fromValues, toValues, filters);
+        (*env)->ReleaseFloatArrayElements(env, filterToValuesArray, toValues, JNI_ABORT);
+        (*env)->ReleaseFloatArrayElements(env, filterFromValuesArray, fromValues, JNI_ABORT);
+        (*env)->ReleaseIntArrayElements(env, filterHandlesArray, handles, JNI_ABORT);
     }
-    sortingIndex->indices = malloc(sizeof(uint32_t) * (maxProductId + 1));
-    for (uint32_t i = 0; i <= maxProductId; i++) {
-        sortingIndex->indices[i] = -1;
+    *filterCount = count;
+    return filters;
+}
+
+static void releaseFilters(JNIEnv *env, query_filter_t *filters, uint32_t filterCount) {
+    for (uint32_t i = 0; i < filterCount; i++) {
+        if (filters[i].nameString) {
+            (*env)->ReleaseStringUTFChars(env, filters[i].nameString, filters[i].name);
+            (*env)->DeleteLocalRef(env, filters[i].nameString);
+        }
     }
-    for (uint32_t i = 1; i < sortedProductCount; i++) {
-        sortingIndex->indices[sortedProducts[i]] = i;
+    free(filters);
+}
+
+static inline void applyFilters(jroaring_t *storage, roaring_bitmap_t *bitmap, const query_filter_t *filters,
+                                uint32_t filterCount) {
+    for (uint32_t i = 0; i < filterCount; i++) {
+        const attribute_t *attribute = filters[i].attribute;
+        const bit_sliced_index_t *valueIndex = filters[i].valueIndex;
+        if (filters[i].nameString) {
+            attribute = hash_map_get(storage->productAttributes, filters[i].nameLength, filters[i].name);
+            valueIndex = hash_map_get(storage->attributeIndexes, filters[i].nameLength, filters[i].name);
+        }
+        if (attribute)
+            applyFilter(bitmap, storage->productCount, attribute, valueIndex, filters[i].fromValue, filters[i].toValue);
     }
-    sorting_index_t *previousValue = hash_map_put(storage->sortingIndexes, sortingIdLength, sortingId, sortingIndex);
-    if (previousValue && previousValue != sortingIndex)
-        freeSortingIndex(previousValue);
 }
 
-JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_init
-        (JNIEnv *env, jclass class) {
-    return (jlong) createStorage();
+static int compareFilters(const void *filter1, const void *filter2) {
+    const query_filter_t *key1 = filter1;
+    const query_filter_t *key2 = filter2;
+    int result = strcmp(key1->name, key2->name);
+    if (result != 0)
+        return result;
+    if (key1->fromValue != key2->fromValue)
+        return key1->fromValue < key2->fromValue ? -1 : 1;
+    if (key1->toValue != key2->toValue)
+        return key1->toValue < key2->toValue ? -1 : 1;
+    return 0;
 }
 
-JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_initStorage
-        (JNIEnv *env, jclass class, jlong pointer, jint rowCount, jint columnCount) {
+/*
+ * Result cache key: canonical expression followed by filters sorted by name, so requests that differ only in
+ * operand or filter order share an entry.
+ */
+static char *getMatchesKey(const expression_t *expression, query_filter_t *filters, uint32_t filterCount,
+                           uint32_t *keyLength) {
+    uint32_t expressionLength;
+    char *canonicalExpression = expression_canonical(expression, &expressionLength);
 
-    jroaring_t *storage = (jroaring_t *) pointer;
-    clearStorage(storage);
+    uint32_t length = expressionLength + 1;
+    for (uint32_t i = 0; i < filterCount; i++) {
+        length += filters[i].nameLength + 1 + sizeof(jfloat) * 2;
+    }
+    qsort(filters, filterCount, sizeof(query_filter_t), compareFilters);
 
-    storage->productCount = rowCount;
-    storage->featureCount = columnCount;
+    char *key = malloc(length);
+    memcpy(key, canonicalExpression, expressionLength + 1);
+    char *position = key + expressionLength + 1;
+    for (uint32_t i = 0; i < filterCount; i++) {
+        memcpy(position, filters[i].name, filters[i].nameLength);
+        position[filters[i].nameLength] = 0;
+        position += filters[i].nameLength + 1;
+        memcpy(position, &filters[i].fromValue, sizeof(jfloat));
+        position += sizeof(jfloat);
+        memcpy(position, &filters[i].toValue, sizeof(jfloat));
+        position += sizeof(jfloat);
+    }
+    free(canonicalExpression);
+    *keyLength = length;
+    return key;
+}
 
-    storage->similarHit = 50;
+// filters are sorted in place, takes no JNI calls so that pool threads can match on behalf of a query
+static roaring_bitmap_t *matchExpression(jroaring_t *storage, const char *expressionChars, uint32_t expressionLength,
+                                         query_filter_t *filters, uint32_t filterCount) {
+    uint64_t stageStart = query_stats_start();
+    expression_t *expression = expression_compile(expressionChars, expressionLength, storage->featureCount);
+    if (!expression)
+        return roaring_bitmap_create();
 
-    storage->productFeatures = malloc(sizeof(roaring_bitmap_t *) * rowCount);
-    storage->productFeaturesExt = malloc(sizeof(roaring_bitmap_t *) * rowCount);
+    uint32_t keyLength;
+    char *key = getMatchesKey(expression, filters, filterCount, &keyLength);
+    roaring_bitmap_t *matches = result_cache_get(storage->resultCache, keyLength, key);
+    if (!matches) {
+        expression_source_t source = {
+                .features = storage->featureProducts,
+                .extFeatures = storage->featureProductsExt,
+                .featureCount = storage->featureCount,
+                .products = storage->indexToProduct,
+                .productCount = storage->productCount
+        };
+        matches = expression_evaluate(expression, &source);
+        stageStart = query_stats_record(STAT(STAGE_MATCH), stageStart);
+        applyFilters(storage, matches, filters, filterCount);
+        query_stats_record(STAT(STAGE_FILTER), stageStart);
+        result_cache_put(storage->resultCache, keyLength, key, matches);
+    } else {
+        query_stats_record(STAT(STAGE_MATCH), stageStart);
+    }
+    free(key);
+    expression_free(expression);
+    return matches;
+}
 
-    storage->featureProducts = malloc(sizeof(roaring_bitmap_t *) * columnCount);
-    memset(storage->featureProducts, 0, sizeof(roaring_bitmap_t *) * columnCount);
-    storage->featureGroups = malloc(sizeof(roaring_bitmap_t *) * columnCount);
-    memset(storage->featureGroups, 0, sizeof(roaring_bitmap_t *) * columnCount);
-    storage->featureProductsExt = malloc(sizeof(roaring_bitmap_t *) * columnCount);
-    memset(storage->featureProductsExt, 0, sizeof(roaring_bitmap_t *) * columnCount);
+static roaring_bitmap_t *getMatches(JNIEnv *env, jroaring_t *storage, jstring expressionString,
+                                    query_filter_t *filters, uint32_t filterCount) {
+    jint expressionLength = (*env)->GetStringUTFLength(env, expressionString);
+    const char *expressionChars = (*env)->GetStringUTFChars(env, expressionString, NULL);
+    roaring_bitmap_t *matches = matchExpression(storage, expressionChars, expressionLength, filters, filterCount);
+    (*env)->ReleaseStringUTFChars(env, expressionString, expressionChars);
+    return matches;
+}
 
-    storage->indexToProduct = malloc(sizeof(uint32_t) * rowCount);
-    storage->indexToGroup = malloc(sizeof(uint32_t) * rowCount);
-    storage->indexToGroupOrder = malloc(sizeof(uint32_t) * rowCount);
+/*
+ * Buffers count queries work in. Every query thread keeps its own for its whole life, so facet counting does
+ * not create and free anything per feature. A group is counted when its stamp differs from the current one,
+ * so the dedupe array never has to be cleared between features.
+ */
+typedef struct count_scratch_s {
+    roaring_bitmap_t *intersection;
+    uint32_t *products;
+    uint32_t productCapacity;
+    uint32_t *groupStamps;
+    uint32_t groupCapacity;
+    uint32_t stamp;
+} count_scratch_t;
 
-    storage->productAttributes = hash_map_create();
-    storage->sortingIndexes = hash_map_create();
+static pthread_key_t countScratchKey;
+static pthread_once_t countScratchOnce = PTHREAD_ONCE_INIT;
+
+static void freeCountScratch(void *argument) {
+    count_scratch_t *scratch = argument;
+    roaring_bitmap_free(scratch->intersection);
+    free(scratch->products);
+    free(scratch->groupStamps);
+    free(scratch);
 }
 
-JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_addItem
-        (JNIEnv *env, jclass class, jlong pointer, jint index, jint productId, jint groupId, jint groupOrder,
-         jintArray featuresArray, jintArray extFeaturesArray, jobjectArray attributeNamesArray,
-         jfloatArray attributeValuesArray) {
+static void createCountScratchKey() {
+    pthread_key_create(&countScratchKey, freeCountScratch);
+}
+
+// NULL when the scratch of the thread cannot be created, counts then go without one
+static count_scratch_t *getCountScratch() {
+    pthread_once(&countScratchOnce, createCountScratchKey);
+    count_scratch_t *scratch = pthread_getspecific(countScratchKey);
+    if (!scratch) {
+        scratch = calloc(1, sizeof(count_scratch_t));
+        if (!scratch)
+            return 0;
+        scratch->intersection = roaring_bitmap_create();
+        if (!scratch->intersection || pthread_setspecific(countScratchKey, scratch) != 0) {
+            freeCountScratch(scratch);
+            return 0;
+        }
+    }
+    return scratch;
+}
+
+// grows the buffers of scratch for productCount products and groups up to maxGroup, leaves it as it was on failure
+static bool reserveCountScratch(count_scratch_t *scratch, uint32_t productCount, uint32_t maxGroup) {
+    uint32_t productCapacity = scratch->productCapacity;
+    uint32_t *products = scratch->products;
+    if (productCount > productCapacity) {
+        productCapacity = max(productCount, productCapacity * 2);
+        products = malloc(sizeof(uint32_t) * productCapacity);
+        if (!products)
+            return false;
+    }
+    uint32_t groupCapacity = scratch->groupCapacity;
+    uint32_t *groupStamps = scratch->groupStamps;
+    if (maxGroup >= groupCapacity) {
+        groupCapacity = max(maxGroup + 1, groupCapacity * 2);
+        groupStamps = calloc(groupCapacity, sizeof(uint32_t));
+        if (!groupStamps) {
+            if (products != scratch->products)
+                free(products);
+            return false;
+        }
+    }
+    if (products != scratch->products) {
+        free(scratch->products);
+        scratch->products = products;
+        scratch->productCapacity = productCapacity;
+    }
+    if (groupStamps != scratch->groupStamps) {
+        free(scratch->groupStamps);
+        scratch->groupStamps = groupStamps;
+        scratch->groupCapacity = groupCapacity;
+        scratch->stamp = 0;
+    }
+    return true;
+}
+
+// collects the groups into a bitmap, for when there is no scratch to stamp them in
+static uint32_t countGroupsByIterator(jroaring_t *storage, const roaring_bitmap_t *products) {
+    roaring_bitmap_t *groups = roaring_bitmap_create();
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(products, &iterator);
+    while (iterator.has_value) {
+        roaring_bitmap_add(groups, *productGroupOf(storage, iterator.current_value));
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    uint32_t groupCount = roaring_bitmap_get_cardinality(groups);
+    roaring_bitmap_free(groups);
+    return groupCount;
+}
+
+static uint32_t countDistinctGroups(jroaring_t *storage, const roaring_bitmap_t *products, uint32_t productCount,
+                                    count_scratch_t *scratch) {
+    if (!scratch || !reserveCountScratch(scratch, productCount, storage->maxGroup))
+        return countGroupsByIterator(storage, products);
+    if (++scratch->stamp == 0) {
+        memset(scratch->groupStamps, 0, sizeof(uint32_t) * scratch->groupCapacity);
+        scratch->stamp = 1;
+    }
+
+    roaring_bitmap_to_uint32_array(products, scratch->products);
+    const uint32_t *productToGroup = storage->productToGroup;
+    uint32_t minProduct = storage->minProduct;
+    uint32_t *groupStamps = scratch->groupStamps;
+    uint32_t stamp = scratch->stamp;
+    uint32_t groupCount = 0;
+    for (uint32_t i = 0; i < productCount; i++) {
+        uint32_t groupId = productToGroup[scratch->products[i] - minProduct];
+        groupCount += groupStamps[groupId] != stamp;
+        groupStamps[groupId] = stamp;
+    }
+    return groupCount;
+}
 
-    jroaring_t *storage = (jroaring_t *) pointer;
+/*
+ * Fills one 4 int record of countProducts result. Ungrouped counts never materialize the intersection.
+ */
+static inline void countFeature(jroaring_t *storage, roaring_bitmap_t *matches, uint32_t feature,
+                                jboolean isGrouped, count_scratch_t *scratch, uint32_t *info) {
+    const roaring_bitmap_t *featureProducts = storage->featureProducts[feature];
+    uint32_t productCount = roaring_bitmap_and_cardinality(matches, featureProducts);
+    info[0] = feature;
+    info[1] = productCount;
+    info[2] = 0;
+    info[3] = false;
+    if (isGrouped && productCount > 0) {
+        if (productCount == roaring_bitmap_get_cardinality(featureProducts)) {
+            // every product with the feature matched, so did every group with it
+            info[2] = roaring_bitmap_get_cardinality(storage->featureGroups[feature]);
+        } else if (scratch) {
+            roaring_bitmap_overwrite(scratch->intersection, matches);
+            roaring_bitmap_and_inplace(scratch->intersection, featureProducts);
+            info[2] = countDistinctGroups(storage, scratch->intersection, productCount, scratch);
+        } else {
+            roaring_bitmap_t *intersection = roaring_bitmap_and(matches, featureProducts);
+            info[2] = countGroupsByIterator(storage, intersection);
+            roaring_bitmap_free(intersection);
+        }
+    }
+}
 
-    storage->productFeatures[index] = roaring_bitmap_from_jint_array(env, featuresArray);
-    storage->productFeaturesExt[index] = roaring_bitmap_from_jint_array(env, extFeaturesArray);
+static void setItem(jroaring_t *storage, uint32_t index, uint32_t productId, uint32_t groupId, uint32_t groupOrder,
+                    roaring_bitmap_t *features, roaring_bitmap_t *extFeatures) {
+    storage->productFeatures[index] = features;
+    storage->productFeaturesExt[index] = extFeatures;
 
     storage->indexToProduct[index] = productId;
     storage->indexToGroup[index] = groupId;
@@ -442,13 +1084,13 @@ JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoar
         storage->minGroup = groupId;
     }
     {
-        uint32_t localMinFeature = roaring_bitmap_minimum(storage->productFeatures[index]);
+        uint32_t localMinFeature = roaring_bitmap_minimum(features);
         if (localMinFeature > storage->minFeature) {
             storage->minFeature = localMinFeature;
         }
     }
     {
-        uint32_t localMinFeatureExt = roaring_bitmap_minimum(storage->productFeaturesExt[index]);
+        uint32_t localMinFeatureExt = roaring_bitmap_minimum(extFeatures);
         if (localMinFeatureExt > storage->minFeatureExt) {
             storage->minFeatureExt = localMinFeatureExt;
         }
@@ -462,52 +1104,67 @@ JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoar
         storage->maxGroup = groupId;
     }
     {
-        uint32_t localMaxFeature = roaring_bitmap_maximum(storage->productFeatures[index]);
+        uint32_t localMaxFeature = roaring_bitmap_maximum(features);
         if (localMaxFeature > storage->maxFeature) {
             storage->maxFeature = localMaxFeature;
         }
     }
     {
-        uint32_t localMaxFeatureExt = roaring_bitmap_maximum(storage->productFeaturesExt[index]);
+        uint32_t localMaxFeatureExt = roaring_bitmap_maximum(extFeatures);
         if (localMaxFeatureExt > storage->maxFeatureExt) {
             storage->maxFeatureExt = localMaxFeatureExt;
         }
     }
+}
 
-    jint attributeCount = (*env)->GetArrayLength(env, attributeNamesArray);
-    if (attributeCount > 0) {
-        jboolean isCopy;
-        jfloat *values = (*env)->GetFloatArrayElements(env, attributeValuesArray, &isCopy);
-        for (jint i = 0; i < attributeCount; i++) {
-            jstring name = (*env)->GetObjectArrayElement(env, attributeNamesArray, i);
-            addAttribute(env, storage, index, productId, name, values[i]);
-        }
-        (*env)->ReleaseFloatArrayElements(env, attributeValuesArray, values, JNI_ABORT);
+static void addSortingIndex(jroaring_t *storage, uint32_t sortingIdLength, const char *sortingId,
+                            sorting_index_t *sortingIndex) {
+    // hash_map_put returns the new value itself when the key was not present yet
+    sorting_index_t *previousValue = hash_map_put(storage->sortingIndexes, sortingIdLength, sortingId, sortingIndex);
+    if (previousValue && previousValue != sortingIndex) {
+        freeSortingIndex(previousValue);
+    } else if (previousValue == sortingIndex) {
+        storage->sortingIndexNameCount++;
+        storage->sortingIndexNames = realloc(storage->sortingIndexNames,
+                                             sizeof(char *) * storage->sortingIndexNameCount);
+        char *name = malloc(sortingIdLength + 1);
+        memcpy(name, sortingId, sortingIdLength);
+        name[sortingIdLength] = 0;
+        storage->sortingIndexNames[storage->sortingIndexNameCount - 1] = name;
     }
 }
 
-JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_completeLoadData
-        (JNIEnv *env, jclass class, jlong pointer) {
-    jroaring_t *storage = (jroaring_t *) pointer;
-
-    {
-        uint32_t length;
-
-        length = sizeof(uint32_t) * (storage->maxProduct + 1);
-        storage->productToIndex = malloc(length);
-        memset(storage->productToIndex, 0, length);
-
-        length = sizeof(roaring_bitmap_t *) * (storage->maxGroup + 1);
-        storage->groupProducts = malloc(length);
-        memset(storage->groupProducts, 0, length);
-
-        length = sizeof(roaring_bitmap_t *) * (storage->maxGroup + 1);
-        storage->groupFeatures = malloc(length);
-        memset(storage->groupFeatures, 0, length);
+static void setSortingIndex(jroaring_t *storage, uint32_t sortingIdLength, const char *sortingId,
+                            uint32_t sortedProductCount, const uint32_t *sortedProducts, bool isAttributeMirror,
+                            bool isShared) {
+    sorting_index_t *sortingIndex = malloc(sizeof(sorting_index_t));
+    sortingIndex->products = malloc(sizeof(uint32_t) * sortedProductCount);
+    memcpy(sortingIndex->products, sortedProducts, sizeof(uint32_t) * sortedProductCount);
+    uint32_t minProductId = sortedProductCount > 0 ? sortedProducts[0] : 0;
+    uint32_t maxProductId = minProductId;
+    for (uint32_t i = 1; i < sortedProductCount; i++) {
+        minProductId = min(minProductId, sortedProducts[i]);
+        maxProductId = max(maxProductId, sortedProducts[i]);
+    }
+    sortingIndex->indices = malloc(sizeof(uint32_t) * (maxProductId - minProductId + 1));
+    memset(sortingIndex->indices, 0xFF, sizeof(uint32_t) * (maxProductId - minProductId + 1));
+    for (uint32_t i = 0; i < sortedProductCount; i++) {
+        sortingIndex->indices[sortedProducts[i] - minProductId] = i;
     }
+    sortingIndex->productCount = sortedProductCount;
+    sortingIndex->productCapacity = sortedProductCount;
+    sortingIndex->tombstoneCount = 0;
+    sortingIndex->minProduct = minProductId;
+    sortingIndex->indexCount = maxProductId - minProductId + 1;
+    sortingIndex->isMapped = false;
+    sortingIndex->isAttributeMirror = isAttributeMirror;
+    sortingIndex->isShared = isShared;
+    addSortingIndex(storage, sortingIdLength, sortingId, sortingIndex);
+}
 
+static void buildIndexes(jroaring_t *storage) {
     for (uint32_t i = 0; i < storage->productCount; i++) {
-        storage->productToIndex[storage->indexToProduct[i]] = i;
+        *productIndexOf(storage, storage->indexToProduct[i]) = i;
 
         if (!storage->groupProducts[storage->indexToGroup[i]]) {
             storage->groupProducts[storage->indexToGroup[i]] = roaring_bitmap_create();
@@ -548,220 +1205,3564 @@ JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoar
         //roaring_bitmap_run_optimize(storage->productFeatures[i]);
         //roaring_bitmap_run_optimize(storage->productFeaturesExt[i]);
     }
+}
 
-    /*for(uint32_t i = 0; i < storage->featureCount; i++) {
-        if(storage->featureProducts[i]) {
-            roaring_bitmap_run_optimize(storage->featureProducts[i]);
-        }
-        if(storage->featureProductsExt[i]) {
-            roaring_bitmap_run_optimize(storage->featureProductsExt[i]);
-        }
-        if(storage->featureGroups[i]) {
-            roaring_bitmap_run_optimize(storage->featureGroups[i]);
-        }
-    }
+typedef struct index_build_s {
+    jroaring_t *storage;
+    uint32_t partCount;
+    uint32_t groupRangeCount;
+    // product indexes bucketed by group, those of group g are groupIndexes[groupStarts[g]..groupStarts[g + 1])
+    uint32_t *groupStarts;
+    uint32_t *groupIndexes;
+    roaring_bitmap_t ***partFeatureProducts;
+    roaring_bitmap_t ***partFeatureGroups;
+    roaring_bitmap_t ***partFeatureProductsExt;
+} index_build_t;
+
+#define INDEX_BUILD_MERGE_CHUNK 256
+
+// builds feature bitmaps of one product range into bitmaps private to the range
+static void buildFeaturePart(void *argument, uint32_t part) {
+    index_build_t *build = argument;
+    jroaring_t *storage = build->storage;
+    roaring_bitmap_t **featureProducts = build->partFeatureProducts[part];
+    roaring_bitmap_t **featureGroups = build->partFeatureGroups[part];
+    roaring_bitmap_t **featureProductsExt = build->partFeatureProductsExt[part];
+    uint32_t from = (uint64_t) storage->productCount * part / build->partCount;
+    uint32_t to = (uint64_t) storage->productCount * (part + 1) / build->partCount;
+
+    for (uint32_t i = from; i < to; i++) {
+        *productIndexOf(storage, storage->indexToProduct[i]) = i;
+
+        roaring_uint32_iterator_t iterator;
 
-    for(uint32_t i = storage->minGroup; i < storage->maxGroup + 1; i++) {
-        if(storage->groupProducts[i]) {
-            roaring_bitmap_run_optimize(storage->groupProducts[i]);
+        roaring_init_iterator(storage->productFeatures[i], &iterator);
+        while (iterator.has_value) {
+            if (!featureProducts[iterator.current_value]) {
+                featureProducts[iterator.current_value] = roaring_bitmap_create();
+                featureGroups[iterator.current_value] = roaring_bitmap_create();
+            }
+            roaring_bitmap_add(featureProducts[iterator.current_value], storage->indexToProduct[i]);
+            roaring_bitmap_add(featureGroups[iterator.current_value], storage->indexToGroup[i]);
+            roaring_advance_uint32_iterator(&iterator);
         }
-        if(storage->groupFeatures[i]) {
-            roaring_bitmap_run_optimize(storage->groupFeatures[i]);
+
+        roaring_init_iterator(storage->productFeaturesExt[i], &iterator);
+        while (iterator.has_value) {
+            if (!featureProductsExt[iterator.current_value]) {
+                featureProductsExt[iterator.current_value] = roaring_bitmap_create();
+            }
+            roaring_bitmap_add(featureProductsExt[iterator.current_value], storage->indexToProduct[i]);
+            roaring_advance_uint32_iterator(&iterator);
         }
-    }*/
+    }
+}
 
-    uint32_t *sortedProducts = malloc(sizeof(uint32_t) * storage->productCount);
-    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
-        const char *attribName = storage->attributeNames[i];
-        uint32_t nameLength = strlen(attribName);
-        product_attribute_t *attributes = hash_map_get(storage->productAttributes, nameLength, attribName);
-        qsort(attributes, storage->productCount, sizeof(product_attribute_t), compareAttributes);
-        for (uint32_t j = 0; j < storage->productCount; j++) {
-            sortedProducts[j] = attributes[j].productId;
+static roaring_bitmap_t *mergeBitmapParts(uint32_t partCount, roaring_bitmap_t ***parts, uint32_t index,
+                                          const roaring_bitmap_t **buffer) {
+    uint32_t count = 0;
+    for (uint32_t part = 0; part < partCount; part++) {
+        if (parts[part][index]) {
+            buffer[count++] = parts[part][index];
         }
-        setSortingIndex(storage, nameLength, attribName, storage->productCount, sortedProducts);
     }
-    free(sortedProducts);
+    if (count == 0)
+        return 0;
+    if (count == 1)
+        return (roaring_bitmap_t *) buffer[0];
+    roaring_bitmap_t *bitmap = roaring_bitmap_or_many(count, buffer);
+    for (uint32_t i = 0; i < count; i++) {
+        roaring_bitmap_free(buffer[i]);
+    }
+    return bitmap;
 }
 
-JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setSortingIndex
-        (JNIEnv *env, jclass class, jlong pointer, jstring sortingIdString, jintArray sortingValuesArray) {
+static void mergeFeatureChunk(void *argument, uint32_t chunk) {
+    index_build_t *build = argument;
+    jroaring_t *storage = build->storage;
+    const roaring_bitmap_t **buffer = malloc(sizeof(roaring_bitmap_t *) * build->partCount);
+    uint32_t from = chunk * INDEX_BUILD_MERGE_CHUNK;
+    uint32_t to = min(from + INDEX_BUILD_MERGE_CHUNK, storage->featureCount);
+    for (uint32_t i = from; i < to; i++) {
+        storage->featureProducts[i] = mergeBitmapParts(build->partCount, build->partFeatureProducts, i, buffer);
+        storage->featureGroups[i] = mergeBitmapParts(build->partCount, build->partFeatureGroups, i, buffer);
+        storage->featureProductsExt[i] = mergeBitmapParts(build->partCount, build->partFeatureProductsExt, i, buffer);
+    }
+    free(buffer);
+}
 
-    jroaring_t *storage = (jroaring_t *) pointer;
+// group bitmaps are owned by group id ranges, every range only visits the products bucketed under its groups
+static void buildGroupRange(void *argument, uint32_t range) {
+    index_build_t *build = argument;
+    jroaring_t *storage = build->storage;
+    uint32_t from = (uint64_t) (storage->maxGroup + 1) * range / build->groupRangeCount;
+    uint32_t to = (uint64_t) (storage->maxGroup + 1) * (range + 1) / build->groupRangeCount;
 
-    jint sortedProductCount = (*env)->GetArrayLength(env, sortingValuesArray);
-    jint nameLength = (*env)->GetStringUTFLength(env, sortingIdString);
-    const char *nameChars = (*env)->GetStringUTFChars(env, sortingIdString, NULL);
-    jint *sortedProducts = (*env)->GetIntArrayElements(env, sortingValuesArray, NULL);
-    setSortingIndex(storage, nameLength, nameChars, sortedProductCount, (const uint32_t *) sortedProducts);
-    (*env)->ReleaseIntArrayElements(env, sortingValuesArray, sortedProducts, JNI_ABORT);
-    (*env)->ReleaseStringUTFChars(env, sortingIdString, nameChars);
+    for (uint32_t groupId = from; groupId < to; groupId++) {
+        uint32_t start = build->groupStarts[groupId];
+        uint32_t end = build->groupStarts[groupId + 1];
+        if (start == end)
+            continue;
+        storage->groupProducts[groupId] = roaring_bitmap_create();
+        storage->groupFeatures[groupId] = roaring_bitmap_create();
+        for (uint32_t j = start; j < end; j++) {
+            uint32_t i = build->groupIndexes[j];
+            roaring_bitmap_add(storage->groupProducts[groupId], storage->indexToProduct[i]);
+            roaring_bitmap_or_inplace(storage->groupFeatures[groupId], storage->productFeatures[i]);
+        }
+    }
+}
+
+// counting sort of product indexes on indexToGroup, stable so every group keeps index order
+static void bucketProductsByGroup(index_build_t *build) {
+    jroaring_t *storage = build->storage;
+    build->groupStarts = calloc((size_t) storage->maxGroup + 2, sizeof(uint32_t));
+    build->groupIndexes = malloc(sizeof(uint32_t) * max(storage->productCount, 1));
+    for (uint32_t i = 0; i < storage->productCount; i++) {
+        build->groupStarts[storage->indexToGroup[i] + 1]++;
+    }
+    for (uint32_t groupId = 0; groupId <= storage->maxGroup; groupId++) {
+        build->groupStarts[groupId + 1] += build->groupStarts[groupId];
+    }
+    uint32_t *next = malloc(sizeof(uint32_t) * ((size_t) storage->maxGroup + 1));
+    memcpy(next, build->groupStarts, sizeof(uint32_t) * ((size_t) storage->maxGroup + 1));
+    for (uint32_t i = 0; i < storage->productCount; i++) {
+        build->groupIndexes[next[storage->indexToGroup[i]]++] = i;
+    }
+    free(next);
+}
+
+/*
+ * Same result as buildIndexes: products are split into one range per thread, every range gets its own
+ * feature bitmaps, and the partial bitmaps of each feature are then or-ed together.
+ */
+static void buildIndexesParallel(jroaring_t *storage) {
+    uint32_t threadCount = min(storage->options->buildThreadCount, max(storage->productCount, 1));
+    thread_pool_t *pool = thread_pool_create(threadCount);
+
+    index_build_t build;
+    build.storage = storage;
+    build.partCount = threadCount;
+    build.groupRangeCount = min(threadCount * 4, storage->maxGroup + 1);
+    build.partFeatureProducts = malloc(sizeof(roaring_bitmap_t **) * threadCount);
+    build.partFeatureGroups = malloc(sizeof(roaring_bitmap_t **) * threadCount);
+    build.partFeatureProductsExt = malloc(sizeof(roaring_bitmap_t **) * threadCount);
+    for (uint32_t i = 0; i < threadCount; i++) {
+        build.partFeatureProducts[i] = calloc(storage->featureCount, sizeof(roaring_bitmap_t *));
+        build.partFeatureGroups[i] = calloc(storage->featureCount, sizeof(roaring_bitmap_t *));
+        build.partFeatureProductsExt[i] = calloc(storage->featureCount, sizeof(roaring_bitmap_t *));
+    }
+
+    thread_pool_run(pool, build.partCount, buildFeaturePart, &build);
+    thread_pool_run(pool, (storage->featureCount + INDEX_BUILD_MERGE_CHUNK - 1) / INDEX_BUILD_MERGE_CHUNK,
+                    mergeFeatureChunk, &build);
+    bucketProductsByGroup(&build);
+    thread_pool_run(pool, build.groupRangeCount, buildGroupRange, &build);
+    free(build.groupStarts);
+    free(build.groupIndexes);
+
+    for (uint32_t i = 0; i < threadCount; i++) {
+        free(build.partFeatureProducts[i]);
+        free(build.partFeatureGroups[i]);
+        free(build.partFeatureProductsExt[i]);
+    }
+    free(build.partFeatureProducts);
+    free(build.partFeatureGroups);
+    free(build.partFeatureProductsExt);
+    thread_pool_free(pool);
+}
+
+static void buildProductGroups(jroaring_t *storage) {
+    free(storage->productToGroup);
+    storage->productToGroup = calloc(productIdRange(storage), sizeof(uint32_t));
+    for (uint32_t i = 0; i < storage->productCount; i++) {
+        *productGroupOf(storage, storage->indexToProduct[i]) = storage->indexToGroup[i];
+    }
+}
+
+static void buildFeatureCounts(jroaring_t *storage) {
+    free(storage->indexToFeatureCount);
+    storage->indexToFeatureCount = malloc(sizeof(uint32_t) * (max(storage->productCapacity, storage->productCount) + 1));
+    for (uint32_t i = 0; i < storage->productCount; i++) {
+        storage->indexToFeatureCount[i] = roaring_bitmap_get_cardinality(storage->productFeatures[i]);
+    }
+}
+
+/*
+ * Slicing an order preserving encoding of every product's value turns a range filter into a few bitmap
+ * operations, however many products it selects. An update sets the one product it changes, entries shifted
+ * in the sorted array keep their values and so their bits.
+ */
+static void buildAttributeIndexes(jroaring_t *storage) {
+    freeAttributeIndexes(storage);
+    if (!storage->options->attributeBitSlices || storage->attributeNameCount == 0)
+        return;
+    storage->attributeIndexes = hash_map_create();
+    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+        const char *attributeName = storage->attributeNames[i];
+        uint32_t nameLength = strlen(attributeName);
+        attribute_t *attribute = hash_map_get(storage->productAttributes, nameLength, attributeName);
+        if (!attribute)
+            continue;
+        bit_sliced_index_t *valueIndex = bit_sliced_index_create(attribute->entryCount,
+                                                                 &attribute->entries[0].productId,
+                                                                 &attribute->entries[0].value,
+                                                                 sizeof(product_attribute_t));
+        if (valueIndex)
+            hash_map_put(storage->attributeIndexes, nameLength, attributeName, valueIndex);
+    }
+}
+
+static void buildSimilarIndex(jroaring_t *storage) {
+    freeSimilarIndex(storage);
+    if (storage->options->similarBands == 0 || storage->productCount == 0)
+        return;
+    uint32_t threadCount = min(storage->options->buildThreadCount, storage->productCount);
+    thread_pool_t *pool = threadCount > 1 ? thread_pool_create(threadCount) : 0;
+    storage->similarIndex = min_hash_index_create(storage->options->similarBands, storage->options->similarRows,
+                                                  storage->productCount, storage->productFeatures,
+                                                  storage->indexToProduct, pool);
+    thread_pool_free(pool);
+    if (storage->similarIndex)
+        storage->similarPending = roaring_bitmap_create();
+}
+
+// bitmaps run-optimized and shrunk per pool task, product bitmaps are then deduplicated on the calling thread
+#define COMPACT_CHUNK_BITMAPS 4096
+#define COMPACT_FAMILY_COUNT 7
+
+typedef struct compact_job_s {
+    jroaring_t *storage;
+    roaring_bitmap_t **families[COMPACT_FAMILY_COUNT];
+    uint32_t lengths[COMPACT_FAMILY_COUNT];
+    uint32_t chunkStarts[COMPACT_FAMILY_COUNT + 1];
+} compact_job_t;
+
+static void compactChunk(void *argument, uint32_t chunk) {
+    compact_job_t *job = argument;
+    uint32_t family = 0;
+    while (chunk >= job->chunkStarts[family + 1]) {
+        family++;
+    }
+    roaring_bitmap_t **bitmaps = job->families[family];
+    uint32_t from = (chunk - job->chunkStarts[family]) * COMPACT_CHUNK_BITMAPS;
+    uint32_t to = min(from + COMPACT_CHUNK_BITMAPS, job->lengths[family]);
+    hash_map_t *sharedBitmaps = job->storage->sharedBitmaps;
+    for (uint32_t i = from; i < to; i++) {
+        // shared bitmaps were compacted when they were first shared, and other tasks may come across them too
+        if (bitmaps[i] && !hash_map_get(sharedBitmaps, sizeof(bitmaps[i]), &bitmaps[i])) {
+            roaring_bitmap_run_optimize(bitmaps[i]);
+            roaring_bitmap_shrink_to_fit(bitmaps[i]);
+        }
+    }
+}
+
+// bytes of every bitmap family, shared product bitmaps counted once
+static uint64_t getBitmapsSizeInBytes(jroaring_t *storage) {
+    roaring_bitmap_t **families[] = {storage->featureProducts, storage->featureProductsExt, storage->featureGroups,
+                                     storage->groupProducts, storage->groupFeatures};
+    uint32_t lengths[] = {storage->featureCount, storage->featureCount, storage->featureCount,
+                          storage->maxGroup + 1, storage->maxGroup + 1};
+    uint64_t size = 0;
+    for (uint32_t family = 0; family < sizeof(lengths) / sizeof(lengths[0]); family++) {
+        for (uint32_t i = 0; families[family] && i < lengths[family]; i++) {
+            if (families[family][i])
+                size += roaring_bitmap_size_in_bytes(families[family][i]);
+        }
+    }
+    roaring_bitmap_t **productFamilies[] = {storage->productFeatures, storage->productFeaturesExt};
+    for (uint32_t family = 0; family < 2; family++) {
+        for (uint32_t i = 0; productFamilies[family] && i < storage->productCount; i++) {
+            roaring_bitmap_t *bitmap = productFamilies[family][i];
+            if (!bitmap)
+                continue;
+            uintptr_t referenceCount = storage->sharedBitmaps ?
+                                       (uintptr_t) hash_map_get(storage->sharedBitmaps, sizeof(bitmap), &bitmap) : 0;
+            size += roaring_bitmap_size_in_bytes(bitmap) / (referenceCount ? referenceCount : 1);
+        }
+    }
+    return size;
+}
+
+/*
+ * Points every product at one instance of each distinct feature set. Candidates are found by a 64-bit hash of
+ * the portable serialization, the same for equal sets once they are run-optimized, and confirmed by comparing sets.
+ */
+static void dedupeProductBitmaps(jroaring_t *storage) {
+    hash_map_t *instances = hash_map_create_pre_sized(storage->productCount);
+    if (!storage->sharedBitmaps)
+        storage->sharedBitmaps = hash_map_create();
+    char *buffer = 0;
+    size_t bufferSize = 0;
+    roaring_bitmap_t **families[] = {storage->productFeatures, storage->productFeaturesExt};
+    for (uint32_t family = 0; family < 2; family++) {
+        for (uint32_t i = 0; i < storage->productCount; i++) {
+            roaring_bitmap_t *bitmap = families[family][i];
+            if (!bitmap)
+                continue;
+            size_t size = roaring_bitmap_portable_size_in_bytes(bitmap);
+            if (size > bufferSize) {
+                free(buffer);
+                bufferSize = max(size, bufferSize * 2);
+                buffer = malloc(bufferSize);
+            }
+            roaring_bitmap_portable_serialize(bitmap, buffer);
+            // a bitmap whose hash is taken by a different set stays unshared
+            uint64_t hash = FastHash64(buffer, size, 0);
+            roaring_bitmap_t *instance = hash_map_get(instances, sizeof(hash), &hash);
+            if (!instance) {
+                hash_map_put(instances, sizeof(hash), &hash, bitmap);
+                continue;
+            }
+            if (instance == bitmap || !roaring_bitmap_equals(instance, bitmap))
+                continue;
+            uintptr_t referenceCount = (uintptr_t) hash_map_get(storage->sharedBitmaps, sizeof(instance), &instance);
+            hash_map_put(storage->sharedBitmaps, sizeof(instance), &instance,
+                         (void *) (referenceCount ? referenceCount + 1 : 2));
+            releaseProductBitmap(storage, bitmap);
+            families[family][i] = instance;
+        }
+    }
+    free(buffer);
+    hash_map_free(instances);
+}
+
+/*
+ * Run-optimizes and shrinks every bitmap family and shares identical product bitmaps, returns the bytes saved.
+ * Storages loaded from snapshot are left as they are, most of their bitmaps stay read-only views.
+ */
+static int64_t compactStorage(jroaring_t *storage) {
+    if (storage->snapshot || !storage->productToIndex)
+        return 0;
+    uint64_t sizeBefore = getBitmapsSizeInBytes(storage);
+
+    compact_job_t job;
+    job.storage = storage;
+    roaring_bitmap_t **families[] = {storage->productFeatures, storage->productFeaturesExt, storage->featureProducts,
+                                     storage->featureProductsExt, storage->featureGroups, storage->groupProducts,
+                                     storage->groupFeatures};
+    uint32_t lengths[] = {storage->productCount, storage->productCount, storage->featureCount, storage->featureCount,
+                          storage->featureCount, storage->maxGroup + 1, storage->maxGroup + 1};
+    job.chunkStarts[0] = 0;
+    for (uint32_t family = 0; family < COMPACT_FAMILY_COUNT; family++) {
+        job.families[family] = families[family];
+        job.lengths[family] = families[family] ? lengths[family] : 0;
+        job.chunkStarts[family + 1] = job.chunkStarts[family] +
+                                      (job.lengths[family] + COMPACT_CHUNK_BITMAPS - 1) / COMPACT_CHUNK_BITMAPS;
+    }
+    uint32_t threadCount = storage->options->buildThreadCount;
+    thread_pool_t *pool = threadCount > 1 ? thread_pool_create(threadCount) : 0;
+    thread_pool_run(pool, job.chunkStarts[COMPACT_FAMILY_COUNT], compactChunk, &job);
+    thread_pool_free(pool);
+
+    dedupeProductBitmaps(storage);
+    return (int64_t) sizeBefore - (int64_t) getBitmapsSizeInBytes(storage);
+}
+
+/*
+ * Layout of getMemoryStats: for productFeatures, productFeaturesExt, featureProducts, featureProductsExt,
+ * featureGroups, groupProducts and groupFeatures in turn the number of bitmaps, their bytes and cardinality,
+ * then count and bytes of array, run and bitset containers. Then count and bytes of each other structure.
+ * Bytes are counted wherever the structure lives, for a storage loaded from snapshot most of them are in the
+ * mapped file, which is reported as a structure of its own.
+ */
+#define MEMORY_BITMAP_VALUES 9
+#define MEMORY_ATTRIBUTES (COMPACT_FAMILY_COUNT * MEMORY_BITMAP_VALUES)
+#define MEMORY_SORTING_INDEXES (MEMORY_ATTRIBUTES + 2)
+#define MEMORY_INDEX_ARRAYS (MEMORY_SORTING_INDEXES + 2)
+#define MEMORY_ATTRIBUTE_INDEXES (MEMORY_INDEX_ARRAYS + 2)
+#define MEMORY_SIMILAR_INDEX (MEMORY_ATTRIBUTE_INDEXES + 2)
+#define MEMORY_SIMILAR_TABLE (MEMORY_SIMILAR_INDEX + 2)
+#define MEMORY_RESULT_CACHE (MEMORY_SIMILAR_TABLE + 2)
+// shared product bitmaps and the bytes sharing saves
+#define MEMORY_SHARED_BITMAPS (MEMORY_RESULT_CACHE + 2)
+#define MEMORY_SNAPSHOT (MEMORY_SHARED_BITMAPS + 2)
+// process wide, blocks handed out and bytes of the pool
+#define MEMORY_RESULT_POOL (MEMORY_SNAPSHOT + 2)
+#define MEMORY_VALUE_COUNT (MEMORY_RESULT_POOL + 2)
+
+/*
+ * Adds a bitmap family to values. A shared product bitmap is counted only the first time it is seen, and
+ * then also added to sharedValues with the bytes its other holders save.
+ */
+static void addBitmapMemoryStats(jroaring_t *storage, roaring_bitmap_t **bitmaps, uint32_t length, hash_map_t *seen,
+                                 jlong *values, jlong *sharedValues) {
+    for (uint32_t i = 0; bitmaps && i < length; i++) {
+        roaring_bitmap_t *bitmap = bitmaps[i];
+        if (!bitmap)
+            continue;
+        uintptr_t referenceCount = storage->sharedBitmaps ?
+                                   (uintptr_t) hash_map_get(storage->sharedBitmaps, sizeof(bitmap), &bitmap) : 0;
+        if (referenceCount) {
+            if (hash_map_get(seen, sizeof(bitmap), &bitmap))
+                continue;
+            hash_map_put(seen, sizeof(bitmap), &bitmap, bitmap);
+            sharedValues[0]++;
+            sharedValues[1] += roaring_bitmap_size_in_bytes(bitmap) * (referenceCount - 1);
+        }
+        roaring_statistics_t statistics;
+        roaring_bitmap_statistics(bitmap, &statistics);
+        values[0]++;
+        values[1] += roaring_bitmap_size_in_bytes(bitmap);
+        values[2] += statistics.cardinality;
+        values[3] += statistics.n_array_containers;
+        values[4] += statistics.n_bytes_array_containers;
+        values[5] += statistics.n_run_containers;
+        values[6] += statistics.n_bytes_run_containers;
+        values[7] += statistics.n_bitset_containers;
+        values[8] += statistics.n_bytes_bitset_containers;
+    }
+}
+
+// adds the storage to values laid out as MEMORY_* above, called under the storage read lock
+static void addMemoryStats(jroaring_t *storage, jlong *values) {
+    roaring_bitmap_t **families[] = {storage->productFeatures, storage->productFeaturesExt, storage->featureProducts,
+                                     storage->featureProductsExt, storage->featureGroups, storage->groupProducts,
+                                     storage->groupFeatures};
+    uint32_t lengths[] = {storage->productCount, storage->productCount, storage->featureCount, storage->featureCount,
+                          storage->featureCount, storage->maxGroup + 1, storage->maxGroup + 1};
+    hash_map_t *seen = hash_map_create();
+    for (uint32_t family = 0; family < COMPACT_FAMILY_COUNT; family++) {
+        addBitmapMemoryStats(storage, families[family], lengths[family], seen, values + family * MEMORY_BITMAP_VALUES,
+                             values + MEMORY_SHARED_BITMAPS);
+    }
+    hash_map_free(seen);
+
+    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+        const char *name = storage->attributeNames[i];
+        attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(name), name);
+        values[MEMORY_ATTRIBUTES]++;
+        values[MEMORY_ATTRIBUTES + 1] += sizeof(attribute_t) +
+                sizeof(product_attribute_t) * (uint64_t) (attribute ? attribute->entryCapacity : 0) +
+                sizeof(uint32_t) * (uint64_t) (attribute && attribute->positions ? productIdRange(storage) : 0);
+        bit_sliced_index_t *valueIndex = storage->attributeIndexes ?
+                                        hash_map_get(storage->attributeIndexes, strlen(name), name) : 0;
+        if (valueIndex) {
+            values[MEMORY_ATTRIBUTE_INDEXES]++;
+            values[MEMORY_ATTRIBUTE_INDEXES + 1] += bit_sliced_index_size_in_bytes(valueIndex);
+        }
+    }
+    for (uint32_t i = 0; i < storage->sortingIndexNameCount; i++) {
+        const char *name = storage->sortingIndexNames[i];
+        sorting_index_t *sortingIndex = hash_map_get(storage->sortingIndexes, strlen(name), name);
+        if (!sortingIndex)
+            continue;
+        values[MEMORY_SORTING_INDEXES]++;
+        values[MEMORY_SORTING_INDEXES + 1] += sizeof(sorting_index_t) +
+                sizeof(uint32_t) * ((uint64_t) sortingIndex->productCount + sortingIndex->indexCount);
+    }
+
+    if (storage->productToIndex) {
+        uint32_t *productArrays[] = {storage->indexToProduct, storage->indexToGroup, storage->indexToGroupOrder,
+                                     storage->indexToFeatureCount};
+        uint64_t bytes = sizeof(roaring_bitmap_t *) * 2 * (uint64_t) storage->productCapacity +
+                         sizeof(roaring_bitmap_t *) * 3 * (uint64_t) storage->featureCount +
+                         sizeof(roaring_bitmap_t *) * 2 * ((uint64_t) storage->maxGroup + 1);
+        for (uint32_t i = 0; i < sizeof(productArrays) / sizeof(productArrays[0]); i++) {
+            if (productArrays[i])
+                bytes += sizeof(uint32_t) * (uint64_t) storage->productCapacity;
+        }
+        bytes += sizeof(uint32_t) * (uint64_t) productIdRange(storage) * (storage->productToGroup ? 2 : 1);
+        values[MEMORY_INDEX_ARRAYS] += storage->productCount;
+        values[MEMORY_INDEX_ARRAYS + 1] += bytes;
+    }
+
+    if (storage->similarIndex) {
+        values[MEMORY_SIMILAR_INDEX] += storage->similarPending ?
+                                        roaring_bitmap_get_cardinality(storage->similarPending) : 0;
+        values[MEMORY_SIMILAR_INDEX + 1] += min_hash_index_size_in_bytes(storage->similarIndex) +
+                (storage->similarPending ? roaring_bitmap_size_in_bytes(storage->similarPending) : 0);
+    }
+    similar_table_t *table = storage->similarTable;
+    if (table) {
+        values[MEMORY_SIMILAR_TABLE] += table->capacity;
+        values[MEMORY_SIMILAR_TABLE + 1] += sizeof(similar_table_t) +
+                (sizeof(similar_product_t) * table->size + sizeof(atomic_uint)) * (uint64_t) table->capacity;
+    }
+
+    result_cache_stats_t cacheStats;
+    result_cache_stats(storage->resultCache, &cacheStats);
+    values[MEMORY_RESULT_CACHE] += cacheStats.entryCount;
+    values[MEMORY_RESULT_CACHE + 1] += cacheStats.usedBytes;
+
+    if (storage->snapshot) {
+        values[MEMORY_SNAPSHOT]++;
+        values[MEMORY_SNAPSHOT + 1] += storage->snapshot->size;
+    }
+}
+
+#define SNAPSHOT_MAGIC "JROARSNP"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_BYTE_ORDER_MARK 0x01020304
+// frozen bitmap views require 32 byte alignment
+#define SNAPSHOT_ALIGNMENT 32
+// flags saved with every sorting index
+#define SNAPSHOT_SORTING_MIRROR 1
+#define SNAPSHOT_SORTING_SHARED 2
+
+typedef struct snapshot_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrderMark;
+    uint32_t productCount;
+    uint32_t featureCount;
+    uint32_t minProduct;
+    uint32_t maxProduct;
+    uint32_t minFeature;
+    uint32_t maxFeature;
+    uint32_t minFeatureExt;
+    uint32_t maxFeatureExt;
+    uint32_t minGroup;
+    uint32_t maxGroup;
+    uint32_t similarHit;
+    uint32_t attributeNameCount;
+    uint32_t sortingIndexNameCount;
+} snapshot_header_t;
+
+typedef struct snapshot_writer_s {
+    FILE *file;
+    uint64_t offset;
+    bool failed;
+} snapshot_writer_t;
+
+typedef struct snapshot_reader_s {
+    const char *data;
+    uint64_t size;
+    uint64_t offset;
+    bool failed;
+} snapshot_reader_t;
+
+static void snapshotWrite(snapshot_writer_t *writer, const void *data, uint64_t length) {
+    if (writer->failed || length == 0)
+        return;
+    if (fwrite(data, 1, length, writer->file) != length) {
+        writer->failed = true;
+        return;
+    }
+    writer->offset += length;
+}
+
+static void snapshotWriteAlign(snapshot_writer_t *writer) {
+    static const char padding[SNAPSHOT_ALIGNMENT] = {0};
+    snapshotWrite(writer, padding, (SNAPSHOT_ALIGNMENT - writer->offset % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT);
+}
+
+static void snapshotWriteName(snapshot_writer_t *writer, const char *name) {
+    uint32_t nameLength = strlen(name);
+    snapshotWrite(writer, &nameLength, sizeof(uint32_t));
+    snapshotWrite(writer, name, nameLength);
+    snapshotWriteAlign(writer);
+}
+
+/*
+ * Bitmap family is stored as table of frozen sizes (0 for missing bitmap) followed by the frozen bitmaps,
+ * each of them aligned, so that they can be viewed right from the mapped file.
+ */
+static void snapshotWriteBitmaps(snapshot_writer_t *writer, uint32_t length, roaring_bitmap_t **bitmaps) {
+    uint64_t *sizes = calloc(length ? length : 1, sizeof(uint64_t));
+    for (uint32_t i = 0; i < length; i++) {
+        if (bitmaps && bitmaps[i])
+            sizes[i] = roaring_bitmap_frozen_size_in_bytes(bitmaps[i]);
+    }
+    snapshotWrite(writer, sizes, sizeof(uint64_t) * length);
+    snapshotWriteAlign(writer);
+    char *buffer = 0;
+    uint64_t bufferSize = 0;
+    for (uint32_t i = 0; i < length && !writer->failed; i++) {
+        if (!sizes[i])
+            continue;
+        if (sizes[i] > bufferSize) {
+            free(buffer);
+            bufferSize = sizes[i];
+            buffer = malloc(bufferSize);
+        }
+        roaring_bitmap_frozen_serialize(bitmaps[i], buffer);
+        snapshotWrite(writer, buffer, sizes[i]);
+        snapshotWriteAlign(writer);
+    }
+    free(buffer);
+    free(sizes);
+}
+
+static bool saveSnapshot(jroaring_t *storage, const char *path) {
+    if (!storage || !storage->productToIndex)
+        return false;
+    snapshot_writer_t writer;
+    writer.file = fopen(path, "wb");
+    writer.offset = 0;
+    writer.failed = !writer.file;
+    if (writer.failed)
+        return false;
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(snapshot_header_t));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrderMark = SNAPSHOT_BYTE_ORDER_MARK;
+    header.productCount = storage->productCount;
+    header.featureCount = storage->featureCount;
+    header.minProduct = storage->minProduct;
+    header.maxProduct = storage->maxProduct;
+    header.minFeature = storage->minFeature;
+    header.maxFeature = storage->maxFeature;
+    header.minFeatureExt = storage->minFeatureExt;
+    header.maxFeatureExt = storage->maxFeatureExt;
+    header.minGroup = storage->minGroup;
+    header.maxGroup = storage->maxGroup;
+    header.similarHit = storage->similarHit;
+    header.attributeNameCount = storage->attributeNameCount;
+    header.sortingIndexNameCount = storage->sortingIndexNameCount;
+    snapshotWrite(&writer, &header, sizeof(snapshot_header_t));
+    snapshotWriteAlign(&writer);
+
+    snapshotWrite(&writer, storage->indexToProduct, sizeof(uint32_t) * storage->productCount);
+    snapshotWriteAlign(&writer);
+    snapshotWrite(&writer, storage->indexToGroup, sizeof(uint32_t) * storage->productCount);
+    snapshotWriteAlign(&writer);
+    snapshotWrite(&writer, storage->indexToGroupOrder, sizeof(uint32_t) * storage->productCount);
+    snapshotWriteAlign(&writer);
+    snapshotWrite(&writer, storage->productToIndex, sizeof(uint32_t) * productIdRange(storage));
+    snapshotWriteAlign(&writer);
+
+    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+        const char *name = storage->attributeNames[i];
+        attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(name), name);
+        snapshotWriteName(&writer, name);
+        snapshotWrite(&writer, &attribute->entryCount, sizeof(uint32_t));
+        snapshotWrite(&writer, &attribute->tombstoneCount, sizeof(uint32_t));
+        snapshotWriteAlign(&writer);
+        snapshotWrite(&writer, attribute->entries, sizeof(product_attribute_t) * attribute->entryCount);
+        snapshotWriteAlign(&writer);
+        snapshotWrite(&writer, attribute->positions, sizeof(uint32_t) * productIdRange(storage));
+        snapshotWriteAlign(&writer);
+    }
+
+    for (uint32_t i = 0; i < storage->sortingIndexNameCount; i++) {
+        const char *name = storage->sortingIndexNames[i];
+        sorting_index_t *sortingIndex = hash_map_get(storage->sortingIndexes, strlen(name), name);
+        snapshotWriteName(&writer, name);
+        snapshotWrite(&writer, &sortingIndex->productCount, sizeof(uint32_t));
+        snapshotWrite(&writer, &sortingIndex->indexCount, sizeof(uint32_t));
+        snapshotWrite(&writer, &sortingIndex->minProduct, sizeof(uint32_t));
+        snapshotWrite(&writer, &sortingIndex->tombstoneCount, sizeof(uint32_t));
+        uint32_t flags = (sortingIndex->isAttributeMirror ? SNAPSHOT_SORTING_MIRROR : 0) |
+                         (sortingIndex->isShared ? SNAPSHOT_SORTING_SHARED : 0);
+        snapshotWrite(&writer, &flags, sizeof(uint32_t));
+        snapshotWriteAlign(&writer);
+        snapshotWrite(&writer, sortingIndex->products, sizeof(uint32_t) * sortingIndex->productCount);
+        snapshotWriteAlign(&writer);
+        snapshotWrite(&writer, sortingIndex->indices, sizeof(uint32_t) * sortingIndex->indexCount);
+        snapshotWriteAlign(&writer);
+    }
+
+    snapshotWriteBitmaps(&writer, storage->productCount, storage->productFeatures);
+    snapshotWriteBitmaps(&writer, storage->productCount, storage->productFeaturesExt);
+    snapshotWriteBitmaps(&writer, storage->featureCount, storage->featureProducts);
+    snapshotWriteBitmaps(&writer, storage->featureCount, storage->featureProductsExt);
+    snapshotWriteBitmaps(&writer, storage->featureCount, storage->featureGroups);
+    snapshotWriteBitmaps(&writer, storage->maxGroup + 1, storage->groupProducts);
+    snapshotWriteBitmaps(&writer, storage->maxGroup + 1, storage->groupFeatures);
+
+    if (fclose(writer.file) != 0)
+        writer.failed = true;
+    return !writer.failed;
+}
+
+static const void *snapshotRead(snapshot_reader_t *reader, uint64_t length) {
+    if (reader->failed || length > reader->size - reader->offset) {
+        reader->failed = true;
+        return 0;
+    }
+    const void *data = reader->data + reader->offset;
+    reader->offset += length;
+    return data;
+}
+
+static void snapshotReadAlign(snapshot_reader_t *reader) {
+    uint64_t offset = reader->offset + (SNAPSHOT_ALIGNMENT - reader->offset % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT;
+    reader->offset = offset <= reader->size ? offset : reader->size;
+}
+
+static const void *snapshotReadArray(snapshot_reader_t *reader, uint64_t length) {
+    const void *data = snapshotRead(reader, length);
+    snapshotReadAlign(reader);
+    return data;
+}
+
+static const char *snapshotReadName(snapshot_reader_t *reader, uint32_t *nameLength) {
+    const uint32_t *length = snapshotRead(reader, sizeof(uint32_t));
+    if (!length)
+        return 0;
+    *nameLength = *length;
+    return snapshotReadArray(reader, *length);
+}
+
+// adds the index of every view to mapped unless it is NULL
+static roaring_bitmap_t **snapshotReadBitmaps(snapshot_reader_t *reader, uint32_t length, roaring_bitmap_t **mapped) {
+    const uint64_t *sizes = snapshotReadArray(reader, sizeof(uint64_t) * length);
+    roaring_bitmap_t **bitmaps = calloc(length ? length : 1, sizeof(roaring_bitmap_t *));
+    if (mapped)
+        *mapped = roaring_bitmap_create();
+    for (uint32_t i = 0; i < length && !reader->failed; i++) {
+        if (!sizes[i])
+            continue;
+        const char *data = snapshotReadArray(reader, sizes[i]);
+        if (data) {
+            // frozen views are read-only, roaring_bitmap_free releases only the view itself
+            bitmaps[i] = (roaring_bitmap_t *) roaring_bitmap_frozen_view(data, sizes[i]);
+            reader->failed = !bitmaps[i];
+            if (mapped && bitmaps[i])
+                roaring_bitmap_add(*mapped, i);
+        }
+    }
+    return bitmaps;
+}
+
+static bool loadSnapshot(jroaring_t *storage, const char *path, bool prefault) {
+    clearStorage(storage);
+    mapped_file_t *file = mapped_file_open(path);
+    if (!file)
+        return false;
+    if (prefault)
+        mapped_file_prefault(file);
+
+    snapshot_reader_t reader;
+    reader.data = file->data;
+    reader.size = file->size;
+    reader.offset = 0;
+    reader.failed = false;
+
+    const snapshot_header_t *header = snapshotReadArray(&reader, sizeof(snapshot_header_t));
+    if (!header || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION || header->byteOrderMark != SNAPSHOT_BYTE_ORDER_MARK ||
+        header->productCount == 0 || header->featureCount == 0) {
+        mapped_file_close(file);
+        return false;
+    }
+
+    storage->snapshot = file;
+    storage->isMapped = true;
+    storage->productCount = header->productCount;
+    storage->productCapacity = header->productCount;
+    storage->featureCount = header->featureCount;
+    storage->minProduct = header->minProduct;
+    storage->maxProduct = header->maxProduct;
+    storage->minFeature = header->minFeature;
+    storage->maxFeature = header->maxFeature;
+    storage->minFeatureExt = header->minFeatureExt;
+    storage->maxFeatureExt = header->maxFeatureExt;
+    storage->minGroup = header->minGroup;
+    storage->maxGroup = header->maxGroup;
+    storage->similarHit = header->similarHit;
+
+    storage->indexToProduct = (uint32_t *) snapshotReadArray(&reader, sizeof(uint32_t) * storage->productCount);
+    storage->indexToGroup = (uint32_t *) snapshotReadArray(&reader, sizeof(uint32_t) * storage->productCount);
+    storage->indexToGroupOrder = (uint32_t *) snapshotReadArray(&reader, sizeof(uint32_t) * storage->productCount);
+    storage->productToIndex = (uint32_t *) snapshotReadArray(&reader, sizeof(uint32_t) * productIdRange(storage));
+
+    storage->productAttributes = hash_map_create();
+    for (uint32_t i = 0; i < header->attributeNameCount && !reader.failed; i++) {
+        uint32_t nameLength;
+        const char *name = snapshotReadName(&reader, &nameLength);
+        const uint32_t *counts = snapshotReadArray(&reader, sizeof(uint32_t) * 2);
+        if (!counts)
+            break;
+        const product_attribute_t *entries = snapshotReadArray(&reader, sizeof(product_attribute_t) * counts[0]);
+        const uint32_t *positions = snapshotReadArray(&reader, sizeof(uint32_t) * productIdRange(storage));
+        attribute_t *attribute = positions ? malloc(sizeof(attribute_t)) : 0;
+        if (!attribute)
+            break;
+        attribute->entries = (product_attribute_t *) entries;
+        attribute->entryCount = counts[0];
+        attribute->entryCapacity = counts[0];
+        attribute->tombstoneCount = counts[1];
+        attribute->positions = (uint32_t *) positions;
+        hash_map_put(storage->productAttributes, nameLength, name, attribute);
+        storage->attributeNameCount++;
+        storage->attributeNames = realloc(storage->attributeNames, sizeof(char *) * storage->attributeNameCount);
+        storage->attributeNames[storage->attributeNameCount - 1] = malloc(nameLength + 1);
+        memcpy(storage->attributeNames[storage->attributeNameCount - 1], name, nameLength);
+        storage->attributeNames[storage->attributeNameCount - 1][nameLength] = 0;
+    }
+
+    storage->sortingIndexes = hash_map_create();
+    for (uint32_t i = 0; i < header->sortingIndexNameCount && !reader.failed; i++) {
+        uint32_t nameLength;
+        const char *name = snapshotReadName(&reader, &nameLength);
+        const uint32_t *counts = snapshotReadArray(&reader, sizeof(uint32_t) * 5);
+        if (!counts)
+            break;
+        const uint32_t *products = snapshotReadArray(&reader, sizeof(uint32_t) * counts[0]);
+        const uint32_t *indices = snapshotReadArray(&reader, sizeof(uint32_t) * counts[1]);
+        if (!indices)
+            break;
+        sorting_index_t *sortingIndex = malloc(sizeof(sorting_index_t));
+        sortingIndex->products = (uint32_t *) products;
+        sortingIndex->indices = (uint32_t *) indices;
+        sortingIndex->productCount = counts[0];
+        sortingIndex->productCapacity = counts[0];
+        sortingIndex->indexCount = counts[1];
+        sortingIndex->minProduct = counts[2];
+        sortingIndex->tombstoneCount = counts[3];
+        sortingIndex->isMapped = true;
+        sortingIndex->isAttributeMirror = (counts[4] & SNAPSHOT_SORTING_MIRROR) != 0;
+        sortingIndex->isShared = (counts[4] & SNAPSHOT_SORTING_SHARED) != 0;
+        addSortingIndex(storage, nameLength, name, sortingIndex);
+    }
+
+    storage->productFeatures = snapshotReadBitmaps(&reader, storage->productCount, 0);
+    storage->productFeaturesExt = snapshotReadBitmaps(&reader, storage->productCount, 0);
+    storage->featureProducts = snapshotReadBitmaps(&reader, storage->featureCount,
+                                                   &storage->mappedBitmaps[MAPPED_FEATURE_PRODUCTS]);
+    storage->featureProductsExt = snapshotReadBitmaps(&reader, storage->featureCount,
+                                                      &storage->mappedBitmaps[MAPPED_FEATURE_PRODUCTS_EXT]);
+    storage->featureGroups = snapshotReadBitmaps(&reader, storage->featureCount,
+                                                 &storage->mappedBitmaps[MAPPED_FEATURE_GROUPS]);
+    storage->groupProducts = snapshotReadBitmaps(&reader, storage->maxGroup + 1,
+                                                 &storage->mappedBitmaps[MAPPED_GROUP_PRODUCTS]);
+    storage->groupFeatures = snapshotReadBitmaps(&reader, storage->maxGroup + 1,
+                                                 &storage->mappedBitmaps[MAPPED_GROUP_FEATURES]);
+
+    if (reader.failed) {
+        clearStorage(storage);
+        return false;
+    }
+    return true;
+}
+
+static bool findProductIndex(jroaring_t *storage, uint32_t productId, uint32_t *index) {
+    if (!storage->productToIndex || productId < storage->minProduct || productId > storage->maxProduct)
+        return false;
+    *index = *productIndexOf(storage, productId);
+    return *index < storage->productCount && storage->indexToProduct[*index] == productId;
+}
+
+static bool ensureProductCapacity(jroaring_t *storage, uint32_t capacity) {
+    if (capacity <= storage->productCapacity)
+        return true;
+    capacity = max(capacity, storage->productCapacity * 2);
+    void *pointer;
+#define GROW_PRODUCT_ARRAY(array) \
+    if (!(pointer = realloc(storage->array, sizeof(storage->array[0]) * capacity))) \
+        return false; \
+    storage->array = pointer;
+    GROW_PRODUCT_ARRAY(productFeatures)
+    GROW_PRODUCT_ARRAY(productFeaturesExt)
+    GROW_PRODUCT_ARRAY(indexToProduct)
+    GROW_PRODUCT_ARRAY(indexToGroup)
+    GROW_PRODUCT_ARRAY(indexToGroupOrder)
+    GROW_PRODUCT_ARRAY(indexToFeatureCount)
+#undef GROW_PRODUCT_ARRAY
+    storage->productCapacity = capacity;
+    return true;
+}
+
+static bool ensureProductIdCapacity(jroaring_t *storage, uint32_t productId) {
+    if (productId >= storage->minProduct && productId <= storage->maxProduct)
+        return true;
+    uint32_t from;
+    uint32_t count;
+    widenProductIdRange(storage->minProduct, productIdRange(storage), productId, &from, &count);
+    // productToIndex, productToGroup and the positions of every attribute are all widened or none of them
+    uint32_t arrayCount = 2 + storage->attributeNameCount;
+    uint32_t ***arrays = malloc(sizeof(uint32_t **) * arrayCount);
+    uint32_t **widened = calloc(arrayCount, sizeof(uint32_t *));
+    bool isWidened = arrays && widened;
+    for (uint32_t i = 0; isWidened && i < arrayCount; i++) {
+        if (i < 2) {
+            arrays[i] = i == 0 ? &storage->productToIndex : &storage->productToGroup;
+        } else {
+            const char *name = storage->attributeNames[i - 2];
+            arrays[i] = &((attribute_t *) hash_map_get(storage->productAttributes, strlen(name), name))->positions;
+        }
+        widened[i] = widenProductIdArray(*arrays[i], storage->minProduct, productIdRange(storage), from, count,
+                                         i < 2 ? 0 : 0xFF);
+        isWidened = widened[i] != 0;
+    }
+    for (uint32_t i = 0; widened && i < arrayCount; i++) {
+        if (isWidened) {
+            free(*arrays[i]);
+            *arrays[i] = widened[i];
+        } else {
+            free(widened[i]);
+        }
+    }
+    free(arrays);
+    free(widened);
+    if (!isWidened)
+        return false;
+    storage->minProduct = from;
+    storage->maxProduct = from + count - 1;
+    return true;
+}
+
+static bool ensureGroupCapacity(jroaring_t *storage, uint32_t groupId) {
+    if (groupId <= storage->maxGroup)
+        return true;
+    size_t length = sizeof(roaring_bitmap_t *) * ((size_t) groupId + 1);
+    size_t addedLength = sizeof(roaring_bitmap_t *) * (groupId - storage->maxGroup);
+    roaring_bitmap_t **groupProducts = realloc(storage->groupProducts, length);
+    if (!groupProducts)
+        return false;
+    memset(groupProducts + storage->maxGroup + 1, 0, addedLength);
+    storage->groupProducts = groupProducts;
+    roaring_bitmap_t **groupFeatures = realloc(storage->groupFeatures, length);
+    if (!groupFeatures)
+        return false;
+    memset(groupFeatures + storage->maxGroup + 1, 0, addedLength);
+    storage->groupFeatures = groupFeatures;
+    storage->maxGroup = groupId;
+    return true;
+}
+
+static inline roaring_bitmap_t *getOrCreateBitmap(roaring_bitmap_t **bitmaps, uint32_t index) {
+    if (!bitmaps[index]) {
+        bitmaps[index] = roaring_bitmap_create();
+    }
+    return bitmaps[index];
+}
+
+// bitmaps[index] ready to be changed in place, created when missing and copied first while it is a frozen view
+static roaring_bitmap_t *getWritableBitmap(jroaring_t *storage, uint32_t family, roaring_bitmap_t **bitmaps,
+                                           uint32_t index) {
+    roaring_bitmap_t *mapped = storage->mappedBitmaps[family];
+    if (mapped && roaring_bitmap_contains(mapped, index)) {
+        roaring_bitmap_t *copy = roaring_bitmap_copy(bitmaps[index]);
+        if (copy) {
+            roaring_bitmap_free(bitmaps[index]);
+            bitmaps[index] = copy;
+            roaring_bitmap_remove(mapped, index);
+        }
+    }
+    return getOrCreateBitmap(bitmaps, index);
+}
+
+static void *copyMemory(const void *data, size_t size) {
+    void *copy = malloc(size + 1);
+    if (copy && size > 0)
+        memcpy(copy, data, size);
+    return copy;
+}
+
+/*
+ * Copies what every update writes to out of the snapshot: sorting indexes, product arrays and attributes, the
+ * latter all or none. Bitmaps are left to getWritableBitmap. Called under the write lock before the first update.
+ */
+static bool detachSnapshot(jroaring_t *storage) {
+    for (uint32_t i = 0; i < storage->sortingIndexNameCount; i++) {
+        const char *name = storage->sortingIndexNames[i];
+        sorting_index_t *sortingIndex = hash_map_get(storage->sortingIndexes, strlen(name), name);
+        if (!sortingIndex || !sortingIndex->isMapped)
+            continue;
+        uint32_t *products = copyMemory(sortingIndex->products, sizeof(uint32_t) * sortingIndex->productCount);
+        uint32_t *indices = copyMemory(sortingIndex->indices, sizeof(uint32_t) * sortingIndex->indexCount);
+        if (!products || !indices) {
+            free(products);
+            free(indices);
+            return false;
+        }
+        sortingIndex->products = products;
+        sortingIndex->indices = indices;
+        sortingIndex->isMapped = false;
+    }
+    if (!storage->isMapped)
+        return true;
+
+    // product arrays first, then entries and positions of every attribute
+    uint32_t copyCount = 4 + storage->attributeNameCount * 2;
+    void ***arrays = malloc(sizeof(void **) * copyCount);
+    size_t *sizes = malloc(sizeof(size_t) * copyCount);
+    void **copies = calloc(copyCount, sizeof(void *));
+    bool copied = arrays && sizes && copies;
+    if (copied) {
+        void **productArrays[] = {(void **) &storage->indexToProduct, (void **) &storage->indexToGroup,
+                                  (void **) &storage->indexToGroupOrder, (void **) &storage->productToIndex};
+        memcpy(arrays, productArrays, sizeof(productArrays));
+        sizes[0] = sizes[1] = sizes[2] = sizeof(uint32_t) * storage->productCount;
+        sizes[3] = sizeof(uint32_t) * productIdRange(storage);
+        for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+            const char *name = storage->attributeNames[i];
+            attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(name), name);
+            arrays[4 + i * 2] = (void **) &attribute->entries;
+            sizes[4 + i * 2] = sizeof(product_attribute_t) * attribute->entryCount;
+            arrays[5 + i * 2] = (void **) &attribute->positions;
+            sizes[5 + i * 2] = sizeof(uint32_t) * productIdRange(storage);
+        }
+    }
+    for (uint32_t i = 0; copied && i < copyCount; i++) {
+        copied = (copies[i] = copyMemory(*arrays[i], sizes[i])) != 0;
+    }
+    for (uint32_t i = 0; copies && i < copyCount; i++) {
+        if (copied)
+            *arrays[i] = copies[i];
+        else
+            free(copies[i]);
+    }
+    free(arrays);
+    free(sizes);
+    free(copies);
+    if (!copied)
+        return false;
+    storage->isMapped = false;
+    return true;
+}
+
+static void addToIndexes(jroaring_t *storage, uint32_t index) {
+    uint32_t productId = storage->indexToProduct[index];
+    uint32_t groupId = storage->indexToGroup[index];
+    roaring_bitmap_add(getWritableBitmap(storage, MAPPED_GROUP_PRODUCTS, storage->groupProducts, groupId), productId);
+    roaring_bitmap_t *groupFeatures = getWritableBitmap(storage, MAPPED_GROUP_FEATURES, storage->groupFeatures,
+                                                        groupId);
+
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(storage->productFeatures[index], &iterator);
+    while (iterator.has_value) {
+        uint32_t feature = iterator.current_value;
+        roaring_bitmap_add(getWritableBitmap(storage, MAPPED_FEATURE_PRODUCTS, storage->featureProducts, feature),
+                           productId);
+        roaring_bitmap_add(getWritableBitmap(storage, MAPPED_FEATURE_GROUPS, storage->featureGroups, feature),
+                           groupId);
+        roaring_bitmap_add(groupFeatures, feature);
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    roaring_init_iterator(storage->productFeaturesExt[index], &iterator);
+    while (iterator.has_value) {
+        roaring_bitmap_add(getWritableBitmap(storage, MAPPED_FEATURE_PRODUCTS_EXT, storage->featureProductsExt,
+                                             iterator.current_value), productId);
+        roaring_advance_uint32_iterator(&iterator);
+    }
+}
+
+static void removeFromIndexes(jroaring_t *storage, uint32_t index) {
+    uint32_t productId = storage->indexToProduct[index];
+    uint32_t groupId = storage->indexToGroup[index];
+    roaring_bitmap_t *groupProducts = getWritableBitmap(storage, MAPPED_GROUP_PRODUCTS, storage->groupProducts,
+                                                        groupId);
+    roaring_bitmap_remove(groupProducts, productId);
+
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(storage->productFeatures[index], &iterator);
+    while (iterator.has_value) {
+        uint32_t feature = iterator.current_value;
+        roaring_bitmap_t *featureProducts = getWritableBitmap(storage, MAPPED_FEATURE_PRODUCTS,
+                                                              storage->featureProducts, feature);
+        roaring_bitmap_remove(featureProducts, productId);
+        // group keeps the feature while any other product of it has the feature
+        if (!roaring_bitmap_intersect(featureProducts, groupProducts))
+            roaring_bitmap_remove(getWritableBitmap(storage, MAPPED_FEATURE_GROUPS, storage->featureGroups, feature),
+                                  groupId);
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    roaring_init_iterator(storage->productFeaturesExt[index], &iterator);
+    while (iterator.has_value) {
+        roaring_bitmap_remove(getWritableBitmap(storage, MAPPED_FEATURE_PRODUCTS_EXT, storage->featureProductsExt,
+                                                iterator.current_value), productId);
+        roaring_advance_uint32_iterator(&iterator);
+    }
+
+    roaring_bitmap_t *groupFeatures = getWritableBitmap(storage, MAPPED_GROUP_FEATURES, storage->groupFeatures,
+                                                        groupId);
+    roaring_bitmap_clear(groupFeatures);
+    roaring_init_iterator(groupProducts, &iterator);
+    while (iterator.has_value) {
+        roaring_bitmap_or_inplace(groupFeatures, storage->productFeatures[*productIndexOf(storage, iterator.current_value)]);
+        roaring_advance_uint32_iterator(&iterator);
+    }
+}
+
+/*
+ * Sorting index built from the attribute in completeLoadData lists products in exactly the attribute order,
+ * tombstones included, so it is kept in sync with every change of the attribute entries. One set by the caller
+ * under the same name is not.
+ */
+static sorting_index_t *asMirrorSortingIndex(sorting_index_t *sortingIndex, const attribute_t *attribute) {
+    if (!sortingIndex || !attribute || !sortingIndex->isAttributeMirror ||
+        sortingIndex->productCount != attribute->entryCount)
+        return 0;
+    return sortingIndex;
+}
+
+static sorting_index_t *getMirrorSortingIndex(jroaring_t *storage, const char *name, const attribute_t *attribute) {
+    return asMirrorSortingIndex(hash_map_get(storage->sortingIndexes, strlen(name), name), attribute);
+}
+
+// arrays with tombstones are compacted once these are more than half of them
+static inline bool hasManyTombstones(uint32_t tombstoneCount, uint32_t count) {
+    return tombstoneCount > count / 2;
+}
+
+static inline uint32_t findAttributePosition(const jroaring_t *storage, const attribute_t *attribute,
+                                             uint32_t productId) {
+    if (!attribute->positions || productId < storage->minProduct || productId > storage->maxProduct)
+        return -1;
+    return attribute->positions[productId - storage->minProduct];
+}
+
+// points positions of the products at entries [from, to] and the mirror index at where they are now
+static void updateAttributePositions(jroaring_t *storage, attribute_t *attribute, sorting_index_t *mirrorIndex,
+                                     uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i <= to; i++) {
+        uint32_t productId = attribute->entries[i].productId;
+        if (mirrorIndex)
+            mirrorIndex->products[i] = productId;
+        if (productId == PRODUCT_TOMBSTONE)
+            continue;
+        attribute->positions[productId - storage->minProduct] = i;
+        if (mirrorIndex)
+            mirrorIndex->indices[productId - mirrorIndex->minProduct] = i;
+    }
+}
+
+/*
+ * First entry in [from, to) whose product id is not below the given one. The entries share one value, so they are
+ * sorted by id, tombstones aside: those hold no id and are stepped over.
+ */
+static uint32_t findProductBound(const attribute_t *attribute, uint32_t from, uint32_t to, uint32_t productId) {
+    const product_attribute_t *entries = attribute->entries;
+    while (from < to) {
+        uint32_t middle = from + (to - from) / 2;
+        uint32_t probe = middle;
+        while (probe < to && entries[probe].productId == PRODUCT_TOMBSTONE) {
+            probe++;
+        }
+        if (probe < to && entries[probe].productId < productId) {
+            from = probe + 1;
+        } else {
+            to = middle;
+        }
+    }
+    return from;
+}
+
+// whether a live entry sorts before, or after unless isBefore, the value of productId
+static inline bool isAttributeEntrySide(const product_attribute_t *entry, float value, uint32_t productId,
+                                        bool isBefore) {
+    if (entry->value != value)
+        return (entry->value < value) == isBefore;
+    return entry->productId != PRODUCT_TOMBSTONE && (entry->productId < productId) == isBefore;
+}
+
+/*
+ * Puts entry before the first one not below its value and id, shifting the entries in between toward the nearest
+ * tombstone, which it takes the place of. The caller leaves one behind first: the old entry of the product,
+ * or one appended to the end for a product without a value, so at most the entries between the two are shifted.
+ */
+static void insertAttributeEntry(jroaring_t *storage, attribute_t *attribute, sorting_index_t *mirrorIndex,
+                                 product_attribute_t entry) {
+    product_attribute_t *entries = attribute->entries;
+    uint32_t target = findProductBound(attribute, findAttributeBound(attribute, entry.value, false),
+                                       findAttributeBound(attribute, entry.value, true), entry.productId);
+    uint32_t tombstone;
+    for (uint32_t distance = 0;; distance++) {
+        if (target + distance < attribute->entryCount && entries[target + distance].productId == PRODUCT_TOMBSTONE) {
+            tombstone = target + distance;
+            break;
+        }
+        if (distance < target && entries[target - 1 - distance].productId == PRODUCT_TOMBSTONE) {
+            tombstone = target - 1 - distance;
+            break;
+        }
+        if (target + distance >= attribute->entryCount && distance >= target)
+            return;
+    }
+    uint32_t position;
+    if (tombstone >= target) {
+        memmove(entries + target + 1, entries + target, sizeof(product_attribute_t) * (tombstone - target));
+        position = target;
+    } else {
+        memmove(entries + tombstone, entries + tombstone + 1, sizeof(product_attribute_t) * (target - 1 - tombstone));
+        position = target - 1;
+    }
+    entries[position] = entry;
+    attribute->tombstoneCount--;
+    if (mirrorIndex)
+        mirrorIndex->tombstoneCount--;
+    updateAttributePositions(storage, attribute, mirrorIndex, min(position, tombstone), max(position, tombstone));
+}
+
+static void compactAttribute(jroaring_t *storage, attribute_t *attribute, sorting_index_t *mirrorIndex) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < attribute->entryCount; i++) {
+        if (attribute->entries[i].productId != PRODUCT_TOMBSTONE)
+            attribute->entries[count++] = attribute->entries[i];
+    }
+    attribute->entryCount = count;
+    attribute->tombstoneCount = 0;
+    if (mirrorIndex) {
+        mirrorIndex->productCount = count;
+        mirrorIndex->tombstoneCount = 0;
+    }
+    if (count > 0)
+        updateAttributePositions(storage, attribute, mirrorIndex, 0, count - 1);
+}
+
+static bit_sliced_index_t *getValueIndex(jroaring_t *storage, const char *name) {
+    return hash_map_get(storage->attributeIndexes, strlen(name), name);
+}
+
+static bool ensureAttributeCapacity(attribute_t *attribute, uint32_t capacity) {
+    if (capacity <= attribute->entryCapacity)
+        return true;
+    capacity = max(capacity, attribute->entryCapacity * 2);
+    product_attribute_t *entries = realloc(attribute->entries, sizeof(product_attribute_t) * capacity);
+    if (!entries)
+        return false;
+    attribute->entries = entries;
+    attribute->entryCapacity = capacity;
+    return true;
+}
+
+// room for one more entry in every attribute given, taken before the product changes anything
+static bool reserveAttributeEntries(jroaring_t *storage, uint32_t attributeCount, const char **attributeNames) {
+    for (uint32_t i = 0; i < attributeCount; i++) {
+        const char *name = attributeNames[i];
+        attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(name), name);
+        if (attribute && !ensureAttributeCapacity(attribute, attribute->entryCount + 1))
+            return false;
+    }
+    return true;
+}
+
+static bool ensureSortingIndexCapacity(sorting_index_t *sortingIndex, uint32_t productCount, uint32_t productId) {
+    if (productCount > sortingIndex->productCapacity) {
+        uint32_t capacity = max(productCount, sortingIndex->productCapacity * 2);
+        uint32_t *products = realloc(sortingIndex->products, sizeof(uint32_t) * capacity);
+        if (!products)
+            return false;
+        sortingIndex->products = products;
+        sortingIndex->productCapacity = capacity;
+    }
+    if (productId < sortingIndex->minProduct || productId - sortingIndex->minProduct >= sortingIndex->indexCount) {
+        uint32_t from;
+        uint32_t count;
+        widenProductIdRange(sortingIndex->minProduct, sortingIndex->indexCount, productId, &from, &count);
+        uint32_t *indices = widenProductIdArray(sortingIndex->indices, sortingIndex->minProduct,
+                                                sortingIndex->indexCount, from, count, 0xFF);
+        if (!indices)
+            return false;
+        free(sortingIndex->indices);
+        sortingIndex->indices = indices;
+        sortingIndex->minProduct = from;
+        sortingIndex->indexCount = count;
+    }
+    return true;
+}
+
+static void setAttributeValue(jroaring_t *storage, const char *name, uint32_t productId, float value) {
+    attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(name), name);
+    if (!attribute)
+        return;
+    sorting_index_t *mirrorIndex = getMirrorSortingIndex(storage, name, attribute);
+    bit_sliced_index_t *valueIndex = getValueIndex(storage, name);
+    // the only product whose bits change, wherever its entry ends up
+    if (valueIndex)
+        bit_sliced_index_set(valueIndex, productId, bit_sliced_index_encode(value));
+    product_attribute_t *entries = attribute->entries;
+    uint32_t position = findAttributePosition(storage, attribute, productId);
+    if (position == -1) {
+        // reserveAttributeEntries made room for the tombstone a product without a value starts from
+        position = attribute->entryCount++;
+        entries[position].value = INFINITY;
+        entries[position].productId = PRODUCT_TOMBSTONE;
+        attribute->tombstoneCount++;
+        if (mirrorIndex) {
+            if (!ensureSortingIndexCapacity(mirrorIndex, attribute->entryCount, productId)) {
+                // no longer follows the attribute, it keeps sorting the products it has
+                mirrorIndex->isAttributeMirror = false;
+                mirrorIndex = 0;
+            } else {
+                mirrorIndex->products[mirrorIndex->productCount++] = PRODUCT_TOMBSTONE;
+                mirrorIndex->tombstoneCount++;
+            }
+        }
+    } else {
+        // the entry stays where it is while its value still falls between its neighbours
+        if ((position == 0 || isAttributeEntrySide(&entries[position - 1], value, productId, true)) &&
+            (position + 1 == attribute->entryCount ||
+             isAttributeEntrySide(&entries[position + 1], value, productId, false))) {
+            entries[position].value = value;
+            return;
+        }
+        entries[position].productId = PRODUCT_TOMBSTONE;
+        attribute->tombstoneCount++;
+        if (mirrorIndex) {
+            mirrorIndex->products[position] = PRODUCT_TOMBSTONE;
+            mirrorIndex->tombstoneCount++;
+        }
+    }
+    product_attribute_t entry = {value, productId};
+    insertAttributeEntry(storage, attribute, mirrorIndex, entry);
+}
+
+static void removeAttributeValue(jroaring_t *storage, const char *name, uint32_t productId) {
+    attribute_t *attribute = hash_map_get(storage->productAttributes, strlen(name), name);
+    if (!attribute)
+        return;
+    sorting_index_t *mirrorIndex = getMirrorSortingIndex(storage, name, attribute);
+    bit_sliced_index_t *valueIndex = getValueIndex(storage, name);
+    uint32_t position = findAttributePosition(storage, attribute, productId);
+    if (position == -1)
+        return;
+    attribute->entries[position].productId = PRODUCT_TOMBSTONE;
+    attribute->positions[productId - storage->minProduct] = -1;
+    attribute->tombstoneCount++;
+    if (mirrorIndex) {
+        mirrorIndex->products[position] = PRODUCT_TOMBSTONE;
+        mirrorIndex->indices[productId - mirrorIndex->minProduct] = -1;
+        mirrorIndex->tombstoneCount++;
+    }
+    if (valueIndex)
+        bit_sliced_index_remove(valueIndex, productId);
+    if (hasManyTombstones(attribute->tombstoneCount, attribute->entryCount))
+        compactAttribute(storage, attribute, mirrorIndex);
+}
+
+static void removeSortedProduct(sorting_index_t *sortingIndex, uint32_t productId) {
+    uint32_t position = getSortedPosition(sortingIndex, productId);
+    if (position >= sortingIndex->productCount || sortingIndex->products[position] != productId)
+        return;
+    sortingIndex->products[position] = PRODUCT_TOMBSTONE;
+    sortingIndex->indices[productId - sortingIndex->minProduct] = -1;
+    sortingIndex->tombstoneCount++;
+    if (sortingIndex->isShared || !hasManyTombstones(sortingIndex->tombstoneCount, sortingIndex->productCount))
+        return;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < sortingIndex->productCount; i++) {
+        uint32_t sortedProductId = sortingIndex->products[i];
+        if (sortedProductId == PRODUCT_TOMBSTONE)
+            continue;
+        sortingIndex->products[count] = sortedProductId;
+        sortingIndex->indices[sortedProductId - sortingIndex->minProduct] = count++;
+    }
+    sortingIndex->productCount = count;
+    sortingIndex->tombstoneCount = 0;
+}
+
+static bool upsertProduct(jroaring_t *storage, uint32_t productId, uint32_t groupId, uint32_t groupOrder,
+                          roaring_bitmap_t *features, roaring_bitmap_t *extFeatures, uint32_t attributeCount,
+                          const char **attributeNames, const float *attributeValues) {
+    if (!storage->productToIndex)
+        return false;
+    if (!roaring_bitmap_is_empty(features) && roaring_bitmap_maximum(features) >= storage->featureCount)
+        return false;
+    if (!roaring_bitmap_is_empty(extFeatures) && roaring_bitmap_maximum(extFeatures) >= storage->featureCount)
+        return false;
+    if (!detachSnapshot(storage) || !ensureGroupCapacity(storage, groupId) ||
+        !reserveAttributeEntries(storage, attributeCount, attributeNames))
+        return false;
+
+    uint32_t index;
+    bool isNew = !findProductIndex(storage, productId, &index);
+    if (isNew) {
+        if (!ensureProductCapacity(storage, storage->productCount + 1) || !ensureProductIdCapacity(storage, productId) ||
+            !ensureSimilarTableCapacity(storage->similarTable, storage->productCount + 1))
+            return false;
+        index = storage->productCount++;
+        *productIndexOf(storage, productId) = index;
+        storage->indexToProduct[index] = productId;
+    } else {
+        removeFromIndexes(storage, index);
+        releaseProductBitmap(storage, storage->productFeatures[index]);
+        releaseProductBitmap(storage, storage->productFeaturesExt[index]);
+    }
+
+    setItem(storage, index, productId, groupId, groupOrder, features, extFeatures);
+    *productGroupOf(storage, productId) = groupId;
+    storage->indexToFeatureCount[index] = roaring_bitmap_get_cardinality(features);
+    similarProductChanged(storage, index, productId);
+    addToIndexes(storage, index);
+
+    // attributes the call leaves out keep the values the product had, a new product has none of them
+    for (uint32_t i = 0; i < attributeCount; i++) {
+        setAttributeValue(storage, attributeNames[i], productId, attributeValues[i]);
+    }
+    if (storage->similarIndex) {
+        roaring_bitmap_add(storage->similarPending, productId);
+        if (roaring_bitmap_get_cardinality(storage->similarPending) > SIMILAR_LSH_MAX_PENDING)
+            freeSimilarIndex(storage);
+    }
+    result_cache_reset(storage->resultCache, storage->options->resultCacheBytes);
+    return true;
+}
+
+static bool removeProduct(jroaring_t *storage, uint32_t productId) {
+    uint32_t index;
+    if (!findProductIndex(storage, productId, &index) || !detachSnapshot(storage))
+        return false;
+
+    removeFromIndexes(storage, index);
+    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+        removeAttributeValue(storage, storage->attributeNames[i], productId);
+    }
+    for (uint32_t i = 0; i < storage->sortingIndexNameCount; i++) {
+        const char *name = storage->sortingIndexNames[i];
+        removeSortedProduct(hash_map_get(storage->sortingIndexes, strlen(name), name), productId);
+    }
+    releaseProductBitmap(storage, storage->productFeatures[index]);
+    releaseProductBitmap(storage, storage->productFeaturesExt[index]);
+
+    uint32_t lastIndex = --storage->productCount;
+    similarProductRemoved(storage, productId, index, lastIndex);
+    if (index != lastIndex) {
+        storage->productFeatures[index] = storage->productFeatures[lastIndex];
+        storage->productFeaturesExt[index] = storage->productFeaturesExt[lastIndex];
+        storage->indexToProduct[index] = storage->indexToProduct[lastIndex];
+        storage->indexToGroup[index] = storage->indexToGroup[lastIndex];
+        storage->indexToGroupOrder[index] = storage->indexToGroupOrder[lastIndex];
+        storage->indexToFeatureCount[index] = storage->indexToFeatureCount[lastIndex];
+        *productIndexOf(storage, storage->indexToProduct[index]) = index;
+    }
+    storage->productFeatures[lastIndex] = 0;
+    storage->productFeaturesExt[lastIndex] = 0;
+    *productIndexOf(storage, productId) = 0;
+    if (storage->similarPending)
+        roaring_bitmap_remove(storage->similarPending, productId);
+    result_cache_reset(storage->resultCache, storage->options->resultCacheBytes);
+    return true;
+}
+
+/*
+ * The most similar products seen so far, kept as a heap with the least similar of them on top.
+ */
+typedef struct similar_top_s {
+    similar_product_t *products;
+    uint32_t count;
+    uint32_t capacity;
+} similar_top_t;
+
+static void offerSimilar(similar_top_t *top, uint32_t productId, uint8_t hitPercent) {
+    similar_product_t product = {productId, hitPercent};
+    uint32_t i;
+    if (top->count < top->capacity) {
+        for (i = top->count++; i > 0 && compareSimilar(&top->products[(i - 1) / 2], &product) < 0; i = (i - 1) / 2) {
+            top->products[i] = top->products[(i - 1) / 2];
+        }
+    } else if (top->capacity > 0 && compareSimilar(&top->products[0], &product) > 0) {
+        for (i = 0; 2 * i + 1 < top->count;) {
+            uint32_t child = 2 * i + 1;
+            if (child + 1 < top->count && compareSimilar(&top->products[child + 1], &top->products[child]) > 0)
+                child++;
+            if (compareSimilar(&top->products[child], &product) <= 0)
+                break;
+            top->products[i] = top->products[child];
+            i = child;
+        }
+    } else {
+        return;
+    }
+    top->products[i] = product;
+}
+
+/*
+ * Jaccard index from the cached feature counts and a single intersection count. Once the heap is full,
+ * products whose counts alone cannot beat the top of it are not intersected at all.
+ */
+static void scoreSimilar(jroaring_t *storage, uint32_t productIndex, uint32_t index, similar_top_t *top) {
+    uint32_t count = storage->indexToFeatureCount[productIndex];
+    uint32_t otherCount = storage->indexToFeatureCount[index];
+    if (top->count == top->capacity) {
+        // the intersection is at most the smaller set and the union at least the larger one
+        if (top->capacity == 0 || max(count, otherCount) == 0 ||
+            round((double) min(count, otherCount) / max(count, otherCount) * 100) < top->products[0].hitPercent)
+            return;
+    }
+    uint64_t intersection = roaring_bitmap_and_cardinality(storage->productFeatures[productIndex],
+                                                           storage->productFeatures[index]);
+    uint64_t union_ = count + otherCount - intersection;
+    offerSimilar(top, storage->indexToProduct[index], union_ > 0 ? round((double) intersection / union_ * 100) : 0);
+}
+
+static uint32_t rankCandidates(jroaring_t *storage, uint32_t productIndex, const roaring_bitmap_t *candidates,
+                               similar_top_t *top) {
+    uint32_t productId = storage->indexToProduct[productIndex];
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(candidates, &iterator);
+    uint32_t count = 0;
+    while (iterator.has_value) {
+        uint32_t index;
+        if (iterator.current_value != productId && findProductIndex(storage, iterator.current_value, &index)) {
+            scoreSimilar(storage, productIndex, index, top);
+            count++;
+        }
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    return count;
+}
+
+/*
+ * Collects the products most similar to the one at productIndex into top, from the candidates of the
+ * similarity index when there is one and useIndex is set, otherwise from the whole catalog. Returns the
+ * number of products compared.
+ */
+static uint32_t rankSimilarProducts(jroaring_t *storage, uint32_t productIndex, bool useIndex, similar_top_t *top) {
+    if (useIndex && storage->similarIndex) {
+        roaring_bitmap_t *candidates = roaring_bitmap_copy(storage->similarPending);
+        min_hash_index_candidates(storage->similarIndex, storage->productFeatures[productIndex], candidates);
+        uint32_t count = rankCandidates(storage, productIndex, candidates, top);
+        roaring_bitmap_free(candidates);
+        return count;
+    }
+    for (uint32_t i = 0; i < storage->productCount; i++) {
+        if (i != productIndex)
+            scoreSimilar(storage, productIndex, i, top);
+    }
+    return storage->productCount - 1;
+}
+
+typedef struct similar_rows_job_s {
+    jroaring_t *storage;
+    const uint32_t *indices;
+    uint32_t count;
+} similar_rows_job_t;
+
+static void buildSimilarRowsChunk(void *argument, uint32_t chunk) {
+    similar_rows_job_t *job = argument;
+    jroaring_t *storage = job->storage;
+    similar_table_t *table = storage->similarTable;
+    uint32_t end = min(chunk * SIMILAR_TABLE_TASK_ROWS + SIMILAR_TABLE_TASK_ROWS, job->count);
+    for (uint32_t i = chunk * SIMILAR_TABLE_TASK_ROWS; i < end; i++) {
+        uint32_t index = job->indices[i];
+        similar_top_t top;
+        top.products = table->rows + (size_t) index * table->size;
+        top.count = 0;
+        top.capacity = min(table->size, storage->productCount - 1);
+        rankSimilarProducts(storage, index, true, &top);
+        qsort(top.products, top.count, sizeof(similar_product_t), compareSimilar);
+        atomic_store_explicit(&table->rowCounts[index], top.count, memory_order_release);
+    }
+}
+
+/*
+ * Recomputes dirty rows a chunk at a time, releasing the read lock in between so that updates are not held
+ * back for the whole build, and sleeps until an update marks more rows dirty.
+ */
+static void *buildSimilarTable(void *argument) {
+    jroaring_t *storage = argument;
+    similar_table_t *table = storage->similarTable;
+    uint32_t *indices = malloc(sizeof(uint32_t) * SIMILAR_TABLE_CHUNK_ROWS);
+    while (true) {
+        pthread_mutex_lock(&table->mutex);
+        while (!table->hasWork && !atomic_load(&table->stopping)) {
+            pthread_cond_wait(&table->wakeup, &table->mutex);
+        }
+        table->hasWork = false;
+        pthread_mutex_unlock(&table->mutex);
+
+        similar_rows_job_t job = {storage, indices, 0};
+        do {
+            if (atomic_load(&table->stopping))
+                break;
+            pthread_rwlock_rdlock(&storage->lock);
+            roaring_uint32_iterator_t iterator;
+            roaring_init_iterator(table->dirtyRows, &iterator);
+            for (job.count = 0; job.count < SIMILAR_TABLE_CHUNK_ROWS && iterator.has_value; job.count++) {
+                indices[job.count] = iterator.current_value;
+                roaring_advance_uint32_iterator(&iterator);
+            }
+            thread_pool_run(table->pool, (job.count + SIMILAR_TABLE_TASK_ROWS - 1) / SIMILAR_TABLE_TASK_ROWS,
+                            buildSimilarRowsChunk, &job);
+            for (uint32_t i = 0; i < job.count; i++) {
+                roaring_bitmap_remove(table->dirtyRows, indices[i]);
+            }
+            pthread_rwlock_unlock(&storage->lock);
+        } while (job.count > 0);
+
+        if (atomic_load(&table->stopping))
+            break;
+    }
+    free(indices);
+    return 0;
+}
+
+static void startSimilarTable(jroaring_t *storage) {
+    freeSimilarTable(storage);
+    if (storage->options->similarTableSize == 0 || storage->productCount == 0)
+        return;
+    similar_table_t *table = calloc(1, sizeof(similar_table_t));
+    if (!table)
+        return;
+    table->size = storage->options->similarTableSize;
+    if (!ensureSimilarTableCapacity(table, storage->productCount)) {
+        free(table->rows);
+        free(table->rowCounts);
+        free(table);
+        return;
+    }
+    table->dirtyRows = roaring_bitmap_create();
+    roaring_bitmap_add_range(table->dirtyRows, 0, storage->productCount);
+    table->changed = roaring_bitmap_create();
+    uint32_t threadCount = min(storage->options->buildThreadCount, storage->productCount);
+    table->pool = threadCount > 1 ? thread_pool_create(threadCount) : 0;
+    pthread_mutex_init(&table->mutex, NULL);
+    pthread_cond_init(&table->wakeup, NULL);
+    table->hasWork = true;
+    atomic_init(&table->stopping, false);
+    storage->similarTable = table;
+    if (pthread_create(&table->builder, NULL, buildSimilarTable, storage) != 0) {
+        // without a builder every row stays dirty and queries keep ranking live
+        pthread_mutex_destroy(&table->mutex);
+        pthread_cond_destroy(&table->wakeup);
+        thread_pool_free(table->pool);
+        roaring_bitmap_free(table->dirtyRows);
+        roaring_bitmap_free(table->changed);
+        free(table->rows);
+        free(table->rowCounts);
+        free(table);
+        storage->similarTable = 0;
+    }
+}
+
+/*
+ * Answers from the row of the product when it is built and long enough. Row entries changed since are skipped
+ * and every changed product is scored instead, the row entries left are still the best of the unchanged ones.
+ */
+static bool serveSimilarRow(jroaring_t *storage, uint32_t productIndex, similar_top_t *top) {
+    similar_table_t *table = storage->similarTable;
+    if (!table || top->capacity > table->size)
+        return false;
+    uint32_t count = atomic_load_explicit(&table->rowCounts[productIndex], memory_order_acquire);
+    if (count == SIMILAR_ROW_DIRTY)
+        return false;
+    const similar_product_t *row = table->rows + (size_t) productIndex * table->size;
+    bool hasChanges = !roaring_bitmap_is_empty(table->changed);
+    uint32_t validCount = 0;
+    for (uint32_t i = 0; i < count && validCount < top->capacity; i++) {
+        uint32_t index;
+        if ((hasChanges && roaring_bitmap_contains(table->changed, row[i].productId)) ||
+            !findProductIndex(storage, row[i].productId, &index))
+            continue;
+        offerSimilar(top, row[i].productId, row[i].hitPercent);
+        validCount++;
+    }
+    // a full row cut off unchanged products that may now belong to the top
+    if (count == table->size && validCount < top->capacity) {
+        top->count = 0;
+        return false;
+    }
+    if (hasChanges)
+        rankCandidates(storage, productIndex, table->changed, top);
+    return true;
+}
+
+static void collectSimilarProducts(jroaring_t *storage, uint32_t productIndex, similar_top_t *top) {
+    if (!serveSimilarRow(storage, productIndex, top))
+        rankSimilarProducts(storage, productIndex, true, top);
+}
+
+static jroaring_handle_t *createHandle() {
+    jroaring_handle_t *handle = malloc(sizeof(jroaring_handle_t));
+    memset(handle, 0, sizeof(jroaring_handle_t));
+    atomic_init(&handle->current, NULL);
+    atomic_init(&handle->epoch, 0);
+    atomic_init(&handle->readers[0], 0);
+    atomic_init(&handle->readers[1], 0);
+    pthread_mutex_init(&handle->publishMutex, NULL);
+    handle->options.resultCacheBytes = (uint64_t) RESULT_CACHE_DEFAULT_MEGABYTES << 20;
+    handle->options.queryParallelMinFeatures = QUERY_PARALLEL_DEFAULT_MIN_FEATURES;
+    handle->options.similarRows = SIMILAR_LSH_DEFAULT_ROWS;
+    atomic_init(&handle->queryPool, NULL);
+    atomic_init(&handle->slowQueries, NULL);
+    pthread_mutex_init(&handle->registry.mutex, NULL);
+    registerName(&handle->registry, strlen(PRICE_NAME), PRICE_NAME);
+    return handle;
+}
+
+// names are registered through the sharded handle only, so that a handle means the same name in every shard
+static jroaring_handle_t *createShardedHandle(uint32_t shardCount) {
+    jroaring_handle_t *handle = createHandle();
+    handle->shards = malloc(sizeof(jroaring_handle_t *) * shardCount);
+    for (uint32_t i = 0; i < shardCount; i++) {
+        handle->shards[i] = createHandle();
+    }
+    handle->shardCount = shardCount;
+    return handle;
+}
+
+static jroaring_t *acquireStorage(jroaring_handle_t *handle, uint32_t *readerSlot) {
+    *readerSlot = atomic_load(&handle->epoch) & 1;
+    atomic_fetch_add(&handle->readers[*readerSlot], 1);
+    return atomic_load(&handle->current);
+}
+
+static void releaseStorage(jroaring_handle_t *handle, uint32_t readerSlot) {
+    atomic_fetch_sub(&handle->readers[readerSlot], 1);
+}
+
+static void waitForReaders(jroaring_handle_t *handle) {
+    for (uint32_t flip = 0; flip < 2; flip++) {
+        uint32_t readerSlot = atomic_fetch_add(&handle->epoch, 1) & 1;
+        while (atomic_load(&handle->readers[readerSlot]) > 0) {
+            sched_yield();
+        }
+    }
+}
+
+static void freeStorage(jroaring_t *storage) {
+    if (storage) {
+        clearStorage(storage);
+        result_cache_free(storage->resultCache);
+        pthread_rwlock_destroy(&storage->lock);
+        free(storage);
+    }
+}
+
+static void setQueryPool(jroaring_handle_t *handle, thread_pool_t *pool) {
+    pthread_mutex_lock(&handle->publishMutex);
+    thread_pool_t *retired = atomic_exchange(&handle->queryPool, pool);
+    waitForReaders(handle);
+    pthread_mutex_unlock(&handle->publishMutex);
+    thread_pool_free(retired);
+}
+
+static void publishStorage(jroaring_handle_t *handle, jroaring_t *storage) {
+    pthread_mutex_lock(&handle->publishMutex);
+    refreshNameSlots(storage);
+    jroaring_t *retired = atomic_exchange(&handle->current, storage);
+    waitForReaders(handle);
+    pthread_mutex_unlock(&handle->publishMutex);
+    freeStorage(retired);
+}
+
+static void freeHandle(jroaring_handle_t *handle) {
+    for (uint32_t i = 0; i < handle->shardCount; i++) {
+        freeHandle(handle->shards[i]);
+    }
+    free(handle->shards);
+    freeStorage(handle->staging);
+    freeStorage(atomic_load(&handle->current));
+    thread_pool_free(atomic_load(&handle->queryPool));
+    query_log_free(atomic_load(&handle->slowQueries));
+    pthread_mutex_destroy(&handle->publishMutex);
+    for (uint32_t i = 0; i < handle->registry.count; i++) {
+        free(handle->registry.names[i]);
+    }
+    free(handle->registry.names);
+    pthread_mutex_destroy(&handle->registry.mutex);
+    free(handle);
+}
+
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_init
+        (JNIEnv *env, jclass class) {
+    return (jlong) createHandle();
+}
+
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_initSharded
+        (JNIEnv *env, jclass class, jint shardCount) {
+    return (jlong) createShardedHandle(shardCount > 0 ? shardCount : 1);
+}
+
+// handle to load, update or snapshot one shard with, 0 when out of range or the handle is not sharded
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getShard
+        (JNIEnv *env, jclass class, jlong pointer, jint shard) {
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    return shard >= 0 && shard < handle->shardCount ? (jlong) handle->shards[shard] : 0;
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setOption
+        (JNIEnv *env, jclass class, jlong pointer, jint option, jint value) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    // shards of a sharded handle are queried on its own query threads and logged by it, every other option is theirs
+    for (uint32_t i = 0; i < handle->shardCount && option != OPTION(QUERY_THREADS) &&
+                         option != OPTION(SLOW_QUERY_MICROS); i++) {
+        Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setOption(env, class,
+                                                                               (jlong) handle->shards[i], option,
+                                                                               value);
+    }
+
+    switch (option) {
+        case OPTION(BUILD_THREADS):
+            handle->options.buildThreadCount = value > 0 ? value : 1;
+            break;
+        case OPTION(RESULT_CACHE_MEGABYTES):
+            handle->options.resultCacheBytes = value > 0 ? (uint64_t) value << 20 : 0;
+            break;
+        case OPTION(ATTRIBUTE_BIT_SLICES):
+            handle->options.attributeBitSlices = value != 0;
+            break;
+        case OPTION(QUERY_THREADS):
+            setQueryPool(handle, value > 1 ? thread_pool_create(value) : 0);
+            break;
+        case OPTION(QUERY_PARALLEL_MIN_FEATURES):
+            handle->options.queryParallelMinFeatures = value > 0 ? value : 0;
+            break;
+        case OPTION(SIMILAR_LSH_BANDS):
+            handle->options.similarBands = value > 0 ? value : 0;
+            break;
+        case OPTION(SIMILAR_LSH_ROWS):
+            handle->options.similarRows = value > 0 ? value : SIMILAR_LSH_DEFAULT_ROWS;
+            break;
+        case OPTION(SIMILAR_TABLE_SIZE):
+            handle->options.similarTableSize = value > 0 ? value : 0;
+            break;
+        case OPTION(COMPACT_AFTER_LOAD):
+            handle->options.compactAfterLoad = value != 0;
+            break;
+        case OPTION(SLOW_QUERY_MICROS):
+            if (value > 0 && !atomic_load(&handle->slowQueries)) {
+                query_log_t *slowQueries = query_log_create(SLOW_QUERY_LOG_CAPACITY);
+                query_log_t *expected = NULL;
+                if (!atomic_compare_exchange_strong(&handle->slowQueries, &expected, slowQueries))
+                    query_log_free(slowQueries);
+            }
+            handle->options.slowQueryNanos = value > 0 ? (uint64_t) value * 1000 : 0;
+            break;
+        default:
+            break;
+    }
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_initStorage
+        (JNIEnv *env, jclass class, jlong pointer, jint rowCount, jint columnCount) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    if (handle->shardCount > 0)
+        return;
+    if (!handle->staging) {
+        handle->staging = createStorage(&handle->options, &handle->registry);
+    }
+    jroaring_t *storage = handle->staging;
+    clearStorage(storage);
+
+    storage->productCount = rowCount;
+    storage->productCapacity = rowCount;
+    storage->featureCount = columnCount;
+    // lowered by every product added
+    storage->minProduct = UINT32_MAX;
+
+    storage->similarHit = 50;
+
+    storage->productFeatures = malloc(sizeof(roaring_bitmap_t *) * rowCount);
+    storage->productFeaturesExt = malloc(sizeof(roaring_bitmap_t *) * rowCount);
+
+    storage->featureProducts = malloc(sizeof(roaring_bitmap_t *) * columnCount);
+    memset(storage->featureProducts, 0, sizeof(roaring_bitmap_t *) * columnCount);
+    storage->featureGroups = malloc(sizeof(roaring_bitmap_t *) * columnCount);
+    memset(storage->featureGroups, 0, sizeof(roaring_bitmap_t *) * columnCount);
+    storage->featureProductsExt = malloc(sizeof(roaring_bitmap_t *) * columnCount);
+    memset(storage->featureProductsExt, 0, sizeof(roaring_bitmap_t *) * columnCount);
+
+    storage->indexToProduct = malloc(sizeof(uint32_t) * rowCount);
+    storage->indexToGroup = malloc(sizeof(uint32_t) * rowCount);
+    storage->indexToGroupOrder = malloc(sizeof(uint32_t) * rowCount);
+
+    storage->productAttributes = hash_map_create();
+    storage->sortingIndexes = hash_map_create();
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_addItem
+        (JNIEnv *env, jclass class, jlong pointer, jint index, jint productId, jint groupId, jint groupOrder,
+         jintArray featuresArray, jintArray extFeaturesArray, jobjectArray attributeNamesArray,
+         jfloatArray attributeValuesArray) {
+
+    jroaring_t *storage = ((jroaring_handle_t *) pointer)->staging;
+    if (!storage)
+        return;
+
+    setItem(storage, index, productId, groupId, groupOrder,
+            roaring_bitmap_from_jint_array(env, featuresArray),
+            roaring_bitmap_from_jint_array(env, extFeaturesArray));
+
+    jint attributeCount = (*env)->GetArrayLength(env, attributeNamesArray);
+    if (attributeCount > 0) {
+        jboolean isCopy;
+        jfloat *values = (*env)->GetFloatArrayElements(env, attributeValuesArray, &isCopy);
+        for (jint i = 0; i < attributeCount; i++) {
+            jstring name = (*env)->GetObjectArrayElement(env, attributeNamesArray, i);
+            addAttribute(env, storage, index, productId, name, values[i]);
+        }
+        (*env)->ReleaseFloatArrayElements(env, attributeValuesArray, values, JNI_ABORT);
+    }
+}
+
+/*
+ * Rows of a CSR feature layout are valid when the offsets grow from row to row within the feature array and
+ * every feature id is below featureCount.
+ */
+static bool isValidFeatureRows(const jint *offsets, jsize rowCount, const jint *features, jsize featureLength,
+                               uint32_t featureCount) {
+    for (jsize i = 0; i < rowCount; i++) {
+        if (offsets[i] < 0 || offsets[i] > offsets[i + 1] || offsets[i + 1] > featureLength)
+            return false;
+    }
+    for (jint i = offsets[0]; i < offsets[rowCount]; i++) {
+        if ((uint32_t) features[i] >= featureCount)
+            return false;
+    }
+    return true;
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_addItems
+        (JNIEnv *env, jclass class, jlong pointer, jint fromIndex, jintArray productIdsArray, jintArray groupIdsArray,
+         jintArray groupOrdersArray, jintArray featureOffsetsArray, jintArray featuresArray,
+         jintArray extFeatureOffsetsArray, jintArray extFeaturesArray, jobjectArray attributeNamesArray,
+         jobjectArray attributeValuesArray) {
+
+    jroaring_t *storage = ((jroaring_handle_t *) pointer)->staging;
+    if (!storage)
+        return;
+
+    jsize rowCount = (*env)->GetArrayLength(env, productIdsArray);
+    if (rowCount <= 0 || fromIndex < 0 || (uint32_t) fromIndex + rowCount > storage->productCount)
+        return;
+    if ((*env)->GetArrayLength(env, groupIdsArray) < rowCount ||
+        (*env)->GetArrayLength(env, groupOrdersArray) < rowCount ||
+        (*env)->GetArrayLength(env, featureOffsetsArray) < rowCount + 1 ||
+        (*env)->GetArrayLength(env, extFeatureOffsetsArray) < rowCount + 1)
+        return;
+    // a short attribute column would leave its rows unset, so the whole call is rejected
+    jsize attributeCount = attributeNamesArray ? (*env)->GetArrayLength(env, attributeNamesArray) : 0;
+    if (attributeCount > 0 &&
+        (!attributeValuesArray || (*env)->GetArrayLength(env, attributeValuesArray) < attributeCount))
+        return;
+    for (jsize i = 0; i < attributeCount; i++) {
+        jfloatArray columnArray = (*env)->GetObjectArrayElement(env, attributeValuesArray, i);
+        bool isShort = !columnArray || (*env)->GetArrayLength(env, columnArray) < rowCount;
+        (*env)->DeleteLocalRef(env, columnArray);
+        if (isShort)
+            return;
+    }
+
+    jint *productIds = (*env)->GetIntArrayElements(env, productIdsArray, NULL);
+    jint *groupIds = (*env)->GetIntArrayElements(env, groupIdsArray, NULL);
+    jint *groupOrders = (*env)->GetIntArrayElements(env, groupOrdersArray, NULL);
+    jint *featureOffsets = (*env)->GetIntArrayElements(env, featureOffsetsArray, NULL);
+    jint *features = (*env)->GetIntArrayElements(env, featuresArray, NULL);
+    jint *extFeatureOffsets = (*env)->GetIntArrayElements(env, extFeatureOffsetsArray, NULL);
+    jint *extFeatures = (*env)->GetIntArrayElements(env, extFeaturesArray, NULL);
+    bool isValid = isValidFeatureRows(featureOffsets, rowCount, features, (*env)->GetArrayLength(env, featuresArray),
+                                      storage->featureCount) &&
+                   isValidFeatureRows(extFeatureOffsets, rowCount, extFeatures,
+                                      (*env)->GetArrayLength(env, extFeaturesArray), storage->featureCount);
+
+    for (jsize i = 0; i < rowCount && isValid; i++) {
+        setItem(storage, fromIndex + i, productIds[i], groupIds[i], groupOrders[i],
+                roaring_bitmap_of_ptr(featureOffsets[i + 1] - featureOffsets[i],
+                                      (const uint32_t *) features + featureOffsets[i]),
+                roaring_bitmap_of_ptr(extFeatureOffsets[i + 1] - extFeatureOffsets[i],
+                                      (const uint32_t *) extFeatures + extFeatureOffsets[i]));
+    }
+
+    (*env)->ReleaseIntArrayElements(env, extFeaturesArray, extFeatures, JNI_ABORT);
+    (*env)->ReleaseIntArrayElements(env, extFeatureOffsetsArray, extFeatureOffsets, JNI_ABORT);
+    (*env)->ReleaseIntArrayElements(env, featuresArray, features, JNI_ABORT);
+    (*env)->ReleaseIntArrayElements(env, featureOffsetsArray, featureOffsets, JNI_ABORT);
+    (*env)->ReleaseIntArrayElements(env, groupOrdersArray, groupOrders, JNI_ABORT);
+    (*env)->ReleaseIntArrayElements(env, groupIdsArray, groupIds, JNI_ABORT);
+    if (!isValid) {
+        (*env)->ReleaseIntArrayElements(env, productIdsArray, productIds, JNI_ABORT);
+        return;
+    }
+
+    // every attribute name is resolved once per call, all of them hashed in one batch, the values are then
+    // copied column by column
+    jstring *names = malloc(sizeof(jstring) * (attributeCount + 1));
+    const char **nameChars = malloc(sizeof(char *) * (attributeCount + 1));
+    uint32_t *nameLengths = malloc(sizeof(uint32_t) * (attributeCount + 1));
+    attribute_t **attributes = malloc(sizeof(attribute_t *) * (attributeCount + 1));
+    if (!names || !nameChars || !nameLengths || !attributes)
+        attributeCount = 0;
+    for (jsize i = 0; i < attributeCount; i++) {
+        names[i] = (*env)->GetObjectArrayElement(env, attributeNamesArray, i);
+        nameLengths[i] = (*env)->GetStringUTFLength(env, names[i]);
+        nameChars[i] = (*env)->GetStringUTFChars(env, names[i], NULL);
+    }
+    hash_map_get_many(storage->productAttributes, attributeCount, nameLengths, (const void *const *) nameChars,
+                      (void **) attributes);
+    for (jsize i = 0; i < attributeCount; i++) {
+        // names first seen in this call, or repeated in it, are looked up again as they are created
+        attribute_t *attribute = attributes[i] ? attributes[i] :
+                                 getOrCreateAttribute(storage, nameLengths[i], nameChars[i]);
+        jfloatArray columnArray = (*env)->GetObjectArrayElement(env, attributeValuesArray, i);
+        if (attribute) {
+            jfloat *values = (*env)->GetFloatArrayElements(env, columnArray, NULL);
+            for (jsize j = 0; j < rowCount; j++) {
+                setLoadedAttributeEntry(attribute, fromIndex + j, productIds[j], values[j]);
+            }
+            (*env)->ReleaseFloatArrayElements(env, columnArray, values, JNI_ABORT);
+        }
+        (*env)->DeleteLocalRef(env, columnArray);
+    }
+    for (jsize i = 0; i < attributeCount; i++) {
+        (*env)->ReleaseStringUTFChars(env, names[i], nameChars[i]);
+        (*env)->DeleteLocalRef(env, names[i]);
+    }
+    free(attributes);
+    free(nameLengths);
+    free(nameChars);
+    free(names);
+
+    (*env)->ReleaseIntArrayElements(env, productIdsArray, productIds, JNI_ABORT);
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_completeLoadData
+        (JNIEnv *env, jclass class, jlong pointer) {
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    jroaring_t *storage = handle->staging;
+    if (!storage)
+        return;
+
+    {
+        size_t length;
+
+        if (storage->productCount == 0)
+            storage->minProduct = storage->maxProduct = 0;
+        storage->productToIndex = calloc(productIdRange(storage), sizeof(uint32_t));
+
+        length = sizeof(roaring_bitmap_t *) * ((size_t) storage->maxGroup + 1);
+        storage->groupProducts = malloc(length);
+        memset(storage->groupProducts, 0, length);
+
+        length = sizeof(roaring_bitmap_t *) * ((size_t) storage->maxGroup + 1);
+        storage->groupFeatures = malloc(length);
+        memset(storage->groupFeatures, 0, length);
+    }
+
+    if (storage->options->buildThreadCount > 1) {
+        buildIndexesParallel(storage);
+    } else {
+        buildIndexes(storage);
+    }
+    buildProductGroups(storage);
+    buildFeatureCounts(storage);
+    if (storage->options->compactAfterLoad)
+        compactStorage(storage);
+
+    uint32_t *sortedProducts = malloc(sizeof(uint32_t) * storage->productCount);
+    for (uint32_t i = 0; i < storage->attributeNameCount; i++) {
+        const char *attribName = storage->attributeNames[i];
+        uint32_t nameLength = strlen(attribName);
+        attribute_t *attribute = hash_map_get(storage->productAttributes, nameLength, attribName);
+        qsort(attribute->entries, attribute->entryCount, sizeof(product_attribute_t), compareAttributes);
+        // products without a value of the attribute leave no entry
+        uint32_t entryCount = 0;
+        for (uint32_t j = 0; j < attribute->entryCount; j++) {
+            if (attribute->entries[j].productId != PRODUCT_TOMBSTONE)
+                attribute->entries[entryCount++] = attribute->entries[j];
+        }
+        attribute->entryCount = entryCount;
+        attribute->tombstoneCount = 0;
+        attribute->positions = malloc(sizeof(uint32_t) * productIdRange(storage));
+        memset(attribute->positions, 0xFF, sizeof(uint32_t) * productIdRange(storage));
+        for (uint32_t j = 0; j < attribute->entryCount; j++) {
+            sortedProducts[j] = attribute->entries[j].productId;
+            attribute->positions[sortedProducts[j] - storage->minProduct] = j;
+        }
+        setSortingIndex(storage, nameLength, attribName, attribute->entryCount, sortedProducts, true, false);
+    }
+    free(sortedProducts);
+    buildAttributeIndexes(storage);
+    buildSimilarIndex(storage);
+    startSimilarTable(storage);
+
+    handle->staging = 0;
+    publishStorage(handle, storage);
+}
+
+static jlong setHandleSortingIndex(JNIEnv *env, jroaring_handle_t *handle, jstring sortingIdString,
+                                   jintArray sortingValuesArray, bool isShared) {
+    // every shard gets the whole order, so that sort positions of different shards can be merged
+    if (handle->shardCount > 0) {
+        jlong isSet = 0;
+        for (uint32_t i = 0; i < handle->shardCount; i++) {
+            isSet |= setHandleSortingIndex(env, handle->shards[i], sortingIdString, sortingValuesArray, true);
+        }
+        return isSet;
+    }
+    // indexes set before completeLoadData are published together with the generation being loaded,
+    // later ones go into the published generation as before
+    uint32_t readerSlot;
+    bool isPublished = !handle->staging;
+    jroaring_t *storage = isPublished ? acquireStorage(handle, &readerSlot) : handle->staging;
+    if (storage) {
+        jint sortedProductCount = (*env)->GetArrayLength(env, sortingValuesArray);
+        jint nameLength = (*env)->GetStringUTFLength(env, sortingIdString);
+        const char *nameChars = (*env)->GetStringUTFChars(env, sortingIdString, NULL);
+        jint *sortedProducts = (*env)->GetIntArrayElements(env, sortingValuesArray, NULL);
+        pthread_rwlock_wrlock(&storage->lock);
+        setSortingIndex(storage, nameLength, nameChars, sortedProductCount, (const uint32_t *) sortedProducts,
+                        false, isShared);
+        refreshNameSlots(storage);
+        pthread_rwlock_unlock(&storage->lock);
+        (*env)->ReleaseIntArrayElements(env, sortingValuesArray, sortedProducts, JNI_ABORT);
+        (*env)->ReleaseStringUTFChars(env, sortingIdString, nameChars);
+    }
+    if (isPublished)
+        releaseStorage(handle, readerSlot);
+
+    return storage ? 1 : 0;
+}
+
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setSortingIndex
+        (JNIEnv *env, jclass class, jlong pointer, jstring sortingIdString, jintArray sortingValuesArray) {
+    return setHandleSortingIndex(env, (jroaring_handle_t *) pointer, sortingIdString, sortingValuesArray, false);
+}
+
+// the published generation resolves new names right away, every later one when it is published
+static void registerHandleNames(JNIEnv *env, jroaring_handle_t *handle, jobjectArray namesArray, jint *handles) {
+    jsize nameCount = (*env)->GetArrayLength(env, namesArray);
+    pthread_mutex_lock(&handle->publishMutex);
+    pthread_mutex_lock(&handle->registry.mutex);
+    for (jsize i = 0; i < nameCount; i++) {
+        jstring nameString = (*env)->GetObjectArrayElement(env, namesArray, i);
+        jsize nameLength = (*env)->GetStringUTFLength(env, nameString);
+        const char *name = (*env)->GetStringUTFChars(env, nameString, NULL);
+        handles[i] = registerName(&handle->registry, nameLength, name);
+        (*env)->ReleaseStringUTFChars(env, nameString, name);
+        (*env)->DeleteLocalRef(env, nameString);
+    }
+    pthread_mutex_unlock(&handle->registry.mutex);
+    jroaring_t *storage = atomic_load(&handle->current);
+    if (storage) {
+        pthread_rwlock_wrlock(&storage->lock);
+        refreshNameSlots(storage);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    pthread_mutex_unlock(&handle->publishMutex);
+}
+
+/*
+ * Returns the handle of every name, -1 for the ones that could not be registered. A sharded handle assigns
+ * handles from its own registry and registers every name in each shard too, a name some shard already has
+ * under another handle, from a registration on the shard itself, gets -1.
+ */
+JNIEXPORT jintArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_registerNames
+        (JNIEnv *env, jclass class, jlong pointer, jobjectArray namesArray) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    jsize nameCount = (*env)->GetArrayLength(env, namesArray);
+    jint *handles = malloc(sizeof(jint) * (nameCount + 1));
+    registerHandleNames(env, handle, namesArray, handles);
+    if (handle->shardCount > 0) {
+        jint *shardHandles = malloc(sizeof(jint) * (nameCount + 1));
+        for (uint32_t shard = 0; shard < handle->shardCount; shard++) {
+            registerHandleNames(env, handle->shards[shard], namesArray, shardHandles);
+            for (jsize i = 0; i < nameCount; i++) {
+                if (shardHandles[i] != handles[i])
+                    handles[i] = -1;
+            }
+        }
+        free(shardHandles);
+    }
+
+    jintArray result = (*env)->NewIntArray(env, nameCount);
+    if (result)
+        (*env)->SetIntArrayRegion(env, result, 0, nameCount, handles);
+    free(handles);
+    return result;
+}
+
+/*
+ * Where a query writes its result. Without a caller buffer the result goes to a pooled block Java gets as a new
+ * direct buffer and may hand back to releaseResult. A caller buffer is written directly when the worst case fits,
+ * otherwise through a pooled block copied over only if the actual result fits. The query is timed from the
+ * sink init to its finish under metric.
+ */
+typedef struct result_sink_s {
+    void *buffer;
+    jlong capacity;
+    void *data;
+    uint32_t metric;
+    uint64_t start;
+} result_sink_t;
+
+static void initBufferSink(result_sink_t *sink, uint32_t metric) {
+    sink->buffer = 0;
+    sink->capacity = 0;
+    sink->data = 0;
+    sink->metric = metric;
+    sink->start = query_stats_start();
+}
+
+static void initCallerSink(JNIEnv *env, result_sink_t *sink, jobject resultBuffer, uint32_t metric) {
+    sink->buffer = resultBuffer ? (*env)->GetDirectBufferAddress(env, resultBuffer) : 0;
+    sink->capacity = sink->buffer ? max((*env)->GetDirectBufferCapacity(env, resultBuffer), 0) : 0;
+    sink->data = 0;
+    sink->metric = metric;
+    sink->start = query_stats_start();
+}
+
+static void *acquireResult(result_sink_t *sink, size_t length) {
+    sink->data = sink->buffer && length <= sink->capacity ? sink->buffer : result_pool_acquire(length);
+    return sink->data;
+}
+
+// length is the size of the result in bytes, negative when the query has none
+static jobject finishBufferResult(JNIEnv *env, result_sink_t *sink, jlong length) {
+    jobject result = 0;
+    if (length < 0) {
+        result_pool_release(sink->data);
+    } else {
+        result = (*env)->NewDirectByteBuffer(env, sink->data, length);
+    }
+    query_stats_record(sink->metric, sink->start);
+    return result;
+}
+
+// returns the size the result needs, it is written only if that is within the capacity of the caller buffer
+static jint finishCallerResult(result_sink_t *sink, jlong length) {
+    if (sink->data != sink->buffer) {
+        if (sink->buffer && length >= 0 && length <= sink->capacity)
+            memcpy(sink->buffer, sink->data, length);
+        result_pool_release(sink->data);
+    }
+    query_stats_record(sink->metric, sink->start);
+    return length;
+}
+
+// traces the query when the handle logs slow queries, the trace must then be passed to logSlowQuery
+static bool beginQueryTrace(jroaring_handle_t *handle, query_trace_t *trace) {
+    if (!handle->options.slowQueryNanos || !atomic_load(&handle->slowQueries))
+        return false;
+    query_stats_begin_trace(trace);
+    return true;
+}
+
+static void appendLogText(query_log_record_t *record, const char *chars, uint32_t length) {
+    if (record->textLength >= QUERY_LOG_TEXT_LENGTH)
+        return;
+    length = min(length, QUERY_LOG_TEXT_LENGTH - 1 - record->textLength);
+    memcpy(record->text + record->textLength, chars, length);
+    record->textLength += length;
+    record->text[record->textLength++] = 0;
+}
+
+static void appendLogString(JNIEnv *env, query_log_record_t *record, jstring string) {
+    if (!string) {
+        appendLogText(record, "", 0);
+        return;
+    }
+    jsize length = (*env)->GetStringUTFLength(env, string);
+    const char *chars = (*env)->GetStringUTFChars(env, string, NULL);
+    appendLogText(record, chars, length);
+    (*env)->ReleaseStringUTFChars(env, string, chars);
+}
+
+static void appendLogName(query_log_record_t *record, jroaring_handle_t *handle, jint nameHandle) {
+    name_registry_t *registry = &handle->registry;
+    pthread_mutex_lock(&registry->mutex);
+    const char *name = nameHandle >= 0 && nameHandle < registry->count ? registry->names[nameHandle] : "";
+    appendLogText(record, name, strlen(name));
+    pthread_mutex_unlock(&registry->mutex);
+}
+
+/*
+ * Ends the trace and logs the query if it took at least the slow query threshold. Filters and the sorting
+ * index are given either by name or by registered handle, a negative sorting handle is the product id order.
+ * Everything is read from Java only for queries that get logged.
+ */
+static void logSlowQuery(JNIEnv *env, jroaring_handle_t *handle, query_trace_t *trace, uint32_t metric,
+                         jlong resultLength, jstring expressionString, jobjectArray filterNamesArray,
+                         jintArray filterHandlesArray, jfloatArray filterFromValuesArray,
+                         jfloatArray filterToValuesArray, jstring sortingIdString, jint sortingHandle) {
+    uint64_t totalNanos = query_stats_end_trace(trace);
+    query_log_t *slowQueries = atomic_load(&handle->slowQueries);
+    if (!slowQueries || totalNanos < handle->options.slowQueryNanos)
+        return;
+
+    query_log_record_t *record = malloc(sizeof(query_log_record_t));
+    if (!record)
+        return;
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    record->timestampMillis = (uint64_t) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+    record->totalNanos = totalNanos;
+    record->resultLength = resultLength;
+    memset(record->stageNanos, 0, sizeof(record->stageNanos));
+    for (uint32_t i = 0; i < SLOW_QUERY_STAGE_COUNT; i++) {
+        record->stageNanos[i] = trace->stageNanos[STAT(STAGE_MATCH) + i];
+    }
+    record->metric = metric;
+    record->matchCount = trace->matchCount;
+    record->textLength = 0;
+
+    appendLogString(env, record, expressionString);
+    if (filterHandlesArray || sortingHandle >= 0) {
+        appendLogName(record, handle, sortingHandle);
+    } else {
+        appendLogString(env, record, sortingIdString);
+    }
+    jsize filterCount = 0;
+    if (filterHandlesArray) {
+        filterCount = (*env)->GetArrayLength(env, filterHandlesArray);
+        jint *filterHandles = (*env)->GetIntArrayElements(env, filterHandlesArray, NULL);
+        for (jsize i = 0; i < filterCount; i++) {
+            appendLogName(record, handle, filterHandles[i]);
+        }
+        (*env)->ReleaseIntArrayElements(env, filterHandlesArray, filterHandles, JNI_ABORT);
+    } else if (filterNamesArray) {
+        filterCount = (*env)->GetArrayLength(env, filterNamesArray);
+        for (jsize i = 0; i < filterCount; i++) {
+            jstring filterName = (*env)->GetObjectArrayElement(env, filterNamesArray, i);
+            appendLogString(env, record, filterName);
+            (*env)->DeleteLocalRef(env, filterName);
+        }
+    }
+    record->filterCount = filterCount;
+    jsize rangeCount = min(filterCount, QUERY_LOG_MAX_FILTERS);
+    if (rangeCount > 0) {
+        (*env)->GetFloatArrayRegion(env, filterFromValuesArray, 0, rangeCount, record->filterFromValues);
+        (*env)->GetFloatArrayRegion(env, filterToValuesArray, 0, rangeCount, record->filterToValues);
+    }
+
+    query_log_append(slowQueries, record);
+    free(record);
+}
+
+static inline uint32_t sortedProduct(const sorting_index_t *sortingIndex, uint32_t position) {
+    return position >= sortingIndex->productCount ? position - sortingIndex->productCount :
+           sortingIndex->products[position];
+}
+
+// products missing from the sorting index follow all the indexed ones, by id
+static inline uint32_t sortPosition(const sorting_index_t *sortingIndex, uint32_t productId) {
+    if (!sortingIndex)
+        return productId;
+    uint32_t position = getSortedPosition(sortingIndex, productId);
+    return position != -1 ? position : sortingIndex->productCount + productId;
+}
+
+/*
+ * Lowest and highest price among matches, false when none of them has a price. The price attribute is kept sorted,
+ * so when matches are dense the first match from either end is only a few steps away, sparse matches look their
+ * prices up one by one.
+ */
+static bool getPriceRange(jroaring_t *storage, const roaring_bitmap_t *matches, uint32_t matchCount,
+                          float *minPrice, float *maxPrice) {
+    const name_slot_t *priceSlot = storage->nameSlotCount > PRICE_NAME_HANDLE ?
+                                   &storage->nameSlots[PRICE_NAME_HANDLE] : 0;
+    const attribute_t *attribute = priceSlot ? priceSlot->attribute : 0;
+    *minPrice = 0;
+    *maxPrice = 0;
+    if (!attribute || matchCount == 0)
+        return false;
+    uint32_t attributeCount = attribute->entryCount;
+    const product_attribute_t *attributes = attribute->entries;
+    if (!attribute->positions || (uint64_t) matchCount * matchCount >= attributeCount) {
+        uint32_t i;
+        for (i = 0; i < attributeCount && !roaring_bitmap_contains(matches, attributes[i].productId); i++);
+        if (i == attributeCount)
+            return false;
+        *minPrice = attributes[i].value;
+        for (i = attributeCount; i-- > 0 && !roaring_bitmap_contains(matches, attributes[i].productId););
+        *maxPrice = attributes[i].value;
+        return true;
+    }
+    bool isFirst = true;
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(matches, &iterator);
+    while (iterator.has_value) {
+        uint32_t position = findAttributePosition(storage, attribute, iterator.current_value);
+        if (position != -1) {
+            float price = attributes[position].value;
+            if (isFirst || price < *minPrice)
+                *minPrice = price;
+            if (isFirst || price > *maxPrice)
+                *maxPrice = price;
+            isFirst = false;
+        }
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    return !isFirst;
+}
+
+/*
+ * Walks matches in result order without materializing it. Dense matches are found by scanning the sorting
+ * index itself, sparse ones are mapped to sort positions first. Either way a window is reached by select
+ * or by a scan proportional to its end, not to the number of matches.
+ */
+typedef struct match_cursor_s {
+    const roaring_bitmap_t *matches;
+    const sorting_index_t *sortingIndex;
+    bool isAscending;
+    bool isScan;
+    uint32_t scanPosition;
+    roaring_bitmap_t *positions;
+    roaring_uint32_iterator_t iterator;
+} match_cursor_t;
+
+static bool nextMatch(match_cursor_t *cursor, uint32_t *productId) {
+    if (cursor->isScan) {
+        const sorting_index_t *sortingIndex = cursor->sortingIndex;
+        while (cursor->scanPosition < sortingIndex->productCount) {
+            uint32_t candidate = sortingIndex->products[cursor->scanPosition];
+            cursor->scanPosition += cursor->isAscending ? 1 : -1;
+            if (roaring_bitmap_contains(cursor->matches, candidate)) {
+                *productId = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (!cursor->iterator.has_value)
+        return false;
+    uint32_t position = cursor->iterator.current_value;
+    *productId = cursor->sortingIndex ? sortedProduct(cursor->sortingIndex, position) : position;
+    if (cursor->isAscending)
+        roaring_advance_uint32_iterator(&cursor->iterator);
+    else
+        roaring_previous_uint32_iterator(&cursor->iterator);
+    return true;
+}
+
+static void openMatchCursor(match_cursor_t *cursor, jroaring_t *storage, const roaring_bitmap_t *matches,
+                            uint32_t matchCount, const sorting_index_t *sortingIndex, bool isAscending,
+                            uint32_t skipCount, uint32_t endCount) {
+    cursor->matches = matches;
+    cursor->sortingIndex = sortingIndex;
+    cursor->isAscending = isAscending;
+    cursor->positions = 0;
+    // a scan takes about endCount * productCount / matchCount steps, mapping takes matchCount
+    cursor->isScan = sortingIndex &&
+                     sortingIndex->productCount - sortingIndex->tombstoneCount == storage->productCount &&
+                     (uint64_t) endCount * sortingIndex->productCount < (uint64_t) matchCount * matchCount;
+    if (cursor->isScan) {
+        cursor->scanPosition = isAscending ? 0 : sortingIndex->productCount - 1;
+        uint32_t productId;
+        for (uint32_t i = 0; i < skipCount && nextMatch(cursor, &productId); i++);
+        return;
+    }
+
+    const roaring_bitmap_t *positions = matches;
+    if (sortingIndex) {
+        cursor->positions = roaring_bitmap_create();
+        roaring_uint32_iterator_t iterator;
+        roaring_init_iterator(matches, &iterator);
+        while (iterator.has_value) {
+            roaring_bitmap_add(cursor->positions, sortPosition(sortingIndex, iterator.current_value));
+            roaring_advance_uint32_iterator(&iterator);
+        }
+        positions = cursor->positions;
+    }
+    uint32_t first;
+    if (skipCount >= matchCount ||
+        !roaring_bitmap_select(positions, isAscending ? skipCount : matchCount - 1 - skipCount, &first)) {
+        cursor->iterator.has_value = false;
+        return;
+    }
+    roaring_init_iterator(positions, &cursor->iterator);
+    roaring_move_uint32_iterator_equalorlarger(&cursor->iterator, first);
+}
+
+static void closeMatchCursor(match_cursor_t *cursor) {
+    if (cursor->positions)
+        roaring_bitmap_free(cursor->positions);
+}
+
+/*
+ * The product shown for its group is its matching member with the highest group order, the earliest in sort
+ * order among equal ones. Groups are small, so this looks at the other members instead of all matches.
+ */
+static bool isGroupRepresentative(jroaring_t *storage, const roaring_bitmap_t *matches,
+                                  const sorting_index_t *sortingIndex, uint32_t productId) {
+    uint32_t productIndex = *productIndexOf(storage, productId);
+    uint32_t groupOrder = storage->indexToGroupOrder[productIndex];
+    const roaring_bitmap_t *groupProducts = storage->groupProducts[storage->indexToGroup[productIndex]];
+    if (!groupProducts)
+        return true;
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(groupProducts, &iterator);
+    while (iterator.has_value) {
+        uint32_t other = iterator.current_value;
+        if (other != productId && roaring_bitmap_contains(matches, other)) {
+            uint32_t otherOrder = storage->indexToGroupOrder[*productIndexOf(storage, other)];
+            if (otherOrder > groupOrder || (otherOrder == groupOrder &&
+                                            sortPosition(sortingIndex, other) < sortPosition(sortingIndex, productId)))
+                return false;
+        }
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    return true;
+}
+
+/*
+ * Result starts with min price, max price as floats, match count and group count. With toBit > fromBit only
+ * the products at [fromBit, toBit) of the result order follow, group representatives only when grouped.
+ * Otherwise every match follows, with -1 in place of products hidden by their group.
+ */
+static jlong lookupProducts(JNIEnv *env, jroaring_t *storage, result_sink_t *sink, jstring expressionString,
+                            jboolean isGrouped, query_filter_t *filters, uint32_t filterCount,
+                            const sorting_index_t *sortingIndex, jboolean isAscending, jint fromBit, jint toBit) {
+    roaring_bitmap_t *matches = getMatches(env, storage, expressionString, filters, filterCount);
+    uint64_t stageStart = query_stats_start();
+
+    uint32_t matchesCardinality = roaring_bitmap_get_cardinality(matches);
+    query_trace_t *trace = query_stats_trace();
+    if (trace)
+        trace->matchCount += matchesCardinality;
+    bool isPage = fromBit >= 0 && toBit > fromBit;
+    uint32_t windowLength = isPage ? min((uint32_t) (toBit - fromBit), matchesCardinality) : matchesCardinality;
+    uint32_t *result = acquireResult(sink, sizeof(jfloat) * 2 + sizeof(jint) * 2 + sizeof(jint) * windowLength);
+    if (!result) {
+        roaring_bitmap_free(matches);
+        return -1;
+    }
+    uint32_t resultCount = 0;
+    uint32_t groupCount = matchesCardinality;
+
+    match_cursor_t cursor;
+    uint32_t productId;
+    if (isPage) {
+        openMatchCursor(&cursor, storage, matches, matchesCardinality, sortingIndex, isAscending,
+                        isGrouped ? 0 : fromBit, toBit);
+        for (uint32_t skipped = 0; resultCount < windowLength && nextMatch(&cursor, &productId);) {
+            if (isGrouped && (!isGroupRepresentative(storage, matches, sortingIndex, productId) || skipped++ < fromBit))
+                continue;
+            result[4 + resultCount++] = productId;
+        }
+        stageStart = query_stats_record(STAT(STAGE_SORT), stageStart);
+        if (isGrouped) {
+            groupCount = countDistinctGroups(storage, matches, matchesCardinality, getCountScratch());
+            stageStart = query_stats_record(STAT(STAGE_GROUP), stageStart);
+        }
+    } else {
+        // representatives are picked in ascending sort order, so the earliest one wins a tie
+        openMatchCursor(&cursor, storage, matches, matchesCardinality, sortingIndex, true, 0, matchesCardinality);
+        uint32_t *groupRepresentatives = 0;
+        if (isGrouped) {
+            groupRepresentatives = malloc(sizeof(uint32_t) * (storage->maxGroup + 1));
+            memset(groupRepresentatives, 0xff, sizeof(uint32_t) * (storage->maxGroup + 1));
+        }
+        while (nextMatch(&cursor, &productId)) {
+            uint32_t resultIndex = isAscending ? resultCount : matchesCardinality - resultCount - 1;
+            result[4 + resultIndex] = productId;
+            resultCount++;
+            if (isGrouped) {
+                uint32_t productIndex = *productIndexOf(storage, productId);
+                uint32_t *representative = &groupRepresentatives[storage->indexToGroup[productIndex]];
+                if (*representative == -1 ||
+                    storage->indexToGroupOrder[productIndex] > storage->indexToGroupOrder[*representative])
+                    *representative = productIndex;
+            }
+        }
+        stageStart = query_stats_record(STAT(STAGE_SORT), stageStart);
+        if (isGrouped) {
+            for (uint32_t i = 0; i < resultCount; i++) {
+                uint32_t index = *productIndexOf(storage, result[4 + i]);
+                if (index != groupRepresentatives[storage->indexToGroup[index]]) {
+                    result[4 + i] = -1;
+                    groupCount--;
+                }
+            }
+            free(groupRepresentatives);
+            stageStart = query_stats_record(STAT(STAGE_GROUP), stageStart);
+        }
+    }
+    closeMatchCursor(&cursor);
+
+    float priceRange[2];
+    getPriceRange(storage, matches, matchesCardinality, &priceRange[0], &priceRange[1]);
+    memcpy(result, priceRange, sizeof(priceRange));
+    result[2] = matchesCardinality;
+    result[3] = groupCount;
+    query_stats_record(STAT(STAGE_OUTPUT), stageStart);
+
+    roaring_bitmap_free(matches);
+
+    return sizeof(jfloat) * 2 + sizeof(jint) * 2 + sizeof(jint) * resultCount;
+}
+
+// sorting by an index the storage does not have gives no result
+static jlong lookupNamedProducts(JNIEnv *env, jroaring_t *storage, result_sink_t *sink, jstring expressionString,
+                                 jboolean isGrouped, jobjectArray filterNamesArray, jfloatArray filterFromValuesArray,
+                                 jfloatArray filterToValuesArray, jstring sortingIdString, jboolean isAscending,
+                                 jint fromBit, jint toBit) {
+    sorting_index_t *sortingIndex = NULL;
+    if (sortingIdString) {
+        jsize sortingIdLength = (*env)->GetStringUTFLength(env, sortingIdString);
+        const char *sortingId = (*env)->GetStringUTFChars(env, sortingIdString, NULL);
+        sortingIndex = hash_map_get(storage->sortingIndexes, sortingIdLength, sortingId);
+        (*env)->ReleaseStringUTFChars(env, sortingIdString, sortingId);
+        if (!sortingIndex)
+            return -1;
+    }
+    uint32_t filterCount;
+    query_filter_t *filters = readNamedFilters(env, filterNamesArray, filterFromValuesArray, filterToValuesArray,
+                                               &filterCount);
+    jlong length = lookupProducts(env, storage, sink, expressionString, isGrouped, filters, filterCount,
+                                  sortingIndex, isAscending, fromBit, toBit);
+    releaseFilters(env, filters, filterCount);
+    return length;
+}
+
+// negative sorting handle is the product id order
+static jlong lookupHandleProducts(JNIEnv *env, jroaring_t *storage, result_sink_t *sink, jstring expressionString,
+                                  jboolean isGrouped, jintArray filterHandlesArray, jfloatArray filterFromValuesArray,
+                                  jfloatArray filterToValuesArray, jint sortingHandle, jboolean isAscending,
+                                  jint fromBit, jint toBit) {
+    sorting_index_t *sortingIndex = NULL;
+    if (sortingHandle >= 0) {
+        if (sortingHandle >= storage->nameSlotCount || !storage->nameSlots[sortingHandle].sortingIndex)
+            return -1;
+        sortingIndex = storage->nameSlots[sortingHandle].sortingIndex;
+    }
+    uint32_t filterCount;
+    query_filter_t *filters = readHandleFilters(env, storage, filterHandlesArray, filterFromValuesArray,
+                                                filterToValuesArray, &filterCount);
+    jlong length = lookupProducts(env, storage, sink, expressionString, isGrouped, filters, filterCount,
+                                  sortingIndex, isAscending, fromBit, toBit);
+    releaseFilters(env, filters, filterCount);
+    return length;
+}
+
+/*
+ * Expression and filters of a query on a sharded handle, read from Java once and matched by every shard.
+ * Filters given by handle are resolved against the name slots of each shard, named ones are hashed by each.
+ */
+typedef struct shard_query_s {
+    jstring expressionString;
+    const char *expression;
+    uint32_t expressionLength;
+    bool isByHandle;
+    query_filter_t *namedFilters;
+    uint32_t namedFilterCount;
+    jintArray filterHandlesArray;
+    jfloatArray filterFromValuesArray;
+    jfloatArray filterToValuesArray;
+    jint *filterHandles;
+    jfloat *filterFromValues;
+    jfloat *filterToValues;
+    uint32_t filterHandleCount;
+    // published generation of every shard, NULL for shards that have none yet
+    jroaring_t **storages;
+    uint32_t *readerSlots;
+} shard_query_t;
+
+static void readShardQuery(JNIEnv *env, shard_query_t *query, jstring expressionString, jobjectArray filterNamesArray,
+                           jintArray filterHandlesArray, jfloatArray filterFromValuesArray,
+                           jfloatArray filterToValuesArray, bool isByHandle) {
+    memset(query, 0, sizeof(shard_query_t));
+    query->expressionString = expressionString;
+    query->expressionLength = (*env)->GetStringUTFLength(env, expressionString);
+    query->expression = (*env)->GetStringUTFChars(env, expressionString, NULL);
+    query->isByHandle = isByHandle;
+    if (!isByHandle) {
+        query->namedFilters = readNamedFilters(env, filterNamesArray, filterFromValuesArray, filterToValuesArray,
+                                               &query->namedFilterCount);
+    } else if (filterHandlesArray) {
+        query->filterHandlesArray = filterHandlesArray;
+        query->filterFromValuesArray = filterFromValuesArray;
+        query->filterToValuesArray = filterToValuesArray;
+        query->filterHandleCount = (*env)->GetArrayLength(env, filterHandlesArray);
+        query->filterHandles = (*env)->GetIntArrayElements(env, filterHandlesArray, NULL);
+        query->filterFromValues = (*env)->GetFloatArrayElements(env, filterFromValuesArray, NULL);
+        query->filterToValues = (*env)->GetFloatArrayElements(env, filterToValuesArray, NULL);
+    }
+}
+
+static void releaseShardQuery(JNIEnv *env, shard_query_t *query) {
+    if (!query->isByHandle) {
+        releaseFilters(env, query->namedFilters, query->namedFilterCount);
+    } else if (query->filterHandlesArray) {
+        (*env)->ReleaseFloatArrayElements(env, query->filterToValuesArray, query->filterToValues, JNI_ABORT);
+        (*env)->ReleaseFloatArrayElements(env, query->filterFromValuesArray, query->filterFromValues, JNI_ABORT);
+        (*env)->ReleaseIntArrayElements(env, query->filterHandlesArray, query->filterHandles, JNI_ABORT);
+    }
+    (*env)->ReleaseStringUTFChars(env, query->expressionString, query->expression);
+}
+
+// read locks are taken and released by the calling thread, pool threads only read the storages meanwhile
+static bool acquireShards(jroaring_handle_t *handle, shard_query_t *query) {
+    query->storages = malloc(sizeof(jroaring_t *) * handle->shardCount);
+    query->readerSlots = malloc(sizeof(uint32_t) * handle->shardCount);
+    bool hasStorage = false;
+    for (uint32_t i = 0; i < handle->shardCount; i++) {
+        query->storages[i] = acquireStorage(handle->shards[i], &query->readerSlots[i]);
+        if (query->storages[i]) {
+            pthread_rwlock_rdlock(&query->storages[i]->lock);
+            hasStorage = true;
+        }
+    }
+    return hasStorage;
+}
+
+static void releaseShards(jroaring_handle_t *handle, shard_query_t *query) {
+    for (uint32_t i = 0; i < handle->shardCount; i++) {
+        if (query->storages[i])
+            pthread_rwlock_unlock(&query->storages[i]->lock);
+        releaseStorage(handle->shards[i], query->readerSlots[i]);
+    }
+    free(query->readerSlots);
+    free(query->storages);
+}
+
+static roaring_bitmap_t *matchShard(shard_query_t *query, jroaring_t *storage) {
+    uint32_t filterCount = query->isByHandle ? query->filterHandleCount : query->namedFilterCount;
+    query_filter_t *filters = malloc(sizeof(query_filter_t) * (filterCount + 1));
+    if (query->isByHandle) {
+        filterCount = resolveHandleFilters(storage, query->filterHandleCount, query->filterHandles,
+                                           query->filterFromValues, query->filterToValues, filters);
+    } else {
+        // every shard sorts its own copy for the cache key
+        memcpy(filters, query->namedFilters, sizeof(query_filter_t) * filterCount);
+    }
+    roaring_bitmap_t *matches = matchExpression(storage, query->expression, query->expressionLength, filters,
+                                                filterCount);
+    free(filters);
+    return matches;
+}
+
+typedef struct shard_entry_s {
+    double sortKey;
+    uint32_t productId;
+    // what goes to the result, -1 when a full result hides the product behind its group representative
+    uint32_t value;
+} shard_entry_t;
+
+// page of one shard: its first entries in result order, every match for a full result
+typedef struct shard_page_s {
+    bool hasSortingIndex;
+    bool hasPrice;
+    uint32_t matchCount;
+    uint32_t groupCount;
+    float minPrice;
+    float maxPrice;
+    shard_entry_t *entries;
+    uint32_t entryCount;
+} shard_page_t;
+
+typedef struct shard_lookup_s {
+    shard_query_t query;
+    jboolean isGrouped;
+    const char *sortingId;
+    uint32_t sortingIdLength;
+    jint sortingHandle;
+    jboolean isAscending;
+    bool isPage;
+    uint32_t pageEnd;
+    shard_page_t *pages;
+} shard_lookup_t;
+
+/*
+ * Orders products of different shards. An index built from an attribute is sorted by every shard on its own,
+ * so its products compare by value. Other indexes are set through the sharded handle with the whole order and
+ * never compacted, so their positions, and the productCount products missing from them are placed after, are
+ * the same in every shard.
+ */
+static inline double shardSortKey(const sorting_index_t *sortingIndex, const product_attribute_t *mirrorAttributes,
+                                  uint32_t productId) {
+    uint32_t position = sortPosition(sortingIndex, productId);
+    if (!mirrorAttributes)
+        return position;
+    return position < sortingIndex->productCount ? mirrorAttributes[position].value : INFINITY;
+}
+
+static void lookupShard(void *argument, uint32_t shard) {
+    shard_lookup_t *lookup = argument;
+    shard_page_t *page = &lookup->pages[shard];
+    jroaring_t *storage = lookup->query.storages[shard];
+    memset(page, 0, sizeof(shard_page_t));
+    page->hasSortingIndex = true;
+    if (!storage)
+        return;
+
+    sorting_index_t *sortingIndex = 0;
+    attribute_t *attribute = 0;
+    if (lookup->sortingId) {
+        sortingIndex = hash_map_get(storage->sortingIndexes, lookup->sortingIdLength, lookup->sortingId);
+        attribute = hash_map_get(storage->productAttributes, lookup->sortingIdLength, lookup->sortingId);
+    } else if (lookup->sortingHandle >= 0 && lookup->sortingHandle < storage->nameSlotCount) {
+        sortingIndex = storage->nameSlots[lookup->sortingHandle].sortingIndex;
+        attribute = storage->nameSlots[lookup->sortingHandle].attribute;
+    }
+    if (!sortingIndex && (lookup->sortingId || lookup->sortingHandle >= 0)) {
+        page->hasSortingIndex = false;
+        return;
+    }
+    const product_attribute_t *mirrorAttributes =
+            asMirrorSortingIndex(sortingIndex, attribute) ? attribute->entries : 0;
+
+    roaring_bitmap_t *matches = matchShard(&lookup->query, storage);
+    uint32_t matchCount = roaring_bitmap_get_cardinality(matches);
+    page->matchCount = matchCount;
+    page->groupCount = lookup->isGrouped && matchCount > 0 ?
+                       countDistinctGroups(storage, matches, matchCount, getCountScratch()) : matchCount;
+    page->hasPrice = getPriceRange(storage, matches, matchCount, &page->minPrice, &page->maxPrice);
+
+    uint32_t entryLimit = lookup->isPage ? min(lookup->pageEnd, page->groupCount) : matchCount;
+    page->entries = malloc(sizeof(shard_entry_t) * (entryLimit + 1));
+    match_cursor_t cursor;
+    openMatchCursor(&cursor, storage, matches, matchCount, sortingIndex, lookup->isAscending, 0, entryLimit);
+    uint32_t productId;
+    while (page->entryCount < entryLimit && nextMatch(&cursor, &productId)) {
+        bool isShown = !lookup->isGrouped || isGroupRepresentative(storage, matches, sortingIndex, productId);
+        if (!isShown && lookup->isPage)
+            continue;
+        shard_entry_t *entry = &page->entries[page->entryCount++];
+        entry->sortKey = shardSortKey(sortingIndex, mirrorAttributes, productId);
+        entry->productId = productId;
+        entry->value = isShown ? productId : -1;
+    }
+    closeMatchCursor(&cursor);
+    roaring_bitmap_free(matches);
+}
+
+static inline bool isShardEntryFirst(const shard_entry_t *entry, const shard_entry_t *other, jboolean isAscending) {
+    if (entry->sortKey != other->sortKey)
+        return (entry->sortKey < other->sortKey) == (isAscending != 0);
+    return (entry->productId < other->productId) == (isAscending != 0);
+}
+
+// same layout as lookupProducts, counts are summed and the pages of the shards merged in result order
+static jlong mergeShardPages(shard_lookup_t *lookup, uint32_t shardCount, result_sink_t *sink, jint fromBit) {
+    uint32_t matchCount = 0;
+    uint32_t groupCount = 0;
+    uint32_t entryCount = 0;
+    float priceRange[2] = {0, 0};
+    bool hasPrice = false;
+    for (uint32_t i = 0; i < shardCount; i++) {
+        shard_page_t *page = &lookup->pages[i];
+        if (!page->hasSortingIndex)
+            return -1;
+        matchCount += page->matchCount;
+        groupCount += page->groupCount;
+        entryCount += page->entryCount;
+        if (page->hasPrice) {
+            priceRange[0] = hasPrice ? min(priceRange[0], page->minPrice) : page->minPrice;
+            priceRange[1] = hasPrice ? max(priceRange[1], page->maxPrice) : page->maxPrice;
+            hasPrice = true;
+        }
+    }
+    query_trace_t *trace = query_stats_trace();
+    if (trace)
+        trace->matchCount += matchCount;
+    uint32_t skipCount = lookup->isPage ? min((uint32_t) fromBit, entryCount) : 0;
+    uint32_t resultCount = lookup->isPage ? min(lookup->pageEnd - fromBit, entryCount - skipCount) : entryCount;
+    uint32_t *result = acquireResult(sink, sizeof(jfloat) * 2 + sizeof(jint) * 2 + sizeof(jint) * resultCount);
+    if (!result)
+        return -1;
+
+    uint32_t *heads = calloc(shardCount, sizeof(uint32_t));
+    for (uint32_t i = 0; i < skipCount + resultCount; i++) {
+        uint32_t first = shardCount;
+        for (uint32_t shard = 0; shard < shardCount; shard++) {
+            shard_page_t *page = &lookup->pages[shard];
+            if (heads[shard] < page->entryCount &&
+                (first == shardCount || isShardEntryFirst(&page->entries[heads[shard]],
+                                                          &lookup->pages[first].entries[heads[first]],
+                                                          lookup->isAscending)))
+                first = shard;
+        }
+        const shard_entry_t *entry = &lookup->pages[first].entries[heads[first]++];
+        if (i >= skipCount)
+            result[4 + i - skipCount] = entry->value;
+    }
+    free(heads);
+
+    memcpy(result, priceRange, sizeof(priceRange));
+    result[2] = matchCount;
+    result[3] = groupCount;
+    return sizeof(jfloat) * 2 + sizeof(jint) * 2 + sizeof(jint) * resultCount;
+}
+
+// a page needs only the first pageEnd entries of every shard, so each shard does about as much as an unsharded page
+static jlong lookupShards(jroaring_handle_t *handle, result_sink_t *sink, shard_lookup_t *lookup, jint fromBit,
+                          jint toBit) {
+    lookup->isPage = fromBit >= 0 && toBit > fromBit;
+    lookup->pageEnd = lookup->isPage ? toBit : 0;
+    lookup->pages = malloc(sizeof(shard_page_t) * handle->shardCount);
+    uint32_t readerSlot;
+    acquireStorage(handle, &readerSlot);
+    jlong length = -1;
+    if (acquireShards(handle, &lookup->query)) {
+        thread_pool_run(atomic_load(&handle->queryPool), handle->shardCount, lookupShard, lookup);
+        uint64_t stageStart = query_stats_start();
+        length = mergeShardPages(lookup, handle->shardCount, sink, fromBit);
+        query_stats_record(STAT(STAGE_MERGE), stageStart);
+        for (uint32_t i = 0; i < handle->shardCount; i++) {
+            free(lookup->pages[i].entries);
+        }
+    }
+    releaseShards(handle, &lookup->query);
+    releaseStorage(handle, readerSlot);
+    free(lookup->pages);
+    return length;
+}
+
+static jlong lookupNamedShards(JNIEnv *env, jroaring_handle_t *handle, result_sink_t *sink, jstring expressionString,
+                               jboolean isGrouped, jobjectArray filterNamesArray, jfloatArray filterFromValuesArray,
+                               jfloatArray filterToValuesArray, jstring sortingIdString, jboolean isAscending,
+                               jint fromBit, jint toBit) {
+    shard_lookup_t lookup = {.isGrouped = isGrouped, .sortingHandle = -1, .isAscending = isAscending};
+    readShardQuery(env, &lookup.query, expressionString, filterNamesArray, 0, filterFromValuesArray,
+                   filterToValuesArray, false);
+    if (sortingIdString) {
+        lookup.sortingIdLength = (*env)->GetStringUTFLength(env, sortingIdString);
+        lookup.sortingId = (*env)->GetStringUTFChars(env, sortingIdString, NULL);
+    }
+    jlong length = lookupShards(handle, sink, &lookup, fromBit, toBit);
+    if (sortingIdString)
+        (*env)->ReleaseStringUTFChars(env, sortingIdString, lookup.sortingId);
+    releaseShardQuery(env, &lookup.query);
+    return length;
+}
+
+static jlong lookupHandleShards(JNIEnv *env, jroaring_handle_t *handle, result_sink_t *sink, jstring expressionString,
+                                jboolean isGrouped, jintArray filterHandlesArray, jfloatArray filterFromValuesArray,
+                                jfloatArray filterToValuesArray, jint sortingHandle, jboolean isAscending,
+                                jint fromBit, jint toBit) {
+    shard_lookup_t lookup = {.isGrouped = isGrouped, .sortingHandle = sortingHandle, .isAscending = isAscending};
+    readShardQuery(env, &lookup.query, expressionString, 0, filterHandlesArray, filterFromValuesArray,
+                   filterToValuesArray, true);
+    jlong length = lookupShards(handle, sink, &lookup, fromBit, toBit);
+    releaseShardQuery(env, &lookup.query);
+    return length;
+}
+
+JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProducts
+        (JNIEnv *env, jclass class, jlong pointer, jstring expressionString, jboolean isGrouped,
+         jobjectArray filterNamesArray, jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray,
+         jstring sortingIdString, jboolean isAscending, jint fromBit, jint toBit) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initBufferSink(&sink, STAT(LOOKUP_PRODUCTS));
+    query_trace_t trace;
+    bool isTraced = beginQueryTrace(handle, &trace);
+    jlong length = -1;
+    if (handle->shardCount > 0) {
+        length = lookupNamedShards(env, handle, &sink, expressionString, isGrouped, filterNamesArray,
+                                   filterFromValuesArray, filterToValuesArray, sortingIdString, isAscending, fromBit,
+                                   toBit);
+    } else {
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handle, &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            length = lookupNamedProducts(env, storage, &sink, expressionString, isGrouped, filterNamesArray,
+                                         filterFromValuesArray, filterToValuesArray, sortingIdString, isAscending,
+                                         fromBit, toBit);
+            pthread_rwlock_unlock(&storage->lock);
+        }
+        releaseStorage(handle, readerSlot);
+    }
+    if (isTraced)
+        logSlowQuery(env, handle, &trace, STAT(LOOKUP_PRODUCTS), length, expressionString, filterNamesArray, 0,
+                     filterFromValuesArray, filterToValuesArray, sortingIdString, -1);
+
+    return finishBufferResult(env, &sink, length);
+}
+
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProductsInto
+        (JNIEnv *env, jclass class, jlong pointer, jstring expressionString, jboolean isGrouped,
+         jobjectArray filterNamesArray, jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray,
+         jstring sortingIdString, jboolean isAscending, jint fromBit, jint toBit, jobject resultBuffer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initCallerSink(env, &sink, resultBuffer, STAT(LOOKUP_PRODUCTS_INTO));
+    query_trace_t trace;
+    bool isTraced = beginQueryTrace(handle, &trace);
+    jlong length = -1;
+    if (handle->shardCount > 0) {
+        length = lookupNamedShards(env, handle, &sink, expressionString, isGrouped, filterNamesArray,
+                                   filterFromValuesArray, filterToValuesArray, sortingIdString, isAscending, fromBit,
+                                   toBit);
+    } else {
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handle, &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            length = lookupNamedProducts(env, storage, &sink, expressionString, isGrouped, filterNamesArray,
+                                         filterFromValuesArray, filterToValuesArray, sortingIdString, isAscending,
+                                         fromBit, toBit);
+            pthread_rwlock_unlock(&storage->lock);
+        }
+        releaseStorage(handle, readerSlot);
+    }
+    if (isTraced)
+        logSlowQuery(env, handle, &trace, STAT(LOOKUP_PRODUCTS_INTO), length, expressionString, filterNamesArray, 0,
+                     filterFromValuesArray, filterToValuesArray, sortingIdString, -1);
+
+    return finishCallerResult(&sink, length);
+}
+
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProductsByHandles
+        (JNIEnv *env, jclass class, jlong pointer, jstring expressionString, jboolean isGrouped,
+         jintArray filterHandlesArray, jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray,
+         jint sortingHandle, jboolean isAscending, jint fromBit, jint toBit, jobject resultBuffer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initCallerSink(env, &sink, resultBuffer, STAT(LOOKUP_PRODUCTS_BY_HANDLES));
+    query_trace_t trace;
+    bool isTraced = beginQueryTrace(handle, &trace);
+    jlong length = -1;
+    if (handle->shardCount > 0) {
+        length = lookupHandleShards(env, handle, &sink, expressionString, isGrouped, filterHandlesArray,
+                                    filterFromValuesArray, filterToValuesArray, sortingHandle, isAscending, fromBit,
+                                    toBit);
+    } else {
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handle, &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            length = lookupHandleProducts(env, storage, &sink, expressionString, isGrouped, filterHandlesArray,
+                                          filterFromValuesArray, filterToValuesArray, sortingHandle, isAscending,
+                                          fromBit, toBit);
+            pthread_rwlock_unlock(&storage->lock);
+        }
+        releaseStorage(handle, readerSlot);
+    }
+    if (isTraced)
+        logSlowQuery(env, handle, &trace, STAT(LOOKUP_PRODUCTS_BY_HANDLES), length, expressionString, 0,
+                     filterHandlesArray, filterFromValuesArray, filterToValuesArray, 0, sortingHandle);
+
+    return finishCallerResult(&sink, length);
+}
+
+// products having all of the ext features, NULL when there are none
+static roaring_bitmap_t *matchExtFeatures(jroaring_t *storage, uint32_t extFeaturesCount, const jint *extFeatures) {
+    roaring_bitmap_t *matches = 0;
+    for (uint32_t i = 0; i < extFeaturesCount; i++) {
+        roaring_bitmap_t *bm = extFeatures[i] >= 0 && extFeatures[i] < storage->featureCount ?
+                               storage->featureProductsExt[extFeatures[i]] : 0;
+        if (!bm) {
+            if (matches)
+                roaring_bitmap_free(matches);
+            return 0;
+        }
+        if (matches)
+            roaring_bitmap_and_inplace(matches, bm);
+        else
+            matches = roaring_bitmap_copy(bm);
+    }
+    return matches;
+}
 
-    return 1;
+static inline uint32_t similarCapacity(jroaring_t *storage, jint maxProducts) {
+    return max(min(maxProducts, (jint) storage->productCount - 1), 0);
 }
 
-JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProducts
-        (JNIEnv *env, jclass class, jlong pointer, jstring expressionString, jboolean isGrouped,
-         jobjectArray filterNamesArray, jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray,
-         jstring sortingIdString, jboolean isAscending, jint fromBit, jint toBit) {
+/*
+ * The heap is kept in the result block itself, ids are then written over the entries they come from.
+ */
+static jlong getSimilarProducts(JNIEnv *env, jroaring_t *storage, result_sink_t *sink, jint productId, jint maxProducts,
+                                jintArray extFeaturesArray) {
+    uint32_t productIndex;
+    if (productId < 0 || !findProductIndex(storage, productId, &productIndex))
+        return -1;
+    similar_top_t top;
+    top.count = 0;
+    top.capacity = similarCapacity(storage, maxProducts);
+
+    if (extFeaturesArray) {
+        jsize extFeaturesCount = (*env)->GetArrayLength(env, extFeaturesArray);
+        jint *extFeatures = extFeaturesCount > 0 ? (*env)->GetIntArrayElements(env, extFeaturesArray, NULL) : 0;
+        roaring_bitmap_t *matches = matchExtFeatures(storage, extFeaturesCount, extFeatures);
+        if (extFeatures)
+            (*env)->ReleaseIntArrayElements(env, extFeaturesArray, extFeatures, JNI_ABORT);
+        if (!matches)
+            return -1;
+        top.products = acquireResult(sink, sizeof(similar_product_t) * (top.capacity + 1));
+        if (top.products)
+            rankCandidates(storage, productIndex, matches, &top);
+        roaring_bitmap_free(matches);
+    } else {
+        top.products = acquireResult(sink, sizeof(similar_product_t) * (top.capacity + 1));
+        if (top.products)
+            collectSimilarProducts(storage, productIndex, &top);
+    }
+    if (!top.products)
+        return -1;
 
-    jroaring_t *storage = (jroaring_t *) pointer;
+    qsort(top.products, top.count, sizeof(similar_product_t), compareSimilar);
+    uint32_t *result = (uint32_t *) top.products;
+    for (uint32_t i = 0; i < top.count; i++) {
+        result[i] = top.products[i].productId;
+    }
+    return sizeof(uint32_t) * top.count;
+}
 
-    roaring_bitmap_t *matches = roaring_bitmap_create();
-    getMatches(env, storage, expressionString, matches);
-    applyFilters(env, storage, matches, filterNamesArray, filterFromValuesArray, filterToValuesArray);
+#define SIMILAR_BATCH_CHUNK_PRODUCTS 16
 
-    uint32_t matchesCardinality = roaring_bitmap_get_cardinality(matches);
-    uint32_t resultLength = sizeof(jfloat) * 2 + sizeof(jint) * 2 + sizeof(jint) * matchesCardinality;
-    uint32_t *result = malloc(resultLength);
-    sorting_index_t *sortingIndex = NULL;
+/*
+ * Top lists of many products at once. Every product owns maxProducts slots of ids while the tasks run,
+ * the lists are packed behind their offsets once all of them are known.
+ */
+typedef struct similar_batch_s {
+    jroaring_t *storage;
+    uint32_t productCount;
+    const jint *productIds;
+    const jint *extFeatureOffsets;
+    const jint *extFeatures;
+    uint32_t capacity;
+    uint32_t *offsets;
+    uint32_t *ids;
+} similar_batch_t;
 
-    if (sortingIdString) {
-        jsize sortingIdLength = (*env)->GetStringUTFLength(env, sortingIdString);
-        const char *sortingId = (*env)->GetStringUTFChars(env, sortingIdString, NULL);
-        sortingIndex = hash_map_get(storage->sortingIndexes, sortingIdLength, sortingId);
-        (*env)->ReleaseStringUTFChars(env, sortingIdString, sortingId);
-        if (!sortingIndex) {
-            roaring_bitmap_free(matches);
-            free(result);
+static void similarBatchChunk(void *argument, uint32_t chunk) {
+    similar_batch_t *batch = argument;
+    jroaring_t *storage = batch->storage;
+    similar_top_t top;
+    top.capacity = batch->capacity;
+    top.products = malloc(sizeof(similar_product_t) * (top.capacity + 1));
+    uint32_t end = min(chunk * SIMILAR_BATCH_CHUNK_PRODUCTS + SIMILAR_BATCH_CHUNK_PRODUCTS, batch->productCount);
+    // the read lock is held a chunk at a time, so updates get in between chunks of a long batch
+    pthread_rwlock_rdlock(&storage->lock);
+    for (uint32_t i = chunk * SIMILAR_BATCH_CHUNK_PRODUCTS; i < end; i++) {
+        uint32_t productIndex;
+        top.count = 0;
+        if (batch->productIds[i] >= 0 && findProductIndex(storage, batch->productIds[i], &productIndex)) {
+            uint32_t extFeaturesCount = batch->extFeatureOffsets ?
+                                        batch->extFeatureOffsets[i + 1] - batch->extFeatureOffsets[i] : 0;
+            if (extFeaturesCount > 0) {
+                roaring_bitmap_t *matches = matchExtFeatures(storage, extFeaturesCount,
+                                                             batch->extFeatures + batch->extFeatureOffsets[i]);
+                if (matches) {
+                    rankCandidates(storage, productIndex, matches, &top);
+                    roaring_bitmap_free(matches);
+                }
+            } else {
+                collectSimilarProducts(storage, productIndex, &top);
+            }
+        }
+        qsort(top.products, top.count, sizeof(similar_product_t), compareSimilar);
+        uint32_t *ids = batch->ids + (size_t) i * batch->capacity;
+        for (uint32_t j = 0; j < top.count; j++) {
+            ids[j] = top.products[j].productId;
+        }
+        batch->offsets[i + 1] = top.count;
+    }
+    pthread_rwlock_unlock(&storage->lock);
+    free(top.products);
+}
+
+/*
+ * Returns productCount + 1 offsets followed by the ids they point into, list i being ids[offsets[i], offsets[i + 1]).
+ * Unknown products get empty lists, so do products whose ext features match nothing. Takes the storage lock itself.
+ */
+static jobject getSimilarProductsBatch(JNIEnv *env, jroaring_t *storage, thread_pool_t *pool,
+                                       jintArray productIdsArray, jint maxProducts,
+                                       jintArray extFeatureOffsetsArray, jintArray extFeaturesArray) {
+    similar_batch_t batch;
+    batch.storage = storage;
+    batch.productCount = (*env)->GetArrayLength(env, productIdsArray);
+    pthread_rwlock_rdlock(&storage->lock);
+    batch.capacity = similarCapacity(storage, maxProducts);
+    pthread_rwlock_unlock(&storage->lock);
+    if (extFeatureOffsetsArray && extFeaturesArray) {
+        jsize extFeaturesCount = (*env)->GetArrayLength(env, extFeaturesArray);
+        if ((*env)->GetArrayLength(env, extFeatureOffsetsArray) != batch.productCount + 1)
             return 0;
+        batch.extFeatureOffsets = (*env)->GetIntArrayElements(env, extFeatureOffsetsArray, NULL);
+        batch.extFeatures = (*env)->GetIntArrayElements(env, extFeaturesArray, NULL);
+        bool isValid = true;
+        for (uint32_t i = 0; i < batch.productCount && isValid; i++) {
+            isValid = batch.extFeatureOffsets[i] >= 0 && batch.extFeatureOffsets[i] <= batch.extFeatureOffsets[i + 1] &&
+                      batch.extFeatureOffsets[i + 1] <= extFeaturesCount;
         }
-        roaring_bitmap_t *sortedMatches = roaring_bitmap_create();
-        roaring_uint32_iterator_t *iterator = roaring_create_iterator(matches);
-        while (iterator->has_value) {
-            uint32_t index = sortingIndex->indices[iterator->current_value];
-            index = index != -1 ? index : (storage->productCount + iterator->current_value);
-            roaring_bitmap_add(sortedMatches, index);
-            roaring_advance_uint32_iterator(iterator);
+        if (!isValid) {
+            (*env)->ReleaseIntArrayElements(env, extFeatureOffsetsArray, (jint *) batch.extFeatureOffsets, JNI_ABORT);
+            (*env)->ReleaseIntArrayElements(env, extFeaturesArray, (jint *) batch.extFeatures, JNI_ABORT);
+            return 0;
         }
-        roaring_free_uint32_iterator(iterator);
-        roaring_bitmap_free(matches);
-        matches = sortedMatches;
+    } else {
+        batch.extFeatureOffsets = 0;
+        batch.extFeatures = 0;
     }
-    float minPrice = 0;
-    float maxPrice = 0;
-    uint32_t *maxGroupOrderIndices = malloc(sizeof(uint32_t) * (storage->maxGroup + 1));
-    {
-        const char *priceAttributeName = "price";
-        product_attribute_t *priceAttributes = hash_map_get(storage->productAttributes, strlen(priceAttributeName),
-                                                            priceAttributeName);
-        roaring_uint32_iterator_t *iterator = roaring_create_iterator(matches);
-        uint32_t i = 0;
-        while (iterator->has_value) {
-            uint32_t resultIndex = isAscending ? i : matchesCardinality - i - 1;
-            uint32_t productId = sortingIdString ? iterator->current_value >= storage->productCount ?
-                                                   iterator->current_value - storage->productCount :
-                                                   sortingIndex->products[iterator->current_value] :
-                                 iterator->current_value;
-            result[4 + resultIndex] = productId;
+    batch.productIds = (*env)->GetIntArrayElements(env, productIdsArray, NULL);
 
-            float price = priceAttributes[storage->productToIndex[productId]].value;
-            if (price > maxPrice)
-                maxPrice = price;
-            if (price < minPrice)
-                minPrice = price;
+    size_t slotCount = (size_t) batch.productCount * batch.capacity;
+    batch.offsets = result_pool_acquire(sizeof(uint32_t) * (batch.productCount + 1 + slotCount));
+    size_t length = 0;
+    if (batch.offsets) {
+        batch.ids = batch.offsets + batch.productCount + 1;
+        batch.offsets[0] = 0;
+        thread_pool_run(pool, (batch.productCount + SIMILAR_BATCH_CHUNK_PRODUCTS - 1) / SIMILAR_BATCH_CHUNK_PRODUCTS,
+                        similarBatchChunk, &batch);
 
-            if (isGrouped) {
-                uint32_t productIndex = storage->productToIndex[productId];
-                uint32_t groupId = storage->indexToGroup[productIndex];
-                uint32_t groupOrder = storage->indexToGroupOrder[productIndex];
-                if (groupOrder > storage->indexToGroupOrder[maxGroupOrderIndices[groupId]])
-                    maxGroupOrderIndices[groupId] = productIndex;
-            }
-            roaring_advance_uint32_iterator(iterator);
+        for (uint32_t i = 0; i < batch.productCount; i++) {
+            uint32_t count = batch.offsets[i + 1];
+            memmove(batch.ids + batch.offsets[i], batch.ids + (size_t) i * batch.capacity, sizeof(uint32_t) * count);
+            batch.offsets[i + 1] = batch.offsets[i] + count;
         }
-        roaring_free_uint32_iterator(iterator);
+        length = sizeof(uint32_t) * (batch.productCount + 1 + batch.offsets[batch.productCount]);
     }
 
-    uint32_t groupCount = matchesCardinality;
-    if (isGrouped) {
-        for (uint32_t i = 0; i < matchesCardinality; i++) {
-            uint32_t index = storage->productToIndex[result[4 + i]];
-            if (index != maxGroupOrderIndices[storage->indexToGroup[index]]) {
-                result[4 + i] = -1;
-                groupCount--;
-            }
+    (*env)->ReleaseIntArrayElements(env, productIdsArray, (jint *) batch.productIds, JNI_ABORT);
+    if (batch.extFeatureOffsets) {
+        (*env)->ReleaseIntArrayElements(env, extFeatureOffsetsArray, (jint *) batch.extFeatureOffsets, JNI_ABORT);
+        (*env)->ReleaseIntArrayElements(env, extFeaturesArray, (jint *) batch.extFeatures, JNI_ABORT);
+    }
+    return batch.offsets ? (*env)->NewDirectByteBuffer(env, batch.offsets, length) : 0;
+}
+
+/*
+ * Share of the exhaustive top results the index finds, counting a result as found when the index returns
+ * a product at least as similar, so ties at the cut do not count as misses.
+ */
+static void measureSimilarRecall(jroaring_t *storage, uint32_t sampleCount, const jint *sample, uint32_t maxProducts,
+                                 float *recall, float *candidateShare) {
+    similar_top_t exact;
+    similar_top_t approximate;
+    exact.capacity = approximate.capacity = storage->productCount > 0 ? min(maxProducts, storage->productCount - 1) : 0;
+    exact.products = malloc(sizeof(similar_product_t) * (exact.capacity + 1));
+    approximate.products = malloc(sizeof(similar_product_t) * (approximate.capacity + 1));
+    uint64_t expected = 0;
+    uint64_t found = 0;
+    uint64_t candidates = 0;
+    uint64_t catalog = 0;
+    for (uint32_t i = 0; i < sampleCount && exact.capacity > 0; i++) {
+        uint32_t index;
+        if (sample[i] < 0 || !findProductIndex(storage, sample[i], &index))
+            continue;
+        exact.count = approximate.count = 0;
+        catalog += rankSimilarProducts(storage, index, false, &exact);
+        candidates += rankSimilarProducts(storage, index, true, &approximate);
+        qsort(exact.products, exact.count, sizeof(similar_product_t), compareSimilar);
+        qsort(approximate.products, approximate.count, sizeof(similar_product_t), compareSimilar);
+        uint32_t threshold = exact.products[exact.count - 1].hitPercent;
+        uint32_t hits = 0;
+        while (hits < approximate.count && approximate.products[hits].hitPercent >= threshold) {
+            hits++;
         }
+        expected += exact.count;
+        found += hits;
     }
+    free(exact.products);
+    free(approximate.products);
+    *recall = expected > 0 ? (float) found / expected : NAN;
+    *candidateShare = catalog > 0 ? (float) candidates / catalog : NAN;
+}
 
-    result[0] = minPrice;
-    result[1] = maxPrice;
-    result[2] = matchesCardinality;
-    result[3] = groupCount;
+JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProducts
+        (JNIEnv *env, jclass class, jlong pointer, jint productId, jint maxProducts, jintArray extFeaturesArray) {
 
-    free(maxGroupOrderIndices);
-    roaring_bitmap_free(matches);
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initBufferSink(&sink, STAT(GET_SIMILAR_PRODUCTS));
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    jlong length = -1;
+    if (storage) {
+        pthread_rwlock_rdlock(&storage->lock);
+        length = getSimilarProducts(env, storage, &sink, productId, maxProducts, extFeaturesArray);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
 
-    return (*env)->NewDirectByteBuffer(env, result, resultLength);
+    return finishBufferResult(env, &sink, length);
 }
 
-JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProducts
-        (JNIEnv *env, jclass class, jlong pointer, jint productId, jint maxProducts, jintArray extFeaturesArray) {
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProductsInto
+        (JNIEnv *env, jclass class, jlong pointer, jint productId, jint maxProducts, jintArray extFeaturesArray,
+         jobject resultBuffer) {
 
-    jroaring_t *storage = (jroaring_t *) pointer;
-    uint32_t productIndex = storage->productToIndex[productId];
-    maxProducts = min(maxProducts, storage->productCount - 1);
-    similar_product_t *similarProducts = malloc(sizeof(similar_product_t) * storage->productCount);
-    memset(similarProducts, 0, sizeof(similar_product_t) * storage->productCount);
-    uint32_t similarProductCount = 0;
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initCallerSink(env, &sink, resultBuffer, STAT(GET_SIMILAR_PRODUCTS_INTO));
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    jlong length = -1;
+    if (storage) {
+        pthread_rwlock_rdlock(&storage->lock);
+        length = getSimilarProducts(env, storage, &sink, productId, maxProducts, extFeaturesArray);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
 
-    if (extFeaturesArray) {
-        jsize extFeaturesCount = (*env)->GetArrayLength(env, extFeaturesArray);
-        if (extFeaturesCount < 1)
-            return 0;
-        jint *extFeatures = (*env)->GetIntArrayElements(env, extFeaturesArray, NULL);
-        if(!storage->featureProductsExt[extFeatures[0]])
-            return 0;
-        roaring_bitmap_t *matches = roaring_bitmap_copy(storage->featureProductsExt[extFeatures[0]]);
-        for (uint32_t i = 0; i < extFeaturesCount; i++) {
-            roaring_bitmap_t *bm = storage->featureProductsExt[extFeatures[i]];
-            if(bm) {
-                roaring_bitmap_and_inplace(matches, bm);
-            } else {
-                roaring_bitmap_free(matches);
-                return 0;
-            }
-        }
-        (*env)->ReleaseIntArrayElements(env, extFeaturesArray, extFeatures, JNI_ABORT);
-        roaring_uint32_iterator_t *iterator = roaring_create_iterator(matches);
-        uint32_t i = 0;
-        while (iterator->has_value) {
-            if(iterator->current_value != productId) {
-                similarProducts[i].productId = iterator->current_value;
-                similarProducts[i].hitPercent = round(roaring_bitmap_jaccard_index(
-                        storage->productFeatures[productIndex],
-                        storage->productFeatures[storage->productToIndex[iterator->current_value]]) * 100);
-                i++;
-            }
-            roaring_advance_uint32_iterator(iterator);
-        }
-        similarProductCount = i;
-        roaring_free_uint32_iterator(iterator);
+    return finishCallerResult(&sink, length);
+}
+
+JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProductsBatch
+        (JNIEnv *env, jclass class, jlong pointer, jintArray productIdsArray, jint maxProducts,
+         jintArray extFeatureOffsetsArray, jintArray extFeaturesArray) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    uint64_t start = query_stats_start();
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    jobject result = 0;
+    if (storage) {
+        result = getSimilarProductsBatch(env, storage, atomic_load(&handle->queryPool), productIdsArray, maxProducts,
+                                         extFeatureOffsetsArray, extFeaturesArray);
+    }
+    releaseStorage(handle, readerSlot);
+
+    query_stats_record(STAT(GET_SIMILAR_PRODUCTS_BATCH), start);
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_measureSimilarRecall
+        (JNIEnv *env, jclass class, jlong pointer, jintArray productIdsArray, jint maxProducts) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    float measures[2] = {NAN, NAN};
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    if (storage && maxProducts > 0) {
+        jsize sampleCount = (*env)->GetArrayLength(env, productIdsArray);
+        jint *sample = (*env)->GetIntArrayElements(env, productIdsArray, NULL);
+        pthread_rwlock_rdlock(&storage->lock);
+        measureSimilarRecall(storage, sampleCount, sample, maxProducts, &measures[0], &measures[1]);
+        pthread_rwlock_unlock(&storage->lock);
+        (*env)->ReleaseIntArrayElements(env, productIdsArray, sample, JNI_ABORT);
+    }
+    releaseStorage(handle, readerSlot);
+
+    jfloatArray result = (*env)->NewFloatArray(env, 2);
+    (*env)->SetFloatArrayRegion(env, result, 0, 2, measures);
+    return result;
+}
+
+typedef struct count_job_s {
+    jroaring_t *storage;
+    roaring_bitmap_t *matches;
+    const jint *features;
+    uint32_t featureCount;
+    jboolean isGrouped;
+    uint32_t *infos;
+} count_job_t;
+
+/*
+ * Features are handed out to the pool in small chunks: their bitmaps differ in size by orders of magnitude,
+ * so threads that got cheap chunks keep claiming more while others are still busy.
+ */
+#define COUNT_CHUNK_FEATURES 64
+
+static inline bool isCountedFeature(jroaring_t *storage, uint32_t feature) {
+    return feature < storage->featureCount && storage->featureProducts[feature];
+}
+
+static inline uint32_t getJobFeature(count_job_t *job, uint32_t position) {
+    return job->features ? (uint32_t) job->features[position] : position;
+}
+
+// records are written at the position of their feature in the request and compacted once all chunks are done
+static void countFeatureChunk(void *argument, uint32_t chunk) {
+    count_job_t *job = argument;
+    count_scratch_t *scratch = job->isGrouped ? getCountScratch() : 0;
+    uint32_t end = min((chunk + 1) * COUNT_CHUNK_FEATURES, job->featureCount);
+    for (uint32_t i = chunk * COUNT_CHUNK_FEATURES; i < end; i++) {
+        uint32_t feature = getJobFeature(job, i);
+        if (isCountedFeature(job->storage, feature))
+            countFeature(job->storage, job->matches, feature, job->isGrouped, scratch, job->infos + i * 4);
+    }
+}
+
+static void countAllFeatureChunk(void *argument, uint32_t chunk) {
+    count_job_t *job = argument;
+    jroaring_t *storage = job->storage;
+    uint32_t end = min((chunk + 1) * COUNT_CHUNK_FEATURES, job->featureCount);
+    for (uint32_t i = chunk * COUNT_CHUNK_FEATURES; i < end; i++) {
+        uint32_t *info = job->infos + i * 4;
+        info[0] = i;
+        info[1] = storage->featureProducts[i] ? roaring_bitmap_get_cardinality(storage->featureProducts[i]) : 0;
+        info[2] = job->isGrouped && storage->featureGroups[i] ?
+                  roaring_bitmap_get_cardinality(storage->featureGroups[i]) : 0;
+        info[3] = false;
+    }
+}
+
+static void runCountJob(thread_pool_t *pool, count_job_t *job, thread_pool_task_t task) {
+    uint32_t chunkCount = (job->featureCount + COUNT_CHUNK_FEATURES - 1) / COUNT_CHUNK_FEATURES;
+    bool isParallel = job->featureCount >= job->storage->options->queryParallelMinFeatures;
+    thread_pool_run(isParallel ? pool : 0, chunkCount, task, job);
+}
+
+static jlong countProducts(JNIEnv *env, jroaring_t *storage, thread_pool_t *pool, result_sink_t *sink,
+                           jstring expressionString, jintArray includedFeaturesArray, jint tailItem,
+                           jboolean isGrouped, query_filter_t *filters, uint32_t filterCount) {
+    roaring_bitmap_t *matches = getMatches(env, storage, expressionString, filters, filterCount);
+    query_trace_t *trace = query_stats_trace();
+    if (trace)
+        trace->matchCount += roaring_bitmap_get_cardinality(matches);
+
+    count_job_t job = {storage, matches, 0, storage->featureCount, isGrouped, 0};
+    jsize includedFeatureCount = (*env)->GetArrayLength(env, includedFeaturesArray);
+    jint *includedFeatures = 0;
+    if (includedFeatureCount > 0) {
+        includedFeatures = (*env)->GetIntArrayElements(env, includedFeaturesArray, NULL);
+        job.features = includedFeatures;
+        job.featureCount = includedFeatureCount;
+    }
+    job.infos = acquireResult(sink, sizeof(uint32_t) * 4 * job.featureCount);
+    if (!job.infos) {
+        if (includedFeatures)
+            (*env)->ReleaseIntArrayElements(env, includedFeaturesArray, includedFeatures, JNI_ABORT);
         roaring_bitmap_free(matches);
+        return -1;
+    }
+    uint64_t stageStart = query_stats_start();
+    runCountJob(pool, &job, countFeatureChunk);
+    stageStart = query_stats_record(STAT(STAGE_COUNT), stageStart);
+
+    uint32_t infoCount = 0;
+    for (uint32_t i = 0; i < job.featureCount; i++) {
+        if (isCountedFeature(storage, getJobFeature(&job, i))) {
+            if (infoCount != i)
+                memcpy(job.infos + infoCount * 4, job.infos + i * 4, sizeof(uint32_t) * 4);
+            infoCount++;
+        }
+    }
+    query_stats_record(STAT(STAGE_OUTPUT), stageStart);
+    if (includedFeatures)
+        (*env)->ReleaseIntArrayElements(env, includedFeaturesArray, includedFeatures, JNI_ABORT);
+
+    roaring_bitmap_free(matches);
+
+    return 16 * infoCount;
+}
+
+static jlong countNamedProducts(JNIEnv *env, jroaring_t *storage, thread_pool_t *pool, result_sink_t *sink,
+                                jstring expressionString, jintArray includedFeaturesArray, jint tailItem,
+                                jboolean isGrouped, jobjectArray filterNamesArray, jfloatArray filterFromValuesArray,
+                                jfloatArray filterToValuesArray) {
+    uint32_t filterCount;
+    query_filter_t *filters = readNamedFilters(env, filterNamesArray, filterFromValuesArray, filterToValuesArray,
+                                               &filterCount);
+    jlong length = countProducts(env, storage, pool, sink, expressionString, includedFeaturesArray, tailItem,
+                                 isGrouped, filters, filterCount);
+    releaseFilters(env, filters, filterCount);
+    return length;
+}
+
+typedef struct shard_count_s {
+    shard_query_t query;
+    // NULL counts every feature of each shard
+    const jint *features;
+    uint32_t featureCount;
+    jboolean isGrouped;
+    bool isAll;
+    thread_pool_t *pool;
+    // uncompacted records of every shard, at the position of their feature in the request
+    uint32_t **infos;
+    // matches of all shards, summed only for a traced query
+    bool isTraced;
+    atomic_uint_fast64_t matchCount;
+} shard_count_t;
+
+// shards run on the pool and split their own features across it as well, so small shards leave threads to big ones
+static void countShard(void *argument, uint32_t shard) {
+    shard_count_t *count = argument;
+    jroaring_t *storage = count->query.storages[shard];
+    count->infos[shard] = 0;
+    if (!storage)
+        return;
+    count_job_t job = {storage, 0, count->features, count->features ? count->featureCount : storage->featureCount,
+                       count->isGrouped, 0};
+    job.infos = malloc(sizeof(uint32_t) * 4 * (job.featureCount + 1));
+    // a shard left without records fails the whole count in mergeShardCounts
+    if (!job.infos)
+        return;
+    if (count->isAll) {
+        runCountJob(count->pool, &job, countAllFeatureChunk);
     } else {
-        uint32_t i;
-        for (i = 0; i < productIndex; i++) {
-            similarProducts[i].productId = storage->indexToProduct[i];
-            similarProducts[i].hitPercent = round(roaring_bitmap_jaccard_index(
-                    storage->productFeatures[productIndex], storage->productFeatures[i]) * 100);
+        job.matches = matchShard(&count->query, storage);
+        if (count->isTraced)
+            atomic_fetch_add(&count->matchCount, roaring_bitmap_get_cardinality(job.matches));
+        runCountJob(count->pool, &job, countFeatureChunk);
+        roaring_bitmap_free(job.matches);
+    }
+    count->infos[shard] = job.infos;
+}
+
+// feature is reported when any shard counts it, with the product and group counts of all shards summed
+static jlong mergeShardCounts(shard_count_t *count, uint32_t shardCount, result_sink_t *sink) {
+    uint32_t featureCount = count->featureCount;
+    for (uint32_t shard = 0; shard < shardCount; shard++) {
+        if (count->query.storages[shard] && !count->infos[shard])
+            return -1;
+    }
+    if (!count->features) {
+        featureCount = 0;
+        for (uint32_t shard = 0; shard < shardCount; shard++) {
+            if (count->query.storages[shard])
+                featureCount = max(featureCount, count->query.storages[shard]->featureCount);
+        }
+    }
+    uint32_t *infos = acquireResult(sink, sizeof(uint32_t) * 4 * featureCount);
+    if (!infos)
+        return -1;
+    uint32_t infoCount = 0;
+    for (uint32_t i = 0; i < featureCount; i++) {
+        uint32_t feature = count->features ? (uint32_t) count->features[i] : i;
+        uint32_t *info = infos + infoCount * 4;
+        bool isCounted = false;
+        info[0] = feature;
+        info[1] = 0;
+        info[2] = 0;
+        info[3] = false;
+        for (uint32_t shard = 0; shard < shardCount; shard++) {
+            jroaring_t *storage = count->query.storages[shard];
+            if (!storage || (!count->features && i >= storage->featureCount) ||
+                (!count->isAll && !isCountedFeature(storage, feature)))
+                continue;
+            info[1] += count->infos[shard][i * 4 + 1];
+            info[2] += count->infos[shard][i * 4 + 2];
+            isCounted = true;
         }
-        for (i = productIndex + 1; i < storage->productCount; i++) {
-            similarProducts[i].productId = storage->indexToProduct[i];
-            similarProducts[i].hitPercent = round(roaring_bitmap_jaccard_index(
-                    storage->productFeatures[productIndex], storage->productFeatures[i]) * 100);
+        infoCount += isCounted;
+    }
+    return 16 * infoCount;
+}
+
+static jlong countShards(jroaring_handle_t *handle, result_sink_t *sink, shard_count_t *count) {
+    count->infos = malloc(sizeof(uint32_t *) * handle->shardCount);
+    if (!count->infos)
+        return -1;
+    uint32_t readerSlot;
+    acquireStorage(handle, &readerSlot);
+    count->pool = atomic_load(&handle->queryPool);
+    query_trace_t *trace = query_stats_trace();
+    count->isTraced = trace != 0;
+    atomic_init(&count->matchCount, 0);
+    jlong length = -1;
+    if (acquireShards(handle, &count->query)) {
+        thread_pool_run(count->pool, handle->shardCount, countShard, count);
+        if (trace)
+            trace->matchCount += atomic_load(&count->matchCount);
+        uint64_t stageStart = query_stats_start();
+        length = mergeShardCounts(count, handle->shardCount, sink);
+        query_stats_record(STAT(STAGE_MERGE), stageStart);
+        for (uint32_t i = 0; i < handle->shardCount; i++) {
+            free(count->infos[i]);
         }
-        similarProductCount = i;
     }
+    releaseShards(handle, &count->query);
+    releaseStorage(handle, readerSlot);
+    free(count->infos);
+    return length;
+}
 
-    qsort(similarProducts, similarProductCount, sizeof(similar_product_t), compareSimilar);
-    uint32_t resultCount = min(similarProductCount, maxProducts);
-    uint32_t *result = malloc(sizeof(uint32_t) * resultCount);
-    for (uint32_t i = 0; i < resultCount; i++) {
-        result[i] = similarProducts[i].productId;
+static jlong countFilteredShards(JNIEnv *env, jroaring_handle_t *handle, result_sink_t *sink, shard_count_t *count,
+                                 jintArray includedFeaturesArray) {
+    jsize includedFeatureCount = (*env)->GetArrayLength(env, includedFeaturesArray);
+    jint *includedFeatures = 0;
+    if (includedFeatureCount > 0) {
+        includedFeatures = (*env)->GetIntArrayElements(env, includedFeaturesArray, NULL);
+        count->features = includedFeatures;
+        count->featureCount = includedFeatureCount;
     }
-    free(similarProducts);
+    jlong length = countShards(handle, sink, count);
+    if (includedFeatures)
+        (*env)->ReleaseIntArrayElements(env, includedFeaturesArray, includedFeatures, JNI_ABORT);
+    releaseShardQuery(env, &count->query);
+    return length;
+}
+
+static jlong countNamedShards(JNIEnv *env, jroaring_handle_t *handle, result_sink_t *sink, jstring expressionString,
+                              jintArray includedFeaturesArray, jboolean isGrouped, jobjectArray filterNamesArray,
+                              jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray) {
+    shard_count_t count = {.isGrouped = isGrouped};
+    readShardQuery(env, &count.query, expressionString, filterNamesArray, 0, filterFromValuesArray,
+                   filterToValuesArray, false);
+    return countFilteredShards(env, handle, sink, &count, includedFeaturesArray);
+}
 
-    return (*env)->NewDirectByteBuffer(env, result, sizeof(uint32_t) * resultCount);
+static jlong countHandleShards(JNIEnv *env, jroaring_handle_t *handle, result_sink_t *sink, jstring expressionString,
+                               jintArray includedFeaturesArray, jboolean isGrouped, jintArray filterHandlesArray,
+                               jfloatArray filterFromValuesArray, jfloatArray filterToValuesArray) {
+    shard_count_t count = {.isGrouped = isGrouped};
+    readShardQuery(env, &count.query, expressionString, 0, filterHandlesArray, filterFromValuesArray,
+                   filterToValuesArray, true);
+    return countFilteredShards(env, handle, sink, &count, includedFeaturesArray);
+}
+
+static jlong countAllShards(jroaring_handle_t *handle, result_sink_t *sink, jboolean isGrouped) {
+    shard_count_t count = {.isGrouped = isGrouped, .isAll = true};
+    return countShards(handle, sink, &count);
 }
 
 JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countProducts
@@ -769,82 +4770,455 @@ JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeR
          jint tailItem, jboolean isGrouped, jobjectArray filterNamesArray, jfloatArray filterFromValuesArray,
          jfloatArray filterToValuesArray) {
 
-    jroaring_t *storage = (jroaring_t *) pointer;
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initBufferSink(&sink, STAT(COUNT_PRODUCTS));
+    query_trace_t trace;
+    bool isTraced = beginQueryTrace(handle, &trace);
+    jlong length = -1;
+    if (handle->shardCount > 0) {
+        length = countNamedShards(env, handle, &sink, expressionString, includedFeaturesArray, isGrouped,
+                                  filterNamesArray, filterFromValuesArray, filterToValuesArray);
+    } else {
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handle, &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            length = countNamedProducts(env, storage, atomic_load(&handle->queryPool), &sink, expressionString,
+                                        includedFeaturesArray, tailItem, isGrouped, filterNamesArray,
+                                        filterFromValuesArray, filterToValuesArray);
+            pthread_rwlock_unlock(&storage->lock);
+        }
+        releaseStorage(handle, readerSlot);
+    }
+    if (isTraced)
+        logSlowQuery(env, handle, &trace, STAT(COUNT_PRODUCTS), length, expressionString, filterNamesArray, 0,
+                     filterFromValuesArray, filterToValuesArray, 0, -1);
 
-    roaring_bitmap_t *matches = roaring_bitmap_create();
-    roaring_bitmap_t *groups = roaring_bitmap_create();
-    getMatches(env, storage, expressionString, matches);
-    applyFilters(env, storage, matches, filterNamesArray, filterFromValuesArray, filterToValuesArray);
+    return finishBufferResult(env, &sink, length);
+}
 
-    uint32_t *infos;
-    uint32_t infoCount = 0;
-    jsize includedFeatureCount = (*env)->GetArrayLength(env, includedFeaturesArray);
-    if (includedFeatureCount > 0) {
-        jboolean isCopy;
-        jint *includedFeatures = (*env)->GetIntArrayElements(env, includedFeaturesArray, &isCopy);
-        infos = malloc(sizeof(uint32_t) * 4 * includedFeatureCount);
-        for (jsize i = 0; i < includedFeatureCount; i++) {
-            if (storage->featureProducts[includedFeatures[i]]) {
-                roaring_bitmap_t *bitmap = roaring_bitmap_and(matches, storage->featureProducts[includedFeatures[i]]);
-                infos[infoCount * 4] = includedFeatures[i];
-                infos[infoCount * 4 + 1] = roaring_bitmap_get_cardinality(bitmap);
-                if (isGrouped)
-                    infos[infoCount * 4 + 2] = getGroupSize(storage, bitmap, groups);
-                else
-                    infos[infoCount * 4 + 2] = 0;
-                infos[infoCount * 4 + 3] = false;
-                infoCount++;
-                roaring_bitmap_free(bitmap);
-            }
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countProductsInto
+        (JNIEnv *env, jclass class, jlong pointer, jstring expressionString, jintArray includedFeaturesArray,
+         jint tailItem, jboolean isGrouped, jobjectArray filterNamesArray, jfloatArray filterFromValuesArray,
+         jfloatArray filterToValuesArray, jobject resultBuffer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initCallerSink(env, &sink, resultBuffer, STAT(COUNT_PRODUCTS_INTO));
+    query_trace_t trace;
+    bool isTraced = beginQueryTrace(handle, &trace);
+    jlong length = -1;
+    if (handle->shardCount > 0) {
+        length = countNamedShards(env, handle, &sink, expressionString, includedFeaturesArray, isGrouped,
+                                  filterNamesArray, filterFromValuesArray, filterToValuesArray);
+    } else {
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handle, &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            length = countNamedProducts(env, storage, atomic_load(&handle->queryPool), &sink, expressionString,
+                                        includedFeaturesArray, tailItem, isGrouped, filterNamesArray,
+                                        filterFromValuesArray, filterToValuesArray);
+            pthread_rwlock_unlock(&storage->lock);
         }
-        (*env)->ReleaseIntArrayElements(env, includedFeaturesArray, includedFeatures, JNI_ABORT);
+        releaseStorage(handle, readerSlot);
+    }
+    if (isTraced)
+        logSlowQuery(env, handle, &trace, STAT(COUNT_PRODUCTS_INTO), length, expressionString, filterNamesArray, 0,
+                     filterFromValuesArray, filterToValuesArray, 0, -1);
+
+    return finishCallerResult(&sink, length);
+}
+
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countProductsByHandles
+        (JNIEnv *env, jclass class, jlong pointer, jstring expressionString, jintArray includedFeaturesArray,
+         jint tailItem, jboolean isGrouped, jintArray filterHandlesArray, jfloatArray filterFromValuesArray,
+         jfloatArray filterToValuesArray, jobject resultBuffer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initCallerSink(env, &sink, resultBuffer, STAT(COUNT_PRODUCTS_BY_HANDLES));
+    query_trace_t trace;
+    bool isTraced = beginQueryTrace(handle, &trace);
+    jlong length = -1;
+    if (handle->shardCount > 0) {
+        length = countHandleShards(env, handle, &sink, expressionString, includedFeaturesArray, isGrouped,
+                                   filterHandlesArray, filterFromValuesArray, filterToValuesArray);
     } else {
-        infos = malloc(sizeof(uint32_t) * 4 * storage->featureCount);
-        for (uint32_t i = 0; i < storage->featureCount; i++) {
-            if (storage->featureProducts[i]) {
-                roaring_bitmap_t *bitmap = roaring_bitmap_and(matches, storage->featureProducts[i]);
-                infos[infoCount * 4] = i;
-                infos[infoCount * 4 + 1] = roaring_bitmap_get_cardinality(bitmap);
-                if (isGrouped)
-                    infos[infoCount * 4 + 2] = getGroupSize(storage, bitmap, groups);
-                else
-                    infos[infoCount * 4 + 2] = 0;
-                infos[infoCount * 4 + 3] = false;
-                infoCount++;
-                roaring_bitmap_free(bitmap);
-            }
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handle, &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            uint32_t filterCount;
+            query_filter_t *filters = readHandleFilters(env, storage, filterHandlesArray, filterFromValuesArray,
+                                                        filterToValuesArray, &filterCount);
+            length = countProducts(env, storage, atomic_load(&handle->queryPool), &sink, expressionString,
+                                   includedFeaturesArray, tailItem, isGrouped, filters, filterCount);
+            releaseFilters(env, filters, filterCount);
+            pthread_rwlock_unlock(&storage->lock);
         }
+        releaseStorage(handle, readerSlot);
     }
+    if (isTraced)
+        logSlowQuery(env, handle, &trace, STAT(COUNT_PRODUCTS_BY_HANDLES), length, expressionString, 0,
+                     filterHandlesArray, filterFromValuesArray, filterToValuesArray, 0, -1);
 
-    roaring_bitmap_free(matches);
-    roaring_bitmap_free(groups);
+    return finishCallerResult(&sink, length);
+}
 
-    return (*env)->NewDirectByteBuffer(env, infos, 16 * infoCount);
+static jlong countAllProducts(jroaring_t *storage, thread_pool_t *pool, result_sink_t *sink, jboolean isGrouped) {
+    count_job_t job = {storage, 0, 0, storage->featureCount, isGrouped, 0};
+    job.infos = acquireResult(sink, sizeof(uint32_t) * 4 * storage->featureCount);
+    if (!job.infos)
+        return -1;
+    uint64_t stageStart = query_stats_start();
+    runCountJob(pool, &job, countAllFeatureChunk);
+    query_stats_record(STAT(STAGE_COUNT), stageStart);
+
+    return 16 * storage->featureCount;
 }
 
 JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countAllProducts
         (JNIEnv *env, jclass class, jlong pointer, jboolean isGrouped) {
 
-    jroaring_t *storage = (jroaring_t *) pointer;
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initBufferSink(&sink, STAT(COUNT_ALL_PRODUCTS));
+    if (handle->shardCount > 0)
+        return finishBufferResult(env, &sink, countAllShards(handle, &sink, isGrouped));
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    jlong length = -1;
+    if (storage) {
+        pthread_rwlock_rdlock(&storage->lock);
+        length = countAllProducts(storage, atomic_load(&handle->queryPool), &sink, isGrouped);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
 
-    uint32_t *infos = malloc(sizeof(uint32_t) * 4 * storage->featureCount);
-    for (uint32_t i = 0; i < storage->featureCount; i++) {
-        infos[i * 4] = i;
-        infos[i * 4 + 1] = storage->featureProducts[i] ? roaring_bitmap_get_cardinality(storage->featureProducts[i])
-                                                       : 0;
-        if (isGrouped)
-            infos[i * 4 + 2] = roaring_bitmap_get_cardinality(storage->featureGroups[i]);
-        else
-            infos[i * 4 + 2] = 0;
-        infos[i * 4 + 3] = false;
+    return finishBufferResult(env, &sink, length);
+}
+
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countAllProductsInto
+        (JNIEnv *env, jclass class, jlong pointer, jboolean isGrouped, jobject resultBuffer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_sink_t sink;
+    initCallerSink(env, &sink, resultBuffer, STAT(COUNT_ALL_PRODUCTS_INTO));
+    if (handle->shardCount > 0)
+        return finishCallerResult(&sink, countAllShards(handle, &sink, isGrouped));
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    jlong length = -1;
+    if (storage) {
+        pthread_rwlock_rdlock(&storage->lock);
+        length = countAllProducts(storage, atomic_load(&handle->queryPool), &sink, isGrouped);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
+
+    return finishCallerResult(&sink, length);
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_releaseResult
+        (JNIEnv *env, jclass class, jobject resultBuffer) {
+    if (resultBuffer)
+        result_pool_release((*env)->GetDirectBufferAddress(env, resultBuffer));
+}
+
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_upsertProduct
+        (JNIEnv *env, jclass class, jlong pointer, jint productId, jint groupId, jint groupOrder,
+         jintArray featuresArray, jintArray extFeaturesArray, jobjectArray attributeNamesArray,
+         jfloatArray attributeValuesArray) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    uint64_t start = query_stats_start();
+    // ids index arrays sized by the largest one seen, and -1 would be taken for a tombstone
+    if (productId < 0 || groupId < 0) {
+        query_stats_record(STAT(UPSERT_PRODUCT), start);
+        return false;
     }
 
-    return (*env)->NewDirectByteBuffer(env, infos, 16 * storage->featureCount);
+    roaring_bitmap_t *features = roaring_bitmap_from_jint_array(env, featuresArray);
+    roaring_bitmap_t *extFeatures = roaring_bitmap_from_jint_array(env, extFeaturesArray);
+
+    jsize attributeCount = attributeNamesArray ? (*env)->GetArrayLength(env, attributeNamesArray) : 0;
+    const char **attributeNames = malloc(sizeof(char *) * (attributeCount + 1));
+    jstring *attributeNameStrings = malloc(sizeof(jstring) * (attributeCount + 1));
+    for (jsize i = 0; i < attributeCount; i++) {
+        attributeNameStrings[i] = (*env)->GetObjectArrayElement(env, attributeNamesArray, i);
+        attributeNames[i] = (*env)->GetStringUTFChars(env, attributeNameStrings[i], NULL);
+    }
+    jfloat *attributeValues = attributeCount > 0 ?
+                              (*env)->GetFloatArrayElements(env, attributeValuesArray, NULL) : NULL;
+
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    bool updated = false;
+    if (storage) {
+        pthread_rwlock_wrlock(&storage->lock);
+        updated = upsertProduct(storage, productId, groupId, groupOrder, features, extFeatures, attributeCount,
+                                attributeNames, attributeValues);
+        refreshNameSlots(storage);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
+
+    if (!updated) {
+        roaring_bitmap_free(features);
+        roaring_bitmap_free(extFeatures);
+    }
+    if (attributeValues)
+        (*env)->ReleaseFloatArrayElements(env, attributeValuesArray, attributeValues, JNI_ABORT);
+    for (jsize i = 0; i < attributeCount; i++) {
+        (*env)->ReleaseStringUTFChars(env, attributeNameStrings[i], attributeNames[i]);
+        (*env)->DeleteLocalRef(env, attributeNameStrings[i]);
+    }
+    free(attributeNameStrings);
+    free(attributeNames);
+
+    query_stats_record(STAT(UPSERT_PRODUCT), start);
+    return updated;
+}
+
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_removeProduct
+        (JNIEnv *env, jclass class, jlong pointer, jint productId) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    uint64_t start = query_stats_start();
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    bool removed = false;
+    if (storage) {
+        pthread_rwlock_wrlock(&storage->lock);
+        removed = removeProduct(storage, productId);
+        refreshNameSlots(storage);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
+
+    query_stats_record(STAT(REMOVE_PRODUCT), start);
+    return removed;
+}
+
+// returns the bytes compaction saved, -1 when there is no published storage
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_compact
+        (JNIEnv *env, jclass class, jlong pointer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    if (handle->shardCount > 0) {
+        jlong saved = -1;
+        for (uint32_t i = 0; i < handle->shardCount; i++) {
+            jlong shardSaved = Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_compact(
+                    env, class, (jlong) handle->shards[i]);
+            if (shardSaved >= 0)
+                saved = max(saved, 0) + shardSaved;
+        }
+        return saved;
+    }
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    jlong saved = -1;
+    if (storage) {
+        pthread_rwlock_wrlock(&storage->lock);
+        saved = compactStorage(storage);
+        pthread_rwlock_unlock(&storage->lock);
+    }
+    releaseStorage(handle, readerSlot);
+
+    return saved;
+}
+
+// shards of a sharded handle are summed, values are all zero while nothing is published
+JNIEXPORT jlongArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getMemoryStats
+        (JNIEnv *env, jclass class, jlong pointer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    jroaring_handle_t **handles = handle->shardCount > 0 ? handle->shards : &handle;
+    uint32_t handleCount = handle->shardCount > 0 ? handle->shardCount : 1;
+    jlong values[MEMORY_VALUE_COUNT] = {0};
+    for (uint32_t i = 0; i < handleCount; i++) {
+        uint32_t readerSlot;
+        jroaring_t *storage = acquireStorage(handles[i], &readerSlot);
+        if (storage) {
+            pthread_rwlock_rdlock(&storage->lock);
+            addMemoryStats(storage, values);
+            pthread_rwlock_unlock(&storage->lock);
+        }
+        releaseStorage(handles[i], readerSlot);
+    }
+    result_pool_stats_t poolStats;
+    result_pool_stats(&poolStats);
+    values[MEMORY_RESULT_POOL] = poolStats.acquired - poolStats.released;
+    values[MEMORY_RESULT_POOL + 1] = poolStats.outstandingBytes + poolStats.freeBytes;
+
+    jlongArray result = (*env)->NewLongArray(env, MEMORY_VALUE_COUNT);
+    if (result)
+        (*env)->SetLongArrayRegion(env, result, 0, MEMORY_VALUE_COUNT, values);
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getCacheStats
+        (JNIEnv *env, jclass class, jlong pointer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    result_cache_stats_t stats;
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+    result_cache_stats(storage ? storage->resultCache : 0, &stats);
+    releaseStorage(handle, readerSlot);
+
+    // counters belong to the published generation and start from zero with every new one
+    jlong values[] = {stats.hits, stats.misses, stats.insertions, stats.evictions, stats.entryCount,
+                      stats.usedBytes, stats.budgetBytes};
+    jsize valueCount = sizeof(values) / sizeof(values[0]);
+    jlongArray result = (*env)->NewLongArray(env, valueCount);
+    if (result)
+        (*env)->SetLongArrayRegion(env, result, 0, valueCount, values);
+    return result;
+}
+
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setQueryStatsEnabled
+        (JNIEnv *env, jclass class, jboolean enabled) {
+    query_stats_set_enabled(enabled);
+}
+
+/*
+ * For every STAT metric in turn the count, total, p50, p90, p99, p99.9 and max nanoseconds since the last reset,
+ * process wide. Entry points are timed from the start of the call, stages only while they run.
+ */
+JNIEXPORT jlongArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getQueryStats
+        (JNIEnv *env, jclass class, jboolean reset) {
+
+    query_stats_summary_t summaries[STAT(COUNT)];
+    query_stats_summarize(STAT(COUNT), summaries, reset);
+
+    jlong values[STAT(COUNT) * 7];
+    for (uint32_t i = 0; i < STAT(COUNT); i++) {
+        query_stats_summary_t *summary = &summaries[i];
+        jlong metricValues[] = {summary->count, summary->totalNanos, summary->p50Nanos, summary->p90Nanos,
+                                summary->p99Nanos, summary->p999Nanos, summary->maxNanos};
+        memcpy(values + i * 7, metricValues, sizeof(metricValues));
+    }
+    jsize valueCount = sizeof(values) / sizeof(values[0]);
+    jlongArray result = (*env)->NewLongArray(env, valueCount);
+    if (result)
+        (*env)->SetLongArrayRegion(env, result, 0, valueCount, values);
+    return result;
+}
+
+/*
+ * Slow queries logged since the last drain, NULL when the handle never logged any. The buffer goes back to
+ * releaseResult. It starts with the record count and the count of records dropped or overwritten as ints, then
+ * every record: timestamp millis, total nanos, result length, nanos of each stage from STAGE_MATCH on as longs,
+ * then metric, match count, filter count and range count as ints, range count from values and to values as
+ * floats, text length as int and the text, padded to 8 bytes. The text holds expression, sorting id and filter
+ * names, each followed by 0.
+ */
+JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_drainSlowQueries
+        (JNIEnv *env, jclass class, jlong pointer) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    query_log_t *slowQueries = atomic_load(&handle->slowQueries);
+    if (!slowQueries)
+        return 0;
+    query_log_record_t *records = malloc(sizeof(query_log_record_t) * query_log_capacity(slowQueries));
+    if (!records)
+        return 0;
+    uint64_t dropped;
+    uint32_t recordCount = query_log_drain(slowQueries, records, &dropped);
+
+    size_t length = sizeof(jint) * 2;
+    for (uint32_t i = 0; i < recordCount; i++) {
+        uint32_t rangeCount = min(records[i].filterCount, QUERY_LOG_MAX_FILTERS);
+        length += sizeof(jlong) * (3 + SLOW_QUERY_STAGE_COUNT) + sizeof(jint) * 5 + sizeof(jfloat) * 2 * rangeCount +
+                  (records[i].textLength + 7) / 8 * 8;
+    }
+    char *result = result_pool_acquire(length);
+    if (!result) {
+        free(records);
+        return 0;
+    }
+    char *position = result;
+#define PUT_VALUE(type, value) { type putValue = (type) (value); memcpy(position, &putValue, sizeof(type)); \
+        position += sizeof(type); }
+    PUT_VALUE(jint, recordCount)
+    PUT_VALUE(jint, min(dropped, INT32_MAX))
+    for (uint32_t i = 0; i < recordCount; i++) {
+        query_log_record_t *record = &records[i];
+        uint32_t rangeCount = min(record->filterCount, QUERY_LOG_MAX_FILTERS);
+        PUT_VALUE(jlong, record->timestampMillis)
+        PUT_VALUE(jlong, record->totalNanos)
+        PUT_VALUE(jlong, record->resultLength)
+        for (uint32_t stage = 0; stage < SLOW_QUERY_STAGE_COUNT; stage++) {
+            PUT_VALUE(jlong, record->stageNanos[stage])
+        }
+        PUT_VALUE(jint, record->metric)
+        PUT_VALUE(jint, record->matchCount)
+        PUT_VALUE(jint, record->filterCount)
+        PUT_VALUE(jint, rangeCount)
+        memcpy(position, record->filterFromValues, sizeof(jfloat) * rangeCount);
+        position += sizeof(jfloat) * rangeCount;
+        memcpy(position, record->filterToValues, sizeof(jfloat) * rangeCount);
+        position += sizeof(jfloat) * rangeCount;
+        PUT_VALUE(jint, record->textLength)
+        memset(position, 0, (record->textLength + 7) / 8 * 8);
+        memcpy(position, record->text, record->textLength);
+        position += (record->textLength + 7) / 8 * 8;
+    }
+#undef PUT_VALUE
+    free(records);
+    return (*env)->NewDirectByteBuffer(env, result, length);
+}
+
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_saveSnapshot
+        (JNIEnv *env, jclass class, jlong pointer, jstring pathString) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    uint32_t readerSlot;
+    jroaring_t *storage = acquireStorage(handle, &readerSlot);
+
+    bool saved = false;
+    if (storage) {
+        const char *path = (*env)->GetStringUTFChars(env, pathString, NULL);
+        pthread_rwlock_rdlock(&storage->lock);
+        saved = saveSnapshot(storage, path);
+        pthread_rwlock_unlock(&storage->lock);
+        (*env)->ReleaseStringUTFChars(env, pathString, path);
+    }
+    releaseStorage(handle, readerSlot);
+
+    return saved;
+}
+
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_loadSnapshot
+        (JNIEnv *env, jclass class, jlong pointer, jstring pathString, jboolean prefault) {
+
+    jroaring_handle_t *handle = (jroaring_handle_t *) pointer;
+    if (handle->shardCount > 0)
+        return false;
+    jroaring_t *storage = createStorage(&handle->options, &handle->registry);
+
+    const char *path = (*env)->GetStringUTFChars(env, pathString, NULL);
+    bool loaded = loadSnapshot(storage, path, prefault);
+    (*env)->ReleaseStringUTFChars(env, pathString, path);
+
+    if (loaded) {
+        buildProductGroups(storage);
+        buildFeatureCounts(storage);
+        buildAttributeIndexes(storage);
+        buildSimilarIndex(storage);
+        startSimilarTable(storage);
+        publishStorage(handle, storage);
+    } else {
+        freeStorage(storage);
+    }
+
+    return loaded;
 }
 
 JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_destroy
         (JNIEnv *env, jclass class, jlong pointer) {
-    jroaring_t *storage = (jroaring_t *) pointer;
-    clearStorage(storage);
-    free(storage);
+    freeHandle((jroaring_handle_t *) pointer);
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define PREFAULT_PAGE_SIZE 4096
+
+#ifdef _WIN32
+
+mapped_file_t* mapped_file_open(const char *path) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return 0;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return 0;
+    const char *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        return 0;
+    }
+    mapped_file_t *mappedFile = malloc(sizeof(mapped_file_t));
+    if (!mappedFile) {
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        return 0;
+    }
+    mappedFile->data = data;
+    mappedFile->size = size.QuadPart;
+    mappedFile->handle = mapping;
+    return mappedFile;
+}
+
+void mapped_file_close(mapped_file_t* file) {
+    if (!file)
+        return;
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->handle);
+    free(file);
+}
+
+#else
+
+mapped_file_t* mapped_file_open(const char *path) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0)
+        return 0;
+    struct stat fileStat;
+    if (fstat(descriptor, &fileStat) != 0 || fileStat.st_size == 0) {
+        close(descriptor);
+        return 0;
+    }
+    void *data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED)
+        return 0;
+    mapped_file_t *mappedFile = malloc(sizeof(mapped_file_t));
+    if (!mappedFile) {
+        munmap(data, fileStat.st_size);
+        return 0;
+    }
+    mappedFile->data = data;
+    mappedFile->size = fileStat.st_size;
+    mappedFile->handle = 0;
+    return mappedFile;
+}
+
+void mapped_file_close(mapped_file_t* file) {
+    if (!file)
+        return;
+    munmap((void *) file->data, file->size);
+    free(file);
+}
+
+#endif
+
+void mapped_file_prefault(mapped_file_t* file) {
+    if (!file)
+        return;
+#if !defined(_WIN32) && defined(MADV_WILLNEED)
+    madvise((void *) file->data, file->size, MADV_WILLNEED);
+#endif
+    volatile uint8_t sink = 0;
+    for (size_t offset = 0; offset < file->size; offset += PREFAULT_PAGE_SIZE) {
+        sink ^= (uint8_t) file->data[offset];
+    }
+    (void) sink;
+}
@@ -0,0 +1,25 @@
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef JROARING_MAPPED_FILE_H
+#define JROARING_MAPPED_FILE_H
+
+typedef struct mapped_file_s {
+    const char *data;
+    size_t size;
+    void *handle;
+} mapped_file_t;
+
+/*
+ * Maps whole file read-only. The pages are shared with every other process that maps the same file.
+ */
+mapped_file_t* mapped_file_open(const char *path);
+
+/*
+ * Asks the OS to read the mapping ahead and touches every page, so first accesses do not fault.
+ */
+void mapped_file_prefault(mapped_file_t* file);
+
+void mapped_file_close(mapped_file_t* file);
+
+#endif //JROARING_MAPPED_FILE_H
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#include "min_hash_index.h"
+
+#define MIN_HASH_BUILD_CHUNK 4096
+
+typedef struct min_hash_entry_s {
+    uint32_t key;
+    uint32_t id;
+} min_hash_entry_t;
+
+/*
+ * Each band is an array of (band key, id) pairs sorted by key, so a bucket is the run of equal keys found by
+ * binary search. Band keys hash rowCount values into 32 bits, which is why a lookup may return a few strangers.
+ */
+typedef struct min_hash_index_s {
+    uint32_t bandCount;
+    uint32_t rowCount;
+    uint32_t *seeds;
+    uint32_t *bandSizes;
+    min_hash_entry_t **bands;
+} min_hash_index_t;
+
+typedef struct min_hash_build_s {
+    min_hash_index_t *index;
+    uint32_t count;
+    roaring_bitmap_t *const *sets;
+    const uint32_t *ids;
+} min_hash_build_t;
+
+static inline uint32_t mix(uint32_t value) {
+    value ^= value >> 16;
+    value *= 0x85ebca6b;
+    value ^= value >> 13;
+    value *= 0xc2b2ae35;
+    value ^= value >> 16;
+    return value;
+}
+
+static void computeBandKeys(const min_hash_index_t *index, const roaring_bitmap_t *set, uint32_t *signature,
+                            uint32_t *keys) {
+    uint32_t hashCount = index->bandCount * index->rowCount;
+    memset(signature, 0xff, sizeof(uint32_t) * hashCount);
+    roaring_uint32_iterator_t iterator;
+    roaring_init_iterator(set, &iterator);
+    while (iterator.has_value) {
+        for (uint32_t i = 0; i < hashCount; i++) {
+            uint32_t hash = mix(iterator.current_value ^ index->seeds[i]);
+            if (hash < signature[i])
+                signature[i] = hash;
+        }
+        roaring_advance_uint32_iterator(&iterator);
+    }
+    for (uint32_t band = 0; band < index->bandCount; band++) {
+        uint32_t key = 0;
+        for (uint32_t row = 0; row < index->rowCount; row++) {
+            key = mix(key ^ signature[band * index->rowCount + row]) + row;
+        }
+        keys[band] = key;
+    }
+}
+
+static void buildChunk(void *argument, uint32_t chunk) {
+    min_hash_build_t *build = argument;
+    min_hash_index_t *index = build->index;
+    uint32_t *signature = malloc(sizeof(uint32_t) * index->bandCount * (index->rowCount + 1));
+    uint32_t *keys = signature + index->bandCount * index->rowCount;
+    uint32_t end = chunk * MIN_HASH_BUILD_CHUNK + MIN_HASH_BUILD_CHUNK;
+    if (end > build->count)
+        end = build->count;
+    for (uint32_t i = chunk * MIN_HASH_BUILD_CHUNK; i < end; i++) {
+        if (!build->sets[i] || roaring_bitmap_is_empty(build->sets[i]))
+            continue;
+        computeBandKeys(index, build->sets[i], signature, keys);
+        for (uint32_t band = 0; band < index->bandCount; band++) {
+            index->bands[band][i].key = keys[band];
+            index->bands[band][i].id = build->ids[i];
+        }
+    }
+    free(signature);
+}
+
+static int compareEntries(const void *entry1, const void *entry2) {
+    const min_hash_entry_t *first = entry1;
+    const min_hash_entry_t *second = entry2;
+    if (first->key != second->key)
+        return first->key < second->key ? -1 : 1;
+    if (first->id != second->id)
+        return first->id < second->id ? -1 : 1;
+    return 0;
+}
+
+static void sortBand(void *argument, uint32_t band) {
+    min_hash_build_t *build = argument;
+    min_hash_index_t *index = build->index;
+    min_hash_entry_t *entries = index->bands[band];
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < build->count; i++) {
+        if (build->sets[i] && !roaring_bitmap_is_empty(build->sets[i]))
+            entries[size++] = entries[i];
+    }
+    qsort(entries, size, sizeof(min_hash_entry_t), compareEntries);
+    index->bandSizes[band] = size;
+}
+
+min_hash_index_t* min_hash_index_create(uint32_t bandCount, uint32_t rowCount, uint32_t count,
+                                        roaring_bitmap_t *const *sets, const uint32_t *ids, thread_pool_t *pool) {
+    if (bandCount == 0 || rowCount == 0)
+        return 0;
+    min_hash_index_t *index = calloc(1, sizeof(min_hash_index_t));
+    if (!index)
+        return 0;
+    index->bandCount = bandCount;
+    index->rowCount = rowCount;
+    index->seeds = malloc(sizeof(uint32_t) * bandCount * rowCount);
+    index->bandSizes = calloc(bandCount, sizeof(uint32_t));
+    index->bands = calloc(bandCount, sizeof(min_hash_entry_t *));
+    if (!index->seeds || !index->bandSizes || !index->bands) {
+        min_hash_index_free(index);
+        return 0;
+    }
+    for (uint32_t i = 0; i < bandCount * rowCount; i++) {
+        index->seeds[i] = mix(i * 0x9e3779b9 + 0x7f4a7c15);
+    }
+    for (uint32_t band = 0; band < bandCount; band++) {
+        index->bands[band] = malloc(sizeof(min_hash_entry_t) * (count > 0 ? count : 1));
+        if (!index->bands[band]) {
+            min_hash_index_free(index);
+            return 0;
+        }
+    }
+
+    min_hash_build_t build = {index, count, sets, ids};
+    thread_pool_run(pool, (count + MIN_HASH_BUILD_CHUNK - 1) / MIN_HASH_BUILD_CHUNK, buildChunk, &build);
+    thread_pool_run(pool, bandCount, sortBand, &build);
+    for (uint32_t band = 0; band < bandCount; band++) {
+        min_hash_entry_t *entries = realloc(index->bands[band],
+                                            sizeof(min_hash_entry_t) * (index->bandSizes[band] + 1));
+        if (entries)
+            index->bands[band] = entries;
+    }
+    return index;
+}
+
+void min_hash_index_candidates(const min_hash_index_t* index, const roaring_bitmap_t *set,
+                               roaring_bitmap_t *candidates) {
+    if (roaring_bitmap_is_empty(set))
+        return;
+    uint32_t *signature = malloc(sizeof(uint32_t) * index->bandCount * (index->rowCount + 1));
+    uint32_t *keys = signature + index->bandCount * index->rowCount;
+    computeBandKeys(index, set, signature, keys);
+    for (uint32_t band = 0; band < index->bandCount; band++) {
+        const min_hash_entry_t *entries = index->bands[band];
+        uint32_t low = 0;
+        uint32_t high = index->bandSizes[band];
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (entries[middle].key < keys[band])
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        for (uint32_t i = low; i < index->bandSizes[band] && entries[i].key == keys[band]; i++) {
+            roaring_bitmap_add(candidates, entries[i].id);
+        }
+    }
+    free(signature);
+}
+
+uint64_t min_hash_index_size_in_bytes(const min_hash_index_t* index) {
+    uint64_t size = sizeof(min_hash_index_t) + sizeof(uint32_t) * index->bandCount * index->rowCount +
+                    (sizeof(uint32_t) + sizeof(min_hash_entry_t *)) * index->bandCount;
+    for (uint32_t band = 0; band < index->bandCount; band++) {
+        size += sizeof(min_hash_entry_t) * index->bandSizes[band];
+    }
+    return size;
+}
+
+void min_hash_index_free(min_hash_index_t* index) {
+    if (!index)
+        return;
+    if (index->bands) {
+        for (uint32_t band = 0; band < index->bandCount; band++) {
+            free(index->bands[band]);
+        }
+    }
+    free(index->bands);
+    free(index->bandSizes);
+    free(index->seeds);
+    free(index);
+}
@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <roaring/roaring.h>
+#include "thread_pool.h"
+
+#ifndef JROARING_MIN_HASH_INDEX_H
+#define JROARING_MIN_HASH_INDEX_H
+
+typedef struct min_hash_index_s min_hash_index_t;
+
+/*
+ * Buckets ids[i] by every band of rowCount MinHash values of sets[i], for i in [0, count). Two sets with Jaccard
+ * index s share a given band with probability s^rowCount, so they meet in at least one of the bands with
+ * probability 1 - (1 - s^rowCount)^bandCount: more rows cut the candidates, more bands win the recall back.
+ * Missing or empty sets are left out. Signatures are computed on the pool, a NULL pool builds on the calling thread.
+ */
+min_hash_index_t* min_hash_index_create(uint32_t bandCount, uint32_t rowCount, uint32_t count,
+                                        roaring_bitmap_t *const *sets, const uint32_t *ids, thread_pool_t *pool);
+
+/*
+ * Adds the ids of every indexed set sharing at least one band with set to candidates. Ids whose bands merely
+ * collide in the hash may be added too, so candidates are meant to be re-ranked by the exact index.
+ */
+void min_hash_index_candidates(const min_hash_index_t* index, const roaring_bitmap_t *set,
+                               roaring_bitmap_t *candidates);
+
+uint64_t min_hash_index_size_in_bytes(const min_hash_index_t* index);
+
+void min_hash_index_free(min_hash_index_t* index);
+
+#endif //JROARING_MIN_HASH_INDEX_H
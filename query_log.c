@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "query_log.h"
+
+/*
+ * Every append takes the next ticket and the slot at ticket modulo capacity. The slot sequence tells who owns
+ * the record: 2 * ticket + 1 while the record of ticket is written or drained, 2 * ticket + 2 once it is
+ * complete. Writers and the drainer take a slot by swapping the sequence, so none of them ever waits for another.
+ * A writer that finds its slot busy gives up and leaves its ticket in skipped, losses are only counted by the drain.
+ */
+typedef struct query_log_slot_s {
+    atomic_uint_fast64_t sequence;
+    // last ticket + 1 whose writer gave up on this slot
+    atomic_uint_fast64_t skipped;
+    query_log_record_t record;
+} query_log_slot_t;
+
+typedef struct query_log_s {
+    uint32_t capacity;
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t dropped;
+    // drains run one at a time, tail is the next ticket to drain
+    pthread_mutex_t drainMutex;
+    uint64_t tail;
+    query_log_slot_t slots[];
+} query_log_t;
+
+query_log_t* query_log_create(uint32_t capacity) {
+    if (capacity == 0)
+        return 0;
+    query_log_t *log = calloc(1, sizeof(query_log_t) + sizeof(query_log_slot_t) * capacity);
+    if (!log)
+        return 0;
+    log->capacity = capacity;
+    atomic_init(&log->head, 0);
+    atomic_init(&log->dropped, 0);
+    pthread_mutex_init(&log->drainMutex, NULL);
+    for (uint32_t i = 0; i < capacity; i++) {
+        atomic_init(&log->slots[i].sequence, 0);
+        atomic_init(&log->slots[i].skipped, 0);
+    }
+    return log;
+}
+
+void query_log_append(query_log_t* log, const query_log_record_t *record) {
+    uint64_t ticket = atomic_fetch_add(&log->head, 1);
+    query_log_slot_t *slot = &log->slots[ticket % log->capacity];
+    uint_fast64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    do {
+        // busy, or already taken by a writer that wrapped around past this one
+        if ((sequence & 1) || sequence > 2 * ticket) {
+            uint_fast64_t skipped = atomic_load(&slot->skipped);
+            while (skipped <= ticket && !atomic_compare_exchange_weak(&slot->skipped, &skipped, ticket + 1));
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&slot->sequence, &sequence, 2 * ticket + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+    memcpy(&slot->record, record, sizeof(query_log_record_t));
+    atomic_store_explicit(&slot->sequence, 2 * ticket + 2, memory_order_release);
+}
+
+uint32_t query_log_drain(query_log_t* log, query_log_record_t *records, uint64_t *dropped) {
+    pthread_mutex_lock(&log->drainMutex);
+    uint64_t head = atomic_load(&log->head);
+    uint64_t ticket = log->tail;
+    if (head - ticket > log->capacity) {
+        atomic_fetch_add(&log->dropped, head - log->capacity - ticket);
+        ticket = head - log->capacity;
+    }
+    uint32_t count = 0;
+    for (; ticket < head; ticket++) {
+        query_log_slot_t *slot = &log->slots[ticket % log->capacity];
+        uint_fast64_t sequence = 2 * ticket + 2;
+        if (atomic_compare_exchange_strong_explicit(&slot->sequence, &sequence, 2 * ticket + 1,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            memcpy(&records[count++], &slot->record, sizeof(query_log_record_t));
+            atomic_store_explicit(&slot->sequence, 2 * ticket + 2, memory_order_release);
+        } else if (sequence > 2 * ticket + 2 || atomic_load(&slot->skipped) > ticket) {
+            // overwritten by a later ticket, or its writer gave up
+            atomic_fetch_add(&log->dropped, 1);
+        } else {
+            // still being written, or its writer did not take the slot yet, left for the next drain
+            break;
+        }
+    }
+    log->tail = ticket;
+    *dropped = atomic_exchange(&log->dropped, 0);
+    pthread_mutex_unlock(&log->drainMutex);
+    return count;
+}
+
+uint32_t query_log_capacity(const query_log_t* log) {
+    return log->capacity;
+}
+
+#ifdef QUERY_LOG_TESTING
+void query_log_hold_slot(query_log_t* log, uint64_t ticket) {
+    atomic_store(&log->slots[ticket % log->capacity].sequence, 2 * ticket + 1);
+}
+
+void query_log_release_slot(query_log_t* log, uint64_t ticket) {
+    atomic_store(&log->slots[ticket % log->capacity].sequence, 2 * ticket + 2);
+}
+#endif
+
+void query_log_free(query_log_t* log) {
+    if (!log)
+        return;
+    pthread_mutex_destroy(&log->drainMutex);
+    free(log);
+}
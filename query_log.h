@@ -0,0 +1,57 @@
+#include <stdint.h>
+
+#ifndef JROARING_QUERY_LOG_H
+#define JROARING_QUERY_LOG_H
+
+#define QUERY_LOG_MAX_STAGES 8
+#define QUERY_LOG_MAX_FILTERS 16
+#define QUERY_LOG_TEXT_LENGTH 1024
+
+typedef struct query_log_record_s {
+    uint64_t timestampMillis;
+    uint64_t totalNanos;
+    int64_t resultLength;
+    uint64_t stageNanos[QUERY_LOG_MAX_STAGES];
+    uint32_t metric;
+    uint32_t matchCount;
+    // ranges of the first QUERY_LOG_MAX_FILTERS filters
+    uint32_t filterCount;
+    float filterFromValues[QUERY_LOG_MAX_FILTERS];
+    float filterToValues[QUERY_LOG_MAX_FILTERS];
+    // expression, sorting id and filter names, each followed by 0, whatever does not fit is cut off
+    uint32_t textLength;
+    char text[QUERY_LOG_TEXT_LENGTH];
+} query_log_record_t;
+
+typedef struct query_log_s query_log_t;
+
+/*
+ * Ring of the last capacity records. Appending never blocks: a record is dropped when its slot is still being
+ * written or drained by someone else, and the oldest records are overwritten when nobody drains in time.
+ * All functions are safe to call from several threads.
+ */
+query_log_t* query_log_create(uint32_t capacity);
+
+void query_log_append(query_log_t* log, const query_log_record_t *record);
+
+/*
+ * Moves up to capacity records, oldest first, to records and returns their number. Records dropped or
+ * overwritten since the last drain are counted in dropped, so every append is either drained or counted once.
+ */
+uint32_t query_log_drain(query_log_t* log, query_log_record_t *records, uint64_t *dropped);
+
+uint32_t query_log_capacity(const query_log_t* log);
+
+#ifdef QUERY_LOG_TESTING
+/*
+ * Keeps the slot of ticket busy, as a drain copying its record does, until it is released. Lets tests make the
+ * writer of a later ticket in the same slot give up. Only built with QUERY_LOG_TESTING, which JRoaringTest defines.
+ */
+void query_log_hold_slot(query_log_t* log, uint64_t ticket);
+
+void query_log_release_slot(query_log_t* log, uint64_t ticket);
+#endif
+
+void query_log_free(query_log_t* log);
+
+#endif //JROARING_QUERY_LOG_H
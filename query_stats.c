@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "query_stats.h"
+
+#define QUERY_STATS_SUB_BUCKET_BITS 3
+#define QUERY_STATS_SUB_BUCKETS (1 << QUERY_STATS_SUB_BUCKET_BITS)
+// highest power of two of nanoseconds with buckets of its own, longer times go to the last bucket
+#define QUERY_STATS_MAX_EXPONENT 35
+#define QUERY_STATS_BUCKET_COUNT \
+    ((QUERY_STATS_MAX_EXPONENT - QUERY_STATS_SUB_BUCKET_BITS + 2) * QUERY_STATS_SUB_BUCKETS)
+
+typedef struct histogram_set_s {
+    uint64_t counts[QUERY_STATS_MAX_METRICS][QUERY_STATS_BUCKET_COUNT];
+    uint64_t totalNanos[QUERY_STATS_MAX_METRICS];
+} histogram_set_t;
+
+/*
+ * Histograms of one thread. Only the owner writes them, with relaxed loads and stores instead of atomic
+ * increments, readers may see a record half applied but never a torn counter.
+ */
+typedef struct thread_histograms_s {
+    struct thread_histograms_s *next;
+    _Atomic uint64_t counts[QUERY_STATS_MAX_METRICS][QUERY_STATS_BUCKET_COUNT];
+    _Atomic uint64_t totalNanos[QUERY_STATS_MAX_METRICS];
+} thread_histograms_t;
+
+static atomic_bool statsEnabled;
+// threads with a trace, so that threads without one do not look theirs up while recording is off
+static atomic_uint activeTraces;
+static pthread_key_t histogramsKey;
+static pthread_key_t traceKey;
+static pthread_once_t histogramsOnce = PTHREAD_ONCE_INIT;
+// guards the list of live thread histograms, what exited threads recorded and the reset baseline
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_histograms_t *liveHistograms;
+static histogram_set_t retiredHistograms;
+static histogram_set_t baseline;
+
+static inline uint32_t bucketOf(uint64_t nanos) {
+    if (nanos < QUERY_STATS_SUB_BUCKETS)
+        return (uint32_t) nanos;
+    uint32_t exponent = 63 - __builtin_clzll(nanos);
+    if (exponent > QUERY_STATS_MAX_EXPONENT)
+        return QUERY_STATS_BUCKET_COUNT - 1;
+    uint32_t subBucket = (nanos >> (exponent - QUERY_STATS_SUB_BUCKET_BITS)) & (QUERY_STATS_SUB_BUCKETS - 1);
+    return (exponent - QUERY_STATS_SUB_BUCKET_BITS + 1) * QUERY_STATS_SUB_BUCKETS + subBucket;
+}
+
+// the highest time that falls in bucket, the value HDR histograms report for it
+static inline uint64_t bucketValue(uint32_t bucket) {
+    if (bucket < QUERY_STATS_SUB_BUCKETS)
+        return bucket;
+    uint32_t exponent = bucket / QUERY_STATS_SUB_BUCKETS + QUERY_STATS_SUB_BUCKET_BITS - 1;
+    uint32_t shift = exponent - QUERY_STATS_SUB_BUCKET_BITS;
+    uint64_t low = (uint64_t) (QUERY_STATS_SUB_BUCKETS + bucket % QUERY_STATS_SUB_BUCKETS) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static void addHistograms(histogram_set_t *set, thread_histograms_t *histograms) {
+    for (uint32_t metric = 0; metric < QUERY_STATS_MAX_METRICS; metric++) {
+        for (uint32_t bucket = 0; bucket < QUERY_STATS_BUCKET_COUNT; bucket++) {
+            set->counts[metric][bucket] += atomic_load_explicit(&histograms->counts[metric][bucket],
+                                                                memory_order_relaxed);
+        }
+        set->totalNanos[metric] += atomic_load_explicit(&histograms->totalNanos[metric], memory_order_relaxed);
+    }
+}
+
+static void retireHistograms(void *argument) {
+    thread_histograms_t *histograms = argument;
+    pthread_mutex_lock(&statsMutex);
+    thread_histograms_t **link = &liveHistograms;
+    while (*link != histograms) {
+        link = &(*link)->next;
+    }
+    *link = histograms->next;
+    addHistograms(&retiredHistograms, histograms);
+    pthread_mutex_unlock(&statsMutex);
+    free(histograms);
+}
+
+static void createHistogramsKey() {
+    pthread_key_create(&histogramsKey, retireHistograms);
+    pthread_key_create(&traceKey, NULL);
+}
+
+static thread_histograms_t *getThreadHistograms() {
+    pthread_once(&histogramsOnce, createHistogramsKey);
+    thread_histograms_t *histograms = pthread_getspecific(histogramsKey);
+    if (!histograms) {
+        histograms = calloc(1, sizeof(thread_histograms_t));
+        if (!histograms)
+            return 0;
+        pthread_setspecific(histogramsKey, histograms);
+        pthread_mutex_lock(&statsMutex);
+        histograms->next = liveHistograms;
+        liveHistograms = histograms;
+        pthread_mutex_unlock(&statsMutex);
+    }
+    return histograms;
+}
+
+static inline uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void query_stats_set_enabled(bool enabled) {
+    atomic_store(&statsEnabled, enabled);
+}
+
+query_trace_t* query_stats_trace() {
+    if (!atomic_load_explicit(&activeTraces, memory_order_relaxed))
+        return 0;
+    pthread_once(&histogramsOnce, createHistogramsKey);
+    return pthread_getspecific(traceKey);
+}
+
+uint64_t query_stats_start() {
+    return atomic_load_explicit(&statsEnabled, memory_order_relaxed) || query_stats_trace() ? now() : 0;
+}
+
+uint64_t query_stats_record(uint32_t metric, uint64_t start) {
+    if (!start || metric >= QUERY_STATS_MAX_METRICS)
+        return 0;
+    uint64_t end = now();
+    uint64_t nanos = end > start ? end - start : 0;
+    query_trace_t *trace = query_stats_trace();
+    if (trace)
+        trace->stageNanos[metric] += nanos;
+    if (!atomic_load_explicit(&statsEnabled, memory_order_relaxed))
+        return end;
+    thread_histograms_t *histograms = getThreadHistograms();
+    if (!histograms)
+        return end;
+    _Atomic uint64_t *count = &histograms->counts[metric][bucketOf(nanos)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    _Atomic uint64_t *total = &histograms->totalNanos[metric];
+    atomic_store_explicit(total, atomic_load_explicit(total, memory_order_relaxed) + nanos, memory_order_relaxed);
+    return end;
+}
+
+// everything recorded so far, called under statsMutex
+static void mergeHistograms(histogram_set_t *set) {
+    memcpy(set, &retiredHistograms, sizeof(histogram_set_t));
+    for (thread_histograms_t *histograms = liveHistograms; histograms; histograms = histograms->next) {
+        addHistograms(set, histograms);
+    }
+}
+
+void query_stats_summarize(uint32_t metricCount, query_stats_summary_t *summaries, bool reset) {
+    memset(summaries, 0, sizeof(query_stats_summary_t) * metricCount);
+    histogram_set_t *set = malloc(sizeof(histogram_set_t));
+    if (!set)
+        return;
+    pthread_mutex_lock(&statsMutex);
+    mergeHistograms(set);
+    for (uint32_t metric = 0; metric < QUERY_STATS_MAX_METRICS; metric++) {
+        for (uint32_t bucket = 0; bucket < QUERY_STATS_BUCKET_COUNT; bucket++) {
+            uint64_t count = set->counts[metric][bucket];
+            set->counts[metric][bucket] -= baseline.counts[metric][bucket];
+            if (reset)
+                baseline.counts[metric][bucket] = count;
+        }
+        uint64_t totalNanos = set->totalNanos[metric];
+        set->totalNanos[metric] -= baseline.totalNanos[metric];
+        if (reset)
+            baseline.totalNanos[metric] = totalNanos;
+    }
+    pthread_mutex_unlock(&statsMutex);
+
+    for (uint32_t metric = 0; metric < metricCount && metric < QUERY_STATS_MAX_METRICS; metric++) {
+        query_stats_summary_t *summary = &summaries[metric];
+        const uint64_t *counts = set->counts[metric];
+        for (uint32_t bucket = 0; bucket < QUERY_STATS_BUCKET_COUNT; bucket++) {
+            summary->count += counts[bucket];
+        }
+        summary->totalNanos = set->totalNanos[metric];
+        // ranks of the percentiles, rounded up so that a single record is every percentile
+        uint64_t ranks[] = {(summary->count * 500 + 999) / 1000, (summary->count * 900 + 999) / 1000,
+                            (summary->count * 990 + 999) / 1000, (summary->count * 999 + 999) / 1000,
+                            summary->count};
+        uint64_t *values[] = {&summary->p50Nanos, &summary->p90Nanos, &summary->p99Nanos, &summary->p999Nanos,
+                              &summary->maxNanos};
+        uint64_t seen = 0;
+        uint32_t next = 0;
+        for (uint32_t bucket = 0; bucket < QUERY_STATS_BUCKET_COUNT && next < 5 && summary->count; bucket++) {
+            seen += counts[bucket];
+            while (next < 5 && seen >= ranks[next]) {
+                *values[next++] = bucketValue(bucket);
+            }
+        }
+    }
+    free(set);
+}
+
+void query_stats_begin_trace(query_trace_t *trace) {
+    memset(trace, 0, sizeof(query_trace_t));
+    pthread_once(&histogramsOnce, createHistogramsKey);
+    pthread_setspecific(traceKey, trace);
+    atomic_fetch_add(&activeTraces, 1);
+    trace->startNanos = now();
+}
+
+uint64_t query_stats_end_trace(query_trace_t *trace) {
+    uint64_t end = now();
+    pthread_setspecific(traceKey, NULL);
+    atomic_fetch_sub(&activeTraces, 1);
+    return end > trace->startNanos ? end - trace->startNanos : 0;
+}
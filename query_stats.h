@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef JROARING_QUERY_STATS_H
+#define JROARING_QUERY_STATS_H
+
+#define QUERY_STATS_MAX_METRICS 24
+
+typedef struct query_stats_summary_s {
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t p50Nanos;
+    uint64_t p90Nanos;
+    uint64_t p99Nanos;
+    uint64_t p999Nanos;
+    uint64_t maxNanos;
+} query_stats_summary_t;
+
+typedef struct query_trace_s {
+    uint64_t startNanos;
+    uint64_t stageNanos[QUERY_STATS_MAX_METRICS];
+    uint64_t matchCount;
+} query_trace_t;
+
+/*
+ * Process wide latency histograms of up to QUERY_STATS_MAX_METRICS metrics, recorded by every thread into its
+ * own histograms and merged only when read. Buckets are log-linear: 8 per power of two of nanoseconds, so any
+ * reported value is within 12.5% of the recorded one, up to about a minute. Recording is off until enabled.
+ * All functions are safe to call from several threads.
+ */
+void query_stats_set_enabled(bool enabled);
+
+/*
+ * Current time to pass to query_stats_record, 0 while recording is off and the thread has no trace.
+ */
+uint64_t query_stats_start();
+
+/*
+ * Records the time since start under metric and returns the current time, so that consecutive stages can
+ * chain. Does nothing and returns 0 when start is 0.
+ */
+uint64_t query_stats_record(uint32_t metric, uint64_t start);
+
+/*
+ * Summaries of the first metricCount metrics since the last reset. With reset, the next summaries start from
+ * here, no record is lost in between.
+ */
+void query_stats_summarize(uint32_t metricCount, query_stats_summary_t *summaries, bool reset);
+
+/*
+ * Until query_stats_end_trace, whatever the calling thread records is also added up in trace, recording on or
+ * off. Records of other threads working for the same query are not.
+ */
+void query_stats_begin_trace(query_trace_t *trace);
+
+/*
+ * Detaches trace from the calling thread and returns the nanoseconds since it began.
+ */
+uint64_t query_stats_end_trace(query_trace_t *trace);
+
+/*
+ * Trace of the calling thread, NULL when it has none.
+ */
+query_trace_t* query_stats_trace();
+
+#endif //JROARING_QUERY_STATS_H
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "hash_map.h"
+#include "result_cache.h"
+
+#define RESULT_CACHE_BINS_COUNT 1024
+#define RESULT_CACHE_ENTRY_OVERHEAD 64
+
+typedef struct result_cache_entry_s {
+    struct result_cache_entry_s *previous;
+    struct result_cache_entry_s *next;
+    roaring_bitmap_t *bitmap;
+    uint64_t size;
+    uint32_t keyLength;
+    char key[];
+} result_cache_entry_t;
+
+/*
+ * Entries form a list from the most to the least recently used one. Each entry keeps its key to remove
+ * itself from the hash map when evicted.
+ */
+typedef struct result_cache_s {
+    pthread_mutex_t mutex;
+    hash_map_t *entries;
+    uint32_t binCount;
+    result_cache_entry_t *head;
+    result_cache_entry_t *tail;
+    uint64_t budgetBytes;
+    result_cache_stats_t stats;
+} result_cache_t;
+
+static void unlinkEntry(result_cache_t *cache, result_cache_entry_t *entry) {
+    if (entry->previous)
+        entry->previous->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next)
+        entry->next->previous = entry->previous;
+    else
+        cache->tail = entry->previous;
+    entry->previous = 0;
+    entry->next = 0;
+}
+
+static void linkEntry(result_cache_t *cache, result_cache_entry_t *entry) {
+    entry->previous = 0;
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->previous = entry;
+    cache->head = entry;
+    if (!cache->tail)
+        cache->tail = entry;
+}
+
+static void removeEntry(result_cache_t *cache, result_cache_entry_t *entry) {
+    hash_map_remove(cache->entries, entry->keyLength, entry->key);
+    unlinkEntry(cache, entry);
+    cache->stats.entryCount--;
+    cache->stats.usedBytes -= entry->size;
+    roaring_bitmap_free(entry->bitmap);
+    free(entry);
+}
+
+static void removeAllEntries(result_cache_t *cache) {
+    while (cache->head) {
+        removeEntry(cache, cache->head);
+    }
+}
+
+result_cache_t* result_cache_create(uint64_t budgetBytes) {
+    result_cache_t *cache = malloc(sizeof(result_cache_t));
+    if (!cache)
+        return 0;
+    memset(cache, 0, sizeof(result_cache_t));
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->binCount = RESULT_CACHE_BINS_COUNT;
+    cache->entries = hash_map_create_pre_sized(cache->binCount);
+    cache->budgetBytes = budgetBytes;
+    cache->stats.budgetBytes = budgetBytes;
+    return cache;
+}
+
+roaring_bitmap_t* result_cache_get(result_cache_t* cache, uint32_t keyLength, const void *key) {
+    if (!cache || cache->budgetBytes == 0)
+        return 0;
+    roaring_bitmap_t *bitmap = 0;
+    pthread_mutex_lock(&cache->mutex);
+    result_cache_entry_t *entry = hash_map_get(cache->entries, keyLength, key);
+    if (entry) {
+        unlinkEntry(cache, entry);
+        linkEntry(cache, entry);
+        bitmap = roaring_bitmap_copy(entry->bitmap);
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return bitmap;
+}
+
+void result_cache_put(result_cache_t* cache, uint32_t keyLength, const void *key, const roaring_bitmap_t *bitmap) {
+    if (!cache || cache->budgetBytes == 0)
+        return;
+    uint64_t size = roaring_bitmap_size_in_bytes(bitmap) + keyLength + RESULT_CACHE_ENTRY_OVERHEAD;
+    if (size > cache->budgetBytes)
+        return;
+    result_cache_entry_t *entry = malloc(sizeof(result_cache_entry_t) + keyLength);
+    if (!entry)
+        return;
+    entry->bitmap = roaring_bitmap_copy(bitmap);
+    entry->size = size;
+    entry->keyLength = keyLength;
+    memcpy(entry->key, key, keyLength);
+
+    pthread_mutex_lock(&cache->mutex);
+    // same key put by a concurrent miss
+    result_cache_entry_t *existing = hash_map_get(cache->entries, keyLength, key);
+    if (existing)
+        removeEntry(cache, existing);
+    while (cache->tail && cache->stats.usedBytes + size > cache->budgetBytes) {
+        removeEntry(cache, cache->tail);
+        cache->stats.evictions++;
+    }
+    if (cache->stats.entryCount >= cache->binCount) {
+        cache->binCount *= 2;
+        cache->entries = hash_map_reload_with_count(cache->entries, cache->binCount);
+    }
+    hash_map_put(cache->entries, keyLength, key, entry);
+    linkEntry(cache, entry);
+    cache->stats.entryCount++;
+    cache->stats.usedBytes += size;
+    cache->stats.insertions++;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void result_cache_reset(result_cache_t* cache, uint64_t budgetBytes) {
+    if (!cache)
+        return;
+    pthread_mutex_lock(&cache->mutex);
+    removeAllEntries(cache);
+    cache->budgetBytes = budgetBytes;
+    cache->stats.budgetBytes = budgetBytes;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void result_cache_stats(result_cache_t* cache, result_cache_stats_t *stats) {
+    if (!cache) {
+        memset(stats, 0, sizeof(result_cache_stats_t));
+        return;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void result_cache_free(result_cache_t* cache) {
+    if (!cache)
+        return;
+    removeAllEntries(cache);
+    hash_map_free(cache->entries);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <roaring/roaring.h>
+
+#ifndef JROARING_RESULT_CACHE_H
+#define JROARING_RESULT_CACHE_H
+
+typedef struct result_cache_s result_cache_t;
+
+typedef struct result_cache_stats_s {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    uint64_t entryCount;
+    uint64_t usedBytes;
+    uint64_t budgetBytes;
+} result_cache_stats_t;
+
+/*
+ * LRU cache of bitmaps keyed by arbitrary bytes, bounded by the memory taken by cached bitmaps and keys.
+ * All functions are safe to call from several threads. A zero budget disables caching.
+ */
+result_cache_t* result_cache_create(uint64_t budgetBytes);
+
+/*
+ * Returns a copy of the cached bitmap, owned by the caller, or NULL on miss.
+ */
+roaring_bitmap_t* result_cache_get(result_cache_t* cache, uint32_t keyLength, const void *key);
+
+/*
+ * Stores a copy of the bitmap, evicting least recently used entries to stay within the budget.
+ */
+void result_cache_put(result_cache_t* cache, uint32_t keyLength, const void *key, const roaring_bitmap_t *bitmap);
+
+/*
+ * Drops every entry and applies new budget. Counters are kept.
+ */
+void result_cache_reset(result_cache_t* cache, uint64_t budgetBytes);
+
+void result_cache_stats(result_cache_t* cache, result_cache_stats_t *stats);
+
+void result_cache_free(result_cache_t* cache);
+
+#endif //JROARING_RESULT_CACHE_H
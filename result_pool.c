@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "result_pool.h"
+
+#define RESULT_POOL_MIN_CLASS 6
+#define RESULT_POOL_CLASS_COUNT 48
+// bytes of free blocks kept per size class, blocks of larger classes are never kept so that one huge result
+// is not held forever
+#define RESULT_POOL_FREE_BYTES_PER_CLASS (16 << 20)
+#define RESULT_POOL_MAGIC 0x4a52504cu
+#define RESULT_POOL_FREE_MAGIC 0x46524545u
+
+/*
+ * Header in front of every block, 16 bytes so that the data stays aligned for any element type.
+ */
+typedef struct result_block_s {
+    struct result_block_s *next;
+    uint32_t sizeClass;
+    uint32_t magic;
+} result_block_t;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static result_block_t *freeBlocks[RESULT_POOL_CLASS_COUNT];
+static uint32_t freeBlockCounts[RESULT_POOL_CLASS_COUNT];
+static result_pool_stats_t poolStats;
+
+static inline uint32_t sizeClassOf(size_t length) {
+    uint32_t sizeClass = RESULT_POOL_MIN_CLASS;
+    while (sizeClass < RESULT_POOL_CLASS_COUNT - 1 && ((size_t) 1 << sizeClass) < length) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+static inline uint32_t maxFreeBlocks(uint32_t sizeClass) {
+    return (uint64_t) RESULT_POOL_FREE_BYTES_PER_CLASS >> sizeClass;
+}
+
+void* result_pool_acquire(size_t length) {
+    uint32_t sizeClass = sizeClassOf(length);
+    if (((size_t) 1 << sizeClass) < length)
+        return 0;
+    pthread_mutex_lock(&poolMutex);
+    result_block_t *block = freeBlocks[sizeClass];
+    if (block) {
+        freeBlocks[sizeClass] = block->next;
+        freeBlockCounts[sizeClass]--;
+        poolStats.freeBytes -= (uint64_t) 1 << sizeClass;
+        poolStats.reused++;
+    }
+    poolStats.acquired++;
+    poolStats.outstandingBytes += (uint64_t) 1 << sizeClass;
+    pthread_mutex_unlock(&poolMutex);
+
+    if (!block) {
+        block = malloc(sizeof(result_block_t) + ((size_t) 1 << sizeClass));
+        if (!block) {
+            pthread_mutex_lock(&poolMutex);
+            poolStats.acquired--;
+            poolStats.outstandingBytes -= (uint64_t) 1 << sizeClass;
+            pthread_mutex_unlock(&poolMutex);
+            return 0;
+        }
+        block->sizeClass = sizeClass;
+    }
+    block->next = 0;
+    block->magic = RESULT_POOL_MAGIC;
+    return block + 1;
+}
+
+void result_pool_release(void *data) {
+    if (!data)
+        return;
+    result_block_t *block = (result_block_t *) data - 1;
+    if (block->magic != RESULT_POOL_MAGIC || block->sizeClass >= RESULT_POOL_CLASS_COUNT)
+        return;
+    uint32_t sizeClass = block->sizeClass;
+    pthread_mutex_lock(&poolMutex);
+    // best effort only: a block released twice is caught while it waits on a free list, not once reused or freed
+    if (block->magic != RESULT_POOL_MAGIC) {
+        pthread_mutex_unlock(&poolMutex);
+        return;
+    }
+    block->magic = RESULT_POOL_FREE_MAGIC;
+    poolStats.released++;
+    poolStats.outstandingBytes -= (uint64_t) 1 << sizeClass;
+    bool isKept = freeBlockCounts[sizeClass] < maxFreeBlocks(sizeClass);
+    if (isKept) {
+        block->next = freeBlocks[sizeClass];
+        freeBlocks[sizeClass] = block;
+        freeBlockCounts[sizeClass]++;
+        poolStats.freeBytes += (uint64_t) 1 << sizeClass;
+    }
+    pthread_mutex_unlock(&poolMutex);
+    if (!isKept)
+        free(block);
+}
+
+void result_pool_stats(result_pool_stats_t *stats) {
+    pthread_mutex_lock(&poolMutex);
+    *stats = poolStats;
+    pthread_mutex_unlock(&poolMutex);
+}
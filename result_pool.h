@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef JROARING_RESULT_POOL_H
+#define JROARING_RESULT_POOL_H
+
+typedef struct result_pool_stats_s {
+    uint64_t acquired;
+    uint64_t reused;
+    uint64_t released;
+    uint64_t outstandingBytes;
+    uint64_t freeBytes;
+} result_pool_stats_t;
+
+/*
+ * Process wide pool of blocks query results are written to before Java gets them as direct buffers.
+ * Blocks come in power of two sizes, a released block waits on the free list of its size for the next
+ * result of about the same length, as long as that list holds less than 16 MB. Returns NULL when out of memory.
+ * All functions are safe to call from several threads.
+ */
+void* result_pool_acquire(size_t length);
+
+/*
+ * Returns block to the pool. The block must come from result_pool_acquire and be released exactly once: right
+ * after the call it may be freed or handed out to another result, so a second release is undefined.
+ */
+void result_pool_release(void *block);
+
+void result_pool_stats(result_pool_stats_t *stats);
+
+#endif //JROARING_RESULT_POOL_H
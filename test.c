@@ -4,7 +4,928 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "MurmurHash3.h"
 #include "hash_map.h"
+#include "expression.h"
+#include "bit_sliced_index.h"
+#include "query_log.h"
+#include "ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring.h"
+
+// seed hash_map.c hashes keys with
+#define TEST_HASH_SEED 0x5EC327D1
+#define COLLISION_SEARCH_KEYS (1 << 18)
+#define EXPRESSION_TEST_FEATURES 10
+#define EXPRESSION_TEST_PRODUCTS 64
+#define QUERY_LOG_TEST_WRITERS 4
+#define QUERY_LOG_TEST_APPENDS 200000
+#define BIT_SLICED_TEST_KEYS 512
+#define LOOKUP_TEST_PRODUCTS 60
+#define LOOKUP_TEST_FEATURES 5
+#define LOOKUP_TEST_SHARDS 2
+#define LOOKUP_TEST_PRICE_FROM 1.0f
+#define LOOKUP_TEST_PRICE_TO 3.5f
+
+typedef struct key_hash_s {
+    uint32_t hash;
+    uint64_t key;
+} key_hash_t;
+
+static int compareKeyHashes(const void *a, const void *b) {
+    uint32_t first = ((const key_hash_t *) a)->hash;
+    uint32_t second = ((const key_hash_t *) b)->hash;
+    return first < second ? -1 : first > second;
+}
+
+static int check(int condition, const char *what) {
+    if(!condition)
+        printf("\nFAILED: %s", what);
+    return !condition;
+}
+
+// two keys with the same 32-bit hash must still be told apart by their bytes
+static int testCollidingKeys() {
+    key_hash_t *hashes = malloc(sizeof(key_hash_t) * COLLISION_SEARCH_KEYS);
+    // keys differ in both 32-bit words, a single word is mixed one to one and never collides
+    for(uint32_t i = 0; i < COLLISION_SEARCH_KEYS; i++) {
+        hashes[i].key = i * 0x9E3779B97F4A7C15ULL;
+        MurmurHash3_x86_32(&hashes[i].key, sizeof(uint64_t), TEST_HASH_SEED, &hashes[i].hash);
+    }
+    qsort(hashes, COLLISION_SEARCH_KEYS, sizeof(key_hash_t), compareKeyHashes);
+    uint32_t i = 1;
+    while(i < COLLISION_SEARCH_KEYS && hashes[i].hash != hashes[i - 1].hash)
+        i++;
+    int failures = check(i < COLLISION_SEARCH_KEYS, "no colliding keys found");
+    if(!failures) {
+        uint64_t first = hashes[i - 1].key;
+        uint64_t second = hashes[i].key;
+        uint32_t values[] = {1, 2};
+        hash_map_t* hashMap = hash_map_create_with_hash(16, HASH_MAP_HASH_MURMUR3_32);
+        hash_map_put(hashMap, sizeof(uint64_t), &first, &values[0]);
+        failures += check(!hash_map_contains(hashMap, sizeof(uint64_t), &second), "colliding key found before put");
+        hash_map_put(hashMap, sizeof(uint64_t), &second, &values[1]);
+        failures += check(hash_map_get(hashMap, sizeof(uint64_t), &first) == &values[0], "first colliding key");
+        failures += check(hash_map_get(hashMap, sizeof(uint64_t), &second) == &values[1], "second colliding key");
+        failures += check(hash_map_remove(hashMap, sizeof(uint64_t), &first) == &values[0], "colliding key removed");
+        failures += check(hash_map_get(hashMap, sizeof(uint64_t), &second) == &values[1], "colliding key after remove");
+        hash_map_free(hashMap);
+    }
+    free(hashes);
+    return failures;
+}
+
+// removed keys leave deleted slots behind, reinserting must reuse them without losing or duplicating keys
+static int testRemoveAndReinsert() {
+    int failures = 0;
+    uint32_t count = 1000;
+    uint32_t *values = malloc(sizeof(uint32_t) * count * 2);
+    for(uint32_t i = 0; i < count * 2; i++) {
+        values[i] = i;
+    }
+    hash_map_t* hashMap = hash_map_create();
+    for(uint32_t i = 0; i < count; i++) {
+        hash_map_put(hashMap, sizeof(uint32_t), &i, &values[i]);
+    }
+    for(int round = 0; round < 20; round++) {
+        for(uint32_t i = round % 2; i < count; i += 2) {
+            failures += check(hash_map_remove(hashMap, sizeof(uint32_t), &i) != 0, "remove present key");
+        }
+        for(uint32_t i = round % 2; i < count; i += 2) {
+            failures += check(!hash_map_contains(hashMap, sizeof(uint32_t), &i), "removed key still found");
+            hash_map_put(hashMap, sizeof(uint32_t), &i, &values[count + i]);
+        }
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        failures += check(hash_map_get(hashMap, sizeof(uint32_t), &i) == &values[count + i], "reinserted key");
+        failures += check(hash_map_remove(hashMap, sizeof(uint32_t), &i) == &values[count + i],
+                          "remove reinserted key");
+        failures += check(!hash_map_remove(hashMap, sizeof(uint32_t), &i), "key removed twice");
+    }
+    hash_map_free(hashMap);
+    free(values);
+    return failures;
+}
+
+// keys over 16 bytes live in the key buffer, which is compacted as removed keys pile up in it
+static int testLongKeys() {
+    int failures = 0;
+    uint32_t count = 2000;
+    uint32_t *values = malloc(sizeof(uint32_t) * count);
+    char key[64];
+    hash_map_t* hashMap = hash_map_create();
+    for(uint32_t i = 0; i < count; i++) {
+        values[i] = i;
+        int keyLength = sprintf(key, "a key longer than sixteen bytes %u", i);
+        hash_map_put(hashMap, keyLength, key, &values[i]);
+        // every other key goes again right away, leaving its bytes behind as garbage
+        if(i % 2) {
+            hash_map_remove(hashMap, keyLength, key);
+        }
+    }
+    for(uint32_t i = 1; i < count; i += 2) {
+        int keyLength = sprintf(key, "a key longer than sixteen bytes %u", i);
+        hash_map_put(hashMap, keyLength, key, &values[i]);
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        int keyLength = sprintf(key, "a key longer than sixteen bytes %u", i);
+        failures += check(hash_map_get(hashMap, keyLength, key) == &values[i], "long key");
+        key[keyLength - 1] = 'x';
+        failures += check(!hash_map_contains(hashMap, keyLength, key), "long key differing in its last byte");
+    }
+    hash_map_free(hashMap);
+    free(values);
+    return failures;
+}
+
+// reloading resizes in place, the caller keeps the same map with the same entries
+static int testReload() {
+    int failures = 0;
+    uint32_t values[100];
+    hash_map_t* hashMap = hash_map_create();
+    for(uint32_t i = 0; i < 100; i++) {
+        values[i] = i;
+        hash_map_put(hashMap, sizeof(uint32_t), &i, &values[i]);
+    }
+    for(uint32_t i = 0; i < 100; i += 3) {
+        hash_map_remove(hashMap, sizeof(uint32_t), &i);
+    }
+    failures += check(hash_map_reload(hashMap) == hashMap, "reload returns the same map");
+    failures += check(hash_map_reload_with_count(hashMap, 5000) == hashMap, "reload with count returns the same map");
+    for(uint32_t i = 0; i < 100; i++) {
+        failures += check(hash_map_get(hashMap, sizeof(uint32_t), &i) == (i % 3 ? &values[i] : 0), "key after reload");
+    }
+    hash_map_free(hashMap);
+    return failures;
+}
+
+// NULL and empty keys find nothing, whatever length comes with them, and do not shift the other results
+static int testGetManySkipsMissingKeys() {
+    int failures = 0;
+    uint32_t values[200];
+    hash_map_t* hashMap = hash_map_create_with_hash(0, HASH_MAP_HASH_FAST64);
+    for(uint32_t i = 0; i < 200; i++) {
+        values[i] = i;
+        hash_map_put(hashMap, sizeof(uint32_t), &values[i], &values[i]);
+    }
+    const void* keys[200];
+    uint32_t keyLengths[200];
+    void* found[200];
+    for(uint32_t i = 0; i < 200; i++) {
+        keys[i] = i % 5 == 0 ? 0 : &values[i];
+        keyLengths[i] = i % 7 == 0 ? 0 : sizeof(uint32_t);
+    }
+    hash_map_get_many(hashMap, 200, keyLengths, keys, found);
+    for(uint32_t i = 0; i < 200; i++) {
+        void* expected = i % 5 == 0 || i % 7 == 0 ? 0 : &values[i];
+        failures += check(found[i] == expected, "get_many result");
+    }
+    hash_map_free(hashMap);
+    return failures;
+}
+
+typedef struct expression_test_s {
+    roaring_bitmap_t *features[EXPRESSION_TEST_FEATURES];
+    roaring_bitmap_t *extFeatures[EXPRESSION_TEST_FEATURES];
+    uint32_t products[EXPRESSION_TEST_PRODUCTS];
+    expression_source_t source;
+} expression_test_t;
+
+// feature f holds the products divisible by f + 2, ext feature f the ones below 4 * f, feature 9 is missing
+static void initExpressionTest(expression_test_t *test) {
+    for(uint32_t f = 0; f < EXPRESSION_TEST_FEATURES; f++) {
+        test->features[f] = f == 9 ? 0 : roaring_bitmap_create();
+        test->extFeatures[f] = roaring_bitmap_create();
+        for(uint32_t i = 0; i < EXPRESSION_TEST_PRODUCTS; i++) {
+            if(test->features[f] && i % (f + 2) == 0)
+                roaring_bitmap_add(test->features[f], i);
+            if(i < 4 * f)
+                roaring_bitmap_add(test->extFeatures[f], i);
+        }
+    }
+    for(uint32_t i = 0; i < EXPRESSION_TEST_PRODUCTS; i++) {
+        test->products[i] = i;
+    }
+    test->source.features = test->features;
+    test->source.extFeatures = test->extFeatures;
+    test->source.featureCount = EXPRESSION_TEST_FEATURES;
+    test->source.products = test->products;
+    test->source.productCount = EXPRESSION_TEST_PRODUCTS;
+}
+
+static void freeExpressionTest(expression_test_t *test) {
+    for(uint32_t f = 0; f < EXPRESSION_TEST_FEATURES; f++) {
+        roaring_bitmap_free(test->features[f]);
+        roaring_bitmap_free(test->extFeatures[f]);
+    }
+}
+
+// the products text matches, computed by hand with the same features the test source has
+static int checkExpression(expression_test_t *test, const char *text, int (*expected)(uint32_t), const char *what) {
+    expression_t *expression = expression_compile(text, strlen(text), EXPRESSION_TEST_FEATURES);
+    if(check(expression != 0, what))
+        return 1;
+    roaring_bitmap_t *result = expression_evaluate(expression, &test->source);
+    int failures = 0;
+    for(uint32_t i = 0; i < EXPRESSION_TEST_PRODUCTS; i++) {
+        failures += check(roaring_bitmap_contains(result, i) == (expected(i) != 0), what);
+    }
+    roaring_bitmap_free(result);
+    expression_free(expression);
+    return failures;
+}
+
+static int nestedProducts(uint32_t i) {
+    // ((0|1)&(2|(3&e4)))
+    return (i % 2 == 0 || i % 3 == 0) && (i % 4 == 0 || (i % 5 == 0 && i < 16));
+}
+
+static int negatedProducts(uint32_t i) {
+    // !0&e3
+    return i % 2 != 0 && i < 12;
+}
+
+static int featureOneProducts(uint32_t i) {
+    return i % 3 == 0;
+}
+
+static int noProducts(uint32_t i) {
+    return 0;
+}
+
+static int allProducts(uint32_t i) {
+    return 1;
+}
+
+static int extFeatureProducts(uint32_t i) {
+    // e2|e5&1
+    return i < 20 && i % 3 == 0;
+}
+
+static int sameCanonical(const char *text1, const char *text2) {
+    expression_t *expression1 = expression_compile(text1, strlen(text1), EXPRESSION_TEST_FEATURES);
+    expression_t *expression2 = expression_compile(text2, strlen(text2), EXPRESSION_TEST_FEATURES);
+    int isSame = 0;
+    if(expression1 && expression2) {
+        uint32_t length1;
+        uint32_t length2;
+        char *canonical1 = expression_canonical(expression1, &length1);
+        char *canonical2 = expression_canonical(expression2, &length2);
+        isSame = length1 == length2 && memcmp(canonical1, canonical2, length1) == 0;
+        free(canonical1);
+        free(canonical2);
+    }
+    expression_free(expression1);
+    expression_free(expression2);
+    return isSame;
+}
+
+static int rejects(const char *text) {
+    expression_t *expression = expression_compile(text, strlen(text), EXPRESSION_TEST_FEATURES);
+    expression_free(expression);
+    return expression == 0;
+}
+
+static int testExpressions() {
+    int failures = 0;
+    expression_test_t test;
+    initExpressionTest(&test);
+    failures += checkExpression(&test, "((0|1)&(2|(3&e4)))", nestedProducts, "nested expression");
+    failures += checkExpression(&test, "(((((1)))))", featureOneProducts, "redundant parentheses");
+    failures += checkExpression(&test, "!0&e3", negatedProducts, "negation");
+    failures += checkExpression(&test, "!!1", featureOneProducts, "double negation");
+    failures += checkExpression(&test, "!(!(1))", featureOneProducts, "double negation around parentheses");
+    failures += checkExpression(&test, "!9", allProducts, "negation of a missing feature");
+    failures += checkExpression(&test, "e2|e5&1", extFeatureProducts, "ext features");
+    failures += checkExpression(&test, "1|10|e42", featureOneProducts, "out of range operands dropped from OR");
+    failures += checkExpression(&test, "1&10", featureOneProducts, "out of range operand dropped from AND");
+    failures += checkExpression(&test, "10", noProducts, "only out of range operands");
+    failures += checkExpression(&test, "", noProducts, "empty expression");
+    failures += check(sameCanonical("1&10", "1"), "dropped operand leaves no trace in canonical text");
+
+    failures += check(rejects("1&x"), "unknown operand rejected");
+    failures += check(rejects("1&!"), "negation without operand rejected");
+    failures += check(rejects("e"), "ext prefix without number rejected");
+    failures += check(rejects("1+2"), "unknown operator rejected");
+
+    failures += check(sameCanonical("1&2", "2&1"), "reordered AND operands");
+    failures += check(sameCanonical("(1|2)&e3", "e3&(2|1)"), "reordered nested operands");
+    failures += check(sameCanonical("2&1&2", "1&2"), "duplicated AND operands");
+    failures += check(sameCanonical("1|1|e1", "e1|1"), "duplicated OR operands");
+    failures += check(sameCanonical("!!3", "3"), "double negation in canonical text");
+    failures += check(!sameCanonical("1&2", "1|2"), "different operators");
+    failures += check(!sameCanonical("1", "e1"), "feature and ext feature");
+    failures += check(!sameCanonical("!1", "1"), "negation kept in canonical text");
+    freeExpressionTest(&test);
+    return failures;
+}
+
+// encoded attribute values compare as the floats they come from, so value ranges map to encoded ranges
+static int testValueEncodingOrder() {
+    int failures = 0;
+    float values[] = {-INFINITY, -1e30f, -2.5f, -1.0f, -1e-30f, 0.0f, 1e-30f, 0.5f, 1.0f, 2.5f, 1e30f, INFINITY};
+    uint32_t count = sizeof(values) / sizeof(values[0]);
+    for(uint32_t i = 1; i < count; i++) {
+        failures += check(bit_sliced_index_encode(values[i - 1]) < bit_sliced_index_encode(values[i]),
+                          "encoded values keep their order");
+    }
+    failures += check(bit_sliced_index_encode(-0.0f) == bit_sliced_index_encode(0.0f), "both zeros encoded alike");
+    return failures;
+}
+
+typedef struct bit_sliced_test_entry_s {
+    float value;
+    uint32_t key;
+} bit_sliced_test_entry_t;
+
+static const float bitSlicedTestValues[] = {-INFINITY, -1e30f, -2.5f, -1.0f, -0.0f, 0.0f, 1e-30f, 0.5f, 1.0f, 2.5f,
+                                            1e30f, INFINITY};
+
+static uint32_t nextTestRandom(uint32_t *state) {
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+// every key in a range of encoded values, and no other, compared with a scan over the entries
+static int checkBitSlicedRanges(const bit_sliced_index_t *index, const bit_sliced_test_entry_t *entries,
+                                uint32_t count, const char *what) {
+    uint32_t valueCount = sizeof(bitSlicedTestValues) / sizeof(bitSlicedTestValues[0]);
+    int failures = 0;
+    for(uint32_t from = 0; from <= valueCount; from++) {
+        for(uint32_t to = 0; to <= valueCount; to++) {
+            // the last bound of each side stands for an open one
+            uint32_t fromCode = from < valueCount ? bit_sliced_index_encode(bitSlicedTestValues[from]) : 0;
+            uint32_t toCode = to < valueCount ? bit_sliced_index_encode(bitSlicedTestValues[to]) : UINT32_MAX;
+            roaring_bitmap_t *range = bit_sliced_index_range(index, fromCode, toCode);
+            uint64_t expectedCount = 0;
+            int isSame = 1;
+            for(uint32_t i = 0; i < count; i++) {
+                if(entries[i].key == BIT_SLICED_INDEX_NO_KEY)
+                    continue;
+                uint32_t code = bit_sliced_index_encode(entries[i].value);
+                int isExpected = code >= fromCode && code <= toCode;
+                expectedCount += isExpected;
+                isSame &= isExpected == roaring_bitmap_contains(range, entries[i].key);
+            }
+            failures += check(isSame && roaring_bitmap_get_cardinality(range) == expectedCount, what);
+            roaring_bitmap_free(range);
+        }
+    }
+    return failures;
+}
+
+static int testBitSlicedIndex() {
+    uint32_t valueCount = sizeof(bitSlicedTestValues) / sizeof(bitSlicedTestValues[0]);
+    bit_sliced_test_entry_t *entries = malloc(sizeof(bit_sliced_test_entry_t) * BIT_SLICED_TEST_KEYS);
+    uint32_t state = 1;
+    for(uint32_t i = 0; i < BIT_SLICED_TEST_KEYS; i++) {
+        entries[i].value = bitSlicedTestValues[nextTestRandom(&state) % valueCount];
+        // some entries hold nothing, as tombstones of an attribute do
+        entries[i].key = i % 7 == 3 ? BIT_SLICED_INDEX_NO_KEY : i * 3;
+    }
+    bit_sliced_index_t *index = bit_sliced_index_create(BIT_SLICED_TEST_KEYS, &entries[0].key, &entries[0].value,
+                                                        sizeof(bit_sliced_test_entry_t));
+    int failures = check(index != 0, "bit sliced index created");
+    if(failures) {
+        free(entries);
+        return failures;
+    }
+    failures += checkBitSlicedRanges(index, entries, BIT_SLICED_TEST_KEYS, "ranges after create");
+
+    for(uint32_t i = 0; i < BIT_SLICED_TEST_KEYS / 2; i++) {
+        uint32_t entry = nextTestRandom(&state) % BIT_SLICED_TEST_KEYS;
+        uint32_t key = entry * 3;
+        if(nextTestRandom(&state) % 3 == 0) {
+            bit_sliced_index_remove(index, key);
+            entries[entry].key = BIT_SLICED_INDEX_NO_KEY;
+        } else {
+            entries[entry].value = bitSlicedTestValues[nextTestRandom(&state) % valueCount];
+            entries[entry].key = key;
+            bit_sliced_index_set(index, key, bit_sliced_index_encode(entries[entry].value));
+        }
+    }
+    failures += checkBitSlicedRanges(index, entries, BIT_SLICED_TEST_KEYS, "ranges after set and remove");
+    roaring_bitmap_t *empty = bit_sliced_index_range(index, 2, 1);
+    failures += check(roaring_bitmap_is_empty(empty), "range with from above to is empty");
+    roaring_bitmap_free(empty);
+    bit_sliced_index_free(index);
+    free(entries);
+    return failures;
+}
+
+static void appendQueryLog(query_log_t* log, int64_t resultLength) {
+    query_log_record_t record;
+    memset(&record, 0, sizeof(query_log_record_t));
+    record.resultLength = resultLength;
+    query_log_append(log, &record);
+}
+
+// appends past capacity overwrite the oldest records, the drain returns the newest ones and counts the rest
+static int testQueryLogOverflow() {
+    int failures = 0;
+    query_log_t* log = query_log_create(4);
+    query_log_record_t records[4];
+    uint64_t dropped;
+    for(int64_t i = 0; i < 10; i++) {
+        appendQueryLog(log, i);
+    }
+    uint32_t count = query_log_drain(log, records, &dropped);
+    failures += check(count == 4 && dropped == 6, "drain after overflow");
+    for(uint32_t i = 0; i < count; i++) {
+        failures += check(records[i].resultLength == 6 + i, "newest records oldest first");
+    }
+    appendQueryLog(log, 10);
+    appendQueryLog(log, 11);
+    count = query_log_drain(log, records, &dropped);
+    failures += check(count == 2 && dropped == 0 && records[0].resultLength == 10 && records[1].resultLength == 11,
+                      "drain after overflow was counted");
+    count = query_log_drain(log, records, &dropped);
+    failures += check(count == 0 && dropped == 0, "empty drain");
+    query_log_free(log);
+    return failures;
+}
+
+// a writer finding its slot in use gives up, and its record is counted as dropped by exactly one drain
+static int testQueryLogBusySlot() {
+    int failures = 0;
+    query_log_t* log = query_log_create(2);
+    query_log_record_t records[2];
+    uint64_t dropped;
+    appendQueryLog(log, 0);
+    failures += check(query_log_drain(log, records, &dropped) == 1 && dropped == 0, "first record drained");
+    // as if a slow drain still held the record of ticket 0, so the writer of ticket 2 finds the slot busy
+    query_log_hold_slot(log, 0);
+    appendQueryLog(log, 1);
+    appendQueryLog(log, 2);
+    query_log_release_slot(log, 0);
+    uint32_t count = query_log_drain(log, records, &dropped);
+    failures += check(count == 1 && records[0].resultLength == 1 && dropped == 1, "given up record counted");
+    count = query_log_drain(log, records, &dropped);
+    failures += check(count == 0 && dropped == 0, "given up record counted once");
+    appendQueryLog(log, 3);
+    appendQueryLog(log, 4);
+    count = query_log_drain(log, records, &dropped);
+    failures += check(count == 2 && dropped == 0 && records[0].resultLength == 3 && records[1].resultLength == 4,
+                      "slot reused after give up");
+    query_log_free(log);
+    return failures;
+}
+
+typedef struct query_log_writers_s {
+    query_log_t* log;
+    atomic_uint finished;
+} query_log_writers_t;
+
+static void *appendQueryLogRecords(void *argument) {
+    query_log_writers_t* writers = argument;
+    for(int64_t i = 0; i < QUERY_LOG_TEST_APPENDS; i++) {
+        appendQueryLog(writers->log, i);
+    }
+    atomic_fetch_add(&writers->finished, 1);
+    return 0;
+}
+
+// writers race each other and the drain on a small ring, yet every append is drained or dropped exactly once
+static int testQueryLogConcurrentDrain() {
+    int failures = 0;
+    for(uint32_t capacity = 1; capacity <= 64; capacity *= 8) {
+        query_log_t* log = query_log_create(capacity);
+        query_log_record_t *records = malloc(sizeof(query_log_record_t) * capacity);
+        query_log_writers_t writerState = {log};
+        atomic_init(&writerState.finished, 0);
+        pthread_t writers[QUERY_LOG_TEST_WRITERS];
+        for(uint32_t i = 0; i < QUERY_LOG_TEST_WRITERS; i++) {
+            pthread_create(&writers[i], NULL, appendQueryLogRecords, &writerState);
+        }
+        uint64_t drained = 0;
+        uint64_t dropped = 0;
+        uint64_t appended = (uint64_t) QUERY_LOG_TEST_WRITERS * QUERY_LOG_TEST_APPENDS;
+        while(atomic_load(&writerState.finished) < QUERY_LOG_TEST_WRITERS) {
+            uint64_t drainDropped;
+            drained += query_log_drain(log, records, &drainDropped);
+            dropped += drainDropped;
+        }
+        for(uint32_t i = 0; i < QUERY_LOG_TEST_WRITERS; i++) {
+            pthread_join(writers[i], NULL);
+        }
+        // the last writers are done, so a drain or two settles every ticket
+        for(uint32_t i = 0; i < 2; i++) {
+            uint64_t drainDropped;
+            drained += query_log_drain(log, records, &drainDropped);
+            dropped += drainDropped;
+        }
+        failures += check(drained + dropped == appended, "appended == drained + dropped");
+        free(records);
+        query_log_free(log);
+    }
+    return failures;
+}
+
+/*
+ * Java side of the JNI calls the lookup tests make. Strings, arrays and direct buffers are plain structs
+ * and only the functions the lookup and load paths of library.c call are there.
+ */
+typedef struct test_java_object_s {
+    jsize length;
+    void *elements;
+} test_java_object_t;
+
+static jobject testJavaObject(test_java_object_t *object, jsize length, const void *elements) {
+    object->length = length;
+    object->elements = (void *) elements;
+    return (jobject) object;
+}
+
+static jsize JNICALL testGetArrayLength(JNIEnv *env, jarray array) {
+    return ((test_java_object_t *) array)->length;
+}
+
+static jint *JNICALL testGetIntArrayElements(JNIEnv *env, jintArray array, jboolean *isCopy) {
+    if(isCopy)
+        *isCopy = JNI_FALSE;
+    return ((test_java_object_t *) array)->elements;
+}
+
+static void JNICALL testReleaseIntArrayElements(JNIEnv *env, jintArray array, jint *elements, jint mode) {
+}
+
+static jfloat *JNICALL testGetFloatArrayElements(JNIEnv *env, jfloatArray array, jboolean *isCopy) {
+    if(isCopy)
+        *isCopy = JNI_FALSE;
+    return ((test_java_object_t *) array)->elements;
+}
+
+static void JNICALL testReleaseFloatArrayElements(JNIEnv *env, jfloatArray array, jfloat *elements, jint mode) {
+}
+
+static void JNICALL testGetFloatArrayRegion(JNIEnv *env, jfloatArray array, jsize start, jsize length,
+                                            jfloat *buffer) {
+    memcpy(buffer, (jfloat *) ((test_java_object_t *) array)->elements + start, sizeof(jfloat) * length);
+}
+
+static jobject JNICALL testGetObjectArrayElement(JNIEnv *env, jobjectArray array, jsize index) {
+    return ((jobject *) ((test_java_object_t *) array)->elements)[index];
+}
+
+static void JNICALL testDeleteLocalRef(JNIEnv *env, jobject object) {
+}
+
+static jsize JNICALL testGetStringUTFLength(JNIEnv *env, jstring string) {
+    return ((test_java_object_t *) string)->length;
+}
+
+static const char *JNICALL testGetStringUTFChars(JNIEnv *env, jstring string, jboolean *isCopy) {
+    if(isCopy)
+        *isCopy = JNI_FALSE;
+    return ((test_java_object_t *) string)->elements;
+}
+
+static void JNICALL testReleaseStringUTFChars(JNIEnv *env, jstring string, const char *chars) {
+}
+
+static void *JNICALL testGetDirectBufferAddress(JNIEnv *env, jobject buffer) {
+    return ((test_java_object_t *) buffer)->elements;
+}
+
+static jlong JNICALL testGetDirectBufferCapacity(JNIEnv *env, jobject buffer) {
+    return ((test_java_object_t *) buffer)->length;
+}
+
+static const struct JNINativeInterface_ testJniFunctions = {
+        .GetArrayLength = testGetArrayLength,
+        .GetIntArrayElements = testGetIntArrayElements,
+        .ReleaseIntArrayElements = testReleaseIntArrayElements,
+        .GetFloatArrayElements = testGetFloatArrayElements,
+        .ReleaseFloatArrayElements = testReleaseFloatArrayElements,
+        .GetFloatArrayRegion = testGetFloatArrayRegion,
+        .GetObjectArrayElement = testGetObjectArrayElement,
+        .DeleteLocalRef = testDeleteLocalRef,
+        .GetStringUTFLength = testGetStringUTFLength,
+        .GetStringUTFChars = testGetStringUTFChars,
+        .ReleaseStringUTFChars = testReleaseStringUTFChars,
+        .GetDirectBufferAddress = testGetDirectBufferAddress,
+        .GetDirectBufferCapacity = testGetDirectBufferCapacity,
+};
+
+static JNIEnv testEnv = &testJniFunctions;
+
+/*
+ * Products of the lookup tests, by their index. Groups of three neighbours share ties in group order and in price,
+ * some products have no price and some are left out of the rank sorting index. Every product has a weight, so an
+ * index by weight covers them all and dense pages by it are read off the index itself.
+ */
+static uint32_t lookupTestProductId(uint32_t i) {
+    return 100 + i * 3;
+}
+
+static uint32_t lookupTestGroup(uint32_t i) {
+    return 5 + i / 3;
+}
+
+static uint32_t lookupTestGroupOrder(uint32_t i) {
+    return i / 2 % 2;
+}
+
+static int lookupTestHasFeature(uint32_t i, uint32_t feature) {
+    switch(feature) {
+        case 0:
+            return i % 2 == 0;
+        case 1:
+            return i % 3 == 0;
+        case 2:
+            return i % 5 < 2;
+        case 3:
+            return i % 7 == 0;
+        default:
+            // the only product of the first shard with it, 40, has no price
+            return i % 20 == 0 || i == 13;
+    }
+}
+
+static int lookupTestHasPrice(uint32_t i) {
+    return i % 9 != 4;
+}
+
+static float lookupTestPrice(uint32_t i) {
+    return (float) ((i * 37 + 5) % 11) / 2;
+}
+
+static float lookupTestWeight(uint32_t i) {
+    return (float) (i * 11 % 7);
+}
+
+static int lookupTestIsRanked(uint32_t i) {
+    return i % 10 != 7;
+}
+
+// product at a position of the rank order, before the unranked ones are left out of it
+static uint32_t lookupTestRanked(uint32_t position) {
+    return position * 13 % LOOKUP_TEST_PRODUCTS;
+}
+
+static int lookupTestAnyOfFirstTwo(uint32_t i) {
+    // 0|1
+    return lookupTestHasFeature(i, 0) || lookupTestHasFeature(i, 1);
+}
+
+static int lookupTestThirdNotFourth(uint32_t i) {
+    // 2&!3
+    return lookupTestHasFeature(i, 2) && !lookupTestHasFeature(i, 3);
+}
+
+static int lookupTestNotFirst(uint32_t i) {
+    // !0
+    return !lookupTestHasFeature(i, 0);
+}
+
+static int lookupTestSecondAndFourth(uint32_t i) {
+    // 1&3, few enough for prices to be looked up product by product
+    return lookupTestHasFeature(i, 1) && lookupTestHasFeature(i, 3);
+}
+
+static int lookupTestFifth(uint32_t i) {
+    // 4
+    return lookupTestHasFeature(i, 4);
+}
+
+static int lookupTestPriceFiltered(uint32_t i) {
+    // 0|1 with price within [LOOKUP_TEST_PRICE_FROM, LOOKUP_TEST_PRICE_TO]
+    return lookupTestAnyOfFirstTwo(i) && lookupTestHasPrice(i) && lookupTestPrice(i) >= LOOKUP_TEST_PRICE_FROM &&
+           lookupTestPrice(i) <= LOOKUP_TEST_PRICE_TO;
+}
+
+static void addLookupTestProduct(jlong handle, jint index, uint32_t i) {
+    jint features[LOOKUP_TEST_FEATURES];
+    jint featureCount = 0;
+    for(uint32_t feature = 0; feature < LOOKUP_TEST_FEATURES; feature++) {
+        if(lookupTestHasFeature(i, feature))
+            features[featureCount++] = feature;
+    }
+    test_java_object_t featuresArray, extFeaturesArray, weightName, priceName, namesArray, valuesArray;
+    jobject names[] = {testJavaObject(&weightName, strlen("weight"), "weight"),
+                       testJavaObject(&priceName, strlen("price"), "price")};
+    jfloat values[] = {lookupTestWeight(i), lookupTestPrice(i)};
+    jsize attributeCount = lookupTestHasPrice(i) ? 2 : 1;
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_addItem(
+            &testEnv, 0, handle, index, lookupTestProductId(i), lookupTestGroup(i), lookupTestGroupOrder(i),
+            testJavaObject(&featuresArray, featureCount, features), testJavaObject(&extFeaturesArray, 0, features),
+            testJavaObject(&namesArray, attributeCount, names), testJavaObject(&valuesArray, attributeCount, values));
+}
+
+// loads the products whose group falls to the shard, every product when shardCount is 1
+static void loadLookupTestShard(jlong handle, uint32_t shard, uint32_t shardCount) {
+    jint productCount = 0;
+    for(uint32_t i = 0; i < LOOKUP_TEST_PRODUCTS; i++) {
+        productCount += lookupTestGroup(i) % shardCount == shard;
+    }
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_initStorage(&testEnv, 0, handle, productCount,
+                                                                             LOOKUP_TEST_FEATURES);
+    jint index = 0;
+    for(uint32_t i = 0; i < LOOKUP_TEST_PRODUCTS; i++) {
+        if(lookupTestGroup(i) % shardCount == shard)
+            addLookupTestProduct(handle, index++, i);
+    }
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_completeLoadData(&testEnv, 0, handle);
+}
+
+static void setLookupTestRank(jlong handle) {
+    jint rankedProducts[LOOKUP_TEST_PRODUCTS];
+    jsize rankedCount = 0;
+    for(uint32_t position = 0; position < LOOKUP_TEST_PRODUCTS; position++) {
+        if(lookupTestIsRanked(lookupTestRanked(position)))
+            rankedProducts[rankedCount++] = lookupTestProductId(lookupTestRanked(position));
+    }
+    test_java_object_t sortingId, sortingValues;
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setSortingIndex(
+            &testEnv, 0, handle, testJavaObject(&sortingId, strlen("rank"), "rank"),
+            testJavaObject(&sortingValues, rankedCount, rankedProducts));
+}
+
+typedef struct lookup_test_key_s {
+    // products missing from the sorting index are in the second tier, by id
+    uint32_t tier;
+    float value;
+    uint32_t productId;
+} lookup_test_key_t;
+
+static int isLookupTestKeyBefore(const lookup_test_key_t *key, const lookup_test_key_t *other) {
+    if(key->tier != other->tier)
+        return key->tier < other->tier;
+    if(key->value != other->value)
+        return key->value < other->value;
+    return key->productId < other->productId;
+}
+
+// product indexes in ascending sort order, by brute force
+static void sortLookupTestProducts(const char *sortingId, uint32_t *order) {
+    lookup_test_key_t keys[LOOKUP_TEST_PRODUCTS];
+    for(uint32_t i = 0; i < LOOKUP_TEST_PRODUCTS; i++) {
+        keys[i].tier = 0;
+        keys[i].value = 0;
+        keys[i].productId = lookupTestProductId(i);
+        if(sortingId && strcmp(sortingId, "price") == 0) {
+            keys[i].tier = !lookupTestHasPrice(i);
+            keys[i].value = keys[i].tier ? 0 : lookupTestPrice(i);
+        } else if(sortingId && strcmp(sortingId, "weight") == 0) {
+            keys[i].value = lookupTestWeight(i);
+        } else if(sortingId) {
+            keys[i].tier = !lookupTestIsRanked(i);
+            for(uint32_t position = 0; !keys[i].tier && lookupTestRanked(position) != i; position++)
+                keys[i].value += lookupTestIsRanked(lookupTestRanked(position));
+        }
+    }
+    for(uint32_t i = 0; i < LOOKUP_TEST_PRODUCTS; i++) {
+        uint32_t j = i;
+        for(; j > 0 && isLookupTestKeyBefore(&keys[i], &keys[order[j - 1]]); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+}
+
+typedef struct lookup_test_query_s {
+    const char *expression;
+    int (*isMatch)(uint32_t i);
+    int hasPriceFilter;
+    const char *sortingId;
+    jboolean isGrouped;
+    jboolean isAscending;
+    jint fromBit;
+    jint toBit;
+} lookup_test_query_t;
+
+// result of a query in the layout of lookupProducts, computed over every product one by one
+static jint expectLookup(const lookup_test_query_t *query, uint32_t *result) {
+    uint32_t order[LOOKUP_TEST_PRODUCTS];
+    uint32_t positions[LOOKUP_TEST_PRODUCTS];
+    sortLookupTestProducts(query->sortingId, order);
+    for(uint32_t position = 0; position < LOOKUP_TEST_PRODUCTS; position++)
+        positions[order[position]] = position;
+
+    uint32_t matchCount = 0;
+    uint32_t groupCount = 0;
+    int hasPrice = 0;
+    float priceRange[2] = {0, 0};
+    int isShown[LOOKUP_TEST_PRODUCTS];
+    for(uint32_t i = 0; i < LOOKUP_TEST_PRODUCTS; i++) {
+        if(!query->isMatch(i))
+            continue;
+        matchCount++;
+        if(lookupTestHasPrice(i)) {
+            priceRange[0] = hasPrice && priceRange[0] < lookupTestPrice(i) ? priceRange[0] : lookupTestPrice(i);
+            priceRange[1] = hasPrice && priceRange[1] > lookupTestPrice(i) ? priceRange[1] : lookupTestPrice(i);
+            hasPrice = 1;
+        }
+        // shown for its group unless a matching member has a higher group order, or an equal one and sorts earlier
+        isShown[i] = 1;
+        for(uint32_t j = 0; j < LOOKUP_TEST_PRODUCTS; j++) {
+            if(j != i && query->isMatch(j) && lookupTestGroup(j) == lookupTestGroup(i) &&
+               (lookupTestGroupOrder(j) > lookupTestGroupOrder(i) ||
+                (lookupTestGroupOrder(j) == lookupTestGroupOrder(i) && positions[j] < positions[i])))
+                isShown[i] = 0;
+        }
+        groupCount += isShown[i];
+    }
+    memcpy(result, priceRange, sizeof(priceRange));
+    result[2] = matchCount;
+    result[3] = query->isGrouped ? groupCount : matchCount;
+
+    int isPage = query->fromBit >= 0 && query->toBit > query->fromBit;
+    uint32_t resultCount = 0;
+    uint32_t skipped = 0;
+    for(uint32_t position = 0; position < LOOKUP_TEST_PRODUCTS; position++) {
+        uint32_t i = order[query->isAscending ? position : LOOKUP_TEST_PRODUCTS - 1 - position];
+        if(!query->isMatch(i))
+            continue;
+        if(!isPage) {
+            result[4 + resultCount++] = query->isGrouped && !isShown[i] ? -1 : lookupTestProductId(i);
+        } else if((!query->isGrouped || isShown[i]) && skipped++ >= query->fromBit &&
+                  skipped <= query->toBit) {
+            result[4 + resultCount++] = lookupTestProductId(i);
+        }
+    }
+    return sizeof(jfloat) * 2 + sizeof(jint) * 2 + sizeof(jint) * resultCount;
+}
+
+static int checkLookup(jlong handle, const lookup_test_query_t *query, const char *what) {
+    uint32_t expected[4 + LOOKUP_TEST_PRODUCTS];
+    uint32_t result[4 + LOOKUP_TEST_PRODUCTS];
+    jint expectedLength = expectLookup(query, expected);
+
+    test_java_object_t expression, priceName, filterNames, fromValues, toValues, sortingId, resultBuffer;
+    jobject filterNameObjects[] = {testJavaObject(&priceName, strlen("price"), "price")};
+    jfloat filterFrom[] = {LOOKUP_TEST_PRICE_FROM};
+    jfloat filterTo[] = {LOOKUP_TEST_PRICE_TO};
+    jsize filterCount = query->hasPriceFilter ? 1 : 0;
+    memset(result, 0xAB, sizeof(result));
+    jint length = Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProductsInto(
+            &testEnv, 0, handle, testJavaObject(&expression, strlen(query->expression), query->expression),
+            query->isGrouped, testJavaObject(&filterNames, filterCount, filterNameObjects),
+            testJavaObject(&fromValues, filterCount, filterFrom), testJavaObject(&toValues, filterCount, filterTo),
+            query->sortingId ? testJavaObject(&sortingId, strlen(query->sortingId), query->sortingId) : 0,
+            query->isAscending, query->fromBit, query->toBit,
+            testJavaObject(&resultBuffer, sizeof(result), result));
+    int isSame = length == expectedLength && memcmp(result, expected, expectedLength) == 0;
+    if(!isSame)
+        printf("\n%s: %s, sorted by %s, %s, %s, [%d, %d)", what, query->expression,
+               query->sortingId ? query->sortingId : "id", query->isGrouped ? "grouped" : "ungrouped",
+               query->isAscending ? "ascending" : "descending", query->fromBit, query->toBit);
+    return check(isSame, what);
+}
+
+static int checkLookups(jlong handle, const char *what) {
+    const lookup_test_query_t expressions[] = {{"0|1", lookupTestAnyOfFirstTwo, 0},
+                                               {"2&!3", lookupTestThirdNotFourth, 0},
+                                               {"!0", lookupTestNotFirst, 0},
+                                               {"1&3", lookupTestSecondAndFourth, 0},
+                                               {"4", lookupTestFifth, 0},
+                                               {"0|1", lookupTestPriceFiltered, 1}};
+    const char *sortingIds[] = {0, "rank", "price", "weight"};
+    // full results, a first page, pages inside the matches and one running past them
+    const jint windows[][2] = {{-1, -1}, {0, 5}, {3, 9}, {7, 8}, {4, LOOKUP_TEST_PRODUCTS * 2}};
+    int failures = 0;
+    for(uint32_t e = 0; e < sizeof(expressions) / sizeof(expressions[0]); e++) {
+        for(uint32_t s = 0; s < sizeof(sortingIds) / sizeof(sortingIds[0]); s++) {
+            for(uint32_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+                for(uint32_t flags = 0; flags < 4; flags++) {
+                    lookup_test_query_t query = expressions[e];
+                    query.sortingId = sortingIds[s];
+                    query.isGrouped = (flags & 1) != 0;
+                    query.isAscending = (flags & 2) != 0;
+                    query.fromBit = windows[w][0];
+                    query.toBit = windows[w][1];
+                    failures += checkLookup(handle, &query, what);
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+// lookups of a handle and of a sharded handle over the same products must both match a brute-force reference
+static int testLookupProducts() {
+    jlong handle = Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_init(&testEnv, 0);
+    loadLookupTestShard(handle, 0, 1);
+    setLookupTestRank(handle);
+    int failures = checkLookups(handle, "lookup");
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_destroy(&testEnv, 0, handle);
+
+    jlong shardedHandle = Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_initSharded(
+            &testEnv, 0, LOOKUP_TEST_SHARDS);
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setOption(
+            &testEnv, 0, shardedHandle, ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_QUERY_THREADS,
+            LOOKUP_TEST_SHARDS);
+    for(uint32_t shard = 0; shard < LOOKUP_TEST_SHARDS; shard++) {
+        jlong shardHandle = Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getShard(&testEnv, 0,
+                                                                                                  shardedHandle, shard);
+        loadLookupTestShard(shardHandle, shard, LOOKUP_TEST_SHARDS);
+    }
+    setLookupTestRank(shardedHandle);
+    failures += checkLookups(shardedHandle, "sharded lookup");
+    Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_destroy(&testEnv, 0, shardedHandle);
+    return failures;
+}
 
 int main() {
     hash_map_t* hashMap = hash_map_create();
@@ -41,5 +962,11 @@ int main() {
     char *lastChar;
     printf("\n%li\n", strtol(" a 123, 50", &lastChar, 10));
     printf("%s\n", lastChar);
-    return 0;
+
+    int failures = testCollidingKeys() + testRemoveAndReinsert() + testLongKeys() + testReload() +
+                   testGetManySkipsMissingKeys() + testQueryLogOverflow() + testQueryLogBusySlot() +
+                   testQueryLogConcurrentDrain() + testExpressions() + testValueEncodingOrder() +
+                   testBitSlicedIndex() + testLookupProducts();
+    printf("\n%d failures\n", failures);
+    return failures != 0;
 }
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "thread_pool.h"
+
+typedef struct thread_pool_job_s {
+    thread_pool_task_t task;
+    void *argument;
+    uint32_t taskCount;
+    atomic_uint nextTask;
+    uint32_t activeThreads;
+    bool linked;
+    struct thread_pool_job_s *next;
+} thread_pool_job_t;
+
+typedef struct thread_pool_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t jobAvailable;
+    pthread_cond_t jobLeft;
+    thread_pool_job_t *jobs;
+    bool stopping;
+    uint32_t threadCount;
+    uint32_t workerCount;
+    pthread_t workers[];
+} thread_pool_t;
+
+static void runTasks(thread_pool_job_t *job) {
+    uint32_t taskIndex;
+    while ((taskIndex = atomic_fetch_add(&job->nextTask, 1)) < job->taskCount) {
+        job->task(job->argument, taskIndex);
+    }
+}
+
+// must be called with the pool mutex held
+static void unlinkJob(thread_pool_t *pool, thread_pool_job_t *job) {
+    if (!job->linked)
+        return;
+    thread_pool_job_t **link = &pool->jobs;
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    job->linked = false;
+}
+
+static void *workerLoop(void *argument) {
+    thread_pool_t *pool = argument;
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (!pool->stopping && !pool->jobs) {
+            pthread_cond_wait(&pool->jobAvailable, &pool->mutex);
+        }
+        if (pool->stopping)
+            break;
+        thread_pool_job_t *job = pool->jobs;
+        job->activeThreads++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        runTasks(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        // every task of the job is claimed at this point, so nobody else should pick it up
+        unlinkJob(pool, job);
+        job->activeThreads--;
+        pthread_cond_broadcast(&pool->jobLeft);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+thread_pool_t* thread_pool_create(uint32_t threadCount) {
+    if (threadCount < 1)
+        threadCount = 1;
+    thread_pool_t *pool = malloc(sizeof(thread_pool_t) + sizeof(pthread_t) * (threadCount - 1));
+    if (!pool)
+        return 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->jobAvailable, NULL);
+    pthread_cond_init(&pool->jobLeft, NULL);
+    pool->jobs = 0;
+    pool->stopping = false;
+    pool->threadCount = threadCount;
+    pool->workerCount = 0;
+    for (uint32_t i = 0; i < threadCount - 1; i++) {
+        if (pthread_create(&pool->workers[i], NULL, workerLoop, pool) != 0)
+            break;
+        pool->workerCount++;
+    }
+    return pool;
+}
+
+uint32_t thread_pool_thread_count(thread_pool_t* pool) {
+    return pool ? pool->workerCount + 1 : 1;
+}
+
+void thread_pool_run(thread_pool_t* pool, uint32_t taskCount, thread_pool_task_t task, void *argument) {
+    if (!pool || pool->workerCount == 0 || taskCount <= 1) {
+        for (uint32_t i = 0; i < taskCount; i++) {
+            task(argument, i);
+        }
+        return;
+    }
+    thread_pool_job_t job;
+    job.task = task;
+    job.argument = argument;
+    job.taskCount = taskCount;
+    atomic_init(&job.nextTask, 0);
+    job.activeThreads = 1;
+    job.linked = true;
+    job.next = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    thread_pool_job_t **link = &pool->jobs;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = &job;
+    pthread_cond_broadcast(&pool->jobAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+
+    runTasks(&job);
+
+    // the job lives on this stack frame, so wait until every worker that took it has let it go
+    pthread_mutex_lock(&pool->mutex);
+    unlinkJob(pool, &job);
+    job.activeThreads--;
+    while (job.activeThreads > 0) {
+        pthread_cond_wait(&pool->jobLeft, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_free(thread_pool_t* pool) {
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->jobAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+    for (uint32_t i = 0; i < pool->workerCount; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool->jobLeft);
+    pthread_cond_destroy(&pool->jobAvailable);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
@@ -0,0 +1,27 @@
+#include <stdint.h>
+
+#ifndef JROARING_THREAD_POOL_H
+#define JROARING_THREAD_POOL_H
+
+typedef struct thread_pool_s thread_pool_t;
+
+typedef void (*thread_pool_task_t)(void *argument, uint32_t taskIndex);
+
+/*
+ * Creates pool for threadCount-way parallelism. The thread calling thread_pool_run always takes part in
+ * its own job, so only threadCount - 1 worker threads are started.
+ */
+thread_pool_t* thread_pool_create(uint32_t threadCount);
+
+uint32_t thread_pool_thread_count(thread_pool_t* pool);
+
+/*
+ * Calls task(argument, i) for every i in [0, taskCount) and returns when all of them are finished.
+ * Tasks are claimed one by one, so idle threads keep picking up work until none is left. Several
+ * threads may run jobs on the same pool concurrently. A NULL pool runs the tasks on the calling thread.
+ */
+void thread_pool_run(thread_pool_t* pool, uint32_t taskCount, thread_pool_task_t task, void *argument);
+
+void thread_pool_free(thread_pool_t* pool);
+
+#endif //JROARING_THREAD_POOL_H
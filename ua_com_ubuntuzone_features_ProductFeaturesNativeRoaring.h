@@ -7,6 +7,68 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_BUILD_THREADS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_BUILD_THREADS 0L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_RESULT_CACHE_MEGABYTES
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_RESULT_CACHE_MEGABYTES 1L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_ATTRIBUTE_BIT_SLICES
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_ATTRIBUTE_BIT_SLICES 2L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_QUERY_THREADS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_QUERY_THREADS 3L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_QUERY_PARALLEL_MIN_FEATURES
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_QUERY_PARALLEL_MIN_FEATURES 4L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SIMILAR_LSH_BANDS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SIMILAR_LSH_BANDS 5L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SIMILAR_LSH_ROWS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SIMILAR_LSH_ROWS 6L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SIMILAR_TABLE_SIZE
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SIMILAR_TABLE_SIZE 7L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_COMPACT_AFTER_LOAD
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_COMPACT_AFTER_LOAD 8L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SLOW_QUERY_MICROS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_OPTION_SLOW_QUERY_MICROS 9L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_LOOKUP_PRODUCTS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_LOOKUP_PRODUCTS 0L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_LOOKUP_PRODUCTS_INTO
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_LOOKUP_PRODUCTS_INTO 1L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_LOOKUP_PRODUCTS_BY_HANDLES
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_LOOKUP_PRODUCTS_BY_HANDLES 2L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_PRODUCTS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_PRODUCTS 3L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_PRODUCTS_INTO
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_PRODUCTS_INTO 4L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_PRODUCTS_BY_HANDLES
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_PRODUCTS_BY_HANDLES 5L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_ALL_PRODUCTS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_ALL_PRODUCTS 6L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_ALL_PRODUCTS_INTO
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT_ALL_PRODUCTS_INTO 7L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_GET_SIMILAR_PRODUCTS
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_GET_SIMILAR_PRODUCTS 8L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_GET_SIMILAR_PRODUCTS_INTO
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_GET_SIMILAR_PRODUCTS_INTO 9L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_GET_SIMILAR_PRODUCTS_BATCH
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_GET_SIMILAR_PRODUCTS_BATCH 10L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_UPSERT_PRODUCT
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_UPSERT_PRODUCT 11L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_REMOVE_PRODUCT
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_REMOVE_PRODUCT 12L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_MATCH
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_MATCH 13L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_FILTER
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_FILTER 14L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_SORT
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_SORT 15L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_GROUP
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_GROUP 16L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_COUNT
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_COUNT 17L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_MERGE
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_MERGE 18L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_OUTPUT
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_STAGE_OUTPUT 19L
+#undef ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT
+#define ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_STAT_COUNT 20L
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    init
@@ -15,6 +77,30 @@ extern "C" {
 JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_init
   (JNIEnv *, jclass);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    initSharded
+ * Signature: (I)J
+ */
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_initSharded
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    getShard
+ * Signature: (JI)J
+ */
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getShard
+  (JNIEnv *, jclass, jlong, jint);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    setOption
+ * Signature: (JII)V
+ */
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setOption
+  (JNIEnv *, jclass, jlong, jint, jint);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    initStorage
@@ -31,6 +117,14 @@ JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoar
 JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_addItem
   (JNIEnv *, jclass, jlong, jint, jint, jint, jint, jintArray, jintArray, jobjectArray, jfloatArray);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    addItems
+ * Signature: (JI[I[I[I[I[I[I[I[Ljava/lang/String;[[F)V
+ */
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_addItems
+  (JNIEnv *, jclass, jlong, jint, jintArray, jintArray, jintArray, jintArray, jintArray, jintArray, jintArray, jobjectArray, jobjectArray);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    completeLoadData
@@ -47,6 +141,14 @@ JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoar
 JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setSortingIndex
   (JNIEnv *, jclass, jlong, jstring, jintArray);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    registerNames
+ * Signature: (J[Ljava/lang/String;)[I
+ */
+JNIEXPORT jintArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_registerNames
+  (JNIEnv *, jclass, jlong, jobjectArray);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    lookupProducts
@@ -55,6 +157,22 @@ JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoa
 JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProducts
   (JNIEnv *, jclass, jlong, jstring, jboolean, jobjectArray, jfloatArray, jfloatArray, jstring, jboolean, jint, jint);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    lookupProductsInto
+ * Signature: (JLjava/lang/String;Z[Ljava/lang/String;[F[FLjava/lang/String;ZIILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProductsInto
+  (JNIEnv *, jclass, jlong, jstring, jboolean, jobjectArray, jfloatArray, jfloatArray, jstring, jboolean, jint, jint, jobject);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    lookupProductsByHandles
+ * Signature: (JLjava/lang/String;Z[I[F[FIZIILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_lookupProductsByHandles
+  (JNIEnv *, jclass, jlong, jstring, jboolean, jintArray, jfloatArray, jfloatArray, jint, jboolean, jint, jint, jobject);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    getSimilarProducts
@@ -63,6 +181,30 @@ JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeR
 JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProducts
   (JNIEnv *, jclass, jlong, jint, jint, jintArray);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    getSimilarProductsInto
+ * Signature: (JII[ILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProductsInto
+  (JNIEnv *, jclass, jlong, jint, jint, jintArray, jobject);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    getSimilarProductsBatch
+ * Signature: (J[II[I[I)Ljava/nio/ByteBuffer;
+ */
+JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getSimilarProductsBatch
+  (JNIEnv *, jclass, jlong, jintArray, jint, jintArray, jintArray);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    measureSimilarRecall
+ * Signature: (J[II)[F
+ */
+JNIEXPORT jfloatArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_measureSimilarRecall
+  (JNIEnv *, jclass, jlong, jintArray, jint);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    countProducts
@@ -71,6 +213,22 @@ JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeR
 JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countProducts
   (JNIEnv *, jclass, jlong, jstring, jintArray, jint, jboolean, jobjectArray, jfloatArray, jfloatArray);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    countProductsInto
+ * Signature: (JLjava/lang/String;[IIZ[Ljava/lang/String;[F[FLjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countProductsInto
+  (JNIEnv *, jclass, jlong, jstring, jintArray, jint, jboolean, jobjectArray, jfloatArray, jfloatArray, jobject);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    countProductsByHandles
+ * Signature: (JLjava/lang/String;[IIZ[I[F[FLjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countProductsByHandles
+  (JNIEnv *, jclass, jlong, jstring, jintArray, jint, jboolean, jintArray, jfloatArray, jfloatArray, jobject);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    countAllProducts
@@ -79,6 +237,102 @@ JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeR
 JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countAllProducts
   (JNIEnv *, jclass, jlong, jboolean);
 
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    countAllProductsInto
+ * Signature: (JZLjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_countAllProductsInto
+  (JNIEnv *, jclass, jlong, jboolean, jobject);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    releaseResult
+ * Signature: (Ljava/nio/ByteBuffer;)V
+ */
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_releaseResult
+  (JNIEnv *, jclass, jobject);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    upsertProduct
+ * Signature: (JIII[I[I[Ljava/lang/String;[F)Z
+ */
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_upsertProduct
+  (JNIEnv *, jclass, jlong, jint, jint, jint, jintArray, jintArray, jobjectArray, jfloatArray);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    removeProduct
+ * Signature: (JI)Z
+ */
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_removeProduct
+  (JNIEnv *, jclass, jlong, jint);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    compact
+ * Signature: (J)J
+ */
+JNIEXPORT jlong JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_compact
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    getMemoryStats
+ * Signature: (J)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getMemoryStats
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    getCacheStats
+ * Signature: (J)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getCacheStats
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    setQueryStatsEnabled
+ * Signature: (Z)V
+ */
+JNIEXPORT void JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_setQueryStatsEnabled
+  (JNIEnv *, jclass, jboolean);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    getQueryStats
+ * Signature: (Z)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_getQueryStats
+  (JNIEnv *, jclass, jboolean);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    drainSlowQueries
+ * Signature: (J)Ljava/nio/ByteBuffer;
+ */
+JNIEXPORT jobject JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_drainSlowQueries
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    saveSnapshot
+ * Signature: (JLjava/lang/String;)Z
+ */
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_saveSnapshot
+  (JNIEnv *, jclass, jlong, jstring);
+
+/*
+ * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
+ * Method:    loadSnapshot
+ * Signature: (JLjava/lang/String;Z)Z
+ */
+JNIEXPORT jboolean JNICALL Java_ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring_loadSnapshot
+  (JNIEnv *, jclass, jlong, jstring, jboolean);
+
 /*
  * Class:     ua_com_ubuntuzone_features_ProductFeaturesNativeRoaring
  * Method:    destroy